@@ -0,0 +1,781 @@
+#!/usr/bin/env python3
+
+"""A stand-in for a pair of key management entities (KMEs) that offer the key delivery API
+defined in ETSI GS QKD 014 V1.1.1 (2019-02). It is meant for testing the etsi014 implementation
+of the QKD API (see qkd_api_etsi014.c) without QKD hardware.
+
+A real deployment has one KME at each end of a QKD link, and the KMEs share keys produced by QKD.
+This stand-in plays both KMEs in a single process: keys are random, and a key that was handed to
+the master SAE (enc_keys) can be retrieved exactly once by the slave SAE (dec_keys).
+
+Supported requests:
+    GET  /api/v1/keys/{slave_SAE_ID}/status
+    GET  /api/v1/keys/{slave_SAE_ID}/enc_keys?number=N&size=BITS
+    POST /api/v1/keys/{master_SAE_ID}/dec_keys    {"key_IDs": [{"key_ID": "..."}, ...]}
+
+With --cert, --key, and --ca the KME uses HTTPS and requires a client certificate.
+
+With --keyring the KME also supports key delivery through a Linux kernel keyring, for SAEs on the
+same host that add key_delivery=keyring to the query of their enc_keys and dec_keys requests: each
+key is added to the keyring (the keyring of the user, or the session keyring, which the SAE must
+then share) as a "user" key that expires after --keyring-timeout seconds, and the key container
+has its serial number ("key_serial") instead of the key. The SAE reads the key and invalidates it.
+
+With --topology and --node the process is one trusted node of a multi-hop QKD network instead, and
+one process must be started for every node in the topology file (see relay_topology.cnf). Each
+node is a KME for the SAEs attached to it, and has a QKD link to each of its neighbours. The QKD
+links are emulated: the node with the lowest name sends random blocks of link key to the other one
+(in the clear, as the mock QKD API does) at the configured key rate. A key that a master SAE gets
+with enc_keys is relayed to the node of the slave SAE hop by hop, one-time-pad encrypted with the
+link key of each hop, and decrypted and re-encrypted at each trusted node in between. The path is
+chosen by the node of the master SAE: the shortest path with link costs that grow as the available
+link key runs low, cached until the available key of some link changes by a factor of two. Nodes
+flood the available key of their links to all other nodes.
+
+Relaying is pipelined: enc_keys returns as soon as the keys have been sent over the first hop, a
+batch of keys is relayed in chunks, each node forwards a chunk as soon as it has received it, and
+dec_keys at the node of the slave SAE waits briefly for keys that are still in transit.
+
+(c) 2019 Bruno Rijsman, All Rights Reserved.
+See LICENSE for licensing information.
+"""
+
+import argparse
+import base64
+import ctypes
+import ctypes.util
+import http.server
+import json
+import os
+import re
+import signal
+import socket
+import ssl
+import struct
+import sys
+import threading
+import time
+import uuid
+
+DEFAULT_KEY_SIZE = 256
+MAX_KEY_PER_REQUEST = 128
+MAX_KEY_SIZE = 8192
+MAX_STORED_KEYS = 100000
+
+PATH_RE = re.compile(r"^/api/v1/keys/([^/]+)/(status|enc_keys|dec_keys)$")
+
+RELAY_BLOCK_SIZE = 1024             # Link key is produced in blocks of this many bytes
+RELAY_MAX_LINK_KEY = 1024 * 1024    # Maximum link key buffered per direction of a link
+RELAY_CHUNK_KEYS = 8                # Keys per relay message
+RELAY_KEY_TIMEOUT = 2.0             # Maximum wait for link key, or for a key in transit
+RELAY_STATE_INTERVAL = 0.1          # Interval between floods of the available link key
+RELAY_GENERATE_INTERVAL = 0.01
+RELAY_COST_REFERENCE = 64 * 1024    # Link key at which a link costs two hops instead of one
+
+MESSAGE_HELLO = 1                   # Node name (first message on a link, from the connecting node)
+MESSAGE_LINK_KEY = 2                # A block of link key
+MESSAGE_RELAY = 3                   # Relay header (JSON), a zero byte, and the encrypted keys
+MESSAGE_LINK_STATE = 4              # Available link key of the links of one node (JSON)
+MESSAGE_HEADER = struct.Struct("!BI")
+
+KEYRINGS = {"user": -4, "session": -3}   # KEY_SPEC_USER_KEYRING, KEY_SPEC_SESSION_KEYRING
+DEFAULT_KEYRING_TIMEOUT = 60
+KEYRING_GENERATION_KEYS = 256       # Keys added to a keyring before the next one is used
+
+RELAY = None
+KEYRING = None
+
+
+class KeyStore:
+    """Keys that were delivered to a master SAE and not yet to the slave SAE."""
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.key_arrived = threading.Condition(self.lock)
+        self.keys = {}
+        self.nr_enc_requests = 0
+        self.nr_dec_requests = 0
+
+    def new_keys(self, number, size, slave_sae_id):
+        keys = [(str(uuid.uuid4()), os.urandom(size // 8)) for _ in range(number)]
+        with self.lock:
+            self.nr_enc_requests += 1
+        if RELAY is not None and not RELAY.is_local(slave_sae_id):
+            if not RELAY.send_keys(slave_sae_id, keys):
+                return None
+            return keys
+        self.put_keys(keys)
+        return keys
+
+    def put_keys(self, keys):
+        with self.lock:
+            for (key_id, key) in keys:
+                if len(self.keys) >= MAX_STORED_KEYS:
+                    # Expire the oldest key (dicts are kept in insertion order)
+                    del self.keys[next(iter(self.keys))]
+                self.keys[key_id] = key
+            self.key_arrived.notify_all()
+
+    def take_keys(self, key_ids):
+        # Relayed keys may still be on their way.
+        deadline = time.monotonic() + (RELAY_KEY_TIMEOUT if RELAY is not None else 0.0)
+        with self.lock:
+            self.nr_dec_requests += 1
+            while not all(key_id in self.keys for key_id in key_ids):
+                remaining = deadline - time.monotonic()
+                if remaining <= 0.0:
+                    return None
+                self.key_arrived.wait(remaining)
+            return [(key_id, self.keys.pop(key_id)) for key_id in key_ids]
+
+
+KEY_STORE = KeyStore()
+
+
+def key_container(keys):
+    return {"keys": [{"key_ID": key_id, "key": base64.b64encode(key).decode("ascii")}
+                     for (key_id, key) in keys]}
+
+
+class Keyring:
+    """Delivers keys through a Linux kernel keyring, using libkeyutils. The keys are not added to
+    the user or session keyring itself, but to keyrings of our own that are linked to it, a new
+    one for every KEYRING_GENERATION_KEYS keys: the kernel charges a keyring to the quota of the
+    user (kernel.keys.maxbytes) for every link that is ever added to it, and only gives that back
+    when the keyring is destroyed. A keyring is unlinked (and destroyed) once the keys in it have
+    all been invalidated by the SAEs, or have expired."""
+
+    def __init__(self, keyring, timeout):
+        self.lib = ctypes.CDLL(ctypes.util.find_library("keyutils") or "libkeyutils.so.1",
+                               use_errno=True)
+        self.lib.add_key.restype = ctypes.c_int32
+        self.lib.add_key.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p,
+                                     ctypes.c_size_t, ctypes.c_int32]
+        self.lib.keyctl_get_keyring_ID.restype = ctypes.c_int32
+        self.lib.keyctl_get_keyring_ID.argtypes = [ctypes.c_int32, ctypes.c_int]
+        self.lib.keyctl_set_timeout.argtypes = [ctypes.c_int32, ctypes.c_uint]
+        self.lib.keyctl_invalidate.argtypes = [ctypes.c_int32]
+        self.lib.keyctl_unlink.argtypes = [ctypes.c_int32, ctypes.c_int32]
+        self.lib.keyctl_read.restype = ctypes.c_long
+        self.lib.keyctl_read.argtypes = [ctypes.c_int32, ctypes.c_char_p, ctypes.c_size_t]
+        # Resolve the keyring (creating the session keyring if there is none) before the request
+        # handler threads are started, so that they all inherit the same keyring.
+        self.parent = self.lib.keyctl_get_keyring_ID(KEYRINGS[keyring], 1)
+        if self.parent < 0:
+            raise OSError(ctypes.get_errno(), "keyctl_get_keyring_ID failed")
+        self.timeout = timeout
+        self.lock = threading.Lock()
+        self.keyring = None
+        self.nr_generation_keys = 0
+        self.nr_generations = 0
+        self.retired = []               # (keyring, time it was retired), oldest first
+        self.nr_keys = 0
+        with self.lock:
+            self.next_generation()
+
+    def next_generation(self):
+        """Start adding keys to a new keyring, and unlink the retired keyrings that are empty (the
+        kernel removes invalidated keys from keyrings) or whose keys have expired. Called with the
+        lock held."""
+        now = time.monotonic()
+        if self.keyring is not None:
+            self.retired.append((self.keyring, now))
+        remaining = []
+        for (keyring, retired) in self.retired:
+            if retired + self.timeout < now or self.lib.keyctl_read(keyring, None, 0) == 0:
+                self.lib.keyctl_unlink(keyring, self.parent)
+            else:
+                remaining.append((keyring, retired))
+        self.retired = remaining
+        description = "qkd-kme:{}:{}".format(os.getpid(), self.nr_generations).encode("ascii")
+        keyring = self.lib.add_key(b"keyring", description, None, 0, self.parent)
+        if keyring <= 0:
+            self.keyring = None
+            error = ctypes.get_errno()
+            raise OSError(error, os.strerror(error))
+        self.keyring = keyring
+        self.nr_generation_keys = 0
+        self.nr_generations += 1
+
+    def close(self):
+        """Unlink our keyrings, which removes the keys that are still in them."""
+        with self.lock:
+            for (keyring, _retired) in self.retired:
+                self.lib.keyctl_unlink(keyring, self.parent)
+            if self.keyring is not None:
+                self.lib.keyctl_unlink(self.keyring, self.parent)
+
+    def add_keys(self, keys, direction):
+        """Add keys to the keyring, and return their serial numbers. Keys are named after the
+        direction ("enc" or "dec") and their key ID, so that the keys for the master SAE and the
+        slave SAE do not replace each other when both SAEs are on this host."""
+        with self.lock:
+            if self.keyring is None or self.nr_generation_keys >= KEYRING_GENERATION_KEYS:
+                self.next_generation()
+            keyring = self.keyring
+            self.nr_generation_keys += len(keys)
+        serials = []
+        for (key_id, key) in keys:
+            description = "qkd:{}:{}".format(direction, key_id).encode("ascii")
+            serial = self.lib.add_key(b"user", description, key, len(key), keyring)
+            if serial > 0:
+                serials.append(serial)
+            if serial <= 0 or self.lib.keyctl_set_timeout(serial, self.timeout) < 0:
+                error = ctypes.get_errno()
+                for serial in serials:
+                    self.lib.keyctl_invalidate(serial)
+                raise OSError(error, os.strerror(error))
+        with self.lock:
+            self.nr_keys += len(serials)
+        return serials
+
+    def key_container(self, keys, direction):
+        serials = self.add_keys(keys, direction)
+        return {"keys": [{"key_ID": key_id, "key_serial": serial}
+                         for ((key_id, _key), serial) in zip(keys, serials)]}
+
+
+class KmeRequestHandler(http.server.BaseHTTPRequestHandler):
+    """Handles ETSI 014 requests. Connections are kept alive (HTTP/1.1)."""
+
+    protocol_version = "HTTP/1.1"
+    disable_nagle_algorithm = True
+
+    def log_message(self, format, *args):
+        if self.server.verbose:
+            http.server.BaseHTTPRequestHandler.log_message(self, format, *args)
+
+    def send_json(self, status, body):
+        data = json.dumps(body).encode("ascii")
+        self.send_response(status)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def send_error_json(self, status, message):
+        self.send_json(status, {"message": message})
+
+    def send_keys(self, keys, params, direction):
+        delivery = params.get("key_delivery", "json")
+        if delivery == "json":
+            self.send_json(200, key_container(keys))
+        elif delivery == "keyring" and KEYRING is not None:
+            try:
+                container = KEYRING.key_container(keys, direction)
+            except OSError as error:
+                # E.g. the quota of the user (kernel.keys.maxkeys) is exhausted.
+                self.send_error_json(503, "Adding keys to keyring failed: {}".format(error))
+                return
+            self.send_json(200, container)
+        else:
+            self.send_error_json(400, "Unsupported key_delivery")
+
+    def parse_path(self):
+        path, _, query = self.path.partition("?")
+        match = PATH_RE.match(path)
+        if match is None:
+            return (None, None, {})
+        params = {}
+        for item in query.split("&"):
+            if "=" in item:
+                (name, value) = item.split("=", 1)
+                params[name] = value
+        return (match.group(1), match.group(2), params)
+
+    def do_GET(self):
+        (sae_id, function, params) = self.parse_path()
+        if function == "status":
+            with KEY_STORE.lock:
+                stored_key_count = len(KEY_STORE.keys)
+            self.send_json(200, {"slave_SAE_ID": sae_id,
+                                 "key_size": DEFAULT_KEY_SIZE,
+                                 "stored_key_count": stored_key_count,
+                                 "max_key_count": MAX_STORED_KEYS,
+                                 "max_key_per_request": MAX_KEY_PER_REQUEST,
+                                 "max_key_size": MAX_KEY_SIZE,
+                                 "min_key_size": 8})
+        elif function == "enc_keys":
+            try:
+                number = int(params.get("number", "1"))
+                size = int(params.get("size", str(DEFAULT_KEY_SIZE)))
+            except ValueError:
+                self.send_error_json(400, "Invalid number or size")
+                return
+            if not (1 <= number <= MAX_KEY_PER_REQUEST and 8 <= size <= MAX_KEY_SIZE and
+                    size % 8 == 0):
+                self.send_error_json(400, "Number or size out of range")
+                return
+            keys = KEY_STORE.new_keys(number, size, sae_id)
+            if keys is None:
+                self.send_error_json(503, "No route with enough key to slave SAE")
+                return
+            self.send_keys(keys, params, "enc")
+        else:
+            self.send_error_json(404, "Unknown request")
+
+    def do_POST(self):
+        (_sae_id, function, params) = self.parse_path()
+        length = int(self.headers.get("Content-Length", "0"))
+        body = self.rfile.read(length)
+        if function != "dec_keys":
+            self.send_error_json(404, "Unknown request")
+            return
+        try:
+            key_ids = [item["key_ID"] for item in json.loads(body)["key_IDs"]]
+        except (ValueError, KeyError, TypeError):
+            self.send_error_json(400, "Invalid key_IDs")
+            return
+        keys = KEY_STORE.take_keys(key_ids)
+        if keys is None:
+            self.send_error_json(400, "Unknown key_ID")
+            return
+        self.send_keys(keys, params, "dec")
+
+
+def xor_bytes(data, pad):
+    return (int.from_bytes(data, "big") ^ int.from_bytes(pad, "big")).to_bytes(len(data), "big")
+
+
+def receive_exactly(sock, size):
+    data = bytearray()
+    while len(data) < size:
+        piece = sock.recv(size - len(data))
+        if not piece:
+            raise ConnectionError("connection closed")
+        data += piece
+    return bytes(data)
+
+
+class Topology:
+    """The trusted nodes, QKD links, and SAEs of the network, read from a topology file with lines
+    "node = NAME HOST:RELAY_PORT KME_PORT", "link = NODE NODE KEY_RATE_BPS", and
+    "sae = SAE_ID NODE"."""
+
+    def __init__(self, file_name):
+        self.nodes = {}
+        self.links = {}
+        self.saes = {}
+        with open(file_name) as file:
+            for (line_nr, line) in enumerate(file, 1):
+                line = line.split("#", 1)[0].strip()
+                if not line:
+                    continue
+                (name, _, value) = line.partition("=")
+                (name, values) = (name.strip(), value.split())
+                try:
+                    if name == "node" and len(values) == 3:
+                        (host, port) = values[1].rsplit(":", 1)
+                        self.nodes[values[0]] = (host, int(port), int(values[2]))
+                    elif name == "link" and len(values) == 3:
+                        self.links[tuple(sorted(values[:2]))] = float(values[2])
+                    elif name == "sae" and len(values) == 2:
+                        self.saes[values[0]] = values[1]
+                    else:
+                        raise ValueError(name)
+                except ValueError:
+                    raise ValueError("{}:{}: invalid line".format(file_name, line_nr))
+        for (node_1, node_2) in self.links:
+            if node_1 not in self.nodes or node_2 not in self.nodes:
+                raise ValueError("{}: link to unknown node".format(file_name))
+
+    def neighbours(self, node):
+        for ((node_1, node_2), rate) in self.links.items():
+            if node in (node_1, node_2):
+                yield (node_2 if node == node_1 else node_1, rate)
+
+
+class RouteTable:
+    """Shortest paths from this node, with the cost of each link direction growing as its
+    available key runs low. Paths are cached, and the cache is only flushed when the available key
+    of some link direction moves to another power of two."""
+
+    def __init__(self, me):
+        self.me = me
+        self.lock = threading.Lock()
+        self.available = {}             # (from, to) -> bytes of link key
+        self.magnitudes = {}
+        self.cache = {}
+        self.nr_computed = 0
+
+    def update(self, from_node, to_node, available):
+        magnitude = int(available).bit_length()
+        with self.lock:
+            self.available[(from_node, to_node)] = available
+            if self.magnitudes.get((from_node, to_node)) != magnitude:
+                self.magnitudes[(from_node, to_node)] = magnitude
+                self.cache.clear()
+
+    def path(self, destination):
+        with self.lock:
+            if destination not in self.cache:
+                self.cache[destination] = self.shortest_path(destination)
+                self.nr_computed += 1
+            return self.cache[destination]
+
+    def shortest_path(self, destination):
+        # Dijkstra; the networks are small, so a linear scan for the closest node is fine.
+        distance = {self.me: 0.0}
+        previous = {}
+        done = set()
+        while True:
+            candidates = [(cost, node) for (node, cost) in distance.items() if node not in done]
+            if not candidates:
+                return None
+            (cost, node) = min(candidates)
+            if node == destination:
+                break
+            done.add(node)
+            for ((from_node, to_node), available) in self.available.items():
+                if from_node != node or available < RELAY_BLOCK_SIZE:
+                    continue
+                new_cost = cost + 1.0 + RELAY_COST_REFERENCE / available
+                if new_cost < distance.get(to_node, float("inf")):
+                    distance[to_node] = new_cost
+                    previous[to_node] = node
+        path = [destination]
+        while path[-1] != self.me:
+            path.append(previous[path[-1]])
+        return list(reversed(path))
+
+
+class Link:
+    """A QKD link to a neighbour. The link key comes in blocks that alternate between the two
+    directions; each direction is a stream of one-time pads for messages in that direction,
+    consumed in order by the sender and the receiver alike."""
+
+    def __init__(self, relay, peer, rate):
+        self.relay = relay
+        self.peer = peer
+        self.rate = rate
+        self.generator = relay.me < peer    # This end produces the link key
+        self.send_direction = 0 if relay.me < peer else 1
+        self.sock = None
+        self.send_lock = threading.Lock()
+        self.key_lock = threading.Lock()
+        self.key_added = threading.Condition(self.key_lock)
+        self.reset()
+
+    def reset(self):
+        self.pads = [bytearray(), bytearray()]
+        self.pad_offsets = [0, 0]       # Offset in the stream of each direction of pads[0]
+        self.nr_blocks = 0
+
+    def up(self, sock):
+        with self.key_lock:
+            self.reset()
+            self.sock = sock
+        threading.Thread(target=self.receive_loop, args=(sock,), daemon=True).start()
+
+    def down(self, sock):
+        with self.key_lock:
+            if self.sock is sock:
+                self.sock = None
+                self.reset()
+            self.key_added.notify_all()
+        sock.close()
+
+    def available(self):
+        with self.key_lock:
+            return len(self.pads[self.send_direction])
+
+    def send_message(self, message_type, payload):
+        with self.send_lock:
+            if self.sock is None:
+                return False
+            try:
+                self.sock.sendall(MESSAGE_HEADER.pack(message_type, len(payload)) + payload)
+            except OSError:
+                return False
+            return True
+
+    def add_block(self, block):
+        with self.key_lock:
+            direction = self.nr_blocks % 2
+            self.pads[direction] += block
+            self.nr_blocks += 1
+            self.key_added.notify_all()
+
+    def generate_block(self):
+        with self.key_lock:
+            if max(len(pads) for pads in self.pads) >= RELAY_MAX_LINK_KEY:
+                return
+        block = os.urandom(RELAY_BLOCK_SIZE)
+        # Sent before it is used, so the peer always has the pads of the messages it receives.
+        with self.send_lock:
+            if self.sock is None:
+                return
+            try:
+                self.sock.sendall(MESSAGE_HEADER.pack(MESSAGE_LINK_KEY, len(block)) + block)
+            except OSError:
+                return
+            self.add_block(block)
+
+    def send_encrypted(self, header, plaintext):
+        """Send a relay message with the plaintext encrypted with the next pads of our direction.
+        Waits (up to RELAY_KEY_TIMEOUT) for link key."""
+        deadline = time.monotonic() + RELAY_KEY_TIMEOUT
+        direction = self.send_direction
+        while True:
+            with self.key_lock:
+                while len(self.pads[direction]) < len(plaintext):
+                    remaining = deadline - time.monotonic()
+                    if remaining <= 0.0 or self.sock is None:
+                        return False
+                    self.key_added.wait(remaining)
+            # The pads are taken and the message sent under the send lock, so that the messages
+            # are on the wire in the order of their pads. The generator does not need the key lock
+            # to be free to make progress, so we do not hold it while waiting.
+            with self.send_lock:
+                with self.key_lock:
+                    if len(self.pads[direction]) < len(plaintext):
+                        continue
+                    header["pad"] = self.pad_offsets[direction]
+                    pad = bytes(self.pads[direction][:len(plaintext)])
+                    del self.pads[direction][:len(plaintext)]
+                    self.pad_offsets[direction] += len(plaintext)
+                payload = json.dumps(header).encode("ascii") + b"\0" + xor_bytes(plaintext, pad)
+                if self.sock is None:
+                    return False
+                try:
+                    self.sock.sendall(MESSAGE_HEADER.pack(MESSAGE_RELAY, len(payload)) + payload)
+                except OSError:
+                    return False
+                return True
+
+    def decrypt(self, offset, ciphertext):
+        direction = 1 - self.send_direction
+        with self.key_lock:
+            if offset != self.pad_offsets[direction] or len(self.pads[direction]) < len(ciphertext):
+                raise ConnectionError("relay message out of sync with link key")
+            pad = bytes(self.pads[direction][:len(ciphertext)])
+            del self.pads[direction][:len(ciphertext)]
+            self.pad_offsets[direction] += len(ciphertext)
+        return xor_bytes(ciphertext, pad)
+
+    def receive_loop(self, sock):
+        try:
+            while True:
+                (message_type, length) = MESSAGE_HEADER.unpack(
+                    receive_exactly(sock, MESSAGE_HEADER.size))
+                payload = receive_exactly(sock, length)
+                if message_type == MESSAGE_LINK_KEY:
+                    self.add_block(payload)
+                elif message_type == MESSAGE_RELAY:
+                    (header, _, ciphertext) = payload.partition(b"\0")
+                    header = json.loads(header)
+                    self.relay.receive_keys(header, self.decrypt(header["pad"], ciphertext))
+                elif message_type == MESSAGE_LINK_STATE:
+                    self.relay.receive_link_state(json.loads(payload), self)
+        except (OSError, ValueError, KeyError, ConnectionError) as error:
+            print("Link to {} down: {}".format(self.peer, error), flush=True)
+        self.down(sock)
+
+
+class Relay:
+    """This trusted node: its links, its route table, and the relaying of keys."""
+
+    def __init__(self, topology, me):
+        if me not in topology.nodes:
+            raise ValueError("Unknown node {}".format(me))
+        self.topology = topology
+        self.me = me
+        self.links = {peer: Link(self, peer, rate) for (peer, rate) in topology.neighbours(me)}
+        self.routes = RouteTable(me)
+        self.state_lock = threading.Lock()
+        self.state_sequences = {}
+        self.sequence = 0
+        self.nr_relayed = 0
+        self.nr_forwarded = 0
+        self.nr_dropped = 0
+
+    def kme_port(self):
+        return self.topology.nodes[self.me][2]
+
+    def is_local(self, sae_id):
+        return self.topology.saes.get(sae_id, self.me) == self.me
+
+    def start(self):
+        (_host, relay_port, _kme_port) = self.topology.nodes[self.me]
+        listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        listener.bind(("", relay_port))
+        listener.listen()
+        threading.Thread(target=self.accept_loop, args=(listener,), daemon=True).start()
+        for link in self.links.values():
+            if link.generator:
+                threading.Thread(target=self.connect_loop, args=(link,), daemon=True).start()
+        threading.Thread(target=self.timer_loop, daemon=True).start()
+
+    def accept_loop(self, listener):
+        while True:
+            (sock, _address) = listener.accept()
+            try:
+                (message_type, length) = MESSAGE_HEADER.unpack(
+                    receive_exactly(sock, MESSAGE_HEADER.size))
+                peer = receive_exactly(sock, length).decode("ascii")
+            except (OSError, ValueError, ConnectionError):
+                sock.close()
+                continue
+            link = self.links.get(peer)
+            if message_type != MESSAGE_HELLO or link is None or link.generator:
+                sock.close()
+                continue
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            print("Link to {} up".format(peer), flush=True)
+            link.up(sock)
+
+    def connect_loop(self, link):
+        (host, port, _kme_port) = self.topology.nodes[link.peer]
+        while True:
+            if link.sock is None:
+                try:
+                    sock = socket.create_connection((host, port))
+                    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+                    name = self.me.encode("ascii")
+                    sock.sendall(MESSAGE_HEADER.pack(MESSAGE_HELLO, len(name)) + name)
+                    print("Link to {} up".format(link.peer), flush=True)
+                    link.up(sock)
+                except OSError:
+                    pass
+            time.sleep(0.5)
+
+    def timer_loop(self):
+        # Produces link key at the configured rate, and periodically floods the link state.
+        credit = {peer: 0.0 for peer in self.links}
+        last = time.monotonic()
+        next_state = last
+        while True:
+            time.sleep(RELAY_GENERATE_INTERVAL)
+            now = time.monotonic()
+            for link in self.links.values():
+                if not link.generator or link.sock is None:
+                    continue
+                credit[link.peer] = min(credit[link.peer] + link.rate / 8.0 * (now - last),
+                                        RELAY_MAX_LINK_KEY)
+                while credit[link.peer] >= RELAY_BLOCK_SIZE:
+                    credit[link.peer] -= RELAY_BLOCK_SIZE
+                    link.generate_block()
+            last = now
+            if now >= next_state:
+                next_state = now + RELAY_STATE_INTERVAL
+                self.flood_link_state()
+
+    def flood_link_state(self):
+        self.sequence += 1
+        available = {peer: link.available() for (peer, link) in self.links.items()
+                     if link.sock is not None}
+        state = {"origin": self.me, "sequence": self.sequence, "links": available}
+        self.receive_link_state(state, None)
+
+    def receive_link_state(self, state, from_link):
+        origin = state["origin"]
+        with self.state_lock:
+            if state["sequence"] <= self.state_sequences.get(origin, 0):
+                return
+            self.state_sequences[origin] = state["sequence"]
+        for (peer, _rate) in self.topology.neighbours(origin):
+            self.routes.update(origin, peer, state["links"].get(peer, 0))
+        payload = json.dumps(state).encode("ascii")
+        for link in self.links.values():
+            if link is not from_link:
+                link.send_message(MESSAGE_LINK_STATE, payload)
+
+    def send_keys(self, slave_sae_id, keys):
+        """Relay keys to the node of the slave SAE, in chunks. Returns False if there is no path
+        or the first hop has no link key."""
+        path = self.routes.path(self.topology.saes[slave_sae_id])
+        if path is None:
+            return False
+        for start in range(0, len(keys), RELAY_CHUNK_KEYS):
+            chunk = keys[start:start + RELAY_CHUNK_KEYS]
+            header = {"path": path, "hop": 1, "ids": [key_id for (key_id, _key) in chunk],
+                      "sizes": [len(key) for (_key_id, key) in chunk]}
+            if not self.links[path[1]].send_encrypted(header, b"".join(k for (_i, k) in chunk)):
+                return False
+        with self.state_lock:
+            self.nr_relayed += len(keys)
+        return True
+
+    def receive_keys(self, header, plaintext):
+        path = header["path"]
+        hop = header["hop"]
+        if path[hop] != self.me:
+            raise ValueError("relay message for another node")
+        if hop == len(path) - 1:
+            (keys, offset) = ([], 0)
+            for (key_id, size) in zip(header["ids"], header["sizes"]):
+                keys.append((key_id, plaintext[offset:offset + size]))
+                offset += size
+            KEY_STORE.put_keys(keys)
+            return
+        # Forward right away (cut-through), so that the hops of a batch overlap.
+        header["hop"] = hop + 1
+        link = self.links.get(path[hop + 1])
+        forwarded = link is not None and link.send_encrypted(header, plaintext)
+        with self.state_lock:
+            if forwarded:
+                self.nr_forwarded += len(header["ids"])
+            else:
+                self.nr_dropped += len(header["ids"])
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Stand-in ETSI GS QKD 014 key management entity")
+    parser.add_argument("--port", type=int, default=8014, help="port to listen on")
+    parser.add_argument("--cert", help="KME certificate (enables HTTPS)")
+    parser.add_argument("--key", help="KME private key")
+    parser.add_argument("--ca", help="CA certificate for verifying SAE certificates")
+    parser.add_argument("--verbose", action="store_true", help="log every request")
+    parser.add_argument("--topology", help="topology file of a network of trusted nodes")
+    parser.add_argument("--node", help="name of this trusted node (with --topology)")
+    parser.add_argument("--keyring", choices=sorted(KEYRINGS),
+                        help="also deliver keys through this Linux kernel keyring")
+    parser.add_argument("--keyring-timeout", type=int, default=DEFAULT_KEYRING_TIMEOUT,
+                        help="seconds after which keys in the keyring expire")
+    args = parser.parse_args()
+    if args.keyring:
+        global KEYRING
+        try:
+            KEYRING = Keyring(args.keyring, args.keyring_timeout)
+        except OSError as error:
+            parser.error("Keyring not available: {}".format(error))
+    if args.topology or args.node:
+        if not (args.topology and args.node):
+            parser.error("--topology and --node must be used together")
+        global RELAY
+        try:
+            RELAY = Relay(Topology(args.topology), args.node)
+        except (OSError, ValueError) as error:
+            parser.error(str(error))
+        args.port = RELAY.kme_port()
+        RELAY.start()
+    server = http.server.ThreadingHTTPServer(("localhost", args.port), KmeRequestHandler)
+    server.verbose = args.verbose
+    if args.cert:
+        context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        context.load_cert_chain(args.cert, args.key)
+        if args.ca:
+            context.load_verify_locations(args.ca)
+            context.verify_mode = ssl.CERT_REQUIRED
+        server.socket = context.wrap_socket(server.socket, server_side=True)
+    # Background processes started from a script ignore SIGINT, so also stop on SIGTERM.
+    signal.signal(signal.SIGTERM, lambda _signum, _frame: sys.exit(0))
+    print("KME listening on port {}".format(args.port), flush=True)
+    try:
+        server.serve_forever()
+    except (KeyboardInterrupt, SystemExit):
+        pass
+    print("enc_keys requests: {}, dec_keys requests: {}".format(
+        KEY_STORE.nr_enc_requests, KEY_STORE.nr_dec_requests), flush=True)
+    if KEYRING is not None:
+        KEYRING.close()
+        print("keys added to keyring: {}".format(KEYRING.nr_keys), flush=True)
+    if RELAY is not None:
+        print("relayed keys: {}, forwarded: {}, dropped: {}, route computations: {}".format(
+            RELAY.nr_relayed, RELAY.nr_forwarded, RELAY.nr_dropped, RELAY.routes.nr_computed),
+            flush=True)
+
+
+if __name__ == "__main__":
+    main()
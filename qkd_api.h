@@ -4,9 +4,11 @@
  * The ETSI Quantum Key Distribution (QKD) Application Programming Interface (API) as defined in
  * ETSI GS QKD 004 V.1.1.1 (2012-12).
  * https://www.etsi.org/deliver/etsi_gs/QKD/001_099/004/01.01.01_60/gs_qkd004v010101p.pdf
- * This repository contains two imlpementations of this API:
+ * This repository contains these imlpementations of this API:
  * (1) A mock implementation (see qkd_api_mock.c)
- * (2) TODO: A simulated BB84 implementation on top of SimulaQron (see qkd_api_bb84_simulaqron.c)
+ * (2) An implementation on top of an ETSI GS QKD 014 key manager (see qkd_api_etsi014.c)
+ * (3) An implementation on top of a pre-generated key file for benchmarking (see qkd_api_keyfile.c)
+ * (4) TODO: A simulated BB84 implementation on top of SimulaQron (see qkd_api_bb84_simulaqron.c)
  * 
  * (c) 2019 Bruno Rijsman, All Rights Reserved.
  * See LICENSE for licensing information.
@@ -15,6 +17,7 @@
 #ifndef QKD_API_H
 #define QKD_API_H
 
+#include "qkd_secure_arena.h"
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -26,7 +29,11 @@ typedef enum {
     QKD_RESULT_CONNECTION_FAILED,
     QKD_RESULT_OUT_OF_MEMORY,
     QKD_STATUS_OPEN_SSL_ERROR,
-    QKD_RESULT_NOT_SUPPORTED
+    QKD_RESULT_NOT_SUPPORTED,
+    QKD_RESULT_TIMEOUT,
+    QKD_RESULT_HEALTH_TEST_FAILED,
+    QKD_RESULT_KEY_ALREADY_USED,
+    QKD_RESULT_JOURNAL_FAILED
 } QKD_result_t;
 
 const char *QKD_result_str(QKD_result_t result);
@@ -39,7 +46,17 @@ typedef struct QKD_key_handle_st {
 
 extern const QKD_key_handle_t QKD_key_handle_null;
 
-char *QKD_shared_secret_str(char *shared_secret, size_t shared_secret_size);
+char *QKD_shared_secret_str(const char *shared_secret, size_t shared_secret_size);
+
+/* Log a shared secret (using QKD_debug) without leaving a copy of it behind. */
+#define QKD_debug_shared_secret(label, shared_secret, shared_secret_size) \
+do { \
+    if (QKD_debug_enabled()) { \
+        char *_str = QKD_shared_secret_str((const char *) (shared_secret), (shared_secret_size)); \
+        QKD_debug("%s = %s", (label), _str ? _str : "(not shown)"); \
+        QKD_secure_free(_str); \
+    } \
+} while (0)
 
 void QKD_key_handle_set_null(QKD_key_handle_t *key_handle);
 bool QKD_key_handle_is_null(const QKD_key_handle_t *key_handle);
@@ -64,6 +81,17 @@ QKD_result_t QKD_close(const QKD_key_handle_t *key_handle);
 
 /* Additional API functions that are not mentioned in the ESTI API document. */
 QKD_result_t QKD_init(bool am_server);
-/* TODO: Also add QKD_finish function and register it in OpenSSL using ENGINE_set_finish_function */
+
+/* Obtain the keys for nr_keys key handles in one call. Key i is stored at
+ * key_buffers + i * key_buffer_size; each key must fit in key_buffer_size bytes. If results is not
+ * NULL, the result for key i is stored in results[i]. Returns QKD_RESULT_SUCCESS if all keys were
+ * obtained, or else the result for the first key that was not. */
+QKD_result_t QKD_get_keys(size_t nr_keys, const QKD_key_handle_t *key_handles, char *key_buffers,
+                          size_t key_buffer_size, QKD_result_t *results);
+
+/* Release everything that QKD_init set up. Buffered key material that has not been used yet is
+ * saved in an encrypted snapshot if snapshots are enabled (see qkd_snapshot.h), so that the next
+ * QKD_init can pick it up again. */
+QKD_result_t QKD_finish(void);
 
 #endif
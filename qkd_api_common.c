@@ -9,7 +9,10 @@
  */
 
 #include "qkd_api.h"
+#include "qkd_debug.h"
+#include "qkd_secure_arena.h"
 #include <assert.h>
+#include <openssl/rand.h>
 #include <stdio.h>
 #include <string.h> 
 
@@ -35,6 +38,14 @@ const char *QKD_result_str(QKD_result_t result)
             return "openssl error";
         case QKD_RESULT_NOT_SUPPORTED:
             return "not supported";
+        case QKD_RESULT_TIMEOUT:
+            return "timeout";
+        case QKD_RESULT_HEALTH_TEST_FAILED:
+            return "health test failed";
+        case QKD_RESULT_KEY_ALREADY_USED:
+            return "key already used";
+        case QKD_RESULT_JOURNAL_FAILED:
+            return "journal failed";
         default:
             assert(false);
     }
@@ -43,26 +54,21 @@ const char *QKD_result_str(QKD_result_t result)
 /**
  * Convert a shared secret to a human readable string.
  * 
+ * The string is as secret as the shared secret itself, so it is allocated from the secure arena.
+ * The caller must release it with QKD_secure_free, which zeroizes it. Use QKD_debug_shared_secret
+ * to log a shared secret.
+ * 
  * Returns a pointer to the human readable string on success, NULL on failure (memory allocation
  * failed)
- * 
- * Note: returns a pointer to a string that is overwritten on the next call to this function.
  */
-char *QKD_shared_secret_str(char *shared_secret, size_t shared_secret_size)
+char *QKD_shared_secret_str(const char *shared_secret, size_t shared_secret_size)
 {
-    static char *str = NULL;
-    static size_t str_size = 0;
-    size_t needed_str_size = 2 * shared_secret_size + 1;
-    if (str == NULL || str_size < needed_str_size) {
-        str = realloc(str, needed_str_size);
-        if (!str) {
-            return NULL;
-        }
-        str_size = needed_str_size;
-
+    char *str = QKD_secure_alloc(2 * shared_secret_size + 1);
+    if (str == NULL) {
+        return NULL;
     }
     char *str_p = str;
-    char *shared_secret_p = shared_secret;
+    const char *shared_secret_p = shared_secret;
     for (int i = 0; i < shared_secret_size; i++) {
         snprintf(str_p, 3, "%02x", (unsigned char) *shared_secret_p);
         str_p += 2;
@@ -105,15 +111,18 @@ bool QKD_key_handle_is_null(const QKD_key_handle_t *key_handle)
  */
 void QKD_key_handle_set_random(QKD_key_handle_t *key_handle)
 {
-    /* Fill the handle with random bytes, but make sure we don't accidentally pick the null key. */
+    /* Fill the handle with random bytes, but make sure we don't accidentally pick the null key. An
+     * unseeded rand() would give every process the same sequence of handles. */
     assert(key_handle != NULL);
     bool at_least_one_non_zero;
     do {
+        if (RAND_bytes((unsigned char *) key_handle->bytes, sizeof(QKD_key_handle_t)) != 1) {
+            QKD_error("RAND_bytes failed");
+            abort();
+        }
         at_least_one_non_zero = false;
         for (size_t i=0; i<sizeof(QKD_key_handle_t); i++) {
-            char c = rand();
-            key_handle->bytes[i] = c;
-            if (c) {
+            if (key_handle->bytes[i]) {
                 at_least_one_non_zero = true;
             }
         }
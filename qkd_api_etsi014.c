@@ -0,0 +1,1472 @@
+/**
+ * qkd_api_etsi014.c
+ *
+ * An implementation of the ETSI QKD API (see qkd_api.h) on top of a key management entity (KME)
+ * that offers the REST-based key delivery API defined in ETSI GS QKD 014 V1.1.1 (2019-02).
+ * https://www.etsi.org/deliver/etsi_gs/QKD/001_099/014/01.01.01_60/gs_qkd014v010101p.pdf
+ *
+ * The server is the master SAE (Secure Application Entity): it gets keys from its KME with
+ * "Get key" (enc_keys), and uses the key ID as the key handle. The client is the slave SAE: it
+ * gets the key with the key ID from its KME with "Get key with key IDs" (dec_keys).
+ *
+ * To keep the KME out of the latency of most handshakes:
+ * (1) The server fetches many keys per enc_keys request, and buffers them in the key store (see
+ *     qkd_key_store.h). QKD_open takes a key from the buffer, and QKD_get_key matches the key ID.
+ * (2) On the client, concurrent QKD_get_key calls are combined into a single dec_keys request.
+ * (3) The connection to the KME is kept open (HTTP keep-alive).
+ *
+ * The connection to the KME uses HTTP, or HTTPS with mutual authentication as required by ETSI
+ * 014. HTTPS is restricted to TLS 1.3 with X25519, so that the connection to the KME does not use
+ * the Diffie-Hellman method that is replaced by the QKD engine in the same process.
+ *
+ * Configuration is through environment variables:
+ *   QKD_ETSI014_KME_URL        URL of the local KME, e.g. http://localhost:8014 (required)
+ *   QKD_ETSI014_PEER_SAE_ID    SAE ID of the peer: the slave SAE for the server, the master SAE
+ *                              for the client (required)
+ *   QKD_ETSI014_BATCH          Number of keys per enc_keys request (default 16)
+ *   QKD_ETSI014_TIMEOUT_MS     Timeout for requests to the KME (default 5000)
+ *   QKD_ETSI014_CA_FILE        CA certificate(s) to verify the KME (HTTPS only)
+ *   QKD_ETSI014_CERT_FILE      Our (SAE) certificate (HTTPS only)
+ *   QKD_ETSI014_KEY_FILE       Our (SAE) private key (HTTPS only)
+ *   QKD_ETSI014_KEY_DELIVERY   "json" (default) or "keyring" (Linux only, see below)
+ *
+ * With QKD_ETSI014_KEY_DELIVERY=keyring, the keys themselves do not go over the connection to the
+ * KME. This is an extension of ETSI 014 for a KME that runs on the same host as the SAE: the SAE
+ * adds key_delivery=keyring to its enc_keys and dec_keys requests, the KME adds each key to a Linux
+ * kernel keyring (as a "user" key that only the processes of the same user can possess, with a
+ * timeout), and the key container has the serial number of the key ("key_serial") instead of the
+ * key. The SAE reads the key with keyctl straight into the buffer of the caller of QKD_get_key,
+ * and invalidates it, so that the kernel removes it. The server keeps the serial number in the key
+ * handle, after the key ID, instead of buffering the key in the key store; the client ignores it.
+ *
+ * If snapshots are enabled (see qkd_snapshot.h), the server saves the keys that it has fetched but
+ * not allocated yet when it finishes, and buffers them again when it is restarted with the same
+ * KME URL and peer SAE ID. The KME of the client still has those keys (unless it expired them, in
+ * which case QKD_get_key on the client fails for that key ID), so they need not be fetched again.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#include "qkd_api.h"
+#include "qkd_debug.h"
+#include "qkd_health.h"
+#include "qkd_journal.h"
+#include "qkd_key_store.h"
+#include "qkd_secure_arena.h"
+#include "qkd_snapshot.h"
+#include <assert.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <linux/keyctl.h>
+#include <sys/syscall.h>
+#endif
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+
+#define DEFAULT_BATCH 16
+#define DEFAULT_TIMEOUT_MS 5000
+
+/* Maximum number of key IDs in one dec_keys request. */
+#define MAX_DEC_KEYS 64
+
+/* Key handles consist of a magic byte, the key size in bytes (2 bytes, network order), and the
+ * key ID (a zero terminated string). Key handles of keys in a kernel keyring have another magic
+ * byte, and the serial number of the key (4 bytes, network order) after the key ID; that keeps a
+ * key handle with a UUID key ID within the 46 bytes that fit in a P-384 public key. */
+#define KEY_HANDLE_MAGIC 0x45
+#define KEY_HANDLE_MAGIC_KEYRING 0x4b
+#define KEY_ID_OFFSET 3
+#define KEY_SERIAL_SIZE 4
+#define MAX_KEY_ID_SIZE (QKD_KEY_HANDLE_SIZE - KEY_ID_OFFSET - 1)
+
+/* The kind of snapshot written by the server. */
+#define SNAPSHOT_KIND "etsi014-server"
+
+/* The kinds of journal of consumed keys written by the server and the client. */
+#define JOURNAL_KIND_SERVER "etsi014-server"
+#define JOURNAL_KIND_CLIENT "etsi014-client"
+
+/* Requests and responses are small: a batch of keys in base64 plus some JSON. */
+#define MAX_MESSAGE_SIZE (256 * 1024)
+
+typedef struct kme_connection_st {
+    char host[256];
+    char port[8];
+    char *path_prefix;              /* /api/v1/keys/<peer SAE ID>/ */
+    bool use_tls;
+    SSL_CTX *ssl_ctx;
+    SSL *ssl;
+    int sock;
+} KME_CONNECTION;
+
+/* A key that has been fetched by the server and that has not been allocated by QKD_open yet. */
+typedef struct unallocated_key_st {
+    struct unallocated_key_st *next;
+    QKD_key_handle_t key_handle;
+} UNALLOCATED_KEY;
+
+/* A QKD_get_key call on the client that is waiting for its key. */
+typedef struct dec_key_request_st {
+    struct dec_key_request_st *next;
+    const QKD_key_handle_t *key_handle;
+    char *key;
+    uint32_t key_size;
+    bool sent;                      /* Part of the dec_keys request in flight */
+    bool done;
+    QKD_result_t result;
+} DEC_KEY_REQUEST;
+
+static bool initialized = false;
+static bool am_server;
+static char *kme_url = NULL;
+static char *peer_sae_id = NULL;
+static int batch = DEFAULT_BATCH;
+static int timeout_ms = DEFAULT_TIMEOUT_MS;
+static bool keyring_delivery = false;
+
+/* Server: the key size of the enc_keys request being parsed. Protected by kme_mutex. */
+static uint32_t enc_key_size;
+
+/* The connection to the KME is used by one request at a time. The server only sends a request
+ * when it runs out of keys (while holding kme_mutex), and the client has at most one dec_keys
+ * request in flight (see QKD_get_key). */
+static KME_CONNECTION kme = {.sock = -1};
+static pthread_mutex_t kme_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Server: keys that have not been allocated yet, oldest first. Protected by kme_mutex. */
+static UNALLOCATED_KEY *unallocated_oldest = NULL;
+static UNALLOCATED_KEY *unallocated_newest = NULL;
+
+/* Client: QKD_get_key calls that wait for their key. Protected by kme_mutex. */
+static DEC_KEY_REQUEST *dec_key_requests = NULL;
+static bool dec_keys_in_flight = false;
+static pthread_cond_t dec_keys_done = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Read an integer from an environment variable, or return the default value if it is not set.
+ */
+static int env_int(const char *name, int default_value)
+{
+    const char *str = getenv(name);
+    return str ? atoi(str) : default_value;
+}
+
+/**
+ * Encode a key ID, the key size, and the serial number of the key in a kernel keyring (or 0 if the
+ * key is not in a keyring) into a key handle.
+ *
+ * Returns true on success, false if the key ID is too long or not safe to put in a JSON string.
+ */
+static bool encode_key_handle(const char *key_id, size_t key_id_size, size_t key_size,
+                              int32_t key_serial, QKD_key_handle_t *key_handle)
+{
+    if (key_id_size == 0 || key_id_size > MAX_KEY_ID_SIZE - (key_serial ? KEY_SERIAL_SIZE : 0) ||
+        key_size == 0 || key_size > 0xffff) {
+        return false;
+    }
+    for (size_t i = 0; i < key_id_size; i++) {
+        if (key_id[i] == '"' || key_id[i] == '\\' || (unsigned char) key_id[i] < 0x20) {
+            return false;
+        }
+    }
+    unsigned char *bytes = (unsigned char *) key_handle->bytes;
+    QKD_key_handle_set_null(key_handle);
+    bytes[0] = key_serial ? KEY_HANDLE_MAGIC_KEYRING : KEY_HANDLE_MAGIC;
+    bytes[1] = key_size >> 8;
+    bytes[2] = key_size & 0xff;
+    memcpy(bytes + KEY_ID_OFFSET, key_id, key_id_size);
+    if (key_serial) {
+        unsigned char *serial_bytes = bytes + KEY_ID_OFFSET + key_id_size + 1;
+        serial_bytes[0] = (uint32_t) key_serial >> 24;
+        serial_bytes[1] = (uint32_t) key_serial >> 16;
+        serial_bytes[2] = (uint32_t) key_serial >> 8;
+        serial_bytes[3] = (uint32_t) key_serial;
+    }
+    return true;
+}
+
+/**
+ * Decode a key handle into the key ID (which is zero terminated inside the key handle) and the key
+ * size.
+ *
+ * Returns the key ID, or NULL if it is not a valid key handle.
+ */
+static const char *decode_key_handle(const QKD_key_handle_t *key_handle, size_t *key_size)
+{
+    const unsigned char *bytes = (const unsigned char *) key_handle->bytes;
+    if ((bytes[0] != KEY_HANDLE_MAGIC && bytes[0] != KEY_HANDLE_MAGIC_KEYRING) ||
+        bytes[KEY_ID_OFFSET] == '\0' || bytes[QKD_KEY_HANDLE_SIZE - 1] != '\0') {
+        return NULL;
+    }
+    const char *key_id = key_handle->bytes + KEY_ID_OFFSET;
+    for (const char *p = key_id; *p; p++) {
+        if (*p == '"' || *p == '\\' || (unsigned char) *p < 0x20) {
+            return NULL;
+        }
+    }
+    if (key_size) {
+        *key_size = (bytes[1] << 8) | bytes[2];
+    }
+    return key_id;
+}
+
+/**
+ * Get the serial number of the key in a kernel keyring from a (valid) key handle.
+ *
+ * Returns the serial number, or 0 if the key is not in a keyring.
+ */
+static int32_t key_handle_serial(const QKD_key_handle_t *key_handle)
+{
+    const unsigned char *bytes = (const unsigned char *) key_handle->bytes;
+    if (bytes[0] != KEY_HANDLE_MAGIC_KEYRING) {
+        return 0;
+    }
+    const unsigned char *serial_bytes = bytes + KEY_ID_OFFSET + strlen(key_handle->bytes +
+                                                                       KEY_ID_OFFSET) + 1;
+    return (int32_t) (((uint32_t) serial_bytes[0] << 24) | ((uint32_t) serial_bytes[1] << 16) |
+                      ((uint32_t) serial_bytes[2] << 8) | serial_bytes[3]);
+}
+
+/**
+ * Read a key of key_size bytes from a kernel keyring, and invalidate it, so that it cannot be read
+ * again and the kernel removes it. The key is copied straight from the kernel into the buffer.
+ *
+ * Returns true on success, false on failure (e.g. the key expired, or has another size).
+ */
+static bool keyring_take(int32_t key_serial, char *key, size_t key_size)
+{
+#ifdef __linux__
+    long size = syscall(SYS_keyctl, KEYCTL_READ, key_serial, key, key_size);
+    if (size < 0) {
+        QKD_error_with_errno("Reading key %d from keyring failed", key_serial);
+    } else if (size != key_size) {
+        QKD_error("Key %d in keyring has %ld bytes, expected %zu", key_serial, size, key_size);
+    }
+    if (syscall(SYS_keyctl, KEYCTL_INVALIDATE, key_serial) != 0 && size >= 0) {
+        QKD_error_with_errno("Invalidating key %d in keyring failed", key_serial);
+    }
+    if (size != key_size) {
+        OPENSSL_cleanse(key, key_size);
+        return false;
+    }
+    return true;
+#else
+    QKD_error("Kernel keyrings are not supported on this platform");
+    return false;
+#endif
+}
+
+/**
+ * Discard a key that is not going to be used, without reading it.
+ */
+static void keyring_discard(int32_t key_serial)
+{
+#ifdef __linux__
+    syscall(SYS_keyctl, KEYCTL_INVALIDATE, key_serial);
+#endif
+}
+
+/**
+ * Server: discard a buffered key (in the key store or in a keyring) that is not going to be used.
+ */
+static void discard_buffered_key(const QKD_key_handle_t *key_handle)
+{
+    size_t key_size;
+    decode_key_handle(key_handle, &key_size);
+    int32_t key_serial = key_handle_serial(key_handle);
+    if (key_serial) {
+        keyring_discard(key_serial);
+    } else {
+        QKD_key_store_consume(peer_sae_id, key_handle, 0, NULL, key_size);
+    }
+}
+
+/**
+ * Parse the KME URL (http://host:port or https://host:port) from the configuration.
+ *
+ * Returns QKD_result_t.
+ */
+static QKD_result_t parse_kme_url(const char *url)
+{
+    QKD_enter();
+    const char *rest;
+    if (strncmp(url, "http://", 7) == 0) {
+        kme.use_tls = false;
+        rest = url + 7;
+    } else if (strncmp(url, "https://", 8) == 0) {
+        kme.use_tls = true;
+        rest = url + 8;
+    } else {
+        QKD_error("Unsupported KME URL %s", url);
+        QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+    }
+    size_t host_len = strcspn(rest, ":/");
+    if (host_len == 0 || host_len >= sizeof(kme.host)) {
+        QKD_error("Invalid host in KME URL %s", url);
+        QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+    }
+    memcpy(kme.host, rest, host_len);
+    kme.host[host_len] = '\0';
+    rest += host_len;
+    const char *port = kme.use_tls ? "443" : "80";
+    size_t port_len = strlen(port);
+    if (*rest == ':') {
+        port = rest + 1;
+        port_len = strcspn(port, "/");
+    }
+    if (port_len == 0 || port_len >= sizeof(kme.port)) {
+        QKD_error("Invalid port in KME URL %s", url);
+        QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+    }
+    memcpy(kme.port, port, port_len);
+    kme.port[port_len] = '\0';
+    QKD_return_success_qkd();
+}
+
+/**
+ * Create the TLS context for HTTPS connections to the KME.
+ *
+ * Returns QKD_result_t.
+ */
+static QKD_result_t create_ssl_ctx(void)
+{
+    QKD_enter();
+    kme.ssl_ctx = SSL_CTX_new(TLS_client_method());
+    if (kme.ssl_ctx == NULL) {
+        QKD_error("SSL_CTX_new failed");
+        QKD_return_error_qkd(QKD_STATUS_OPEN_SSL_ERROR);
+    }
+    const char *ca_file = getenv("QKD_ETSI014_CA_FILE");
+    const char *cert_file = getenv("QKD_ETSI014_CERT_FILE");
+    const char *key_file = getenv("QKD_ETSI014_KEY_FILE");
+    if (SSL_CTX_set_min_proto_version(kme.ssl_ctx, TLS1_3_VERSION) != 1 ||
+        SSL_CTX_set1_groups_list(kme.ssl_ctx, "X25519") != 1 ||
+        (ca_file && SSL_CTX_load_verify_locations(kme.ssl_ctx, ca_file, NULL) != 1) ||
+        (cert_file && SSL_CTX_use_certificate_chain_file(kme.ssl_ctx, cert_file) != 1) ||
+        (key_file && SSL_CTX_use_PrivateKey_file(kme.ssl_ctx, key_file, SSL_FILETYPE_PEM) != 1)) {
+        QKD_error("Configuring TLS for the KME connection failed");
+        SSL_CTX_free(kme.ssl_ctx);
+        kme.ssl_ctx = NULL;
+        QKD_return_error_qkd(QKD_STATUS_OPEN_SSL_ERROR);
+    }
+    SSL_CTX_set_verify(kme.ssl_ctx, SSL_VERIFY_PEER, NULL);
+    QKD_return_success_qkd();
+}
+
+/**
+ * Close the connection to the KME.
+ */
+static void kme_disconnect(void)
+{
+    QKD_enter();
+    if (kme.ssl) {
+        SSL_free(kme.ssl);
+        kme.ssl = NULL;
+    }
+    if (kme.sock != -1) {
+        close(kme.sock);
+        kme.sock = -1;
+    }
+    QKD_return_success_void();
+}
+
+/**
+ * Open the connection to the KME, if it is not open already.
+ *
+ * Returns QKD_result_t.
+ */
+static QKD_result_t kme_connect(void)
+{
+    QKD_enter();
+    if (kme.sock != -1) {
+        QKD_return_success_qkd();
+    }
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = NULL;
+    if (getaddrinfo(kme.host, kme.port, &hints, &res) != 0) {
+        QKD_error("getaddrinfo %s:%s failed", kme.host, kme.port);
+        QKD_return_error_qkd(QKD_RESULT_CONNECTION_FAILED);
+    }
+    int sock = -1;
+    for (struct addrinfo *ai = res; ai != NULL && sock == -1; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock != -1 && connect(sock, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (sock == -1) {
+        QKD_error_with_errno("connect to KME %s:%s failed", kme.host, kme.port);
+        QKD_return_error_qkd(QKD_RESULT_CONNECTION_FAILED);
+    }
+    struct timeval tv = {.tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    kme.sock = sock;
+
+    if (kme.use_tls) {
+        kme.ssl = SSL_new(kme.ssl_ctx);
+        if (kme.ssl == NULL || SSL_set_fd(kme.ssl, sock) != 1 ||
+            SSL_set_tlsext_host_name(kme.ssl, kme.host) != 1 ||
+            SSL_set1_host(kme.ssl, kme.host) != 1 || SSL_connect(kme.ssl) != 1) {
+            QKD_error("TLS connection to KME %s:%s failed", kme.host, kme.port);
+            kme_disconnect();
+            QKD_return_error_qkd(QKD_RESULT_CONNECTION_FAILED);
+        }
+    }
+    QKD_debug("Connected to KME %s:%s", kme.host, kme.port);
+    QKD_return_success_qkd();
+}
+
+/**
+ * Send bytes to the KME.
+ *
+ * Returns true on success, false on failure.
+ */
+static bool kme_send(const char *buffer, size_t size)
+{
+    while (size > 0) {
+        ssize_t written;
+        if (kme.ssl) {
+            written = SSL_write(kme.ssl, buffer, size);
+        } else {
+            written = send(kme.sock, buffer, size, MSG_NOSIGNAL);
+        }
+        if (written <= 0) {
+            QKD_error("Sending to KME failed");
+            return false;
+        }
+        buffer += written;
+        size -= written;
+    }
+    return true;
+}
+
+/**
+ * Receive up to size bytes from the KME.
+ *
+ * Returns the number of bytes received, or -1 on failure (or if the KME closed the connection).
+ */
+static ssize_t kme_receive(char *buffer, size_t size)
+{
+    ssize_t bytes_read = kme.ssl ? SSL_read(kme.ssl, buffer, size) : read(kme.sock, buffer, size);
+    return bytes_read > 0 ? bytes_read : -1;
+}
+
+/**
+ * Find a header (name including the colon, case insensitive) in the header of an HTTP response,
+ * which ends at end.
+ *
+ * Returns a pointer to the value of the header, or NULL if the header is not present.
+ */
+static const char *find_header(const char *response, const char *end, const char *name)
+{
+    size_t name_size = strlen(name);
+    for (const char *line = strstr(response, "\r\n"); line && line < end;
+         line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, name, name_size) == 0) {
+            return line + name_size;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Send one HTTP request to the KME and receive the response body, over the persistent connection.
+ * The body (which is zero terminated) contains key material, and is too big for the secure arena,
+ * so the caller must zeroize and free it with OPENSSL_clear_free(body, response_size).
+ *
+ * Returns QKD_result_t.
+ */
+static QKD_result_t kme_exchange(const char *method, const char *path, const char *body,
+                                 char **response_body, size_t *response_size)
+{
+    QKD_enter();
+    size_t body_size = body ? strlen(body) : 0;
+    char header[512];
+    int header_size = snprintf(header, sizeof(header),
+                               "%s %s HTTP/1.1\r\n"
+                               "Host: %s:%s\r\n"
+                               "Accept: application/json\r\n"
+                               "Connection: keep-alive\r\n"
+                               "%s"
+                               "Content-Length: %zu\r\n"
+                               "\r\n",
+                               method, path, kme.host, kme.port,
+                               body ? "Content-Type: application/json\r\n" : "",
+                               body_size);
+    if (header_size < 0 || header_size >= sizeof(header)) {
+        QKD_error("HTTP request header too long");
+        QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+    }
+    /* Send the header and the body in one go, so that they go out in one TCP segment. */
+    char *request = malloc(header_size + body_size);
+    if (request == NULL) {
+        QKD_error("malloc failed");
+        QKD_return_error_qkd(QKD_RESULT_OUT_OF_MEMORY);
+    }
+    memcpy(request, header, header_size);
+    if (body) {
+        memcpy(request + header_size, body, body_size);
+    }
+    bool sent = kme_send(request, header_size + body_size);
+    free(request);
+    if (!sent) {
+        QKD_return_error_qkd(QKD_RESULT_SEND_FAILED);
+    }
+
+    /* Receive until we have the complete header, then until we have Content-Length bytes of
+     * body. Only responses with a Content-Length are supported. */
+    char *buffer = malloc(MAX_MESSAGE_SIZE + 1);
+    if (buffer == NULL) {
+        QKD_error("malloc failed");
+        QKD_return_error_qkd(QKD_RESULT_OUT_OF_MEMORY);
+    }
+    size_t received = 0;
+    char *body_start = NULL;
+    size_t content_length = 0;
+    while (body_start == NULL || received < (body_start - buffer) + content_length) {
+        if (received == MAX_MESSAGE_SIZE) {
+            QKD_error("HTTP response too long");
+            OPENSSL_clear_free(buffer, MAX_MESSAGE_SIZE + 1);
+            QKD_return_error_qkd(QKD_RESULT_RECEIVE_FAILED);
+        }
+        ssize_t bytes_read = kme_receive(buffer + received, MAX_MESSAGE_SIZE - received);
+        if (bytes_read < 0) {
+            QKD_error("Receiving from KME failed");
+            OPENSSL_clear_free(buffer, MAX_MESSAGE_SIZE + 1);
+            QKD_return_error_qkd(QKD_RESULT_RECEIVE_FAILED);
+        }
+        received += bytes_read;
+        buffer[received] = '\0';
+        if (body_start == NULL && (body_start = strstr(buffer, "\r\n\r\n")) != NULL) {
+            body_start += 4;
+            const char *length_str = find_header(buffer, body_start, "Content-Length:");
+            if (length_str == NULL) {
+                QKD_error("HTTP response without Content-Length");
+                OPENSSL_clear_free(buffer, MAX_MESSAGE_SIZE + 1);
+                QKD_return_error_qkd(QKD_RESULT_RECEIVE_FAILED);
+            }
+            content_length = strtoul(length_str, NULL, 10);
+            if ((body_start - buffer) + content_length > MAX_MESSAGE_SIZE) {
+                QKD_error("HTTP response too long");
+                OPENSSL_clear_free(buffer, MAX_MESSAGE_SIZE + 1);
+                QKD_return_error_qkd(QKD_RESULT_RECEIVE_FAILED);
+            }
+        }
+    }
+    int status = 0;
+    if (sscanf(buffer, "HTTP/1.%*d %d", &status) != 1) {
+        QKD_error("Invalid HTTP response");
+        OPENSSL_clear_free(buffer, MAX_MESSAGE_SIZE + 1);
+        QKD_return_error_qkd(QKD_RESULT_RECEIVE_FAILED);
+    }
+    if (status != 200) {
+        /* The KME refused the request (e.g. an unknown key ID); the connection is still good. */
+        QKD_error("KME returned HTTP status %d for %s %s", status, method, path);
+        OPENSSL_clear_free(buffer, MAX_MESSAGE_SIZE + 1);
+        QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+    }
+
+    /* Move the body to the start of the buffer. */
+    memmove(buffer, body_start, content_length);
+    OPENSSL_cleanse(buffer + content_length, MAX_MESSAGE_SIZE + 1 - content_length);
+    buffer[content_length] = '\0';
+    *response_body = buffer;
+    *response_size = MAX_MESSAGE_SIZE + 1;
+    QKD_return_success_qkd();
+}
+
+/**
+ * Send an HTTP request to the KME, reconnecting and retrying once if the persistent connection
+ * turns out to have been closed by the KME. There can be only one request in flight at a time.
+ *
+ * Returns QKD_result_t.
+ */
+static QKD_result_t kme_request(const char *method, const char *path, const char *body,
+                                char **response_body, size_t *response_size)
+{
+    QKD_enter();
+    QKD_result_t qkd_result = QKD_RESULT_CONNECTION_FAILED;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        qkd_result = kme_connect();
+        if (QKD_RESULT_SUCCESS != qkd_result) {
+            QKD_return_error_qkd(qkd_result);
+        }
+        qkd_result = kme_exchange(method, path, body, response_body, response_size);
+        if (QKD_RESULT_SUCCESS == qkd_result) {
+            QKD_return_success_qkd();
+        }
+        if (QKD_RESULT_NOT_SUPPORTED == qkd_result) {
+            QKD_return_error_qkd(qkd_result);
+        }
+        kme_disconnect();
+    }
+    QKD_return_error_qkd(qkd_result);
+}
+
+/**
+ * Find the next string value of the given field in a JSON text, starting at *position. This is
+ * not a general JSON parser; it is just enough for the responses defined in ETSI 014, in which
+ * key_ID and key are strings without escapes.
+ *
+ * Returns a pointer to the value (which is not zero terminated) and stores its size in
+ * *value_size, or returns NULL if there are no more such fields. Advances *position.
+ */
+static const char *next_json_string(const char **position, const char *field, size_t *value_size)
+{
+    char pattern[32];
+    snprintf(pattern, sizeof(pattern), "\"%s\"", field);
+    const char *p = strstr(*position, pattern);
+    if (p == NULL) {
+        return NULL;
+    }
+    p += strlen(pattern);
+    p += strspn(p, " \t\r\n");
+    if (*p != ':') {
+        return NULL;
+    }
+    p++;
+    p += strspn(p, " \t\r\n");
+    if (*p != '"') {
+        return NULL;
+    }
+    p++;
+    const char *end = strchr(p, '"');
+    if (end == NULL) {
+        return NULL;
+    }
+    *value_size = end - p;
+    *position = end + 1;
+    return p;
+}
+
+/**
+ * Find the next (non-negative) integer value of the given field in a JSON text, starting at
+ * *position (see next_json_string).
+ *
+ * Returns true and stores the value in *value if there is such a field, false otherwise. Advances
+ * *position.
+ */
+static bool next_json_integer(const char **position, const char *field, unsigned long *value)
+{
+    char pattern[32];
+    snprintf(pattern, sizeof(pattern), "\"%s\"", field);
+    const char *p = strstr(*position, pattern);
+    if (p == NULL) {
+        return false;
+    }
+    p += strlen(pattern);
+    p += strspn(p, " \t\r\n");
+    if (*p != ':') {
+        return false;
+    }
+    p++;
+    p += strspn(p, " \t\r\n");
+    if (*p < '0' || *p > '9') {
+        return false;
+    }
+    char *end;
+    *value = strtoul(p, &end, 10);
+    *position = end;
+    return true;
+}
+
+/**
+ * Parse the key container (the response to enc_keys and dec_keys) and call the callback for each
+ * key with its key ID and either the decoded key, or (with keyring delivery) a NULL key and the
+ * serial number of the key in the keyring.
+ *
+ * Returns the number of keys, or -1 on failure.
+ */
+static int parse_key_container(const char *json,
+                               void (*callback)(const char *key_id, size_t key_id_size,
+                                                const char *key, size_t key_size,
+                                                int32_t key_serial))
+{
+    QKD_enter();
+    int nr_keys = 0;
+    const char *position = json;
+    while (true) {
+        size_t key_id_size;
+        size_t key_b64_size;
+        const char *key_id = next_json_string(&position, "key_ID", &key_id_size);
+        if (key_id == NULL) {
+            break;
+        }
+        if (keyring_delivery) {
+            unsigned long key_serial;
+            if (!next_json_integer(&position, "key_serial", &key_serial) || key_serial == 0 ||
+                key_serial > INT32_MAX) {
+                QKD_error("Invalid key serial in key container");
+                QKD_return_error("%d", -1);
+            }
+            callback(key_id, key_id_size, NULL, 0, key_serial);
+            nr_keys++;
+            continue;
+        }
+        const char *key_b64 = next_json_string(&position, "key", &key_b64_size);
+        if (key_b64 == NULL || key_b64_size % 4 != 0) {
+            QKD_error("Invalid key in key container");
+            QKD_return_error("%d", -1);
+        }
+        size_t key_size = key_b64_size / 4 * 3;
+        char *key = QKD_secure_alloc(key_size);
+        if (key == NULL) {
+            QKD_return_error("%d", -1);
+        }
+        if (EVP_DecodeBlock((unsigned char *) key, (const unsigned char *) key_b64,
+                            key_b64_size) < 0) {
+            QKD_error("Invalid base64 in key container");
+            QKD_secure_free(key);
+            QKD_return_error("%d", -1);
+        }
+        /* EVP_DecodeBlock does not remove the padding. */
+        if (key_b64_size >= 2 && key_b64[key_b64_size - 1] == '=') {
+            key_size -= key_b64[key_b64_size - 2] == '=' ? 2 : 1;
+        }
+        callback(key_id, key_id_size, key, key_size, 0);
+        QKD_secure_free(key);
+        nr_keys++;
+    }
+    QKD_return_success("%d", nr_keys);
+}
+
+/**
+ * Server: buffer a key received from the KME, in the key store, or (with keyring delivery) just by
+ * keeping its serial number in the key handle. Called with kme_mutex held.
+ */
+static void buffer_enc_key(const char *key_id, size_t key_id_size, const char *key,
+                           size_t key_size, int32_t key_serial)
+{
+    UNALLOCATED_KEY *unallocated = malloc(sizeof(*unallocated));
+    if (unallocated == NULL) {
+        QKD_error("malloc failed");
+        if (key_serial) {
+            keyring_discard(key_serial);
+        }
+        return;
+    }
+    if (key_serial) {
+        key_size = enc_key_size;
+    } else {
+        QKD_health_feed(key, key_size);
+    }
+    if (!encode_key_handle(key_id, key_id_size, key_size, key_serial,
+                           &unallocated->key_handle) ||
+        (!key_serial && QKD_key_store_put(peer_sae_id, &unallocated->key_handle, key,
+                                          key_size) != QKD_RESULT_SUCCESS)) {
+        QKD_error("Cannot buffer key");
+        if (key_serial) {
+            keyring_discard(key_serial);
+        }
+        free(unallocated);
+        return;
+    }
+    unallocated->next = NULL;
+    if (unallocated_newest) {
+        unallocated_newest->next = unallocated;
+    } else {
+        unallocated_oldest = unallocated;
+    }
+    unallocated_newest = unallocated;
+}
+
+/**
+ * Server: get a batch of keys of key_size bytes from the KME. Called with kme_mutex held.
+ *
+ * Returns QKD_result_t.
+ */
+static QKD_result_t fetch_enc_keys(uint32_t key_size)
+{
+    QKD_enter();
+    char path[512];
+    snprintf(path, sizeof(path), "%senc_keys?number=%d&size=%u%s", kme.path_prefix, batch,
+             key_size * 8, keyring_delivery ? "&key_delivery=keyring" : "");
+    char *body;
+    size_t body_size;
+    QKD_result_t qkd_result = kme_request("GET", path, NULL, &body, &body_size);
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_return_error_qkd(qkd_result);
+    }
+    enc_key_size = key_size;
+    int nr_keys = parse_key_container(body, buffer_enc_key);
+    OPENSSL_clear_free(body, body_size);
+    if (nr_keys <= 0) {
+        QKD_error("No keys in enc_keys response");
+        QKD_return_error_qkd(QKD_RESULT_RECEIVE_FAILED);
+    }
+    QKD_debug("Fetched %d keys from KME", nr_keys);
+    QKD_return_success_qkd();
+}
+
+/**
+ * Client: hand a key received from the KME (or read from the keyring) to the QKD_get_key call that
+ * waits for it. Called with kme_mutex held.
+ */
+static void deliver_dec_key(const char *key_id, size_t key_id_size, const char *key,
+                            size_t key_size, int32_t key_serial)
+{
+    for (DEC_KEY_REQUEST *request = dec_key_requests; request; request = request->next) {
+        const char *request_key_id = decode_key_handle(request->key_handle, NULL);
+        if (request->sent && !request->done && strlen(request_key_id) == key_id_size &&
+            memcmp(request_key_id, key_id, key_id_size) == 0) {
+            if (key_serial) {
+                /* Read the key into the buffer of the first request for it. */
+                if (!keyring_take(key_serial, request->key, request->key_size)) {
+                    request->result = QKD_RESULT_RECEIVE_FAILED;
+                    request->done = true;
+                    return;
+                }
+                key = request->key;
+                key_size = request->key_size;
+                key_serial = 0;
+            }
+            if (key_size == request->key_size) {
+                if (request->key != key) {
+                    memcpy(request->key, key, key_size);
+                }
+                QKD_health_feed(key, key_size);
+                request->result = QKD_RESULT_SUCCESS;
+            } else {
+                QKD_error("Key has %zu bytes, expected %u", key_size, request->key_size);
+                request->result = QKD_RESULT_NOT_SUPPORTED;
+            }
+            request->done = true;
+        }
+    }
+    if (key_serial) {
+        keyring_discard(key_serial);
+    }
+}
+
+/**
+ * Client: get the keys for all waiting QKD_get_key(s) calls (at most MAX_DEC_KEYS) from the KME in a
+ * single dec_keys request. Called with kme_mutex held, but releases it during the request so that
+ * more QKD_get_key(s) calls can queue up for the next request.
+ */
+static void fetch_dec_keys(void)
+{
+    QKD_enter();
+    size_t body_size = 32 + MAX_DEC_KEYS * (MAX_KEY_ID_SIZE + 16);
+    char *body = malloc(body_size);
+    if (body == NULL) {
+        QKD_error("malloc failed");
+        QKD_return_success_void();
+    }
+    size_t length = snprintf(body, body_size, "{\"key_IDs\":[");
+    int nr_requests = 0;
+    for (DEC_KEY_REQUEST *request = dec_key_requests; request && nr_requests < MAX_DEC_KEYS;
+         request = request->next) {
+        if (!request->done) {
+            length += snprintf(body + length, body_size - length, "%s{\"key_ID\":\"%s\"}",
+                               nr_requests ? "," : "",
+                               decode_key_handle(request->key_handle, NULL));
+            request->sent = true;
+            nr_requests++;
+        }
+    }
+    snprintf(body + length, body_size - length, "]}");
+
+    char path[512];
+    snprintf(path, sizeof(path), "%sdec_keys%s", kme.path_prefix,
+             keyring_delivery ? "?key_delivery=keyring" : "");
+    dec_keys_in_flight = true;
+    pthread_mutex_unlock(&kme_mutex);
+    char *response;
+    size_t response_size;
+    QKD_result_t qkd_result = kme_request("POST", path, body, &response, &response_size);
+    free(body);
+    pthread_mutex_lock(&kme_mutex);
+    dec_keys_in_flight = false;
+
+    if (QKD_RESULT_SUCCESS == qkd_result) {
+        QKD_debug("Requested %d keys from KME", nr_requests);
+        parse_key_container(response, deliver_dec_key);
+        OPENSSL_clear_free(response, response_size);
+    }
+
+    /* Fail the requests that were part of this dec_keys request but did not get a key. */
+    for (DEC_KEY_REQUEST *request = dec_key_requests; request; request = request->next) {
+        if (request->sent && !request->done) {
+            request->result = QKD_RESULT_SUCCESS == qkd_result ? QKD_RESULT_RECEIVE_FAILED :
+                                                                  qkd_result;
+            request->done = true;
+        }
+    }
+    pthread_cond_broadcast(&dec_keys_done);
+    QKD_return_success_void();
+}
+
+/**
+ * Write a string to a snapshot, preceded by its length (2 bytes, network order).
+ *
+ * Returns true on success, false on failure.
+ */
+static bool write_snapshot_string(QKD_snapshot_t *snapshot, const char *string)
+{
+    size_t size = strlen(string);
+    unsigned char size_bytes[2] = {size >> 8, size & 0xff};
+    return size <= 0xffff && QKD_snapshot_write(snapshot, size_bytes, sizeof(size_bytes)) &&
+           QKD_snapshot_write(snapshot, string, size);
+}
+
+/**
+ * Read a string that was written by write_snapshot_string, and check that it is equal to the
+ * expected string.
+ *
+ * Returns true if the string was read and is equal to the expected string, false otherwise.
+ */
+static bool read_snapshot_string(QKD_snapshot_t *snapshot, const char *expected)
+{
+    unsigned char size_bytes[2];
+    if (!QKD_snapshot_read(snapshot, size_bytes, sizeof(size_bytes))) {
+        return false;
+    }
+    size_t size = ((size_t) size_bytes[0] << 8) | size_bytes[1];
+    char *string = malloc(size + 1);
+    if (string == NULL || !QKD_snapshot_read(snapshot, string, size)) {
+        free(string);
+        return false;
+    }
+    string[size] = '\0';
+    bool equal = strcmp(string, expected) == 0;
+    free(string);
+    return equal;
+}
+
+/**
+ * Server: save the unallocated keys in a snapshot (if snapshots are enabled), together with the
+ * KME URL and peer SAE ID that they belong to. Keys in a keyring are read from the keyring, and
+ * saved as keys that are buffered in the key store when the snapshot is loaded. Called with
+ * kme_mutex held.
+ */
+static void write_snapshot(void)
+{
+    QKD_enter();
+    QKD_snapshot_t *snapshot = QKD_snapshot_create(SNAPSHOT_KIND);
+    if (snapshot == NULL) {
+        QKD_return_success_void();
+    }
+    uint32_t nr_keys = 0;
+    for (UNALLOCATED_KEY *unallocated = unallocated_oldest; unallocated;
+         unallocated = unallocated->next) {
+        nr_keys++;
+    }
+    unsigned char nr_keys_bytes[4] = {nr_keys >> 24, nr_keys >> 16, nr_keys >> 8, nr_keys};
+    bool ok = write_snapshot_string(snapshot, kme_url) &&
+              write_snapshot_string(snapshot, peer_sae_id) &&
+              QKD_snapshot_write(snapshot, nr_keys_bytes, sizeof(nr_keys_bytes));
+    for (UNALLOCATED_KEY *unallocated = unallocated_oldest; ok && unallocated;
+         unallocated = unallocated->next) {
+        size_t key_size;
+        const char *key_id = decode_key_handle(&unallocated->key_handle, &key_size);
+        int32_t key_serial = key_handle_serial(&unallocated->key_handle);
+        QKD_key_handle_t key_handle = unallocated->key_handle;
+        if (key_serial) {
+            encode_key_handle(key_id, strlen(key_id), key_size, 0, &key_handle);
+        }
+        char *key = QKD_secure_alloc(key_size);
+        ok = key != NULL &&
+             (key_serial ? keyring_take(key_serial, key, key_size) :
+                           QKD_key_store_take(peer_sae_id, &key_handle, key, key_size)) &&
+             QKD_snapshot_write(snapshot, &key_handle, QKD_KEY_HANDLE_SIZE) &&
+             QKD_snapshot_write(snapshot, key, key_size);
+        QKD_secure_free(key);
+    }
+    if (!ok) {
+        QKD_error("Writing snapshot failed");
+        QKD_snapshot_close(snapshot);
+        QKD_return_success_void();
+    }
+    if (QKD_RESULT_SUCCESS == QKD_snapshot_commit(snapshot)) {
+        QKD_debug("Saved %u keys in snapshot", nr_keys);
+    }
+    QKD_return_success_void();
+}
+
+/**
+ * Server: buffer the keys that were saved in a snapshot (if snapshots are enabled, and there is a
+ * snapshot for the same KME URL and peer SAE ID).
+ */
+static void load_snapshot(void)
+{
+    QKD_enter();
+    QKD_snapshot_t *snapshot = QKD_snapshot_open(SNAPSHOT_KIND);
+    if (snapshot == NULL) {
+        QKD_return_success_void();
+    }
+    unsigned char nr_keys_bytes[4];
+    if (!read_snapshot_string(snapshot, kme_url) || !read_snapshot_string(snapshot, peer_sae_id) ||
+        !QKD_snapshot_read(snapshot, nr_keys_bytes, sizeof(nr_keys_bytes))) {
+        QKD_error("Discarding snapshot for other KME or peer");
+        QKD_snapshot_close(snapshot);
+        QKD_return_success_void();
+    }
+    uint32_t nr_keys = ((uint32_t) nr_keys_bytes[0] << 24) | ((uint32_t) nr_keys_bytes[1] << 16) |
+                       ((uint32_t) nr_keys_bytes[2] << 8) | nr_keys_bytes[3];
+    pthread_mutex_lock(&kme_mutex);
+    UNALLOCATED_KEY *first_loaded = NULL;
+    UNALLOCATED_KEY *last_loaded = NULL;
+    bool ok = true;
+    for (uint32_t i = 0; ok && i < nr_keys; i++) {
+        QKD_key_handle_t key_handle;
+        size_t key_size = 0;
+        char *key = NULL;
+        ok = QKD_snapshot_read(snapshot, &key_handle, QKD_KEY_HANDLE_SIZE) &&
+             decode_key_handle(&key_handle, &key_size) != NULL &&
+             key_handle_serial(&key_handle) == 0 &&
+             (key = QKD_secure_alloc(key_size)) != NULL &&
+             QKD_snapshot_read(snapshot, key, key_size);
+        UNALLOCATED_KEY *unallocated = ok ? malloc(sizeof(*unallocated)) : NULL;
+        ok = unallocated != NULL &&
+             QKD_key_store_put(peer_sae_id, &key_handle, key, key_size) == QKD_RESULT_SUCCESS;
+        QKD_secure_free(key);
+        if (!ok) {
+            free(unallocated);
+            break;
+        }
+        unallocated->key_handle = key_handle;
+        unallocated->next = NULL;
+        if (last_loaded) {
+            last_loaded->next = unallocated;
+        } else {
+            first_loaded = unallocated;
+        }
+        last_loaded = unallocated;
+    }
+    ok = ok && QKD_snapshot_verify(snapshot);
+    QKD_snapshot_close(snapshot);
+    while (!ok && first_loaded) {
+        UNALLOCATED_KEY *unallocated = first_loaded;
+        first_loaded = unallocated->next;
+        discard_buffered_key(&unallocated->key_handle);
+        free(unallocated);
+    }
+    if (first_loaded) {
+        last_loaded->next = unallocated_oldest;
+        unallocated_oldest = first_loaded;
+        if (unallocated_newest == NULL) {
+            unallocated_newest = last_loaded;
+        }
+    }
+    pthread_mutex_unlock(&kme_mutex);
+    if (!ok) {
+        QKD_error("Discarding snapshot");
+        QKD_return_success_void();
+    }
+    QKD_debug("Loaded %u keys from snapshot", nr_keys);
+    QKD_return_success_void();
+}
+
+/**
+ * Initialize the API: read the configuration from the environment.
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_init(bool server)
+{
+    QKD_enter();
+    am_server = server;
+    const char *url = getenv("QKD_ETSI014_KME_URL");
+    const char *peer = getenv("QKD_ETSI014_PEER_SAE_ID");
+    if (url == NULL || peer == NULL) {
+        QKD_error("QKD_ETSI014_KME_URL and QKD_ETSI014_PEER_SAE_ID must be set");
+        QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+    }
+    QKD_result_t qkd_result = parse_kme_url(url);
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_return_error_qkd(qkd_result);
+    }
+    if (kme.use_tls) {
+        qkd_result = create_ssl_ctx();
+        if (QKD_RESULT_SUCCESS != qkd_result) {
+            QKD_return_error_qkd(qkd_result);
+        }
+    }
+    free(kme_url);
+    kme_url = strdup(url);
+    free(peer_sae_id);
+    peer_sae_id = strdup(peer);
+    free(kme.path_prefix);
+    kme.path_prefix = malloc(strlen(peer) + 32);
+    if (kme_url == NULL || peer_sae_id == NULL || kme.path_prefix == NULL) {
+        QKD_error("malloc failed");
+        QKD_return_error_qkd(QKD_RESULT_OUT_OF_MEMORY);
+    }
+    sprintf(kme.path_prefix, "/api/v1/keys/%s/", peer);
+    batch = env_int("QKD_ETSI014_BATCH", DEFAULT_BATCH);
+    timeout_ms = env_int("QKD_ETSI014_TIMEOUT_MS", DEFAULT_TIMEOUT_MS);
+    const char *key_delivery = getenv("QKD_ETSI014_KEY_DELIVERY");
+    if (key_delivery == NULL || strcmp(key_delivery, "json") == 0) {
+        keyring_delivery = false;
+    } else if (strcmp(key_delivery, "keyring") == 0) {
+#ifndef __linux__
+        QKD_error("Key delivery through a kernel keyring is only supported on Linux");
+        QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+#endif
+        keyring_delivery = true;
+    } else {
+        QKD_error("Unsupported QKD_ETSI014_KEY_DELIVERY %s", key_delivery);
+        QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+    }
+    QKD_debug("ETSI 014 KME %s, peer SAE %s, batch %d, key delivery %s", url, peer, batch,
+              keyring_delivery ? "keyring" : "json");
+    qkd_result = QKD_journal_init(am_server ? JOURNAL_KIND_SERVER : JOURNAL_KIND_CLIENT);
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_return_error_qkd(qkd_result);
+    }
+    if (am_server) {
+        load_snapshot();
+    }
+    initialized = true;
+    QKD_return_success_qkd();
+}
+
+/**
+ * Implementation of QKD_finish. The server saves its unallocated keys in a snapshot (if snapshots
+ * are enabled). Keys that were allocated by QKD_open but not obtained yet are not saved: the
+ * client may already have asked its KME for them.
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_finish(void)
+{
+    QKD_enter();
+    if (!initialized) {
+        QKD_return_success_qkd();
+    }
+    pthread_mutex_lock(&kme_mutex);
+    if (am_server) {
+        write_snapshot();
+    }
+    while (unallocated_oldest) {
+        UNALLOCATED_KEY *unallocated = unallocated_oldest;
+        unallocated_oldest = unallocated->next;
+        discard_buffered_key(&unallocated->key_handle);
+        free(unallocated);
+    }
+    unallocated_newest = NULL;
+    kme_disconnect();
+    if (kme.ssl_ctx) {
+        SSL_CTX_free(kme.ssl_ctx);
+        kme.ssl_ctx = NULL;
+    }
+    QKD_journal_finish();
+    initialized = false;
+    pthread_mutex_unlock(&kme_mutex);
+    QKD_return_success_qkd();
+}
+
+/**
+ * Implementation of QKD_open.
+ *
+ * On the server, take a key from the buffer of keys fetched from the KME (fetching a new batch if
+ * the buffer is empty), and return its key ID in the key handle. On the client, the key handle is
+ * the one chosen by the server, and there is nothing to do.
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_open(char *destination, QKD_qos_t qos, QKD_key_handle_t *key_handle)
+{
+    QKD_enter();
+    assert(key_handle != NULL);
+    if (!am_server) {
+        QKD_return_success_qkd();
+    }
+    if (!QKD_health_serving()) {
+        QKD_return_error_qkd(QKD_RESULT_HEALTH_TEST_FAILED);
+    }
+    assert(QKD_key_handle_is_null(key_handle));
+    pthread_mutex_lock(&kme_mutex);
+    while (true) {
+        if (unallocated_oldest == NULL) {
+            QKD_result_t qkd_result = fetch_enc_keys(qos.requested_length);
+            if (QKD_RESULT_SUCCESS != qkd_result) {
+                pthread_mutex_unlock(&kme_mutex);
+                QKD_return_error_qkd(qkd_result);
+            }
+        }
+        UNALLOCATED_KEY *unallocated = unallocated_oldest;
+        unallocated_oldest = unallocated->next;
+        if (unallocated_oldest == NULL) {
+            unallocated_newest = NULL;
+        }
+        *key_handle = unallocated->key_handle;
+        free(unallocated);
+        size_t key_size;
+        decode_key_handle(key_handle, &key_size);
+        if (key_size == qos.requested_length) {
+            break;
+        }
+        /* Left over from a batch for a different key size. */
+        discard_buffered_key(key_handle);
+    }
+    pthread_mutex_unlock(&kme_mutex);
+    QKD_debug("Allocated key %s", decode_key_handle(key_handle, NULL));
+    QKD_return_success_qkd();
+}
+
+/**
+ * Implementation of QKD_connect_nonblock. Keys delivered through ETSI 014 are always synchronized
+ * at both ends, so there is nothing to do except check the key handle.
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_connect_nonblock(const QKD_key_handle_t *key_handle)
+{
+    QKD_enter();
+    if (decode_key_handle(key_handle, NULL) == NULL) {
+        QKD_error("Invalid key handle");
+        QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+    }
+    QKD_return_success_qkd();
+}
+
+/**
+ * Implementation of QKD_connect_blocking (see QKD_connect_nonblock).
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_connect_blocking(const QKD_key_handle_t *key_handle, uint32_t timeout)
+{
+    QKD_enter();
+    QKD_result_t qkd_result = QKD_connect_nonblock(key_handle);
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_return_error_qkd(qkd_result);
+    }
+    QKD_return_success_qkd();
+}
+
+/**
+ * Implementation of QKD_get_key.
+ *
+ * This is QKD_get_keys for a single key. Concurrent calls on the client share dec_keys requests
+ * (see get_dec_keys).
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_get_key(const QKD_key_handle_t *key_handle, char *key_buffer)
+{
+    QKD_enter();
+    assert(key_buffer != NULL);
+    size_t key_size;
+    if (decode_key_handle(key_handle, &key_size) == NULL) {
+        QKD_error("Invalid key handle");
+        QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+    }
+    QKD_result_t qkd_result = QKD_get_keys(1, key_handle, key_buffer, key_size, NULL);
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_return_error_qkd(qkd_result);
+    }
+    QKD_return_success_qkd();
+}
+
+/**
+ * Server: get keys from the key store, taking the key store lock once, or from the keyring.
+ *
+ * Stores the result for each key in results.
+ */
+static void get_buffered_keys(size_t nr_keys, const QKD_key_handle_t *key_handles,
+                              char *key_buffers, size_t key_buffer_size, QKD_result_t *results)
+{
+    QKD_enter();
+    QKD_key_store_piece_t *pieces = calloc(nr_keys, sizeof(*pieces));
+    if (pieces == NULL) {
+        QKD_error("malloc failed");
+        for (size_t i = 0; i < nr_keys; i++) {
+            results[i] = QKD_RESULT_OUT_OF_MEMORY;
+        }
+        QKD_return_success_void();
+    }
+    size_t nr_pieces = 0;
+    for (size_t i = 0; i < nr_keys; i++) {
+        if (QKD_RESULT_SUCCESS != results[i]) {
+            continue;
+        }
+        char *key = key_buffers + i * key_buffer_size;
+        size_t key_size;
+        decode_key_handle(&key_handles[i], &key_size);
+        int32_t key_serial = key_handle_serial(&key_handles[i]);
+        if (key_serial) {
+            if (keyring_take(key_serial, key, key_size)) {
+                QKD_health_feed(key, key_size);
+            } else {
+                results[i] = QKD_RESULT_RECEIVE_FAILED;
+            }
+            continue;
+        }
+        pieces[i].key_handle = key_handles[i];
+        pieces[i].key = key;
+        pieces[i].key_size = key_size;
+        nr_pieces++;
+    }
+    if (nr_pieces > 0) {
+        QKD_key_store_consume_batch(peer_sae_id, pieces, nr_keys);
+    }
+    for (size_t i = 0; i < nr_keys; i++) {
+        if (QKD_RESULT_SUCCESS == results[i] && !key_handle_serial(&key_handles[i]) &&
+            !pieces[i].found) {
+            QKD_error("Key is no longer in the key store (evicted)");
+            results[i] = QKD_RESULT_OUT_OF_MEMORY;
+        }
+    }
+    free(pieces);
+    QKD_return_success_void();
+}
+
+/**
+ * Client: get keys from the KME. All keys are queued at once, so that (up to MAX_DEC_KEYS of
+ * them) they go into the same dec_keys request, possibly together with the keys of concurrent
+ * calls. Whoever finds no request in flight sends the next one; the others wait for it to finish.
+ *
+ * Stores the result for each key in results.
+ */
+static void get_dec_keys(size_t nr_keys, const QKD_key_handle_t *key_handles, char *key_buffers,
+                         size_t key_buffer_size, QKD_result_t *results)
+{
+    QKD_enter();
+    DEC_KEY_REQUEST *requests = calloc(nr_keys, sizeof(*requests));
+    if (requests == NULL) {
+        QKD_error("malloc failed");
+        for (size_t i = 0; i < nr_keys; i++) {
+            results[i] = QKD_RESULT_OUT_OF_MEMORY;
+        }
+        QKD_return_success_void();
+    }
+    pthread_mutex_lock(&kme_mutex);
+    for (size_t i = nr_keys; i > 0; i--) {
+        DEC_KEY_REQUEST *request = &requests[i - 1];
+        size_t key_size = 0;
+        decode_key_handle(&key_handles[i - 1], &key_size);
+        request->key_handle = &key_handles[i - 1];
+        request->key = key_buffers + (i - 1) * key_buffer_size;
+        request->key_size = key_size;
+        request->result = results[i - 1];
+        request->done = QKD_RESULT_SUCCESS != request->result;
+        if (!request->done) {
+            request->next = dec_key_requests;
+            dec_key_requests = request;
+        }
+    }
+    for (size_t i = 0; i < nr_keys; i++) {
+        while (!requests[i].done) {
+            if (dec_keys_in_flight) {
+                pthread_cond_wait(&dec_keys_done, &kme_mutex);
+            } else {
+                fetch_dec_keys();
+            }
+        }
+    }
+    DEC_KEY_REQUEST **link = &dec_key_requests;
+    while (*link != NULL) {
+        if (*link >= requests && *link < requests + nr_keys) {
+            *link = (*link)->next;
+        } else {
+            link = &(*link)->next;
+        }
+    }
+    pthread_mutex_unlock(&kme_mutex);
+    for (size_t i = 0; i < nr_keys; i++) {
+        results[i] = requests[i].result;
+    }
+    free(requests);
+    QKD_return_success_void();
+}
+
+/**
+ * Implementation of QKD_get_keys (see qkd_api.h).
+ *
+ * On the server, the keys are taken from the key store. On the client, the keys are requested
+ * from the KME in a single dec_keys request (if there are no more than MAX_DEC_KEYS of them).
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_get_keys(size_t nr_keys, const QKD_key_handle_t *key_handles, char *key_buffers,
+                          size_t key_buffer_size, QKD_result_t *results)
+{
+    QKD_enter();
+    assert(key_handles != NULL || nr_keys == 0);
+    assert(key_buffers != NULL || nr_keys == 0);
+    if (!QKD_health_serving()) {
+        for (size_t i = 0; results != NULL && i < nr_keys; i++) {
+            results[i] = QKD_RESULT_HEALTH_TEST_FAILED;
+        }
+        QKD_return_error_qkd(QKD_RESULT_HEALTH_TEST_FAILED);
+    }
+    QKD_result_t *key_results = results ? results : malloc(nr_keys * sizeof(*key_results));
+    if (key_results == NULL && nr_keys > 0) {
+        QKD_error("malloc failed");
+        QKD_return_error_qkd(QKD_RESULT_OUT_OF_MEMORY);
+    }
+    for (size_t i = 0; i < nr_keys; i++) {
+        size_t key_size;
+        if (decode_key_handle(&key_handles[i], &key_size) == NULL ||
+            key_size > key_buffer_size) {
+            QKD_error("Invalid key handle");
+            key_results[i] = QKD_RESULT_NOT_SUPPORTED;
+        } else {
+            key_results[i] = QKD_RESULT_SUCCESS;
+        }
+    }
+    if (am_server) {
+        get_buffered_keys(nr_keys, key_handles, key_buffers, key_buffer_size, key_results);
+    } else {
+        get_dec_keys(nr_keys, key_handles, key_buffers, key_buffer_size, key_results);
+    }
+    QKD_journal_consume(nr_keys, key_handles, key_buffers, key_buffer_size, NULL, key_results);
+    QKD_result_t qkd_result = QKD_RESULT_SUCCESS;
+    for (size_t i = 0; i < nr_keys; i++) {
+        if (QKD_RESULT_SUCCESS == key_results[i]) {
+            size_t key_size;
+            decode_key_handle(&key_handles[i], &key_size);
+            QKD_debug_shared_secret("Shared secret", key_buffers + i * key_buffer_size,
+                                    key_size);
+        } else if (QKD_RESULT_SUCCESS == qkd_result) {
+            qkd_result = key_results[i];
+        }
+    }
+    if (key_results != results) {
+        free(key_results);
+    }
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_return_error_qkd(qkd_result);
+    }
+    QKD_return_success_qkd();
+}
+
+/**
+ * Implementation of QKD_close. On the server, a key that was allocated but never obtained is
+ * discarded. The KME of the client keeps the key until the client asks for it, or until the KME
+ * expires it.
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_close(const QKD_key_handle_t *key_handle)
+{
+    QKD_enter();
+    assert(key_handle);
+    if (am_server && decode_key_handle(key_handle, NULL) != NULL) {
+        discard_buffered_key(key_handle);
+    }
+    QKD_return_success_qkd();
+}
@@ -0,0 +1,435 @@
+/**
+ * qkd_api_keyfile.c
+ *
+ * An implementation of the ETSI QKD API (see qkd_api.h) on top of a file of pre-generated key that
+ * is present at both ends, for benchmarking and for reproducing problems. It is the fastest
+ * possible source of key, which gives an upper bound on the throughput of the engines, and the key
+ * stream is the same on every run. Of course it is only as secret as the file.
+ *
+ * The file is mapped into memory at both ends. QKD_open on the server allocates the next range of
+ * the file by atomically advancing an offset, without taking a lock, and the key handle carries the
+ * offset and the length of that range (and a fingerprint of the file, to detect ends that use
+ * different files). Both ends then copy the key straight from the mapping into the buffer of the
+ * caller, so no network round trip is needed, and nothing is buffered in between.
+ *
+ * The mapping uses huge pages where the kernel supports that: a file on a hugetlbfs file system is
+ * always mapped with huge pages, and for other files transparent huge pages are requested.
+ *
+ * Configuration is through environment variables:
+ *   QKD_KEYFILE                The key file, e.g. created with "head -c 64M /dev/urandom"
+ *                              (required, must be the same at both ends)
+ *   QKD_KEYFILE_OFFSET         Offset in the file of the first key allocated by the server
+ *                              (default 0), to replay a run from a given point
+ *   QKD_KEYFILE_WRAP           If 1, start again at the beginning of the file when the end is
+ *                              reached (re-using key; for long benchmarks only). By default
+ *                              QKD_open fails when the file is used up.
+ *
+ * Unless key is re-used on purpose with QKD_KEYFILE_WRAP, the server requires the journal of
+ * consumed keys (QKD_JOURNAL_DIR, see qkd_journal.h): without it, a restarted server would hand out
+ * the key of the previous run again. The two cannot be combined, since the journal refuses the key
+ * that wrapping re-uses. Within a process, QKD_finish followed by QKD_init continues after the key
+ * that was allocated before.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#include "qkd_api.h"
+#include "qkd_debug.h"
+#include "qkd_health.h"
+#include "qkd_journal.h"
+#include "qkd_util.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+
+/* Key handles consist of a magic byte, the fingerprint of the key file, the offset of the key in
+ * the file, and the key size (64 bits each, network order). */
+#define KEY_HANDLE_MAGIC 0x46
+
+/* The fingerprint is computed over the size and the first bytes of the file. */
+#define FINGERPRINT_BYTES 4096
+
+/* The kinds of journal of consumed keys written by the server and the client. */
+#define JOURNAL_KIND_SERVER "keyfile-server"
+#define JOURNAL_KIND_CLIENT "keyfile-client"
+
+typedef struct key_file_st {
+    unsigned char *start;
+    size_t size;
+    uint64_t fingerprint;
+    bool wrap;
+    _Atomic uint64_t next_offset;       /* Server: total number of bytes allocated so far (kept
+                                         * across QKD_finish) */
+} KEY_FILE;
+
+static KEY_FILE key_file = {0};
+static bool initialized = false;
+static bool am_server;
+
+static void encode_key_handle(uint64_t offset, uint64_t key_size, QKD_key_handle_t *key_handle)
+{
+    unsigned char *bytes = (unsigned char *) key_handle->bytes;
+    QKD_key_handle_set_null(key_handle);
+    bytes[0] = KEY_HANDLE_MAGIC;
+    QKD_put_uint64(bytes + 1, key_file.fingerprint);
+    QKD_put_uint64(bytes + 9, offset);
+    QKD_put_uint64(bytes + 17, key_size);
+}
+
+/**
+ * Decode a key handle, and check that it refers to a range of our key file.
+ *
+ * Returns true on success, false if the key handle is not valid.
+ */
+static bool decode_key_handle(const QKD_key_handle_t *key_handle, uint64_t *offset,
+                              uint64_t *key_size)
+{
+    const unsigned char *bytes = (const unsigned char *) key_handle->bytes;
+    if (bytes[0] != KEY_HANDLE_MAGIC) {
+        return false;
+    }
+    if (QKD_get_uint64(bytes + 1) != key_file.fingerprint) {
+        QKD_error("Key handle is for a different key file");
+        return false;
+    }
+    *offset = QKD_get_uint64(bytes + 9);
+    *key_size = QKD_get_uint64(bytes + 17);
+    return *key_size > 0 && *offset < key_file.size && *key_size <= key_file.size - *offset;
+}
+
+/**
+ * Compute the fingerprint of the mapped key file.
+ *
+ * Returns true on success, false on failure.
+ */
+static bool compute_fingerprint(void)
+{
+    unsigned char size_bytes[8];
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_size = 0;
+    QKD_put_uint64(size_bytes, key_file.size);
+    size_t nr_bytes = key_file.size < FINGERPRINT_BYTES ? key_file.size : FINGERPRINT_BYTES;
+    EVP_MD_CTX *md_ctx = EVP_MD_CTX_new();
+    bool ok = md_ctx != NULL &&
+              EVP_DigestInit_ex(md_ctx, EVP_sha256(), NULL) == 1 &&
+              EVP_DigestUpdate(md_ctx, size_bytes, sizeof(size_bytes)) == 1 &&
+              EVP_DigestUpdate(md_ctx, key_file.start, nr_bytes) == 1 &&
+              EVP_DigestFinal_ex(md_ctx, digest, &digest_size) == 1;
+    EVP_MD_CTX_free(md_ctx);
+    if (ok) {
+        key_file.fingerprint = QKD_get_uint64(digest);
+    }
+    return ok;
+}
+
+/**
+ * Map the key file into memory.
+ *
+ * Returns QKD_result_t.
+ */
+static QKD_result_t map_key_file(const char *file_name)
+{
+    QKD_enter();
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1) {
+        QKD_error_with_errno("Could not open key file %s", file_name);
+        QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        QKD_error("Key file %s is empty or cannot be read", file_name);
+        close(fd);
+        QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+    }
+    /* Pre-fault the whole mapping, so that page faults do not end up in the measurements. */
+    void *start = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (start == MAP_FAILED) {
+        QKD_error_with_errno("mmap of key file %s failed", file_name);
+        QKD_return_error_qkd(QKD_RESULT_OUT_OF_MEMORY);
+    }
+#ifdef MADV_HUGEPAGE
+    /* Fails harmlessly if the kernel has no transparent huge pages for files. */
+    madvise(start, st.st_size, MADV_HUGEPAGE);
+#endif
+#ifdef MADV_DONTDUMP
+    madvise(start, st.st_size, MADV_DONTDUMP);
+#endif
+    key_file.start = start;
+    key_file.size = st.st_size;
+    if (!compute_fingerprint()) {
+        QKD_error("Could not compute fingerprint of key file");
+        munmap(key_file.start, key_file.size);
+        key_file.start = NULL;
+        key_file.size = 0;
+        QKD_return_error_qkd(QKD_STATUS_OPEN_SSL_ERROR);
+    }
+    QKD_return_success_qkd();
+}
+
+/**
+ * Check that the key file is not used in a way that hands out the same key twice by accident (see
+ * QKD_KEYFILE_WRAP above). Called after the journal has been initialized.
+ *
+ * Returns true if the configuration is safe, false if not.
+ */
+static bool check_key_reuse(void)
+{
+    if (key_file.wrap && QKD_journal_enabled()) {
+        QKD_error("QKD_KEYFILE_WRAP re-uses key, which the journal (QKD_JOURNAL_DIR) refuses; "
+                  "set only one of them");
+        return false;
+    }
+    if (am_server && !key_file.wrap && !QKD_journal_enabled()) {
+        QKD_error("Without a journal the server would hand out the same key again after a "
+                  "restart; set QKD_JOURNAL_DIR, or QKD_KEYFILE_WRAP=1 to re-use key on purpose");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Initialize the API: map the key file. Does nothing if the API is initialized already.
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_init(bool server)
+{
+    QKD_enter();
+    if (initialized) {
+        QKD_return_success_qkd();
+    }
+    am_server = server;
+    const char *file_name = getenv("QKD_KEYFILE");
+    if (file_name == NULL) {
+        QKD_error("QKD_KEYFILE must be set");
+        QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+    }
+    QKD_result_t qkd_result = map_key_file(file_name);
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_return_error_qkd(qkd_result);
+    }
+    const char *offset_str = getenv("QKD_KEYFILE_OFFSET");
+    const char *wrap_str = getenv("QKD_KEYFILE_WRAP");
+    uint64_t offset = offset_str ? strtoull(offset_str, NULL, 10) : 0;
+    if (offset > atomic_load(&key_file.next_offset)) {
+        atomic_store(&key_file.next_offset, offset);
+    }
+    key_file.wrap = wrap_str != NULL && atoi(wrap_str) != 0;
+    qkd_result = QKD_journal_init(am_server ? JOURNAL_KIND_SERVER : JOURNAL_KIND_CLIENT);
+    if (QKD_RESULT_SUCCESS == qkd_result && !check_key_reuse()) {
+        QKD_journal_finish();
+        qkd_result = QKD_RESULT_NOT_SUPPORTED;
+    }
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        munmap(key_file.start, key_file.size);
+        key_file.start = NULL;
+        key_file.size = 0;
+        QKD_return_error_qkd(qkd_result);
+    }
+    QKD_debug("Key file %s, %zu bytes, fingerprint %016llx", file_name, key_file.size,
+              (unsigned long long) key_file.fingerprint);
+    initialized = true;
+    QKD_return_success_qkd();
+}
+
+/**
+ * Implementation of QKD_finish: unmap the key file.
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_finish(void)
+{
+    QKD_enter();
+    if (!initialized) {
+        QKD_return_success_qkd();
+    }
+    if (am_server) {
+        QKD_debug("Allocated %llu bytes of key",
+                  (unsigned long long) atomic_load(&key_file.next_offset));
+    }
+    QKD_journal_finish();
+    munmap(key_file.start, key_file.size);
+    key_file.start = NULL;
+    key_file.size = 0;
+    initialized = false;
+    QKD_return_success_qkd();
+}
+
+/**
+ * Implementation of QKD_open.
+ *
+ * On the server, allocate the next range of the key file, and return its offset in the key handle.
+ * A key never straddles the end of the file: with wrapping enabled, a range that would is skipped.
+ * On the client, the key handle is the one chosen by the server, and there is nothing to do.
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_open(char *destination, QKD_qos_t qos, QKD_key_handle_t *key_handle)
+{
+    QKD_enter();
+    assert(key_handle != NULL);
+    if (!am_server) {
+        QKD_return_success_qkd();
+    }
+    if (!QKD_health_serving()) {
+        QKD_return_error_qkd(QKD_RESULT_HEALTH_TEST_FAILED);
+    }
+    assert(QKD_key_handle_is_null(key_handle));
+    uint64_t key_size = qos.requested_length;
+    if (!initialized || key_size == 0 || key_size > key_file.size) {
+        QKD_error("Cannot allocate a key of %llu bytes", (unsigned long long) key_size);
+        QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+    }
+    uint64_t offset;
+    uint64_t max_attempts = key_file.size / key_size + 1;
+    for (uint64_t attempt = 0; ; attempt++) {
+        if (attempt > max_attempts) {
+            QKD_error("All key in the key file has been consumed");
+            QKD_return_error_qkd(QKD_RESULT_KEY_ALREADY_USED);
+        }
+        uint64_t allocated = atomic_fetch_add(&key_file.next_offset, key_size);
+        offset = key_file.wrap ? allocated % key_file.size : allocated;
+        if (offset > key_file.size - key_size) {
+            if (!key_file.wrap) {
+                QKD_error("Key file used up");
+                QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+            }
+            continue;
+        }
+        /* After a restart, skip the key that the journal says has been consumed already. */
+        encode_key_handle(offset, key_size, key_handle);
+        if (!QKD_journal_is_consumed(key_handle)) {
+            break;
+        }
+    }
+    QKD_debug("Allocated key at offset %llu", (unsigned long long) offset);
+    QKD_return_success_qkd();
+}
+
+/**
+ * Implementation of QKD_connect_nonblock. Both ends already have all the key, so there is nothing
+ * to do except check the key handle.
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_connect_nonblock(const QKD_key_handle_t *key_handle)
+{
+    QKD_enter();
+    uint64_t offset, key_size;
+    if (!initialized || !decode_key_handle(key_handle, &offset, &key_size)) {
+        QKD_error("Invalid key handle");
+        QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+    }
+    QKD_return_success_qkd();
+}
+
+/**
+ * Implementation of QKD_connect_blocking (see QKD_connect_nonblock).
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_connect_blocking(const QKD_key_handle_t *key_handle, uint32_t timeout)
+{
+    QKD_enter();
+    QKD_result_t qkd_result = QKD_connect_nonblock(key_handle);
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_return_error_qkd(qkd_result);
+    }
+    QKD_return_success_qkd();
+}
+
+/**
+ * Implementation of QKD_get_key: copy the key from the mapping of the key file.
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_get_key(const QKD_key_handle_t *key_handle, char *key_buffer)
+{
+    QKD_enter();
+    assert(key_buffer != NULL);
+    uint64_t offset, key_size;
+    if (!initialized || !decode_key_handle(key_handle, &offset, &key_size)) {
+        QKD_error("Invalid key handle");
+        QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+    }
+    if (!QKD_health_serving()) {
+        QKD_return_error_qkd(QKD_RESULT_HEALTH_TEST_FAILED);
+    }
+    memcpy(key_buffer, key_file.start + offset, key_size);
+    QKD_health_feed(key_buffer, key_size);
+    QKD_result_t qkd_result = QKD_RESULT_SUCCESS;
+    QKD_journal_consume(1, key_handle, key_buffer, key_size, NULL, &qkd_result);
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_return_error_qkd(qkd_result);
+    }
+    QKD_debug_shared_secret("Shared secret", key_buffer, key_size);
+    QKD_return_success_qkd();
+}
+
+/**
+ * Implementation of QKD_get_keys (see QKD_get_key).
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_get_keys(size_t nr_keys, const QKD_key_handle_t *key_handles, char *key_buffers,
+                          size_t key_buffer_size, QKD_result_t *results)
+{
+    QKD_enter();
+    assert(key_handles != NULL || nr_keys == 0);
+    assert(key_buffers != NULL || nr_keys == 0);
+    if (!QKD_health_serving()) {
+        for (size_t i = 0; results != NULL && i < nr_keys; i++) {
+            results[i] = QKD_RESULT_HEALTH_TEST_FAILED;
+        }
+        QKD_return_error_qkd(QKD_RESULT_HEALTH_TEST_FAILED);
+    }
+    QKD_result_t *key_results = results ? results : malloc(nr_keys * sizeof(*key_results));
+    if (key_results == NULL && nr_keys > 0) {
+        QKD_error("malloc failed");
+        QKD_return_error_qkd(QKD_RESULT_OUT_OF_MEMORY);
+    }
+    for (size_t i = 0; i < nr_keys; i++) {
+        uint64_t offset, key_size;
+        key_results[i] = QKD_RESULT_SUCCESS;
+        if (!initialized || !decode_key_handle(&key_handles[i], &offset, &key_size) ||
+            key_size > key_buffer_size) {
+            QKD_error("Invalid key handle");
+            key_results[i] = QKD_RESULT_NOT_SUPPORTED;
+        } else {
+            memcpy(key_buffers + i * key_buffer_size, key_file.start + offset, key_size);
+            QKD_health_feed(key_buffers + i * key_buffer_size, key_size);
+        }
+    }
+    QKD_journal_consume(nr_keys, key_handles, key_buffers, key_buffer_size, NULL, key_results);
+    QKD_result_t qkd_result = QKD_RESULT_SUCCESS;
+    for (size_t i = 0; i < nr_keys && QKD_RESULT_SUCCESS == qkd_result; i++) {
+        qkd_result = key_results[i];
+    }
+    if (key_results != results) {
+        free(key_results);
+    }
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_return_error_qkd(qkd_result);
+    }
+    QKD_return_success_qkd();
+}
+
+/**
+ * Implementation of QKD_close. Key in the file is never given back, so there is nothing to do.
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_close(const QKD_key_handle_t *key_handle)
+{
+    QKD_enter();
+    assert(key_handle);
+    QKD_return_success_qkd();
+}
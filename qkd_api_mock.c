@@ -1,9 +1,49 @@
 /**
  * qkd_api_mock.c
  * 
- * A mock implementation of the ETSI QKD API. Instead of really using QKD to exchange a key, the
- * server picks a key at random and sends it to the client over an insecure classical channel. This
- * is for testing only.
+ * A mock implementation of the ETSI QKD API. Instead of really using QKD to exchange key, the
+ * server's key manager picks a stream of random key and sends it to the client's key manager over
+ * an insecure classical channel (the "link"). This is for testing only.
+ * 
+ * Both ends of the link hold an identical copy of the key stream, addressed by offset. The link
+ * runs in the background, ahead of the handshakes: the server sends the key stream in blocks, the
+ * client acknowledges each block, and only acknowledged (i.e. synchronized) blocks are handed out.
+ * QKD_open on the server allocates a range of the synchronized key stream, and the key handle
+ * carries only the link identifier, the offset, and the length of that range. Each end then reads
+ * the key from its own copy, so QKD_connect_blocking and QKD_get_key need no network round trip,
+ * and it does not matter in which order OpenSSL calls the two ends.
+ *
+ * The two ends can be connected by several links, one for each key manager endpoint (see
+ * link_endpoints). Each link has its own key stream, and QKD_open on the server allocates the key
+ * from a link chosen with the power of two choices (see QKD_mock_choose_link), based on how much
+ * key each link has available and how many QKD_open calls are already waiting for it. Small keys
+ * are allocated from per-thread magazines of key stream instead (see qkd_mock_magazine.h).
+ *
+ * Synchronized key that has not been allocated yet survives a new link connection, and (with
+ * snapshots enabled, see qkd_snapshot.h) a restart of either end: when the link comes up, the
+ * server offers the unallocated blocks of the previous link, the client confirms the ones that it
+ * still has, and those become the first blocks of the new link.
+ *
+ * With the link emulator configured for LDPC reconciliation, the client receives each block with
+ * bit errors at the emulated QBER, together with the syndromes needed to correct them, as it would
+ * receive raw key from a real QKD link. Blocks that cannot be corrected are rejected and dropped.
+ * The key stream flows as a pipeline (see client_link_thread): the server keeps several blocks in
+ * flight, the client corrects them on a pool of worker threads (see qkd_pipeline.h), and it adds
+ * them to the key stream in order, as soon as each one is corrected.
+ *
+ * With the link emulator configured with a detection probability, each block is preceded by the
+ * BB84 sifting that would have produced it (see qkd_mock_protocol.h): the server announces the
+ * detections of the block and their bases, and the client answers which of them it kept, in the
+ * compact encoding of qkd_sifting.h.
+ *
+ * The server's key manager can be replicated to a standby node (see qkd_replication.h and
+ * qkd_mock_replication.h): the standby receives every block of the key stream and how far each
+ * link has allocated, and when the active node dies, it takes over the endpoints and offers the
+ * blocks that were not allocated yet to the client, as if it were the active node after a restart.
+ *
+ * This file holds the links and their threads, and the QKD API itself. The messages on the links
+ * are in qkd_mock_protocol.c, the magazines in qkd_mock_magazine.c, and the replication in
+ * qkd_mock_replication.c; they share the links through qkd_mock.h.
  * 
  * (c) 2019 Bruno Rijsman, All Rights Reserved.
  * See LICENSE for licensing information.
@@ -11,45 +51,258 @@
 
 #include "qkd_api.h"
 #include "qkd_debug.h"
+#include "qkd_health.h"
+#include "qkd_journal.h"
+#include "qkd_key_store.h"
+#include "qkd_mock.h"
+#include "qkd_mock_magazine.h"
+#include "qkd_mock_protocol.h"
+#include "qkd_mock_replication.h"
+#include "qkd_pipeline.h"
+#include "qkd_replication.h"
+#include "qkd_secure_arena.h"
+#include "qkd_snapshot.h"
+#include "qkd_util.h"
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h> 
 #include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <openssl/rand.h>
 
 /* TODO: Server can have more than one simultanious client */
-/* TODO: Add support for non-blocking connect */
 
 /**
  * TCP port number used for the "mock" replacement of the QKD protocol.
  */
 #define QKD_PORT 8999
-#define QKD_PORT_STR "8999"
 
-static int listen_sock = -1;
+/* The server keeps this much synchronized key stream ready that has not been allocated yet. */
+#define KEY_LOOKAHEAD_BYTES (8 * KEY_BLOCK_SIZE)
+
+/* The blocks of the key stream in flight: the server sends up to QKD_MOCK_PIPELINE_WINDOW blocks
+ * before it waits for an acknowledgement, and the client corrects (with LDPC reconciliation) up
+ * to that many blocks at once, on QKD_MOCK_PIPELINE_THREADS worker threads. */
+#define DEFAULT_PIPELINE_WINDOW 4
+#define MAX_PIPELINE_THREADS 8
+
+#define LINK_STALL_SECONDS 1.0  /* A link with a block in flight for longer than this is unhealthy,
+                                 * and QKD_open does not allocate key from it */
+#define LINK_HANDSHAKE_SECONDS 5    /* Server: a new link connection must be up within this time */
+
+/* The key store peers of the pads and the resumed blocks of a link (see QKD_LINK). */
+#define AUTH_PEER "auth"
+#define RESUME_PEER "resume"
+#define SNAPSHOT_KIND_SERVER "mock-server"
+#define SNAPSHOT_KIND_CLIENT "mock-client"
+
+/* The server waits this long while the replication backlog to the standby is full. */
+#define REPLICATION_BACKLOG_RETRY_SECONDS 0.01
+
+/* The links, one for each key manager endpoint. The fields up, id, nr_blocks_synced, next_offset,
+ * nr_waiting, the watermark fields, and on the server the block sequence numbers and sent times
+ * are protected by QKD_mock_link_mutex. Only the link thread changes up, sock, id, and peer; it
+ * can read them without taking the mutex. On the server, up and id are also written atomically,
+ * because the magazines read them without taking the mutex, and nr_allocated is updated
+ * atomically. The resume state, the authentication state, and the other fields are only used by
+ * the link thread (or QKD_init and QKD_finish, when the link threads are not running, or the
+ * replication thread of a standby server, before it takes over). */
+QKD_LINK QKD_mock_links[MAX_LINKS];
+size_t QKD_mock_nr_links = 0;
+pthread_mutex_t QKD_mock_link_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t QKD_mock_link_changed = PTHREAD_COND_INITIALIZER;
+bool QKD_mock_server;
+uint64_t QKD_mock_pipeline_window;      /* Blocks in flight per link */
+static bool initialized = false;
+static bool finishing = false;          /* QKD_finish is stopping the link threads */
+static pthread_t link_thread;           /* Server: a single link thread serves all links */
+static int wakeup_pipe[2] = {-1, -1};   /* Server: wakes up the link thread to send more blocks */
+static uint64_t choice_random_state;    /* For QKD_mock_choose_link, protected by
+                                         * QKD_mock_link_mutex */
+static QKD_pipeline_t *pipeline = NULL; /* Client: the worker threads for reconciliation */
+static bool links_started = false;      /* Server: false on a standby until it takes over */
 
-QKD_qos_t current_qos;
+/**
+ * Convert a timeout in milliseconds as used in the ETSI QKD API to seconds. A timeout of zero
+ * means wait forever.
+ */
+static double timeout_seconds(uint32_t timeout)
+{
+    return timeout == 0 ? INFINITY : timeout / 1000.0;
+}
 
-typedef struct qkd_session_t {
-    bool am_client;
-    char *destination;
-    QKD_key_handle_t key_handle;
-    QKD_qos_t qos;
-    int connection_sock;
-} QKD_SESSION;
+/**
+ * The TCP port that the server listens on, and that the client connects to, if the endpoint does
+ * not include a port: QKD_PORT, unless overridden with environment variable QKD_MOCK_PORT (to run
+ * several pairs of engines on one host).
+ */
+static uint16_t mock_port(void)
+{
+    const char *port_str = getenv("QKD_MOCK_PORT");
+    if (port_str != NULL) {
+        long port = strtol(port_str, NULL, 10);
+        if (port > 0 && port <= 65535) {
+            return (uint16_t) port;
+        }
+        QKD_error("Invalid QKD_MOCK_PORT %s", port_str);
+    }
+    return QKD_PORT;
+}
 
-static QKD_SESSION *qkd_session = NULL;  /* TODO: For now this is the one and only session */
+/**
+ * Split an endpoint into the host and the port (mock_port if the endpoint does not include one).
+ *
+ * Returns true on success, false if the port is not valid.
+ */
+static bool split_endpoint(const char *endpoint, char *host, size_t host_size, char *port,
+                           size_t port_size)
+{
+    snprintf(host, host_size, "%s", endpoint);
+    snprintf(port, port_size, "%u", mock_port());
+    char *colon = strrchr(host, ':');
+    if (colon != NULL && strchr(host, ':') == colon) {
+        *colon = '\0';
+        long port_nr = strtol(colon + 1, NULL, 10);
+        if (port_nr <= 0 || port_nr > 65535) {
+            return false;
+        }
+        snprintf(port, port_size, "%ld", port_nr);
+    }
+    return true;
+}
+
+/**
+ * Get an alternative of an endpoint. An endpoint can list several alternatives for the same link,
+ * separated by '|', such as the active and the standby node of a replicated key manager (see
+ * qkd_replication.h): the client connects to the first alternative that accepts, and the server
+ * listens on the port of the first alternative.
+ *
+ * Returns the number of alternatives. If index is less than that, alternative number index is
+ * stored in alternative.
+ */
+static size_t endpoint_alternative(const char *endpoint, size_t index, char *alternative,
+                                   size_t alternative_size)
+{
+    size_t nr_alternatives = 0;
+    const char *start = endpoint;
+    while (true) {
+        size_t len = strcspn(start, "|");
+        if (nr_alternatives++ == index) {
+            snprintf(alternative, alternative_size, "%.*s", (int) len, start);
+        }
+        if (start[len] == '\0') {
+            return nr_alternatives;
+        }
+        start += len + 1;
+    }
+}
+
+/**
+ * Set up a link for each key manager endpoint. The endpoints are taken from environment variable
+ * QKD_MOCK_ENDPOINTS, a comma-separated list of host names or addresses, each optionally followed
+ * by a colon and a port (or several alternatives, see endpoint_alternative). The client connects
+ * a link to each endpoint, and the server listens on the port of each endpoint (on all
+ * addresses), so both ends can use the same list. Without
+ * QKD_MOCK_ENDPOINTS, there is a single link to localhost.
+ *
+ * Returns QKD_result_t.
+ */
+static QKD_result_t link_endpoints(void)
+{
+    QKD_enter();
+    const char *endpoints = getenv("QKD_MOCK_ENDPOINTS");
+    if (endpoints == NULL || *endpoints == '\0') {
+        endpoints = "localhost";
+    }
+    QKD_mock_nr_links = 0;
+    const char *start = endpoints;
+    while (true) {
+        size_t len = strcspn(start, ",");
+        if (len == 0 || len > MAX_ENDPOINT_LEN || QKD_mock_nr_links == MAX_LINKS) {
+            QKD_error("Invalid QKD_MOCK_ENDPOINTS %s (at most %d endpoints of at most %d "
+                      "characters each)", endpoints, MAX_LINKS, MAX_ENDPOINT_LEN);
+            QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+        }
+        QKD_LINK *link = &QKD_mock_links[QKD_mock_nr_links];
+        memset(link, 0, sizeof(*link));
+        snprintf(link->endpoint, sizeof(link->endpoint), "%.*s", (int) len, start);
+        char alternative[sizeof(link->endpoint)];
+        char host[sizeof(link->endpoint)];
+        char port[16];
+        char first_port[16];
+        size_t nr_alternatives = endpoint_alternative(link->endpoint, 0, alternative,
+                                                      sizeof(alternative));
+        for (size_t i = 0; i < nr_alternatives; i++) {
+            endpoint_alternative(link->endpoint, i, alternative, sizeof(alternative));
+            if (alternative[0] == '\0' ||
+                !split_endpoint(alternative, host, sizeof(host), port, sizeof(port))) {
+                QKD_error("Invalid endpoint %s", link->endpoint);
+                QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+            }
+            if (i == 0) {
+                strcpy(first_port, port);
+            }
+        }
+        strcpy(port, first_port);
+        for (size_t i = 0; i < QKD_mock_nr_links; i++) {
+            if (strcmp(QKD_mock_links[i].endpoint, link->endpoint) == 0 ||
+                (QKD_mock_server && QKD_mock_links[i].port == atoi(port))) {
+                QKD_error("Duplicate endpoint %s", link->endpoint);
+                QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+            }
+        }
+        link->port = (uint16_t) atoi(port);
+        link->listen_sock = -1;
+        link->sock = -1;
+        link->block_ready_time = NAN;
+        snprintf(link->resume_peer, sizeof(link->resume_peer), "%s-%zu", RESUME_PEER,
+                 QKD_mock_nr_links);
+        snprintf(link->auth_peer, sizeof(link->auth_peer), "%s-%zu", AUTH_PEER, QKD_mock_nr_links);
+        snprintf(link->next_auth_peer, sizeof(link->next_auth_peer), "%s-%zu+", AUTH_PEER,
+                 QKD_mock_nr_links);
+        QKD_mock_nr_links++;
+        if (start[len] == '\0') {
+            break;
+        }
+        start += len + 1;
+    }
+    QKD_debug("%zu key manager endpoints", QKD_mock_nr_links);
+    QKD_return_success_qkd();
+}
+
+/**
+ * Find the link with the given link id. Must be called with QKD_mock_link_mutex held.
+ *
+ * Returns the link, or NULL if no link that is up has that id.
+ */
+static QKD_LINK *find_link(uint64_t link_id)
+{
+    for (size_t i = 0; i < QKD_mock_nr_links; i++) {
+        if (QKD_mock_links[i].up && QKD_mock_links[i].id == link_id) {
+            return &QKD_mock_links[i];
+        }
+    }
+    return NULL;
+}
 
 /** 
  * Listen for incoming connections.
  *
- * Create a listen socket to receive incoming connections from the clients.
+ * Create a listen socket to receive incoming connections from the clients on the given port.
  * 
  * Returns listen socket on success, or -1 on failure.
  */
-static int listen_for_incoming_connections()
+static int listen_for_incoming_connections(uint16_t port)
 {
     QKD_enter();
 
@@ -82,7 +335,7 @@ static int listen_for_incoming_connections()
     bzero(&listen_address, sizeof(listen_address));
     listen_address.sin_family = AF_INET; 
     listen_address.sin_addr.s_addr = htonl(INADDR_ANY); 
-    listen_address.sin_port = htons(QKD_PORT);
+    listen_address.sin_port = htons(port);
     result = bind(sock, (const struct sockaddr *) &listen_address, sizeof(listen_address));
     if (result != 0) {
         QKD_error_with_errno("bind failed");
@@ -99,6 +352,22 @@ static int listen_for_incoming_connections()
     QKD_return_success("%d", sock);
 }
 
+/**
+ * Bound the time that reads and writes on a link connection may block (0: no bound).
+ *
+ * Returns true on success, false on failure.
+ */
+static bool set_timeout(int sock, int seconds)
+{
+    struct timeval timeout = {.tv_sec = seconds, .tv_usec = 0};
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0 ||
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0) {
+        QKD_error_with_errno("setsockopt SO_RCVTIMEO/SO_SNDTIMEO failed");
+        return false;
+    }
+    return true;
+}
+
 /** 
  * Connect to server.
  *
@@ -106,15 +375,19 @@ static int listen_for_incoming_connections()
  * 
  * Returns connection socket on success, or -1 on failure.
  */
-static int connect_to_server(char *destination)
+static int connect_to_server(const char *destination)
 {
     QKD_enter();
     assert(destination != NULL);
 
-    /* Resolve the destination to an address. */
-    /* TODO: for now, ignore the destination and just hard-code localhost */
-    const char *host_str = "localhost";
-    const char *port_str = QKD_PORT_STR;
+    /* Resolve the destination to an address. The destination is a host name or address, optionally
+     * followed by a colon and a port number (the default port is the one we listen on). */
+    char host_str[256];
+    char port_str[16];
+    if (!split_endpoint(destination, host_str, sizeof(host_str), port_str, sizeof(port_str))) {
+        QKD_error("Invalid port in destination %s", destination);
+        QKD_return_error("%d", -1);
+    }
     struct addrinfo hints;
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_INET;
@@ -124,7 +397,7 @@ static int connect_to_server(char *destination)
     struct addrinfo *res = NULL;
     int result = getaddrinfo(host_str, port_str, &hints, &res);
     if (result != 0) {
-        QKD_error_with_errno("getaddrinfo failed");
+        QKD_error("getaddrinfo %s port %s failed: %s", host_str, port_str, gai_strerror(result));
         QKD_return_error("%d", -1);
     }
 
@@ -146,178 +419,1227 @@ static int connect_to_server(char *destination)
     }
 
     freeaddrinfo(res);
+    QKD_set_no_delay(sock);
     QKD_return_success("%d", sock);
 }
 
 /**
- * Accept an incoming TCP connection from the client (blocking).
- * 
- * Returns the connection socket on success, -1 on failure.
+ * Encode the link id, offset, and length of a range of the key stream into a key handle, and the
+ * magazine that holds it (the index of the magazine plus one, 0 if the key is in the key store).
+ */
+void QKD_mock_encode_key_handle(uint64_t link_id, uint64_t offset, uint32_t length,
+                                unsigned magazine, QKD_key_handle_t *key_handle)
+{
+    unsigned char *bytes = (unsigned char *) key_handle->bytes;
+    QKD_key_handle_set_null(key_handle);
+    bytes[0] = KEY_HANDLE_MAGIC;
+    QKD_put_uint64(bytes + 1, link_id);
+    QKD_put_uint64(bytes + 9, offset);
+    QKD_put_uint64(bytes + 17, length);
+    bytes[25] = (unsigned char) magazine;
+}
+
+/**
+ * Decode a key handle into the link id, offset, and length of a range of the key stream.
+ *
+ * Returns true on success, false if it is not a valid key handle.
+ */
+static bool decode_key_handle(const QKD_key_handle_t *key_handle, uint64_t *link_id,
+                              uint64_t *offset, uint32_t *length)
+{
+    const unsigned char *bytes = (const unsigned char *) key_handle->bytes;
+    if (bytes[0] != KEY_HANDLE_MAGIC) {
+        return false;
+    }
+    *link_id = QKD_get_uint64(bytes + 1);
+    *offset = QKD_get_uint64(bytes + 9);
+    uint64_t length_64 = QKD_get_uint64(bytes + 17);
+    if (length_64 == 0 || length_64 > KEY_BLOCK_SIZE ||
+        *offset % KEY_BLOCK_SIZE + length_64 > KEY_BLOCK_SIZE) {
+        return false;
+    }
+    *length = length_64;
+    return true;
+}
+
+/**
+ * The handle under which a block of the key stream is kept in the key store.
  */
-static int accept_connection_from_client()
+void QKD_mock_encode_block_handle(uint64_t link_id, uint64_t block_index,
+                                  QKD_key_handle_t *block_handle)
+{
+    unsigned char *bytes = (unsigned char *) block_handle->bytes;
+    QKD_key_handle_set_null(block_handle);
+    bytes[0] = BLOCK_HANDLE_MAGIC;
+    QKD_put_uint64(bytes + 1, link_id);
+    QKD_put_uint64(bytes + 9, block_index);
+}
+
+/**
+ * Wait for the link to change, but not beyond the deadline (in seconds of the monotonic clock).
+ * Must be called with QKD_mock_link_mutex held.
+ *
+ * Returns true if woken up before the deadline, false if the deadline has passed.
+ */
+static bool wait_for_link_change(double deadline)
+{
+    if (deadline == INFINITY) {
+        pthread_cond_wait(&QKD_mock_link_changed, &QKD_mock_link_mutex);
+        return true;
+    }
+    double wait = deadline - QKD_monotonic_seconds();
+    if (wait <= 0.0) {
+        return false;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    double wake = ts.tv_sec + ts.tv_nsec / 1e9 + wait;
+    ts.tv_sec = (time_t) wake;
+    ts.tv_nsec = (long) ((wake - (time_t) wake) * 1e9);
+    pthread_cond_timedwait(&QKD_mock_link_changed, &QKD_mock_link_mutex, &ts);
+    return true;
+}
+
+/**
+ * Take a link down: close the connection and discard the key stream, except for the blocks that
+ * may be resumed by the next link to the same endpoint. Called by the link thread.
+ */
+static void link_down(QKD_LINK *link)
 {
     QKD_enter();
-    assert(listen_sock != -1);
+    pthread_mutex_lock(&QKD_mock_link_mutex);
+    if (link->up) {
+        QKD_debug("Link %016llx to %s is down", (unsigned long long) link->id, link->peer);
+        QKD_mock_retain_for_resume(link);
+        QKD_key_store_discard_peer(link->peer);
+        if (QKD_mock_server) {
+            QKD_mock_magazines_discard(link);
+        }
+    }
+    if (QKD_mock_server) {
+        for (; link->oldest_block_seq < link->next_block_seq; link->oldest_block_seq++) {
+            unsigned char **block = &link->blocks_in_flight[link->oldest_block_seq %
+                                                            QKD_mock_pipeline_window];
+            QKD_secure_free(*block);
+            *block = NULL;
+        }
+        for (uint64_t i = 0; i < QKD_mock_pipeline_window; i++) {
+            free(link->sift_results[i]);
+            link->sift_results[i] = NULL;
+        }
+    }
+    QKD_mock_auth_link_down(link);
+    __atomic_store_n(&link->up, false, __ATOMIC_RELEASE);
+    if (link->sock != -1) {
+        close(link->sock);
+        link->sock = -1;
+    }
+    pthread_cond_broadcast(&QKD_mock_link_changed);
+    pthread_mutex_unlock(&QKD_mock_link_mutex);
+    QKD_return_success_void();
+}
 
-    int sock = accept(listen_sock, NULL, NULL);
+/**
+ * Server: accept a link connection from the client on the endpoint of a link. A new link
+ * connection replaces the current link of that endpoint (if any), and starts a new key stream, but
+ * only once the client has authenticated (if authentication is enabled) and has been sent the
+ * hello. Until then the new connection runs on a candidate link with the pads in a key store peer
+ * of its own, and the current link is left alone. The whole exchange must finish within
+ * LINK_HANDSHAKE_SECONDS, so that a client that goes silent cannot hold up the link thread.
+ */
+static void server_accept_link(QKD_LINK *link)
+{
+    QKD_enter();
+    struct sockaddr_storage address;
+    socklen_t address_len = sizeof(address);
+    int sock = accept(link->listen_sock, (struct sockaddr *) &address, &address_len);
     if (sock == -1) {
         QKD_error_with_errno("accept failed");
-        QKD_return_error("%d", -1);
+        QKD_return_success_void();
     }
+    QKD_set_no_delay(sock);
 
-    QKD_return_success("%d", sock);
+    /* Emulate the time it takes for the two ends of a real QKD link to rendezvous. */
+    QKD_mock_link_emulator_rendezvous(INFINITY);
+
+    uint64_t link_id;
+    QKD_LINK *candidate = calloc(1, sizeof(*candidate));
+    if (candidate == NULL || RAND_bytes((unsigned char *) &link_id, sizeof(link_id)) != 1) {
+        QKD_error("Preparing link connection failed");
+        free(candidate);
+        close(sock);
+        QKD_return_success_void();
+    }
+    candidate->sock = sock;
+    strcpy(candidate->auth_peer, link->next_auth_peer);
+    bool ok = set_timeout(sock, LINK_HANDSHAKE_SECONDS) && QKD_mock_auth_link_up(candidate) &&
+              QKD_mock_send_message_header(candidate, MESSAGE_HELLO, link_id);
+    if (!ok) {
+        QKD_mock_auth_link_down(candidate);
+        free(candidate);
+        close(sock);
+        QKD_return_success_void();
+    }
+    link_down(link);
+    link->sock = sock;
+    link->auth = candidate->auth;
+    strcpy(link->next_auth_peer, link->auth_peer);
+    strcpy(link->auth_peer, candidate->auth_peer);
+    free(candidate);
+
+    /* The key stream of each link is kept in the key store of a peer of its own: the address of
+     * the client and the port of the endpoint. */
+    char host[INET6_ADDRSTRLEN];
+    if (getnameinfo((struct sockaddr *) &address, address_len, host, sizeof(host), NULL, 0,
+                    NI_NUMERICHOST) != 0) {
+        strcpy(host, "unknown");
+    }
+    char peer[sizeof(link->peer)];
+    snprintf(peer, sizeof(peer), "%s:%u", host, link->port);
+    uint64_t nr_resumed = 0;
+    if (!QKD_mock_server_resume(link, link_id, peer, &nr_resumed) || !set_timeout(sock, 0)) {
+        link_down(link);
+        QKD_return_success_void();
+    }
+
+    pthread_mutex_lock(&QKD_mock_link_mutex);
+    __atomic_store_n(&link->id, link_id, __ATOMIC_RELEASE);
+    __atomic_store_n(&link->up, true, __ATOMIC_RELEASE);
+    strcpy(link->peer, peer);
+    link->nr_blocks_synced = nr_resumed;
+    link->next_offset = 0;
+    link->next_block_seq = nr_resumed;
+    link->oldest_block_seq = nr_resumed;
+    link->block_ready_time = NAN;
+    QKD_mock_replicate_link(link);
+    pthread_cond_broadcast(&QKD_mock_link_changed);
+    pthread_mutex_unlock(&QKD_mock_link_mutex);
+    QKD_debug("Link %016llx to %s is up", (unsigned long long) link_id, link->peer);
+    QKD_return_success_void();
 }
 
 /**
- * Send a key handle over a TCP connection (blocking).
- * 
- * Returns QKD_result_t.
+ * Server: receive the acknowledgement for the oldest block in flight from the client, after which
+ * the block is synchronized and becomes the next block of the key stream, or its rejection, after
+ * which the block is dropped. With emulated sifting, the client's answer to the sifting of a block
+ * in flight also arrives here; a block can only be acknowledged or rejected after it.
  */
-static QKD_result_t send_key_handle(int sock, const QKD_key_handle_t *key_handle)
+static void server_receive_ack(QKD_LINK *link)
 {
     QKD_enter();
-    assert(key_handle != NULL);
+    unsigned char type;
+    uint64_t block_seq;
+    if (!QKD_mock_receive_any_message_header(link, &type, &block_seq)) {
+        link_down(link);
+        QKD_return_success_void();
+    }
+    if (type == MESSAGE_SIFT_RESULT) {
+        if (!QKD_mock_receive_sift_result(link, block_seq)) {
+            link_down(link);
+        }
+        QKD_return_success_void();
+    }
+    if (!QKD_mock_receive_message_end(link)) {
+        link_down(link);
+        QKD_return_success_void();
+    }
+    pthread_mutex_lock(&QKD_mock_link_mutex);
+    if ((type != MESSAGE_ACK && type != MESSAGE_REJECT) ||
+        link->oldest_block_seq == link->next_block_seq || block_seq != link->oldest_block_seq ||
+        link->sift_results[block_seq % QKD_mock_pipeline_window] != NULL) {
+        pthread_mutex_unlock(&QKD_mock_link_mutex);
+        QKD_error("Unexpected message type %d for block %llu", type,
+                  (unsigned long long) block_seq);
+        link_down(link);
+        QKD_return_success_void();
+    }
+    unsigned char **block = &link->blocks_in_flight[block_seq % QKD_mock_pipeline_window];
+    link->oldest_block_seq++;
+    if (type == MESSAGE_REJECT) {
+        pthread_mutex_unlock(&QKD_mock_link_mutex);
+        QKD_secure_free(*block);
+        *block = NULL;
+        QKD_debug("Block %llu rejected", (unsigned long long) block_seq);
+        QKD_return_success_void();
+    }
+    uint64_t block_index = link->nr_blocks_synced;
+    QKD_key_handle_t block_handle;
+    QKD_mock_encode_block_handle(link->id, block_index, &block_handle);
+    if (QKD_key_store_put(link->peer, &block_handle, (char *) *block, KEY_BLOCK_SIZE) !=
+        QKD_RESULT_SUCCESS) {
+        pthread_mutex_unlock(&QKD_mock_link_mutex);
+        QKD_secure_free(*block);
+        *block = NULL;
+        QKD_error("Storing block %llu failed", (unsigned long long) block_index);
+        link_down(link);
+        QKD_return_success_void();
+    }
+    QKD_mock_replicate_block(link, block_index, *block);
+    link->nr_blocks_synced++;
+    pthread_cond_broadcast(&QKD_mock_link_changed);
+    pthread_mutex_unlock(&QKD_mock_link_mutex);
+    QKD_secure_free(*block);
+    *block = NULL;
+    QKD_return_success_void();
+}
 
-    int bytes_written = write(sock, key_handle->bytes, QKD_KEY_HANDLE_SIZE);
-    if (bytes_written != QKD_KEY_HANDLE_SIZE) {
-        QKD_error_with_errno("write failed");
-        QKD_return_error_qkd(QKD_RESULT_SEND_FAILED);
+/**
+ * Server: if the lookahead of synchronized key stream of a link (counting the blocks in flight) is
+ * running low, and fewer than QKD_mock_pipeline_window blocks are in flight, generate the next
+ * block of the key stream and send it to the client. If the link emulator is enabled, the next
+ * block is only generated once the emulated link would have produced it. The block is kept until
+ * the client acknowledges it (see server_receive_ack).
+ *
+ * Returns the number of seconds until the next block is ready, or INFINITY if there is nothing to
+ * do until the next event on the link.
+ */
+static double server_send_block(QKD_LINK *link)
+{
+    QKD_enter();
+    pthread_mutex_lock(&QKD_mock_link_mutex);
+    uint64_t nr_in_flight = link->next_block_seq - link->oldest_block_seq;
+    uint64_t synced_bytes = (link->nr_blocks_synced + nr_in_flight) * KEY_BLOCK_SIZE;
+    bool need_block = link->up && nr_in_flight < QKD_mock_pipeline_window &&
+                      synced_bytes - link->next_offset < KEY_LOOKAHEAD_BYTES;
+    uint64_t block_seq = link->next_block_seq;
+    pthread_mutex_unlock(&QKD_mock_link_mutex);
+    if (!need_block) {
+        QKD_return_success("%f", INFINITY);
+    }
+    if (QKD_replication_backlog_full()) {
+        /* Do not let the key stream run further ahead of the standby. */
+        QKD_return_success("%f", REPLICATION_BACKLOG_RETRY_SECONDS);
+    }
 
+    if (isnan(link->block_ready_time)) {
+        link->block_ready_time = QKD_mock_link_emulator_reserve_key(KEY_BLOCK_SIZE);
+    }
+    double wait = link->block_ready_time - QKD_monotonic_seconds();
+    if (wait > 0.0) {
+        if (wait == INFINITY) {
+            /* The emulated link will not produce key at all; try again later. */
+            link->block_ready_time = NAN;
+            wait = 1.0;
+        }
+        QKD_return_success("%f", wait);
     }
+    link->block_ready_time = NAN;
 
-    QKD_return_success_qkd();
+    unsigned char *block = QKD_secure_alloc(KEY_BLOCK_SIZE);
+    if (block == NULL) {
+        QKD_error("QKD_secure_alloc failed");
+        QKD_return_error("%f", 1.0);
+    }
+    if (QKD_mock_auth_needs_refill(link)) {
+        /* This block becomes authentication pads instead of part of the key stream. */
+        bool sent = QKD_mock_send_auth_block(link, block);
+        QKD_secure_free(block);
+        if (!sent) {
+            QKD_error("Sending authentication block failed");
+            link_down(link);
+            QKD_return_error("%f", INFINITY);
+        }
+        QKD_return_success("%f", 0.0);
+    }
+    bool sent = RAND_bytes(block, KEY_BLOCK_SIZE) == 1;
+    if (sent) {
+        QKD_health_feed(block, KEY_BLOCK_SIZE);
+    }
+    sent = sent && QKD_mock_send_key_block(link, block_seq, block);
+    if (!sent) {
+        QKD_secure_free(block);
+        QKD_error("Sending block %llu failed", (unsigned long long) block_seq);
+        link_down(link);
+        QKD_return_error("%f", INFINITY);
+    }
+    pthread_mutex_lock(&QKD_mock_link_mutex);
+    link->blocks_in_flight[block_seq % QKD_mock_pipeline_window] = block;
+    link->block_sent_times[block_seq % QKD_mock_pipeline_window] = QKD_monotonic_seconds();
+    link->next_block_seq++;
+    pthread_mutex_unlock(&QKD_mock_link_mutex);
+    QKD_debug("Sent block %llu", (unsigned long long) block_seq);
+    /* There may be room for another block in flight. */
+    QKD_return_success("%f", 0.0);
 }
 
 /**
- * Receive a key handle over a TCP connection (blocking).
- * 
- * Returns QKD_result_t.
+ * Server: the link thread. It serves all links: it accepts link connections on the endpoint of
+ * each link, and keeps the lookahead of synchronized key stream of each link filled.
  */
-static QKD_result_t receive_key_handle(int sock, QKD_key_handle_t *key_handle)
+static void *server_link_thread(void *arg)
 {
     QKD_enter();
-    assert(key_handle != NULL);
-
-    int bytes_read = read(sock, key_handle->bytes, QKD_KEY_HANDLE_SIZE);
-    if (bytes_read != QKD_KEY_HANDLE_SIZE) {
-        QKD_error_with_errno("read failed");
-        QKD_return_error_qkd(QKD_RESULT_RECEIVE_FAILED);
+    double wait = INFINITY;
+    while (true) {
+        /* For each link, its listen socket and its connection (ignored by poll if -1). */
+        struct pollfd pfds[1 + 2 * MAX_LINKS];
+        pfds[0] = (struct pollfd) {.fd = wakeup_pipe[0], .events = POLLIN};
+        for (size_t i = 0; i < QKD_mock_nr_links; i++) {
+            pfds[1 + 2 * i] = (struct pollfd) {.fd = QKD_mock_links[i].listen_sock,
+                                               .events = POLLIN};
+            pfds[2 + 2 * i] = (struct pollfd) {.fd = QKD_mock_links[i].sock, .events = POLLIN};
+        }
+        int timeout_ms = wait == INFINITY ? -1 : (int) ceil(wait * 1000.0);
+        if (poll(pfds, 1 + 2 * QKD_mock_nr_links, timeout_ms) == -1 && errno != EINTR) {
+            QKD_error_with_errno("poll failed");
+            QKD_sleep_seconds(1.0);
+        }
+        if (__atomic_load_n(&finishing, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        if (pfds[0].revents & POLLIN) {
+            char drain[64];
+            if (read(wakeup_pipe[0], drain, sizeof(drain)) == -1) {
+                QKD_error_with_errno("read wakeup pipe failed");
+            }
+        }
+        wait = INFINITY;
+        for (size_t i = 0; i < QKD_mock_nr_links; i++) {
+            QKD_LINK *link = &QKD_mock_links[i];
+            if (pfds[1 + 2 * i].revents & POLLIN) {
+                server_accept_link(link);
+            }
+            if (link->sock != -1 && (pfds[2 + 2 * i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                server_receive_ack(link);
+            }
+            double link_wait = server_send_block(link);
+            if (link_wait < wait) {
+                wait = link_wait;
+            }
+        }
+    }
+    for (size_t i = 0; i < QKD_mock_nr_links; i++) {
+        link_down(&QKD_mock_links[i]);
     }
+    QKD_return_success("%p", NULL);
+}
 
+/**
+ * Client: connect a link to its endpoint (the first alternative that accepts, starting with the
+ * one that was connected last), and resume the blocks of the previous link to that endpoint (if
+ * any).
+ *
+ * Returns QKD_result_t.
+ */
+static QKD_result_t client_connect_link(QKD_LINK *link)
+{
+    QKD_enter();
+    char alternative[sizeof(link->endpoint)];
+    size_t nr_alternatives = endpoint_alternative(link->endpoint, 0, alternative,
+                                                  sizeof(alternative));
+    int sock = -1;
+    for (size_t i = 0; -1 == sock && i < nr_alternatives; i++) {
+        size_t index = (link->alternative + i) % nr_alternatives;
+        endpoint_alternative(link->endpoint, index, alternative, sizeof(alternative));
+        sock = connect_to_server(alternative);
+        if (-1 != sock) {
+            link->alternative = index;
+        }
+    }
+    if (-1 == sock) {
+        QKD_error("connect_to_server %s failed", link->endpoint);
+        QKD_return_error_qkd(QKD_RESULT_CONNECTION_FAILED);
+    }
+    pthread_mutex_lock(&QKD_mock_link_mutex);
+    link->sock = sock;
+    pthread_mutex_unlock(&QKD_mock_link_mutex);
+    uint64_t link_id;
+    uint64_t nr_resumed = 0;
+    if (!QKD_mock_auth_link_up(link) ||
+        !QKD_mock_receive_message_header(link, MESSAGE_HELLO, &link_id) ||
+        !QKD_mock_receive_message_end(link) ||
+        !QKD_mock_client_resume(link, link_id, link->endpoint, &nr_resumed)) {
+        link_down(link);
+        QKD_return_error_qkd(QKD_RESULT_CONNECTION_FAILED);
+    }
+    pthread_mutex_lock(&QKD_mock_link_mutex);
+    link->up = true;
+    link->id = link_id;
+    strcpy(link->peer, link->endpoint);
+    link->nr_blocks_synced = nr_resumed;
+    link->next_block_seq = nr_resumed;
+    link->oldest_block_seq = nr_resumed;
+    pthread_cond_broadcast(&QKD_mock_link_changed);
+    pthread_mutex_unlock(&QKD_mock_link_mutex);
+    QKD_debug("Link %016llx to %s is up", (unsigned long long) link_id, link->endpoint);
     QKD_return_success_qkd();
 }
 
 /**
- * Send a shared secret over a TCP connection (blocking).
- * 
- * The mock implementation of the API does not provide any security at all because the shared secret
- * is sent in the clear.
- * 
- * Returns QKD_result_t.
+ * Client: allocate the ring of jobs of a link, and the pipe through which the worker threads tell
+ * the link thread that a job is done.
+ *
+ * Returns true on success, false on failure.
  */
-static QKD_result_t send_shared_secret(int sock, const char *shared_secret,
-                                       size_t shared_secret_size)
+static bool client_new_jobs(QKD_LINK *link)
 {
     QKD_enter();
-    assert(shared_secret != NULL);
+    link->done_pipe[0] = link->done_pipe[1] = -1;
+    link->jobs = calloc(QKD_mock_pipeline_window, sizeof(BLOCK_JOB));
+    if (link->jobs == NULL) {
+        QKD_error("calloc failed");
+        QKD_return_error("%d", false);
+    }
+    for (uint64_t i = 0; i < QKD_mock_pipeline_window; i++) {
+        BLOCK_JOB *job = &link->jobs[i];
+        job->link = link;
+        job->block = QKD_secure_alloc(KEY_BLOCK_SIZE);
+        job->syndromes = malloc(LDPC_FRAMES_PER_BLOCK * LDPC_FRAME_SIZE);
+        if (job->block == NULL || job->syndromes == NULL) {
+            QKD_error("Allocating job failed");
+            QKD_return_error("%d", false);
+        }
+    }
+    if (pipe(link->done_pipe) != 0) {
+        QKD_error_with_errno("pipe failed");
+        link->done_pipe[0] = link->done_pipe[1] = -1;
+        QKD_return_error("%d", false);
+    }
+    /* A worker never blocks on a full pipe: the byte already in it wakes up the link thread. */
+    for (int i = 0; i < 2; i++) {
+        if (fcntl(link->done_pipe[i], F_SETFL, O_NONBLOCK) != 0) {
+            QKD_error_with_errno("fcntl failed");
+            QKD_return_error("%d", false);
+        }
+    }
+    QKD_return_success("%d", true);
+}
 
-    int bytes_written = write(sock, shared_secret, shared_secret_size);
-    if (bytes_written != shared_secret_size) {
-        QKD_error_with_errno("write failed");
-        QKD_return_error_qkd(QKD_RESULT_SEND_FAILED);
+/**
+ * Client: free the ring of jobs of a link (there must be no job in a worker thread).
+ */
+static void client_free_jobs(QKD_LINK *link)
+{
+    for (uint64_t i = 0; link->jobs != NULL && i < QKD_mock_pipeline_window; i++) {
+        QKD_secure_free(link->jobs[i].block);
+        free(link->jobs[i].syndromes);
+    }
+    free(link->jobs);
+    link->jobs = NULL;
+    for (int i = 0; i < 2; i++) {
+        if (link->done_pipe[i] != -1) {
+            close(link->done_pipe[i]);
+            link->done_pipe[i] = -1;
+        }
+    }
+}
 
+/**
+ * Client: read the bytes that the worker threads wrote to the done pipe of a link.
+ */
+static void client_drain_done_pipe(QKD_LINK *link)
+{
+    char drain[64];
+    while (read(link->done_pipe[0], drain, sizeof(drain)) > 0) {
     }
+}
 
-    QKD_return_success_qkd();
+/**
+ * Client: receive the next message from the server: an authentication block, which is handled
+ * right away (using scratch), the sifting of the next block, which is answered right away, or a
+ * block of the key stream, which goes into the next job of the ring. A block with LDPC
+ * reconciliation is handed to the pipeline to be corrected.
+ *
+ * Returns true on success, false if the link failed.
+ */
+static bool client_receive_block(QKD_LINK *link, unsigned char *scratch)
+{
+    QKD_enter();
+    unsigned char type;
+    uint64_t block_seq;
+    if (!QKD_mock_receive_any_message_header(link, &type, &block_seq)) {
+        QKD_return_error("%d", false);
+    }
+    if (type == MESSAGE_AUTH_BLOCK) {
+        if (!QKD_mock_receive_auth_block(link, block_seq, scratch)) {
+            QKD_return_error("%d", false);
+        }
+        QKD_return_success("%d", true);
+    }
+    if (type == MESSAGE_SIFT) {
+        if (!QKD_mock_receive_sift(link, block_seq)) {
+            QKD_return_error("%d", false);
+        }
+        QKD_return_success("%d", true);
+    }
+    BLOCK_JOB *job = &link->jobs[block_seq % QKD_mock_pipeline_window];
+    if (block_seq != link->next_block_seq ||
+        block_seq - link->oldest_block_seq >= QKD_mock_pipeline_window ||
+        (type != MESSAGE_BLOCK && type != MESSAGE_BLOCK_LDPC)) {
+        QKD_error("Unexpected message type %d for block %llu", type,
+                  (unsigned long long) block_seq);
+        QKD_return_error("%d", false);
+    }
+    __atomic_store_n(&job->done, false, __ATOMIC_RELAXED);
+    if (type == MESSAGE_BLOCK) {
+        if (!QKD_mock_receive_payload(link, job->block, KEY_BLOCK_SIZE) ||
+            !QKD_mock_receive_message_end(link)) {
+            QKD_return_error("%d", false);
+        }
+        job->corrected = true;
+        __atomic_store_n(&job->done, true, __ATOMIC_RELAXED);
+        link->next_block_seq++;
+        QKD_return_success("%d", true);
+    }
+    if (!QKD_mock_receive_block_ldpc(link, job)) {
+        QKD_return_error("%d", false);
+    }
+    link->next_block_seq++;
+    if (pipeline != NULL) {
+        QKD_pipeline_submit(pipeline, QKD_mock_reconcile_block, job);
+    } else {
+        QKD_mock_reconcile_block(job);
+    }
+    QKD_return_success("%d", true);
 }
 
 /**
- * Receive a shared secret over a TCP connection (blocking).
- * 
- * The caller is responsible for allocating the memory pointed to by shared secret (which implies
- * that the caller must now a-priori how large the shared secret will be.)
- * 
- * Returns QKD_result_t.
+ * Client: take the jobs that are done off the ring of a link, in order, up to the first one that
+ * is not: add each corrected block to the key stream and acknowledge it, and reject the others.
+ *
+ * Returns true on success, false if the link failed.
  */
-static QKD_result_t receive_shared_secret(int sock, char *shared_secret, size_t shared_secret_size)
+static bool client_commit_blocks(QKD_LINK *link)
 {
     QKD_enter();
-    assert(shared_secret != NULL);
+    while (link->oldest_block_seq != link->next_block_seq) {
+        BLOCK_JOB *job = &link->jobs[link->oldest_block_seq % QKD_mock_pipeline_window];
+        if (!__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        uint64_t block_seq = link->oldest_block_seq++;
+        if (!job->corrected) {
+            if (!QKD_mock_send_message_header(link, MESSAGE_REJECT, block_seq)) {
+                QKD_return_error("%d", false);
+            }
+            continue;
+        }
+        QKD_health_feed(job->block, KEY_BLOCK_SIZE);
+        uint64_t block_index = link->nr_blocks_synced;
+        QKD_key_handle_t block_handle;
+        QKD_mock_encode_block_handle(link->id, block_index, &block_handle);
+        if (QKD_key_store_put(link->peer, &block_handle, (char *) job->block,
+                              KEY_BLOCK_SIZE) != QKD_RESULT_SUCCESS ||
+            !QKD_mock_send_message_header(link, MESSAGE_ACK, block_seq)) {
+            QKD_return_error("%d", false);
+        }
+        pthread_mutex_lock(&QKD_mock_link_mutex);
+        link->nr_blocks_synced++;
+        pthread_cond_broadcast(&QKD_mock_link_changed);
+        pthread_mutex_unlock(&QKD_mock_link_mutex);
+        QKD_debug("Received block %llu", (unsigned long long) block_index);
+    }
+    QKD_return_success("%d", true);
+}
 
-    int bytes_read = read(sock, shared_secret, shared_secret_size);
-    if (bytes_read != shared_secret_size) {
-        QKD_error_with_errno("read failed");
-        QKD_return_error_qkd(QKD_RESULT_RECEIVE_FAILED);
+/**
+ * Client: take a link down, after waiting for the jobs of the link that are still in the worker
+ * threads (so that their buffers can be reused).
+ */
+static void client_link_down(QKD_LINK *link)
+{
+    QKD_enter();
+    for (; link->oldest_block_seq != link->next_block_seq; link->oldest_block_seq++) {
+        BLOCK_JOB *job = &link->jobs[link->oldest_block_seq % QKD_mock_pipeline_window];
+        while (!__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) {
+            struct pollfd pfd = {.fd = link->done_pipe[0], .events = POLLIN};
+            poll(&pfd, 1, -1);
+            client_drain_done_pipe(link);
+        }
     }
+    link_down(link);
+    QKD_return_success_void();
+}
 
+/**
+ * Client: the link thread of a link. It receives the blocks of the key stream from the server,
+ * hands them to the pipeline to be corrected (up to QKD_mock_pipeline_window blocks at a time),
+ * and adds them to the key stream and acknowledges them in order, as they are done. When the link
+ * goes down (e.g. because the server restarts), or could not be connected when the API was
+ * initialized, it reconnects.
+ */
+static void *client_link_thread(void *arg)
+{
+    QKD_enter();
+    QKD_LINK *link = arg;
+    unsigned char *scratch = QKD_secure_alloc(KEY_BLOCK_SIZE);
+    if (scratch == NULL || !client_new_jobs(link)) {
+        QKD_error("Allocating link thread buffers failed");
+        QKD_secure_free(scratch);
+        client_free_jobs(link);
+        link_down(link);
+        QKD_return_error("%p", NULL);
+    }
+    while (!__atomic_load_n(&finishing, __ATOMIC_ACQUIRE)) {
+        if (link->sock == -1 && QKD_RESULT_SUCCESS != client_connect_link(link)) {
+            pthread_mutex_lock(&QKD_mock_link_mutex);
+            if (!finishing) {
+                wait_for_link_change(QKD_monotonic_seconds() + 1.0);
+            }
+            pthread_mutex_unlock(&QKD_mock_link_mutex);
+            continue;
+        }
+        /* With the ring full, the next block waits in the socket until a job is done. */
+        bool ring_full = link->next_block_seq - link->oldest_block_seq >= QKD_mock_pipeline_window;
+        struct pollfd pfds[2] = {{.fd = link->done_pipe[0], .events = POLLIN},
+                                 {.fd = ring_full ? -1 : link->sock, .events = POLLIN}};
+        if (poll(pfds, 2, -1) == -1 && errno != EINTR) {
+            QKD_error_with_errno("poll failed");
+            QKD_sleep_seconds(1.0);
+            continue;
+        }
+        if (pfds[0].revents & POLLIN) {
+            client_drain_done_pipe(link);
+        }
+        bool readable = pfds[1].revents & (POLLIN | POLLHUP | POLLERR);
+        if ((readable && !client_receive_block(link, scratch)) ||
+            !client_commit_blocks(link)) {
+            client_link_down(link);
+        }
+    }
+    client_link_down(link);
+    QKD_secure_free(scratch);
+    client_free_jobs(link);
+    QKD_return_success("%p", NULL);
+}
+
+/**
+ * The number of blocks in flight per link: environment variable QKD_MOCK_PIPELINE_WINDOW (which
+ * must be the same on both ends), or DEFAULT_PIPELINE_WINDOW.
+ */
+static uint64_t pipeline_window_size(void)
+{
+    const char *window_str = getenv("QKD_MOCK_PIPELINE_WINDOW");
+    if (window_str != NULL) {
+        long window = strtol(window_str, NULL, 10);
+        if (window >= 1 && window <= MAX_PIPELINE_WINDOW) {
+            return (uint64_t) window;
+        }
+        QKD_error("Invalid QKD_MOCK_PIPELINE_WINDOW %s", window_str);
+    }
+    return DEFAULT_PIPELINE_WINDOW;
+}
+
+/**
+ * Client: the number of worker threads that correct blocks: environment variable
+ * QKD_MOCK_PIPELINE_THREADS (0 to correct them in the link threads), or one per online processor,
+ * up to MAX_PIPELINE_THREADS.
+ */
+static int pipeline_threads(void)
+{
+    const char *threads_str = getenv("QKD_MOCK_PIPELINE_THREADS");
+    if (threads_str != NULL) {
+        long threads = strtol(threads_str, NULL, 10);
+        if (threads >= 0 && threads <= MAX_PIPELINE_THREADS) {
+            return (int) threads;
+        }
+        QKD_error("Invalid QKD_MOCK_PIPELINE_THREADS %s", threads_str);
+    }
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    return threads < 1 ? 1 : threads > MAX_PIPELINE_THREADS ? MAX_PIPELINE_THREADS : (int) threads;
+}
+
+/**
+ * Server: start listening for the link connection from the client on the endpoint of each link,
+ * and start the link thread.
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_mock_server_start_links(void)
+{
+    QKD_enter();
+    for (size_t i = 0; i < QKD_mock_nr_links; i++) {
+        QKD_mock_links[i].listen_sock = listen_for_incoming_connections(QKD_mock_links[i].port);
+        if (-1 == QKD_mock_links[i].listen_sock) {
+            QKD_error_with_errno("listen on port %u failed", QKD_mock_links[i].port);
+            QKD_return_error_qkd(QKD_RESULT_CONNECTION_FAILED);
+        }
+    }
+    if (pipe(wakeup_pipe) != 0) {
+        QKD_error_with_errno("pipe failed");
+        QKD_return_error_qkd(QKD_RESULT_CONNECTION_FAILED);
+    }
+    if (pthread_create(&link_thread, NULL, server_link_thread, NULL) != 0) {
+        QKD_error("pthread_create failed");
+        QKD_return_error_qkd(QKD_RESULT_OUT_OF_MEMORY);
+    }
+    __atomic_store_n(&links_started, true, __ATOMIC_RELEASE);
     QKD_return_success_qkd();
 }
 
-/** 
- * Allocate and initialize a new QKD session.
+/**
+ * Server: wake up the link thread to refill the lookahead of key stream that was allocated from.
+ */
+void QKD_mock_wake_link_thread(void)
+{
+    if (write(wakeup_pipe[1], "", 1) != 1) {
+        QKD_error_with_errno("write wakeup pipe failed");
+    }
+}
+
+/**
+ * Client: establish a link to each endpoint, and start the link threads. At least one link must
+ * come up; the link threads of the others keep trying to connect.
  *
- * Destination is a string containing the host name or IP address (as a string) of the remote side
- * of the QKD connection. For servers, destination may be NULL, which means that the server is
- * willing to accept an incoming QKD connection from any client.
- * 
- * Returns pointer to new session, or NULL on failure.
+ * Returns QKD_result_t.
  */
-QKD_SESSION *qkd_session_new(bool am_client, char *destination, QKD_qos_t qos)
+static QKD_result_t client_start_links(void)
 {
     QKD_enter();
+    QKD_result_t qkd_result = QKD_RESULT_CONNECTION_FAILED;
+    int nr_threads = pipeline_threads();
+    if (nr_threads > 0 && pipeline == NULL) {
+        /* Without the pipeline, the link threads correct the blocks themselves. */
+        pipeline = QKD_pipeline_new(nr_threads, MAX_LINKS * MAX_PIPELINE_WINDOW);
+    }
+    for (size_t i = 0; i < QKD_mock_nr_links; i++) {
+        if (QKD_RESULT_SUCCESS == client_connect_link(&QKD_mock_links[i])) {
+            qkd_result = QKD_RESULT_SUCCESS;
+        }
+    }
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        for (size_t i = 0; i < QKD_mock_nr_links; i++) {
+            QKD_mock_discard_resume(&QKD_mock_links[i]);
+        }
+        QKD_return_error_qkd(qkd_result);
+    }
+    for (size_t i = 0; i < QKD_mock_nr_links; i++) {
+        if (pthread_create(&QKD_mock_links[i].thread, NULL, client_link_thread,
+                           &QKD_mock_links[i]) != 0) {
+            QKD_error("pthread_create failed");
+            /* Stop the link threads that were started. */
+            pthread_mutex_lock(&QKD_mock_link_mutex);
+            __atomic_store_n(&finishing, true, __ATOMIC_RELEASE);
+            for (size_t j = 0; j < QKD_mock_nr_links; j++) {
+                if (QKD_mock_links[j].sock != -1) {
+                    shutdown(QKD_mock_links[j].sock, SHUT_RDWR);
+                }
+            }
+            pthread_cond_broadcast(&QKD_mock_link_changed);
+            pthread_mutex_unlock(&QKD_mock_link_mutex);
+            for (size_t j = 0; j < i; j++) {
+                pthread_join(QKD_mock_links[j].thread, NULL);
+            }
+            for (size_t j = i; j < QKD_mock_nr_links; j++) {
+                link_down(&QKD_mock_links[j]);
+            }
+            __atomic_store_n(&finishing, false, __ATOMIC_RELEASE);
+            QKD_return_error_qkd(QKD_RESULT_OUT_OF_MEMORY);
+        }
+    }
+    QKD_return_success_qkd();
+}
 
-    /* Allocate the session. */
-    QKD_SESSION *session = malloc(sizeof(QKD_SESSION));
-    if (session == NULL) {
-        QKD_error("malloc failed");
-        QKD_return_error("%p", NULL);
+/**
+ * Read the blocks that were retained for resumption by a link from a snapshot.
+ *
+ * Returns true on success, false on failure.
+ */
+static bool load_link_snapshot(QKD_snapshot_t *snapshot, QKD_LINK *link, char *block)
+{
+    unsigned char header[24];
+    if (!QKD_snapshot_read(snapshot, header, sizeof(header))) {
+        return false;
     }
+    uint64_t link_id = QKD_get_uint64(header);
+    uint64_t first_block = QKD_get_uint64(header + 8);
+    uint64_t nr_blocks = QKD_get_uint64(header + 16);
+    uint64_t end_block = first_block;
+    bool ok = nr_blocks <= MAX_RESUME_BLOCKS;
+    for (uint64_t i = 0; ok && i < nr_blocks; i++) {
+        unsigned char index[8];
+        QKD_key_handle_t block_handle;
+        ok = QKD_snapshot_read(snapshot, index, sizeof(index)) &&
+             QKD_snapshot_read(snapshot, block, KEY_BLOCK_SIZE);
+        uint64_t block_index = QKD_get_uint64(index);
+        ok = ok && block_index >= end_block && block_index < first_block + MAX_RESUME_BLOCKS;
+        end_block = block_index + 1;
+        QKD_mock_encode_block_handle(link_id, block_index, &block_handle);
+        ok = ok && QKD_key_store_put(link->resume_peer, &block_handle, block, KEY_BLOCK_SIZE) ==
+                       QKD_RESULT_SUCCESS;
+    }
+    link->resume.link_id = link_id;
+    link->resume.first_block = first_block;
+    link->resume.nr_blocks = end_block - first_block;
+    return ok;
+}
 
-    /* Initialize the session. */
-    session->am_client = am_client;
-    if (destination) {
-        session->destination = strdup(destination);
-        if (session->destination == NULL) {
-            QKD_error("malloc failed");
-            free(session);
-            QKD_return_error("%p", NULL);
+/**
+ * Load the blocks that were retained for resumption from the snapshot written by QKD_finish (if
+ * snapshots are enabled and there is one). The snapshot holds the blocks of each link, in the
+ * order of the endpoints; it is discarded if the number of endpoints has changed.
+ */
+static void load_snapshot(void)
+{
+    QKD_enter();
+    QKD_snapshot_t *snapshot = QKD_snapshot_open(QKD_mock_server ? SNAPSHOT_KIND_SERVER :
+                                                                   SNAPSHOT_KIND_CLIENT);
+    if (snapshot == NULL) {
+        QKD_return_success_void();
+    }
+    unsigned char count[8];
+    char *block = QKD_secure_alloc(KEY_BLOCK_SIZE);
+    bool ok = block != NULL && QKD_snapshot_read(snapshot, count, sizeof(count)) &&
+              QKD_get_uint64(count) == QKD_mock_nr_links;
+    uint64_t nr_blocks = 0;
+    for (size_t i = 0; ok && i < QKD_mock_nr_links; i++) {
+        ok = load_link_snapshot(snapshot, &QKD_mock_links[i], block);
+        nr_blocks += QKD_mock_links[i].resume.nr_blocks;
+    }
+    QKD_secure_free(block);
+    if (!ok || !QKD_snapshot_verify(snapshot)) {
+        QKD_error("Discarding snapshot");
+        for (size_t i = 0; i < QKD_mock_nr_links; i++) {
+            QKD_mock_discard_resume(&QKD_mock_links[i]);
         }
-    } else {
-        session->destination = NULL;
+        QKD_snapshot_close(snapshot);
+        QKD_return_success_void();
     }
-    QKD_key_handle_set_random(&session->key_handle);
-    session->qos = qos;
-    session->connection_sock = -1;
+    QKD_snapshot_close(snapshot);
+    QKD_debug("Loaded %llu blocks from snapshot", (unsigned long long) nr_blocks);
+    QKD_return_success_void();
+}
 
-    QKD_return_success("%p", session);
+/**
+ * Write the blocks that were retained for resumption by a link to a snapshot, and discard them
+ * from memory.
+ *
+ * Returns the number of blocks written, or -1 on failure.
+ */
+static int64_t write_link_snapshot(QKD_snapshot_t *snapshot, QKD_LINK *link)
+{
+    /* Take the blocks out of the key store first, to know how many there are. */
+    char *blocks[MAX_RESUME_BLOCKS];
+    uint64_t indexes[MAX_RESUME_BLOCKS];
+    uint64_t nr_blocks = 0;
+    for (uint64_t i = 0; i < link->resume.nr_blocks && nr_blocks < MAX_RESUME_BLOCKS; i++) {
+        QKD_key_handle_t block_handle;
+        uint64_t index = link->resume.first_block + i;
+        QKD_mock_encode_block_handle(link->resume.link_id, index, &block_handle);
+        char *block = QKD_secure_alloc(KEY_BLOCK_SIZE);
+        if (block == NULL) {
+            break;
+        }
+        if (!QKD_key_store_take(link->resume_peer, &block_handle, block, KEY_BLOCK_SIZE)) {
+            QKD_secure_free(block);
+            continue;
+        }
+        blocks[nr_blocks] = block;
+        indexes[nr_blocks++] = index;
+    }
+    QKD_mock_discard_resume(link);
+    unsigned char header[24];
+    QKD_put_uint64(header, link->resume.link_id);
+    QKD_put_uint64(header + 8, link->resume.first_block);
+    QKD_put_uint64(header + 16, nr_blocks);
+    bool ok = QKD_snapshot_write(snapshot, header, sizeof(header));
+    for (uint64_t i = 0; i < nr_blocks; i++) {
+        unsigned char index[8];
+        QKD_put_uint64(index, indexes[i]);
+        ok = ok && QKD_snapshot_write(snapshot, index, sizeof(index)) &&
+             QKD_snapshot_write(snapshot, blocks[i], KEY_BLOCK_SIZE);
+        QKD_secure_free(blocks[i]);
+    }
+    return ok ? (int64_t) nr_blocks : -1;
 }
 
 /**
- * Delete a QKD session.
+ * Write the blocks that were retained for resumption by each link to a snapshot (if snapshots are
+ * enabled), and discard them from memory.
  */
-void qkd_session_delete(QKD_SESSION *session)
+static void write_snapshot(void)
 {
     QKD_enter();
-    assert(session != NULL);
-    free(session);
+    QKD_snapshot_t *snapshot = QKD_snapshot_create(QKD_mock_server ? SNAPSHOT_KIND_SERVER :
+                                                                     SNAPSHOT_KIND_CLIENT);
+    if (snapshot == NULL) {
+        for (size_t i = 0; i < QKD_mock_nr_links; i++) {
+            QKD_mock_discard_resume(&QKD_mock_links[i]);
+        }
+        QKD_return_success_void();
+    }
+    unsigned char count[8];
+    QKD_put_uint64(count, QKD_mock_nr_links);
+    bool ok = QKD_snapshot_write(snapshot, count, sizeof(count));
+    int64_t nr_blocks = 0;
+    for (size_t i = 0; i < QKD_mock_nr_links; i++) {
+        int64_t nr_link_blocks = write_link_snapshot(snapshot, &QKD_mock_links[i]);
+        ok = ok && nr_link_blocks >= 0;
+        nr_blocks += nr_link_blocks;
+    }
+    if (!ok) {
+        QKD_error("Writing snapshot failed");
+        QKD_snapshot_close(snapshot);
+        QKD_return_success_void();
+    }
+    if (QKD_RESULT_SUCCESS == QKD_snapshot_commit(snapshot)) {
+        QKD_debug("Saved %lld blocks in snapshot", (long long) nr_blocks);
+    }
     QKD_return_success_void();
 }
 
 /**
- * Initialize the API.
- * 
+ * The offset in the key stream of a link at which a key of the given length would be allocated:
+ * the first unallocated offset, or the start of the next block if the key would straddle two
+ * blocks (a key never straddles two blocks). Must be called with QKD_mock_link_mutex held.
+ */
+uint64_t QKD_mock_allocation_offset(const QKD_LINK *link, uint32_t length)
+{
+    uint64_t offset = link->next_offset;
+    if (offset % KEY_BLOCK_SIZE + length > KEY_BLOCK_SIZE) {
+        offset += KEY_BLOCK_SIZE - offset % KEY_BLOCK_SIZE;
+    }
+    return offset;
+}
+
+/**
+ * Server: how much key a link can offer to a new key of the given length: the key up to the
+ * allocation limit that has not been allocated yet, minus the key that the QKD_open calls that
+ * are already waiting for the link will take. Must be called with QKD_mock_link_mutex held.
+ */
+static int64_t link_score(const QKD_LINK *link, uint32_t length)
+{
+    int64_t available = (int64_t) QKD_mock_allocation_limit(link) -
+                        (int64_t) QKD_mock_allocation_offset(link, length);
+    return available - (int64_t) link->nr_waiting * length;
+}
+
+/**
+ * Server: is a link healthy? It must be up, and it must not be stalled: a block that has been in
+ * flight for longer than LINK_STALL_SECONDS means that the client is not keeping up (or is gone
+ * without closing the connection). Must be called with QKD_mock_link_mutex held.
+ */
+static bool link_healthy(const QKD_LINK *link, double now)
+{
+    size_t oldest = link->oldest_block_seq % QKD_mock_pipeline_window;
+    return link->up && !(link->oldest_block_seq != link->next_block_seq &&
+                         now - link->block_sent_times[oldest] > LINK_STALL_SECONDS);
+}
+
+/**
+ * Server: choose the link to allocate a key of the given length from, with the power of two
+ * choices: pick two healthy links at random, and take the one with the higher score (see
+ * link_score). Compared to always taking the best link, this does not send a burst of callers to
+ * the same link, while still steering them away from links that are short of key. Must be called
+ * with QKD_mock_link_mutex held.
+ *
+ * Returns the link, or NULL if no link is healthy.
+ */
+QKD_LINK *QKD_mock_choose_link(uint32_t length)
+{
+    double now = QKD_monotonic_seconds();
+    QKD_LINK *healthy[MAX_LINKS];
+    size_t nr_healthy = 0;
+    for (size_t i = 0; i < QKD_mock_nr_links; i++) {
+        if (link_healthy(&QKD_mock_links[i], now)) {
+            healthy[nr_healthy++] = &QKD_mock_links[i];
+        }
+    }
+    if (nr_healthy <= 1) {
+        return nr_healthy == 1 ? healthy[0] : NULL;
+    }
+
+    /* xorshift64* is plenty for spreading load; it needs no lock of its own. */
+    uint64_t x = choice_random_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    choice_random_state = x;
+    uint64_t random = x * 0x2545F4914F6CDD1DULL;
+    size_t first = (random >> 32) % nr_healthy;
+    size_t second = (random & 0xffffffff) % (nr_healthy - 1);
+    if (second >= first) {
+        second++;
+    }
+    QKD_LINK *link = healthy[first];
+    if (link_score(healthy[second], length) > link_score(link, length)) {
+        link = healthy[second];
+    }
+    return link;
+}
+
+/**
+ * Wait until the range of the key stream referred to by a key handle has been synchronized, but
+ * not beyond the deadline (in seconds of the monotonic clock).
+ *
  * Returns QKD_result_t.
  */
-QKD_result_t QKD_init(bool am_server)
+static QKD_result_t wait_for_key(const QKD_key_handle_t *key_handle, double deadline)
 {
     QKD_enter();
-    if (am_server) {
-        listen_sock = listen_for_incoming_connections();
-        if (-1 == listen_sock) {
-            QKD_error_with_errno("listen failed");
+    uint64_t link_id;
+    uint64_t offset;
+    uint32_t length;
+    if (!decode_key_handle(key_handle, &link_id, &offset, &length)) {
+        QKD_error("Invalid key handle %s", QKD_key_handle_str(key_handle));
+        QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+    }
+    bool used;
+    if (QKD_mock_magazine_find(key_handle, link_id, offset, length, NULL, &used)) {
+        /* Only synchronized key goes into a magazine. */
+        QKD_return_success_qkd();
+    }
+    if (used) {
+        QKD_error("Key was already obtained");
+        QKD_return_error_qkd(QKD_RESULT_KEY_ALREADY_USED);
+    }
+    pthread_mutex_lock(&QKD_mock_link_mutex);
+    while (true) {
+        QKD_LINK *link = find_link(link_id);
+        if (link == NULL) {
+            pthread_mutex_unlock(&QKD_mock_link_mutex);
+            QKD_error("Key handle is not for a current link");
             QKD_return_error_qkd(QKD_RESULT_CONNECTION_FAILED);
         }
+        if (offset + length <= link->nr_blocks_synced * KEY_BLOCK_SIZE) {
+            break;
+        }
+        if (!wait_for_link_change(deadline)) {
+            pthread_mutex_unlock(&QKD_mock_link_mutex);
+            QKD_error("Timed out waiting for key to be synchronized");
+            QKD_return_error_qkd(QKD_RESULT_TIMEOUT);
+        }
+    }
+    pthread_mutex_unlock(&QKD_mock_link_mutex);
+    QKD_return_success_qkd();
+}
+
+/**
+ * Initialize the API. On the server, this starts listening for the link connections from the
+ * client. On the client, this establishes the links to the endpoints of the server (the server
+ * must be running), after which the key streams are synchronized in the background.
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_init(bool server)
+{
+    QKD_enter();
+    if (initialized) {
+        QKD_return_success_qkd();
+    }
+    QKD_result_t qkd_result = QKD_mock_link_emulator_init();
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_return_error_qkd(qkd_result);
+    }
+    QKD_mock_server = server;
+    qkd_result = QKD_mock_auth_init();
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_return_error_qkd(qkd_result);
+    }
+    qkd_result = link_endpoints();
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_return_error_qkd(qkd_result);
+    }
+    if (RAND_bytes((unsigned char *) &choice_random_state, sizeof(choice_random_state)) != 1) {
+        QKD_error("RAND_bytes failed");
+        QKD_return_error_qkd(QKD_RESULT_OUT_OF_MEMORY);
+    }
+    choice_random_state |= 1;
+    qkd_result = QKD_journal_init(QKD_mock_server ? SNAPSHOT_KIND_SERVER : SNAPSHOT_KIND_CLIENT);
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_return_error_qkd(qkd_result);
+    }
+    QKD_mock_pipeline_window = pipeline_window_size();
+    QKD_mock_magazines_init();
+    qkd_result = QKD_mock_server ? QKD_mock_replication_start() : QKD_RESULT_SUCCESS;
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_return_error_qkd(qkd_result);
+    }
+    if (QKD_mock_server && QKD_replication_role() == QKD_REPLICATION_ROLE_STANDBY) {
+        /* The links are started when the standby takes over (see replication_active_lost in
+         * qkd_mock_replication.c). */
+        initialized = true;
+        QKD_return_success_qkd();
+    }
+    load_snapshot();
+    qkd_result = QKD_mock_server ? QKD_mock_server_start_links() : client_start_links();
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_replication_stop();
+        QKD_return_error_qkd(qkd_result);
+    }
+    initialized = true;
+    QKD_return_success_qkd();
+}
+
+/**
+ * Finish the API: stop the link threads, take the links down, and save the synchronized key that
+ * has not been allocated yet in a snapshot (if snapshots are enabled), so that QKD_init can resume
+ * it after a restart.
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_finish(void)
+{
+    QKD_enter();
+    if (!initialized) {
+        QKD_return_success_qkd();
+    }
+    QKD_replication_stop();
+    QKD_replication_stats_t replication_stats;
+    QKD_replication_get_stats(&replication_stats);
+    if (replication_stats.role == QKD_REPLICATION_ROLE_ACTIVE) {
+        QKD_debug("Replicated %llu records in %llu batches to the standby, lag mean %.3f ms "
+                  "max %.3f ms", (unsigned long long) replication_stats.nr_records,
+                  (unsigned long long) replication_stats.nr_batches,
+                  replication_stats.nr_batches > 0 ?
+                      1000.0 * replication_stats.total_lag / replication_stats.nr_batches : 0.0,
+                  1000.0 * replication_stats.max_lag);
+    } else if (replication_stats.role == QKD_REPLICATION_ROLE_STANDBY) {
+        QKD_debug("Applied %llu records in %llu batches from the active server",
+                  (unsigned long long) replication_stats.nr_records,
+                  (unsigned long long) replication_stats.nr_batches);
+    }
+    bool started = __atomic_load_n(&links_started, __ATOMIC_ACQUIRE);
+    pthread_mutex_lock(&QKD_mock_link_mutex);
+    __atomic_store_n(&finishing, true, __ATOMIC_RELEASE);
+    for (size_t i = 0; !QKD_mock_server && i < QKD_mock_nr_links; i++) {
+        if (QKD_mock_links[i].sock != -1) {
+            shutdown(QKD_mock_links[i].sock, SHUT_RDWR);
+        }
     }
+    pthread_cond_broadcast(&QKD_mock_link_changed);
+    pthread_mutex_unlock(&QKD_mock_link_mutex);
+    if (QKD_mock_server && started) {
+        if (write(wakeup_pipe[1], "", 1) != 1) {
+            QKD_error_with_errno("write wakeup pipe failed");
+        }
+        pthread_join(link_thread, NULL);
+    } else if (!QKD_mock_server) {
+        for (size_t i = 0; i < QKD_mock_nr_links; i++) {
+            pthread_join(QKD_mock_links[i].thread, NULL);
+        }
+        QKD_pipeline_free(pipeline);
+        pipeline = NULL;
+    }
+    if (QKD_mock_server) {
+        QKD_mock_magazines_discard(NULL);
+    }
+    for (size_t i = 0; QKD_mock_server && i < QKD_mock_nr_links; i++) {
+        QKD_debug("Allocated %llu keys from the link to endpoint %s",
+                  (unsigned long long) QKD_mock_links[i].nr_allocated, QKD_mock_links[i].endpoint);
+    }
+    if (QKD_mock_server && !started) {
+        /* A standby that did not take over: the replicated blocks are the active server's. */
+        for (size_t i = 0; i < QKD_mock_nr_links; i++) {
+            QKD_mock_discard_resume(&QKD_mock_links[i]);
+        }
+    } else {
+        write_snapshot();
+    }
+    QKD_mock_auth_finish();
+    QKD_journal_finish();
+    if (QKD_mock_server && started) {
+        for (size_t i = 0; i < QKD_mock_nr_links; i++) {
+            close(QKD_mock_links[i].listen_sock);
+            QKD_mock_links[i].listen_sock = -1;
+        }
+        close(wakeup_pipe[0]);
+        close(wakeup_pipe[1]);
+        wakeup_pipe[0] = wakeup_pipe[1] = -1;
+    }
+    __atomic_store_n(&links_started, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&finishing, false, __ATOMIC_RELEASE);
+    initialized = false;
     QKD_return_success_qkd();
 }
 
@@ -326,11 +1648,17 @@ QKD_result_t QKD_init(bool am_server)
  * "Receive an association (key_handle) to a set of future keys at both ends of the QKD link through
  * this distributed Key Management Layer and establish a set of parameters that define the expected
  * levels of key service. This function shall return immediately and not block."
- * 
- * On the server side, the provided key handle may contain the QKD_key_handle_null value (which is
- * different from the key_handle pointer being NULL), in which case this function will allocate a
- * new handle and return it in the key_handle paramter.
- * 
+ *
+ * On the server side, the provided key handle must contain the QKD_key_handle_null value (which is
+ * different from the key_handle pointer being NULL). This function allocates a range of the
+ * synchronized key stream of requested_length bytes, and returns a key handle for it in the
+ * key_handle parameter. If no synchronized key stream is available, this function waits for it,
+ * but not longer than the timeout in the QoS parameters.
+ * A key that fits in a magazine is allocated from the magazine of the calling thread (see
+ * QKD_mock_magazine_open), which is refilled from a link only now and then.
+ *
+ * On the client side, the key handle is the one chosen by the server, and there is nothing to do.
+ *
  * Returns QKD_result_t.
  */
 QKD_result_t QKD_open(char *destination, QKD_qos_t qos, QKD_key_handle_t *key_handle)
@@ -338,30 +1666,66 @@ QKD_result_t QKD_open(char *destination, QKD_qos_t qos, QKD_key_handle_t *key_ha
     QKD_enter();
     assert(key_handle != NULL);
 
-    /* Do we have a destination? In our implementation, the destination is optional, even though
-     * the ETSI QKD API document doesn't say anything about the destination being optional. If the
-     * destination is NULL it means we will accept incoming QKD connections from any client, and
-     * if the destination is not NULL it means that we are a client and that destination contains
-     * the address of the server. */
-    bool am_client = (destination != NULL);
+    /* The destination is not used: QKD_init says whether we are the server, and the client's key
+     * managers are its link endpoints (see link_endpoints). */
+    if (!QKD_mock_server) {
+        QKD_return_success_qkd();
+    }
+    if (!__atomic_load_n(&links_started, __ATOMIC_ACQUIRE)) {
+        QKD_error("Standby server has not taken over from the active server");
+        QKD_return_error_qkd(QKD_RESULT_CONNECTION_FAILED);
+    }
+    if (!QKD_health_serving()) {
+        QKD_return_error_qkd(QKD_RESULT_HEALTH_TEST_FAILED);
+    }
 
     /* TODO: For now (maybe forever) we don't support predefined key handles on the server.
      * Hence we insist that the provded key handle is a null key handle (which is not the same
      * thing as a null pointer.) */
-    if (!am_client) {
-        assert(QKD_key_handle_is_null(key_handle));
+    assert(QKD_key_handle_is_null(key_handle));
+    uint32_t length = qos.requested_length;
+    if (length == 0 || length > KEY_BLOCK_SIZE) {
+        QKD_error("Requested length %u not supported", length);
+        QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
     }
-
-    /* Create a new QKD session */
-    /* TODO: for now we only allow one concurrent session. */
-    assert(qkd_session == NULL);
-    qkd_session = qkd_session_new(am_client, destination, qos);
-    if (qkd_session == NULL) {
-        QKD_return_error_qkd(QKD_RESULT_OUT_OF_MEMORY);
+    if (QKD_mock_magazine_open(length, key_handle)) {
+        QKD_debug("Allocated key of length %u from the magazine of this thread", length);
+        QKD_return_success_qkd();
     }
 
-    /* Return the key handle for the session (in the key_handle parameter) */
-    *key_handle = qkd_session->key_handle;
+    /* Allocate the range from the synchronized key stream of a link. If the chosen link does not
+     * have enough key, wait in its queue, and choose again when any link changes. */
+    double deadline = QKD_monotonic_seconds() + timeout_seconds(qos.timeout);
+    pthread_mutex_lock(&QKD_mock_link_mutex);
+    QKD_LINK *link;
+    uint64_t offset;
+    while (true) {
+        link = QKD_mock_choose_link(length);
+        if (link != NULL) {
+            offset = QKD_mock_allocation_offset(link, length);
+            if (offset + length <= QKD_mock_allocation_limit(link)) {
+                break;
+            }
+            link->nr_waiting++;
+        }
+        bool woken = wait_for_link_change(deadline);
+        if (link != NULL) {
+            link->nr_waiting--;
+        }
+        if (!woken) {
+            pthread_mutex_unlock(&QKD_mock_link_mutex);
+            QKD_error("Timed out waiting for synchronized key");
+            QKD_return_error_qkd(QKD_RESULT_TIMEOUT);
+        }
+    }
+    link->next_offset = offset + length;
+    __atomic_add_fetch(&link->nr_allocated, 1, __ATOMIC_RELAXED);
+    QKD_mock_request_watermark(link);
+    QKD_mock_encode_key_handle(link->id, offset, length, 0, key_handle);
+    pthread_mutex_unlock(&QKD_mock_link_mutex);
+    QKD_mock_wake_link_thread();
+    QKD_debug("Allocated key stream offset %llu length %u from the link to %s",
+              (unsigned long long) offset, length, link->endpoint);
     QKD_return_success_qkd();
 }
 
@@ -370,14 +1734,17 @@ QKD_result_t QKD_open(char *destination, QKD_qos_t qos, QKD_key_handle_t *key_ha
  * as follows: "Verifies that the QKD link is available and the key_handle association is
  * synchronized at both ends of the link. This function shall not block and returns immediately
  * indicating that both sides of the link have rendezvoused or an error has occured."
- * 
- * Returns QKD_result_t.
+ *
+ * Returns QKD_result_t (QKD_RESULT_TIMEOUT if the key has not been synchronized yet).
  */
 QKD_result_t QKD_connect_nonblock(const QKD_key_handle_t *key_handle)
 {
     QKD_enter();
-    /* TODO: Not yet implemented. */
-    QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+    QKD_result_t qkd_result = wait_for_key(key_handle, -INFINITY);
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_return_error_qkd(qkd_result);
+    }
+    QKD_return_success_qkd();
 }
 
 /**
@@ -385,73 +1752,19 @@ QKD_result_t QKD_connect_nonblock(const QKD_key_handle_t *key_handle)
  * as follows: "Verifies that the QKD link is available and the key_handle association is
  * synchronized at both ends of the link. This function shall block until both sides of the link
  * have rendezvoused, an error is detected, or the specified TIMEOUT delay has been exceeded."
- * 
+ *
+ * The server only hands out synchronized key, so normally this returns immediately.
+ *
  * Returns QKD_result_t.
  */
 QKD_result_t QKD_connect_blocking(const QKD_key_handle_t *key_handle, uint32_t timeout)
 {
     QKD_enter();
-    /* TODO: Implement the timeout */
-
-    /* TODO: For now there is only one concurrent session. */
-    assert(qkd_session != NULL);
-    int connection_sock = -1;
-    if (qkd_session->am_client) {
-
-        /* Client */
-
-        /* Initiate a TCP connection to the server. */
-        QKD_debug("Initiate TCP connection to server");
-        assert(qkd_session->destination != NULL);
-        connection_sock = connect_to_server(qkd_session->destination);
-        if (-1 == connection_sock) {
-            QKD_error("connect_to_server failed");
-            QKD_return_error_qkd(QKD_RESULT_CONNECTION_FAILED);
-        }
-        QKD_debug("TCP connected to server");
-
-        /* Send our (the client's) key handle to the server. */
-        QKD_result_t qkd_result = send_key_handle(connection_sock, key_handle);
-        if (QKD_RESULT_SUCCESS != qkd_result) {
-            QKD_error("send_key_handle failed");
-            QKD_return_error_qkd(qkd_result);
-        }
-        QKD_debug("Sent key handle to server");
-
-    } else {
-
-        /* Server */
-
-        /* Accept an incoming TCP connection from the client. */
-        QKD_debug("Accept an incoming TCP connection from the client");
-        connection_sock = accept_connection_from_client();
-        if (-1 == connection_sock) {
-            QKD_error("accept_connection_from_client failed");
-            QKD_return_error_qkd(QKD_RESULT_CONNECTION_FAILED);
-        }
-        QKD_debug("TCP connected to client");
-
-        /* Receive the client's key handle. */
-        QKD_key_handle_t client_key_handle;
-        QKD_result_t qkd_result = receive_key_handle(connection_sock, &client_key_handle);
-        if (QKD_RESULT_SUCCESS != qkd_result) {
-            QKD_error("receive_key_handle failed");
-            QKD_return_error_qkd(qkd_result);
-        }
-        QKD_debug("Received key handle from client");
-
-        /* The client's key handle must be the same as ours. This is just a sanity check does
-         * not provide any level of security since the key handle was sent in the clear, namely
-         * in the public key of the Diffie-Hellman exchange. (Anyway this mock implementation is
-         * not intended to be secure in the first place.) */ 
-        bool same = QKD_key_handle_compare(&client_key_handle, key_handle) == 0;
-        assert(same);
-        QKD_debug("Client's key handle is same as server's key handle");
+    QKD_result_t qkd_result = wait_for_key(key_handle,
+                                           QKD_monotonic_seconds() + timeout_seconds(timeout));
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_return_error_qkd(qkd_result);
     }
-
-    /* Store connection socket in QKD session */
-    qkd_session->connection_sock = connection_sock;
-
     QKD_return_success_qkd();
 }
 
@@ -466,82 +1779,185 @@ QKD_result_t QKD_connect_blocking(const QKD_key_handle_t *key_handle, uint32_t t
  * or non-blocking and always return with the status parameter indicating success or failure,
  * depending on the request made via the QKD_OPEN function. The TIMEOUT value for this function is
  * specified in the QKD_OPEN() function."
- * 
+ *
  * The key (i.e. the shared secret) is returned in the shared_secret parameter. The caller is
  * responsible for allocating memory for shared secret.
- * 
+ *
+ * The key is read from the local copy of the synchronized key stream, and zeroized in the local
+ * copy, so each key can be obtained only once at each end. There is no network communication.
+ *
  * Returns QKD_result_t.
  */
 QKD_result_t QKD_get_key(const QKD_key_handle_t *key_handle, char* shared_secret)
 {
     QKD_enter();
+    assert(shared_secret != NULL);
+    uint64_t link_id;
+    uint64_t offset;
+    uint32_t length;
+    if (!decode_key_handle(key_handle, &link_id, &offset, &length)) {
+        QKD_error("Invalid key handle %s", QKD_key_handle_str(key_handle));
+        QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+    }
+    QKD_result_t qkd_result = QKD_get_keys(1, key_handle, shared_secret, length, NULL);
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_return_error_qkd(qkd_result);
+    }
+    QKD_return_success_qkd();
+}
 
-    /* TODO: For now there is only one concurrent session. */
-    assert(qkd_session != NULL);
-    assert(qkd_session->connection_sock != -1);    /* TODO: Keep track of connected in session. */
-
-    int shared_secret_size = qkd_session->qos.requested_length;
-    QKD_debug("Shared secret size is %d", shared_secret_size);
-
-    if (qkd_session->am_client) {
-
-        /* Client */
-
-        /* There is a subtle hack here. It is necessary that the client chooses the shared secret
-         * and sends it to the server. If we do it the other way around, i.e. if the server chooses
-         * the shared secret and send it to the client, we will het a deadlock. This is because in
-         * the OpenSSL implementation of the client side is as follows
-         * (1) The client receives a Server Hello Message, which contains the Diffie-Hellman
-         *     parameters and public key from the server.
-         * (2) The client chooses its own Diffie-Hellman private key, using the received
-         *     Diffie-Hellman parameters.
-         * (3) The client calls generate_key to compute the shared secret based on (a) the received
-         *     Diffie-Hellman paramters, (b) the received server's public key, and (c) it's own,
-         *     i.e. the client's private key.
-         * (4) Then, and only then, does the client send the Client Key Exchange message to the
-         *     server, which contains the client's public key.
-         * (5) The server can only call generate_key after it has received the Client Key Exchange
-         *     message.
-         * Now, if the server chooses the key, then the client will do a blocking receive in step
-         * (3) to receive the shared secret from the server, but that message will never come
-         * because it can only be sent in step (5).
-         * This implementation is a hack because it makes assumptions about in which order
-         * QKD_get_key will called on the server and the client. */
-
-        /* Choose a random shared secret. */
-        assert(shared_secret != NULL);
-        srand(time(NULL));
-        for (int i = 0; i < shared_secret_size; ++i) {
-            shared_secret[i] = rand();
-        }
-        QKD_debug("Shared secret = %s", QKD_shared_secret_str(shared_secret, shared_secret_size));
-
-        /* Send the shared secret to the server. */
-        QKD_result_t qkd_result = send_shared_secret(qkd_session->connection_sock, shared_secret,
-                                               shared_secret_size);
-        if (QKD_RESULT_SUCCESS != qkd_result) {
-            QKD_error("send_shared_secret failed: %s", QKD_result_str(qkd_result));
-            QKD_return_error_qkd(qkd_result);
-        }
-        QKD_debug("Sent shared secret to server");
-
-    } else {
-
-        /* Server */
+/**
+ * Mock implementation of QKD_get_keys (see qkd_api.h): QKD_get_key for several key handles at
+ * once. Keys that are in a magazine are read from it. For the others, the link state is checked
+ * under a single lock, and the keys of each link are read from the key store under a single lock.
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_get_keys(size_t nr_keys, const QKD_key_handle_t *key_handles, char *key_buffers,
+                          size_t key_buffer_size, QKD_result_t *results)
+{
+    QKD_enter();
+    assert(key_handles != NULL || nr_keys == 0);
+    assert(key_buffers != NULL || nr_keys == 0);
+    if (!QKD_health_serving()) {
+        for (size_t i = 0; results != NULL && i < nr_keys; i++) {
+            results[i] = QKD_RESULT_HEALTH_TEST_FAILED;
+        }
+        QKD_return_error_qkd(QKD_RESULT_HEALTH_TEST_FAILED);
+    }
+    /* The arrays per key, in a single allocation. */
+    QKD_key_store_piece_t *pieces = malloc(nr_keys * (2 * sizeof(*pieces) + 2 * sizeof(size_t) +
+                                                      sizeof(bool)));
+    QKD_key_store_piece_t *batch = pieces + nr_keys;
+    size_t *key_sizes = (size_t *) (batch + nr_keys);
+    size_t *key_links = key_sizes + nr_keys;
+    bool *in_magazine = (bool *) (key_links + nr_keys);
+    QKD_result_t *piece_results = results ? results : malloc(nr_keys * sizeof(*piece_results));
+    if ((pieces == NULL || piece_results == NULL) && nr_keys > 0) {
+        free(pieces);
+        if (piece_results != results) {
+            free(piece_results);
+        }
+        QKD_error("malloc failed");
+        QKD_return_error_qkd(QKD_RESULT_OUT_OF_MEMORY);
+    }
 
-        /* Receive the shared secret chosen by the client. */
-        QKD_debug("Waiting for shared_secret from client");
-        QKD_result_t qkd_result = receive_shared_secret(qkd_session->connection_sock, shared_secret,
-                                                  shared_secret_size);
-        if (QKD_RESULT_SUCCESS != qkd_result) {
-            QKD_error("receive_shared_secret failed: %s", QKD_result_str(qkd_result));
-            QKD_return_error_qkd(qkd_result);
+    /* Read the keys that are in a magazine from it, without taking QKD_mock_link_mutex. */
+    size_t nr_in_magazines = 0;
+    for (size_t i = 0; i < nr_keys; i++) {
+        uint64_t link_id;
+        uint64_t offset;
+        uint32_t length;
+        char *key = key_buffers + i * key_buffer_size;
+        bool used = false;
+        key_sizes[i] = 0;
+        in_magazine[i] = (decode_key_handle(&key_handles[i], &link_id, &offset, &length) &&
+                          length <= key_buffer_size &&
+                          QKD_mock_magazine_find(&key_handles[i], link_id, offset, length, key,
+                                                 &used));
+        if (used) {
+            QKD_error("Key was already obtained");
+            in_magazine[i] = true;
+            key_links[i] = MAX_LINKS;
+            piece_results[i] = QKD_RESULT_KEY_ALREADY_USED;
+            nr_in_magazines++;
+        } else if (in_magazine[i]) {
+            QKD_debug_shared_secret("Shared secret", key, length);
+            key_links[i] = MAX_LINKS;
+            key_sizes[i] = length;
+            piece_results[i] = QKD_RESULT_SUCCESS;
+            nr_in_magazines++;
         }
-        QKD_debug("Received shared secret from client");
-        QKD_debug("Shared secret = %s", QKD_shared_secret_str(shared_secret, shared_secret_size));
+    }
 
+    /* Check that every other key is on a current link and has been synchronized, and note which
+     * link it is on. */
+    char peers[MAX_LINKS][sizeof(QKD_mock_links[0].peer)];
+    if (nr_in_magazines < nr_keys) {
+        pthread_mutex_lock(&QKD_mock_link_mutex);
+        for (size_t i = 0; i < QKD_mock_nr_links; i++) {
+            strcpy(peers[i], QKD_mock_links[i].peer);
+        }
+    }
+    for (size_t i = 0; i < nr_keys && nr_in_magazines < nr_keys; i++) {
+        QKD_key_store_piece_t *piece = &pieces[i];
+        uint64_t link_id;
+        uint64_t offset;
+        uint32_t length;
+        QKD_LINK *link = NULL;
+        piece->key = NULL;
+        piece->key_size = 0;
+        if (in_magazine[i]) {
+            continue;
+        }
+        if (!decode_key_handle(&key_handles[i], &link_id, &offset, &length) ||
+            length > key_buffer_size) {
+            QKD_error("Invalid key handle %s", QKD_key_handle_str(&key_handles[i]));
+            piece_results[i] = QKD_RESULT_NOT_SUPPORTED;
+        } else if ((link = find_link(link_id)) == NULL) {
+            QKD_error("Key handle is not for a current link");
+            piece_results[i] = QKD_RESULT_CONNECTION_FAILED;
+        } else if (offset + length > link->nr_blocks_synced * KEY_BLOCK_SIZE) {
+            QKD_error("Key has not been synchronized yet");
+            piece_results[i] = QKD_RESULT_TIMEOUT;
+        } else {
+            key_links[i] = link - QKD_mock_links;
+            QKD_mock_encode_block_handle(link_id, offset / KEY_BLOCK_SIZE, &piece->key_handle);
+            piece->offset = offset % KEY_BLOCK_SIZE;
+            piece->key = key_buffers + i * key_buffer_size;
+            piece->key_size = length;
+            key_sizes[i] = length;
+            piece_results[i] = QKD_RESULT_SUCCESS;
+        }
+    }
+    if (nr_in_magazines < nr_keys) {
+        pthread_mutex_unlock(&QKD_mock_link_mutex);
     }
 
+    /* Consume the pieces of each link in a batch. Pieces that failed the checks are not
+     * consumed. */
+    QKD_result_t qkd_result = QKD_RESULT_SUCCESS;
+    for (size_t link_index = 0; link_index < QKD_mock_nr_links; link_index++) {
+        size_t nr_pieces = 0;
+        for (size_t i = 0; i < nr_keys; i++) {
+            if (QKD_RESULT_SUCCESS == piece_results[i] && key_links[i] == link_index) {
+                batch[nr_pieces++] = pieces[i];
+            }
+        }
+        if (nr_pieces == 0) {
+            continue;
+        }
+        QKD_key_store_consume_batch(peers[link_index], batch, nr_pieces);
+        for (size_t i = 0, j = 0; i < nr_keys && j < nr_pieces; i++) {
+            if (QKD_RESULT_SUCCESS == piece_results[i] && key_links[i] == link_index) {
+                if (batch[j].found) {
+                    QKD_debug_shared_secret("Shared secret", batch[j].key, batch[j].key_size);
+                } else if (batch[j].used) {
+                    QKD_error("Key was already obtained");
+                    piece_results[i] = QKD_RESULT_KEY_ALREADY_USED;
+                } else {
+                    QKD_error("Key is no longer in the key store (evicted)");
+                    piece_results[i] = QKD_RESULT_OUT_OF_MEMORY;
+                }
+                j++;
+            }
+        }
+    }
+    for (size_t i = 0; i < nr_keys && QKD_RESULT_SUCCESS == qkd_result; i++) {
+        qkd_result = piece_results[i];
+    }
+    QKD_result_t journal_result = QKD_journal_consume(nr_keys, key_handles, key_buffers,
+                                                      key_buffer_size, key_sizes, piece_results);
+    if (QKD_RESULT_SUCCESS == qkd_result) {
+        qkd_result = journal_result;
+    }
+    free(pieces);
+    if (piece_results != results) {
+        free(piece_results);
+    }
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_return_error_qkd(qkd_result);
+    }
     QKD_return_success_qkd();
 }
 
@@ -551,21 +1967,14 @@ QKD_result_t QKD_get_key(const QKD_key_handle_t *key_handle, char* shared_secret
  * allocated for this key_handle. Due to timing differences at the other end of the link, the peer
  * operation will happen at some other time and any unused keys shall be held until that occurs and
  * then discarded."
- * 
+ *
+ * Key that was allocated but never obtained stays in the key store until it is evicted.
+ *
  * Returns QKD_result_t.
  */
 QKD_result_t QKD_close(const QKD_key_handle_t *key_handle)
 {
     QKD_enter();
     assert(key_handle);
-
-    /* TODO: For now there is only one concurrent session. */
-    assert(qkd_session != NULL);
-    assert(qkd_session->connection_sock != -1);
-    close(qkd_session->connection_sock);
-    qkd_session->connection_sock = -1;
-    free(qkd_session);
-    qkd_session = NULL;
-
     QKD_return_success_qkd();
 }
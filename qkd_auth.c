@@ -0,0 +1,334 @@
+/**
+ * qkd_auth.c
+ *
+ * Wegman-Carter authentication with GHASH (see qkd_auth.h).
+ *
+ * GHASH processes the message in 16-byte blocks X1, X2, ..., Xn (the last one padded with zeros),
+ * followed by a block with the length of the message in bits: Y = (Y ^ Xi) * H for each block,
+ * starting from Y = 0, with multiplication in GF(2^128) as defined for AES-GCM (NIST SP 800-38D).
+ * The PCLMULQDQ implementation follows the Intel white paper "Intel Carry-Less Multiplication
+ * Instruction and its Usage for Computing the GCM Mode": it computes four 256-bit products
+ * (Y ^ X1) * H^4 ^ X2 * H^3 ^ X3 * H^2 ^ X4 * H and reduces their sum only once.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#include "qkd_auth.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_CLMUL 1
+#endif
+
+typedef void (*ghash_blocks_t)(const QKD_auth_key_t *key, unsigned char *state,
+                               const unsigned char *data, size_t nr_blocks);
+
+static pthread_once_t ghash_blocks_once = PTHREAD_ONCE_INIT;
+static ghash_blocks_t ghash_blocks = NULL;
+
+/* An element of GF(2^128) as two big-endian 64-bit halves of the 16-byte block. */
+typedef struct element_st {
+    uint64_t hi;
+    uint64_t lo;
+} element_t;
+
+static element_t load_element(const unsigned char *bytes)
+{
+    element_t element = {0, 0};
+    for (int i = 0; i < 8; i++) {
+        element.hi = (element.hi << 8) | bytes[i];
+        element.lo = (element.lo << 8) | bytes[8 + i];
+    }
+    return element;
+}
+
+static void store_element(element_t element, unsigned char *bytes)
+{
+    for (int i = 7; i >= 0; i--) {
+        bytes[i] = element.hi & 0xff;
+        bytes[8 + i] = element.lo & 0xff;
+        element.hi >>= 8;
+        element.lo >>= 8;
+    }
+}
+
+/**
+ * Multiply two elements of GF(2^128), one bit at a time (Algorithm 1 of NIST SP 800-38D). Slow,
+ * but without secret-dependent branches or table lookups.
+ */
+static element_t multiply(element_t x, element_t y)
+{
+    element_t z = {0, 0};
+    element_t v = y;
+    for (int i = 0; i < 128; i++) {
+        uint64_t word = i < 64 ? x.hi : x.lo;
+        uint64_t mask = -((word >> (63 - i % 64)) & 1);
+        z.hi ^= v.hi & mask;
+        z.lo ^= v.lo & mask;
+        uint64_t carry = -(v.lo & 1);
+        v.lo = (v.lo >> 1) | (v.hi << 63);
+        v.hi = (v.hi >> 1) ^ (0xe100000000000000ULL & carry);
+    }
+    return z;
+}
+
+/**
+ * Process whole blocks of a message. Portable version.
+ */
+static void ghash_blocks_portable(const QKD_auth_key_t *key, unsigned char *state,
+                                  const unsigned char *data, size_t nr_blocks)
+{
+    element_t h = load_element(key->powers[0]);
+    element_t y = load_element(state);
+    for (size_t i = 0; i < nr_blocks; i++) {
+        element_t x = load_element(data + 16 * i);
+        y.hi ^= x.hi;
+        y.lo ^= x.lo;
+        y = multiply(y, h);
+    }
+    store_element(y, state);
+}
+
+#ifdef HAVE_CLMUL
+/**
+ * The 256-bit carry-less product of two byte-reflected elements, as two 128-bit halves.
+ */
+__attribute__((target("pclmul,ssse3")))
+static inline void clmul_wide(__m128i a, __m128i b, __m128i *lo, __m128i *hi)
+{
+    __m128i middle = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10),
+                                   _mm_clmulepi64_si128(a, b, 0x01));
+    *lo = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x00), _mm_slli_si128(middle, 8));
+    *hi = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x11), _mm_srli_si128(middle, 8));
+}
+
+/**
+ * Reduce a 256-bit product (or a sum of products) modulo the GCM polynomial. The product of
+ * byte-reflected elements is one bit off, so it is shifted left by one bit first.
+ */
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i reduce(__m128i lo, __m128i hi)
+{
+    __m128i lo_carry = _mm_srli_epi32(lo, 31);
+    __m128i hi_carry = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    __m128i cross_carry = _mm_srli_si128(lo_carry, 12);
+    hi_carry = _mm_slli_si128(hi_carry, 4);
+    lo_carry = _mm_slli_si128(lo_carry, 4);
+    lo = _mm_or_si128(lo, lo_carry);
+    hi = _mm_or_si128(_mm_or_si128(hi, hi_carry), cross_carry);
+
+    __m128i a = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)),
+                              _mm_slli_epi32(lo, 25));
+    __m128i b = _mm_srli_si128(a, 4);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(a, 12));
+    __m128i c = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)),
+                              _mm_xor_si128(_mm_srli_epi32(lo, 7), b));
+    return _mm_xor_si128(hi, _mm_xor_si128(lo, c));
+}
+
+/**
+ * Process whole blocks of a message. PCLMULQDQ version, with the same results as
+ * ghash_blocks_portable.
+ */
+__attribute__((target("pclmul,ssse3")))
+static void ghash_blocks_clmul(const QKD_auth_key_t *key, unsigned char *state,
+                               const unsigned char *data, size_t nr_blocks)
+{
+    const __m128i reflect = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i h[4];
+    for (int i = 0; i < 4; i++) {
+        h[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) key->powers[i]), reflect);
+    }
+    __m128i y = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) state), reflect);
+    while (nr_blocks >= 4) {
+        __m128i lo, hi, product_lo, product_hi;
+        __m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) data), reflect);
+        clmul_wide(_mm_xor_si128(y, x), h[3], &lo, &hi);
+        for (int i = 1; i < 4; i++) {
+            x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16 * i)), reflect);
+            clmul_wide(x, h[3 - i], &product_lo, &product_hi);
+            lo = _mm_xor_si128(lo, product_lo);
+            hi = _mm_xor_si128(hi, product_hi);
+        }
+        y = reduce(lo, hi);
+        data += 64;
+        nr_blocks -= 4;
+    }
+    while (nr_blocks > 0) {
+        __m128i lo, hi;
+        __m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) data), reflect);
+        clmul_wide(_mm_xor_si128(y, x), h[0], &lo, &hi);
+        y = reduce(lo, hi);
+        data += 16;
+        nr_blocks--;
+    }
+    _mm_storeu_si128((__m128i *) state, _mm_shuffle_epi8(y, reflect));
+}
+#endif
+
+/**
+ * Choose the implementation of GHASH: PCLMULQDQ if the CPU supports it, unless environment
+ * variable QKD_AUTH_CLMUL is set to 0.
+ */
+static void choose_ghash_blocks(void)
+{
+    ghash_blocks = ghash_blocks_portable;
+#ifdef HAVE_CLMUL
+    const char *clmul = getenv("QKD_AUTH_CLMUL");
+    if ((clmul == NULL || strcmp(clmul, "0") != 0) && __builtin_cpu_supports("pclmul") &&
+        __builtin_cpu_supports("ssse3")) {
+        ghash_blocks = ghash_blocks_clmul;
+    }
+#endif
+}
+
+/**
+ * Is the PCLMULQDQ implementation of GHASH used?
+ */
+bool QKD_auth_clmul_enabled(void)
+{
+    pthread_once(&ghash_blocks_once, choose_ghash_blocks);
+    return ghash_blocks != ghash_blocks_portable;
+}
+
+/**
+ * Initialize an authentication key from a QKD_AUTH_KEY_SIZE-byte hash key.
+ */
+void QKD_auth_key_init(QKD_auth_key_t *key, const unsigned char *hash_key)
+{
+    assert(key != NULL);
+    assert(hash_key != NULL);
+    pthread_once(&ghash_blocks_once, choose_ghash_blocks);
+    element_t h = load_element(hash_key);
+    element_t power = h;
+    store_element(power, key->powers[0]);
+    for (int i = 1; i < 4; i++) {
+        power = multiply(power, h);
+        store_element(power, key->powers[i]);
+    }
+}
+
+/**
+ * Zeroize an authentication key.
+ */
+void QKD_auth_key_cleanse(QKD_auth_key_t *key)
+{
+    volatile unsigned char *p = (volatile unsigned char *) key;
+    for (size_t i = 0; i < sizeof(*key); i++) {
+        p[i] = 0;
+    }
+}
+
+/**
+ * Start authenticating a message.
+ */
+void QKD_auth_init(QKD_auth_t *auth, const QKD_auth_key_t *key)
+{
+    assert(auth != NULL);
+    assert(key != NULL);
+    memset(auth, 0, sizeof(*auth));
+    auth->key = key;
+}
+
+/**
+ * Add the next piece of the message.
+ */
+void QKD_auth_update(QKD_auth_t *auth, const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+    auth->size += size;
+    if (auth->partial_size > 0) {
+        size_t fill = 16 - auth->partial_size;
+        if (fill > size) {
+            fill = size;
+        }
+        memcpy(auth->partial + auth->partial_size, bytes, fill);
+        auth->partial_size += fill;
+        bytes += fill;
+        size -= fill;
+        if (auth->partial_size < 16) {
+            return;
+        }
+        ghash_blocks(auth->key, auth->state, auth->partial, 1);
+        auth->partial_size = 0;
+    }
+    if (size >= 16) {
+        ghash_blocks(auth->key, auth->state, bytes, size / 16);
+        bytes += size - size % 16;
+        size %= 16;
+    }
+    memcpy(auth->partial, bytes, size);
+    auth->partial_size = size;
+}
+
+/**
+ * Finish authenticating a message: compute the tag, using up the given QKD_AUTH_PAD_SIZE-byte
+ * one-time pad.
+ */
+void QKD_auth_final(QKD_auth_t *auth, const unsigned char *pad, unsigned char *tag)
+{
+    unsigned char blocks[32];
+    size_t nr_blocks = 1;
+    memset(blocks, 0, sizeof(blocks));
+    if (auth->partial_size > 0) {
+        memcpy(blocks, auth->partial, auth->partial_size);
+        nr_blocks = 2;
+    }
+    /* The length block: the length of the message (as additional data) in bits, and zero. */
+    uint64_t bits = auth->size * 8;
+    for (int i = 0; i < 8; i++) {
+        blocks[16 * (nr_blocks - 1) + 7 - i] = (bits >> (8 * i)) & 0xff;
+    }
+    ghash_blocks(auth->key, auth->state, blocks, nr_blocks);
+    for (int i = 0; i < QKD_AUTH_TAG_SIZE; i++) {
+        tag[i] = auth->state[i] ^ pad[i];
+    }
+    memset(auth->partial, 0, sizeof(auth->partial));
+    memset(auth->state, 0, sizeof(auth->state));
+}
+
+/**
+ * Compute the tag of a message, using up the given one-time pad.
+ */
+void QKD_auth_tag(const QKD_auth_key_t *key, const void *message, size_t size,
+                  const unsigned char *pad, unsigned char *tag)
+{
+    QKD_auth_t auth;
+    QKD_auth_init(&auth, key);
+    QKD_auth_update(&auth, message, size);
+    QKD_auth_final(&auth, pad, tag);
+}
+
+/**
+ * Compute the tags of several messages, using up one pad per message: message i uses the pad at
+ * pads + i * QKD_AUTH_PAD_SIZE, and its tag is stored at tags + i * QKD_AUTH_TAG_SIZE. This is how
+ * a key manager authenticates a batch of messages with pads that it took from the key store in a
+ * single call.
+ */
+void QKD_auth_tag_batch(const QKD_auth_key_t *key, const void *const *messages,
+                        const size_t *sizes, size_t nr_messages, const unsigned char *pads,
+                        unsigned char *tags)
+{
+    for (size_t i = 0; i < nr_messages; i++) {
+        QKD_auth_tag(key, messages[i], sizes[i], pads + i * QKD_AUTH_PAD_SIZE,
+                     tags + i * QKD_AUTH_TAG_SIZE);
+    }
+}
+
+/**
+ * Compare two tags in constant time.
+ */
+bool QKD_auth_tags_equal(const unsigned char *tag1, const unsigned char *tag2)
+{
+    unsigned char difference = 0;
+    for (int i = 0; i < QKD_AUTH_TAG_SIZE; i++) {
+        difference |= tag1[i] ^ tag2[i];
+    }
+    return difference == 0;
+}
@@ -0,0 +1,59 @@
+/**
+ * qkd_auth.h
+ *
+ * Wegman-Carter authentication of classical-channel messages: the tag of a message is a universal
+ * hash of the message (GHASH, the polynomial hash over GF(2^128) of AES-GCM) under a hash key,
+ * XORed with a one-time pad. Both the hash key and the pads are secret key shared by the two ends,
+ * for instance from a pre-shared key at first and from QKD key afterwards. Each pad must be used
+ * for one tag only; the hash key can be reused as long as the pads are not.
+ *
+ * GHASH is computed with the carry-less multiply instruction (PCLMULQDQ) when the CPU has it,
+ * processing four blocks per reduction, and with a portable implementation otherwise (or with
+ * environment variable QKD_AUTH_CLMUL set to 0). The tag of a message under hash key H and pad P
+ * equals the AES-GCM tag with the message as additional authenticated data, no plaintext, H as the
+ * hash subkey, and P as the encrypted initial counter block.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#ifndef QKD_AUTH_H
+#define QKD_AUTH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define QKD_AUTH_KEY_SIZE 16        /* Hash key */
+#define QKD_AUTH_PAD_SIZE 16        /* One-time pad, consumed by each tag */
+#define QKD_AUTH_TAG_SIZE 16
+
+typedef struct QKD_auth_key_st {
+    unsigned char powers[4][16];    /* H, H^2, H^3, H^4 */
+} QKD_auth_key_t;
+
+/* The running hash of a message that is authenticated piece by piece. */
+typedef struct QKD_auth_st {
+    const QKD_auth_key_t *key;
+    unsigned char state[16];
+    unsigned char partial[16];      /* Bytes of the message that do not fill a block yet */
+    size_t partial_size;
+    uint64_t size;
+} QKD_auth_t;
+
+void QKD_auth_key_init(QKD_auth_key_t *key, const unsigned char *hash_key);
+void QKD_auth_key_cleanse(QKD_auth_key_t *key);
+
+void QKD_auth_init(QKD_auth_t *auth, const QKD_auth_key_t *key);
+void QKD_auth_update(QKD_auth_t *auth, const void *data, size_t size);
+void QKD_auth_final(QKD_auth_t *auth, const unsigned char *pad, unsigned char *tag);
+
+void QKD_auth_tag(const QKD_auth_key_t *key, const void *message, size_t size,
+                  const unsigned char *pad, unsigned char *tag);
+void QKD_auth_tag_batch(const QKD_auth_key_t *key, const void *const *messages,
+                        const size_t *sizes, size_t nr_messages, const unsigned char *pads,
+                        unsigned char *tags);
+bool QKD_auth_tags_equal(const unsigned char *tag1, const unsigned char *tag2);
+bool QKD_auth_clmul_enabled(void);
+
+#endif /* QKD_AUTH_H */
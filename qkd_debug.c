@@ -17,6 +17,23 @@
 /* TODO: Turn debug on or off using environment variable */
 static bool debug = true;
 
+/**
+ * Turn debug output on or off (errors are always printed). Tools that call the QKD code at a high
+ * rate, such as the simulator, turn it off.
+ */
+void QKD_debug_set_enabled(bool enabled)
+{
+    debug = enabled;
+}
+
+/**
+ * Is debug output on? For debug output that is expensive to produce.
+ */
+bool QKD_debug_enabled(void)
+{
+    return debug;
+}
+
 static void print_location(const char *file, int line, const char *func)
 {
     fprintf(stderr, "[%s:%d (%s)] ", file, line, func);
@@ -12,6 +12,9 @@
 
 #include <stdbool.h>
 
+void QKD_debug_set_enabled(bool enabled);
+bool QKD_debug_enabled(void);
+
 void _QKD_error(const char *file, int line, const char *func, const char *format, ...);
 
 #define QKD_error(format, ...) _QKD_error(__FILE__, __LINE__, __func__, format, ##__VA_ARGS__)
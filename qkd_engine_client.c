@@ -2,7 +2,8 @@
  * qkd_engine_client.c
  * 
  * An OpenSSL Engine for OpenSSL clients that "hijacks" the existing Diffie-Helman key agreement
- * protocol in OpenSSL to implement a QKD key agreement on top of the ETSI QKD API.
+ * protocol in OpenSSL to implement a QKD key agreement on top of the ETSI QKD API. The elliptic
+ * curve Diffie-Hellman (ECDH) key agreement is hijacked in the same way.
  * There is a separate engine for OpenSSL servers (see qkd_engine_server.c).
  * See qkd_api.h for the definition of the ETSI QKD API.
  * 
@@ -61,6 +62,97 @@ static int client_generate_key(DH *dh)
     QKD_return_success("%d", 1);
 }
 
+/**
+ * Compute the shared secret in hybrid mode, i.e. when the server's public key contains both a
+ * classical X25519 public key and (optionally) a QKD key handle. We try to get the QKD key within
+ * the latency budget. If we succeed, we mix the QKD key with the classical X25519 shared key;
+ * otherwise we use the classical shared key only. We tell the server which of the two we did by
+ * replacing our public key with a hybrid public key (OpenSSL sends our public key to the server
+ * after it has computed the shared secret).
+ * 
+ * Returns the size of the generated shared secret on success, -1 on failure.
+ */
+static int client_compute_hybrid_key(unsigned char *shared_secret, DH *dh,
+                                     unsigned char server_flags, QKD_key_handle_t *key_handle,
+                                     const unsigned char *server_x25519_public_key)
+{
+    QKD_enter();
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int shared_secret_size = DH_size(dh);
+
+    unsigned char x25519_private_key[QKD_X25519_KEY_SIZE];
+    unsigned char x25519_public_key[QKD_X25519_KEY_SIZE];
+    if (QKD_hybrid_generate_classical_key(x25519_private_key, x25519_public_key) != 1) {
+        QKD_error("QKD_hybrid_generate_classical_key failed");
+        QKD_return_error("%d", -1);
+    }
+
+    /* Try to get the QKD key within the latency budget. */
+    unsigned char flags = 0;
+    unsigned char *qkd_key = NULL;
+    QKD_hybrid_path_t path = QKD_HYBRID_PATH_FALLBACK_NOT_OFFERED;
+    if (server_flags & QKD_HYBRID_FLAG_QKD) {
+        QKD_qos_t qos = {
+            .requested_length = shared_secret_size,
+            .max_bps = 0,
+            .priority = 0,
+            .timeout = QKD_hybrid_remaining_ms(&start)
+        };
+        QKD_result_t qkd_result = QKD_RESULT_OUT_OF_MEMORY;
+        qkd_key = QKD_secure_alloc(shared_secret_size);
+        if (qkd_key != NULL) {
+            qkd_result = QKD_open(NULL, qos, key_handle);
+        }
+        if (QKD_RESULT_SUCCESS == qkd_result) {
+            qkd_result = QKD_connect_blocking(key_handle, QKD_hybrid_remaining_ms(&start));
+            if (QKD_RESULT_SUCCESS == qkd_result) {
+                qkd_result = QKD_get_key(key_handle, (char *) qkd_key);
+            }
+            QKD_close(key_handle);
+        }
+        if (QKD_RESULT_SUCCESS == qkd_result) {
+            flags |= QKD_HYBRID_FLAG_QKD;
+            path = QKD_HYBRID_PATH_MIXED;
+        } else {
+            QKD_debug("No QKD key (%s), fall back to classical key exchange",
+                      QKD_result_str(qkd_result));
+            path = (QKD_RESULT_TIMEOUT == qkd_result) ? QKD_HYBRID_PATH_FALLBACK_TIMEOUT :
+                                                         QKD_HYBRID_PATH_FALLBACK_ERROR;
+            QKD_secure_free(qkd_key);
+            qkd_key = NULL;
+        }
+    }
+
+    int result = QKD_hybrid_derive_secret(x25519_private_key, server_x25519_public_key, qkd_key,
+                                          qkd_key ? shared_secret_size : 0, shared_secret,
+                                          shared_secret_size);
+    OPENSSL_cleanse(x25519_private_key, sizeof(x25519_private_key));
+    QKD_secure_free(qkd_key);
+    if (result != 1) {
+        QKD_error("QKD_hybrid_derive_secret failed");
+        QKD_return_error("%d", -1);
+    }
+
+    /* Replace our public key with the hybrid public key that is sent to the server. */
+    BIGNUM *public_key = BN_new();
+    if (public_key == NULL ||
+        QKD_hybrid_encode_client_public_key(flags, x25519_public_key, public_key) != 1) {
+        QKD_error("QKD_hybrid_encode_client_public_key failed");
+        BN_free(public_key);
+        QKD_return_error("%d", -1);
+    }
+    if (DH_set0_key(dh, public_key, NULL) != 1) {
+        QKD_error("DH_set0_key failed");
+        BN_free(public_key);
+        QKD_return_error("%d", -1);
+    }
+
+    QKD_hybrid_count_path(path);
+    QKD_debug_shared_secret("shared secret", shared_secret, shared_secret_size);
+    QKD_return_success("%d", shared_secret_size);
+}
+
 /**
  * Callback which registered in the client OpenSSL engine to be called when OpenSSL needs the engine
  * to compute the Diffie-Hellman shared secret based on Diffie-Hellman parameters, the server public
@@ -72,8 +164,21 @@ static int client_compute_key(unsigned char *shared_secret, const BIGNUM *public
 {
     QKD_enter();
 
-    /* Convert the public key provided by the server into an ETSI API key handle. */
+    /* If the server does hybrid mode, we do too. */
     QKD_key_handle_t key_handle = QKD_key_handle_null;
+    unsigned char server_flags;
+    unsigned char server_x25519_public_key[QKD_X25519_KEY_SIZE];
+    if (QKD_hybrid_decode_server_public_key(public_key, &server_flags, &key_handle,
+                                            server_x25519_public_key)) {
+        int result = client_compute_hybrid_key(shared_secret, dh, server_flags, &key_handle,
+                                               server_x25519_public_key);
+        if (result < 0) {
+            QKD_return_error("%d", -1);
+        }
+        QKD_return_success("%d", result);
+    }
+
+    /* Convert the public key provided by the server into an ETSI API key handle. */
     int convert_result = QKD_bignum_to_key_handle(public_key, &key_handle);
     if (convert_result != 1) {
         QKD_error("QKD_bignum_to_key_handle failed (return code %d)", convert_result);
@@ -90,8 +195,9 @@ static int client_compute_key(unsigned char *shared_secret, const BIGNUM *public
         .timeout = 0
     };
 
-    /* TODO: Extract the destination from the handle. For now, hard-code localhost. */
-    QKD_result_t qkd_result = QKD_open("localhost", qos, &key_handle);
+    /* The key handle says which key the server allocated. The QKD API implementation knows its
+     * own key managers (e.g. QKD_MOCK_ENDPOINTS for the mock), so there is no destination. */
+    QKD_result_t qkd_result = QKD_open(NULL, qos, &key_handle);
     if (QKD_RESULT_SUCCESS != qkd_result) {
         QKD_error("QKD_open failed (return code %d)", qkd_result);
         QKD_return_error("%d", -1);
@@ -101,6 +207,7 @@ static int client_compute_key(unsigned char *shared_secret, const BIGNUM *public
     qkd_result = QKD_connect_blocking(&key_handle, 0);   /* TODO: right value for timeout? */
     if (QKD_RESULT_SUCCESS != qkd_result) {
         QKD_error("QKD_connect_blocking failed (return code %d)", qkd_result);
+        QKD_close(&key_handle);
         QKD_return_error("%d", -1);
     }
 
@@ -109,10 +216,10 @@ static int client_compute_key(unsigned char *shared_secret, const BIGNUM *public
     qkd_result = QKD_get_key(&key_handle, (char *) shared_secret);
     if (QKD_RESULT_SUCCESS != qkd_result) {
         QKD_error("QKD_get_key failed (return code %d)", qkd_result);
+        QKD_close(&key_handle);
         QKD_return_error("%d", -1);
     }
-    QKD_debug("shared secret = %s", QKD_shared_secret_str((char *) shared_secret,
-                                                           shared_secret_size));
+    QKD_debug_shared_secret("shared secret", shared_secret, shared_secret_size);
 
     /* Close the QKD session. */
     qkd_result = QKD_close(&key_handle);
@@ -124,6 +231,80 @@ static int client_compute_key(unsigned char *shared_secret, const BIGNUM *public
     QKD_return_success("%d", shared_secret_size);
 }
 
+/**
+ * Callback which is registered in the client OpenSSL engine to be called when OpenSSL needs the
+ * engine to generate an ECDH key pair. As for Diffie-Hellman, the server does not need anything
+ * from us, so we use a fixed private key and the corresponding public key (the generator).
+ * 
+ * Returns 1 on success, 0 on failure.
+ */
+static int client_ec_generate_key(EC_KEY *ec_key)
+{
+    QKD_enter();
+    const EC_GROUP *group = EC_KEY_get0_group(ec_key);
+    BIGNUM *private_key = BN_secure_new();
+    int result = private_key != NULL && BN_set_word(private_key, QKD_fixed_private_key) == 1 &&
+                 EC_KEY_set_private_key(ec_key, private_key) == 1 &&
+                 EC_KEY_set_public_key(ec_key, EC_GROUP_get0_generator(group)) == 1;
+    BN_clear_free(private_key);
+    if (!result) {
+        QKD_error("Could not set fixed EC key");
+        QKD_return_error("%d", 0);
+    }
+    QKD_return_success("%d", 1);
+}
+
+/**
+ * Callback which is registered in the client OpenSSL engine to be called when OpenSSL needs the
+ * engine to compute the ECDH shared secret. The shared secret is the QKD key for the key handle in
+ * the server's public key. OpenSSL frees the shared secret.
+ * 
+ * Returns 1 on success, 0 on failure.
+ */
+static int client_ec_compute_key(unsigned char **shared_secret, size_t *shared_secret_size,
+                                 const EC_POINT *server_public_key, const EC_KEY *ec_key)
+{
+    QKD_enter();
+    const EC_GROUP *group = EC_KEY_get0_group(ec_key);
+    QKD_key_handle_t key_handle;
+    if (QKD_ec_point_to_key_handle(group, server_public_key, &key_handle) != 1) {
+        QKD_error("QKD_ec_point_to_key_handle failed");
+        QKD_return_error("%d", 0);
+    }
+    QKD_debug("Key handle = %s", QKD_key_handle_str(&key_handle));
+    size_t size = QKD_ec_shared_secret_nr_bytes(group);
+    QKD_qos_t qos = {
+        .requested_length = size,
+        .max_bps = 0,
+        .priority = 0,
+        .timeout = 0
+    };
+    unsigned char *secret = QKD_secure_alloc(size);
+    QKD_result_t qkd_result = QKD_RESULT_OUT_OF_MEMORY;
+    if (secret != NULL) {
+        qkd_result = QKD_open(NULL, qos, &key_handle);
+    }
+    if (QKD_RESULT_SUCCESS == qkd_result) {
+        qkd_result = QKD_connect_blocking(&key_handle, 0);
+        if (QKD_RESULT_SUCCESS == qkd_result) {
+            qkd_result = QKD_get_key(&key_handle, (char *) secret);
+        }
+        QKD_close(&key_handle);
+    }
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_error("Could not get QKD key: %s", QKD_result_str(qkd_result));
+        QKD_secure_free(secret);
+        QKD_return_error("%d", 0);
+    }
+    QKD_debug_shared_secret("shared secret", secret, size);
+    if (!QKD_ec_hand_over_shared_secret(secret, size, shared_secret)) {
+        QKD_error("OPENSSL_memdup failed");
+        QKD_return_error("%d", 0);
+    }
+    *shared_secret_size = size;
+    QKD_return_success("%d", 1);
+}
+
 /**
  * Initialize the engine.
  * 
@@ -137,6 +318,23 @@ static int client_engine_init(ENGINE *engine)
         QKD_error("QKD_init failed: ", QKD_result_str(qkd_result));
         QKD_return_error("%d", -1);
     }
+    QKD_engine_finish_at_exit();
+    QKD_return_success("%d", 1);
+}
+
+/**
+ * Finish the engine.
+ * 
+ * Returns 1 on success, 0 on failure.
+ */
+static int client_engine_finish(ENGINE *engine)
+{
+    QKD_enter();
+    QKD_result_t qkd_result = QKD_finish();
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_error("QKD_finish failed: %s", QKD_result_str(qkd_result));
+        QKD_return_error("%d", 0);
+    }
     QKD_return_success("%d", 1);
 }
 
@@ -149,7 +347,9 @@ int client_engine_bind(ENGINE *engine, const char *engine_id)
 {
     QKD_enter();
     int result = QKD_engine_bind(engine, "qkd_engine_client", "QKD Client Engine", client_generate_key,
-                                 client_compute_key, client_engine_init);
+                                 client_compute_key, client_ec_generate_key,
+                                 client_ec_compute_key, client_engine_init,
+                                 client_engine_finish);
     if (1 != result) {
         QKD_error("QKD_engine_bind failed (return code %d)", result);
         QKD_return_error("%d", 0);
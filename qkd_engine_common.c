@@ -11,8 +11,12 @@
 #include "qkd_engine_common.h"
 #include "qkd_debug.h"
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 #include <openssl/engine.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
 
 bool QKD_return_fixed_key_for_testing = false; /* Use command line option orenvironment variable */
 const unsigned long QKD_fixed_private_key = 1;
@@ -20,6 +24,30 @@ const unsigned long QKD_fixed_public_key = 2;
 
 bool running_on_simulaqron = false;
 
+/**
+ * Exit handler that finishes the QKD API.
+ */
+static void finish_at_exit(void)
+{
+    QKD_finish();
+}
+
+/**
+ * Make sure that the QKD API is finished when the process exits normally, even if the application
+ * never finishes the engine. OpenSSL only finishes the engine from its own exit handler, when
+ * libcrypto is already partly cleaned up, which is too late to e.g. write an encrypted snapshot.
+ * Exit handlers run in reverse order of registration, and OpenSSL registers its exit handler
+ * before it loads the engine, so this one runs first. QKD_finish does nothing if it is called
+ * again when the engine is finished after all.
+ */
+void QKD_engine_finish_at_exit(void)
+{
+    static bool registered = false;
+    if (!registered && atexit(finish_at_exit) == 0) {
+        registered = true;
+    }
+}
+
 /**
  * Convert an OpenSSL public key (which is stored as a big number) to an ETSI API key handle.
  * 
@@ -49,6 +77,120 @@ void QKD_key_handle_to_bignum(const QKD_key_handle_t *key_handle, BIGNUM *bn)
     QKD_return_success_void();
 }
 
+/* Encoding of a key handle in an EC public key. An EC public key is a point on the curve, and
+ * OpenSSL rejects points that are not, so the key handle cannot simply be the x coordinate. The x
+ * coordinate is (with n the size of the field in bytes):
+ *
+ *   zero byte | first n - 2 bytes of the key handle | counter
+ *
+ * where the counter is the first value for which x is the x coordinate of a point on the curve
+ * (this is the case for about half of all values). The leading zero byte keeps x below the prime.
+ * The remaining bytes of the key handle must be zero, which means that the curve must be large
+ * enough for the key handle: P-256 is enough for the key handles of the mock QKD API, and P-384
+ * for those of the ETSI 014 QKD API. The y coordinate is always the even one. */
+#define EC_KEY_HANDLE_MAX_FIELD_SIZE (QKD_KEY_HANDLE_SIZE + 2)
+
+/**
+ * The size of the ECDH shared secret (the x coordinate of the shared point) for a curve.
+ *
+ * Returns the size in bytes.
+ */
+int QKD_ec_shared_secret_nr_bytes(const EC_GROUP *group)
+{
+    return (EC_GROUP_get_degree(group) + 7) / 8;
+}
+
+/**
+ * Hand an ECDH shared secret that was allocated with QKD_secure_alloc over to OpenSSL, which
+ * releases it with OPENSSL_clear_free: copy it to the ordinary heap only now, and zeroize and
+ * release the secure copy.
+ *
+ * Returns 1 on success, 0 on failure (the secure copy is released in either case).
+ */
+int QKD_ec_hand_over_shared_secret(unsigned char *secret, size_t size,
+                                   unsigned char **shared_secret)
+{
+    *shared_secret = OPENSSL_memdup(secret, size);
+    QKD_secure_free(secret);
+    return *shared_secret != NULL;
+}
+
+/**
+ * Convert an ETSI API key handle to an EC public key (a point on the curve).
+ *
+ * Returns 1 on success, 0 on failure (e.g. key handle does not fit in the curve).
+ */
+int QKD_key_handle_to_ec_point(const QKD_key_handle_t *key_handle, const EC_GROUP *group,
+                               EC_POINT *point)
+{
+    QKD_enter();
+    const unsigned char *handle_bytes = (const unsigned char *) key_handle->bytes;
+    int field_size = QKD_ec_shared_secret_nr_bytes(group);
+    int nr_handle_bytes = field_size - 2;
+    if (nr_handle_bytes < 1) {
+        QKD_error("Curve too small for key handle");
+        QKD_return_error("%d", 0);
+    }
+    for (int i = nr_handle_bytes; i < QKD_KEY_HANDLE_SIZE; i++) {
+        if (handle_bytes[i] != 0) {
+            QKD_error("Key handle does not fit in %d-byte curve, use a larger curve", field_size);
+            QKD_return_error("%d", 0);
+        }
+    }
+    unsigned char x_bytes[EC_KEY_HANDLE_MAX_FIELD_SIZE] = {0};
+    memcpy(x_bytes + 1, handle_bytes,
+           nr_handle_bytes < QKD_KEY_HANDLE_SIZE ? nr_handle_bytes : QKD_KEY_HANDLE_SIZE);
+    BIGNUM *x = BN_new();
+    BN_CTX *bn_ctx = BN_CTX_new();
+    int result = 0;
+    ERR_set_mark();
+    for (int counter = 0; counter < 256 && x != NULL && bn_ctx != NULL; counter++) {
+        x_bytes[field_size - 1] = counter;
+        if (BN_bin2bn(x_bytes, field_size, x) != NULL &&
+            EC_POINT_set_compressed_coordinates(group, point, x, 0, bn_ctx) == 1) {
+            result = 1;
+            break;
+        }
+    }
+    ERR_pop_to_mark();
+    BN_free(x);
+    BN_CTX_free(bn_ctx);
+    if (result != 1) {
+        QKD_error("Could not encode key handle as point on curve");
+        QKD_return_error("%d", 0);
+    }
+    QKD_return_success("%d", 1);
+}
+
+/**
+ * Convert an EC public key (a point on the curve) that was encoded by QKD_key_handle_to_ec_point
+ * back to an ETSI API key handle.
+ *
+ * Returns 1 on success, 0 on failure (the point does not contain a key handle).
+ */
+int QKD_ec_point_to_key_handle(const EC_GROUP *group, const EC_POINT *point,
+                               QKD_key_handle_t *key_handle)
+{
+    QKD_enter();
+    int field_size = QKD_ec_shared_secret_nr_bytes(group);
+    if (field_size < 3 || field_size > EC_KEY_HANDLE_MAX_FIELD_SIZE) {
+        QKD_error("Unsupported curve size %d", field_size);
+        QKD_return_error("%d", 0);
+    }
+    BIGNUM *x = BN_new();
+    unsigned char x_bytes[EC_KEY_HANDLE_MAX_FIELD_SIZE];
+    int result = x != NULL && EC_POINT_get_affine_coordinates(group, point, x, NULL, NULL) == 1 &&
+                 BN_bn2binpad(x, x_bytes, field_size) == field_size && x_bytes[0] == 0;
+    BN_free(x);
+    if (!result) {
+        QKD_error("EC public key does not contain a key handle");
+        QKD_return_error("%d", 0);
+    }
+    QKD_key_handle_set_null(key_handle);
+    memcpy(key_handle->bytes, x_bytes + 1, field_size - 2);
+    QKD_return_success("%d", 1);
+}
+
 int QKD_shared_secret_nr_bytes(DH *dh)
 {
     /* In real life the shared secret is a number between 1 and P-1, where P is the prime number
@@ -73,7 +215,9 @@ int QKD_shared_secret_nr_bytes(DH *dh)
 int QKD_engine_bind(ENGINE *engine, const char *engine_id, const char *engine_name,
                     int (*generate_key) (DH *),
                     int (*compute_key) (unsigned char *key, const BIGNUM *pub_key, DH *dh),
-                    ENGINE_GEN_INT_FUNC_PTR engine_init)
+                    QKD_ec_keygen_t ec_keygen, QKD_ec_compute_key_t ec_compute_key,
+                    ENGINE_GEN_INT_FUNC_PTR engine_init,
+                    ENGINE_GEN_INT_FUNC_PTR engine_finish)
 {
     QKD_enter();
 
@@ -115,11 +259,314 @@ int QKD_engine_bind(ENGINE *engine, const char *engine_id, const char *engine_na
         QKD_return_error("%d", 0);
     }
 
+    /* Start from the default EC method, so that e.g. ECDSA signatures with the certificate key
+     * still work, and only replace ECDH key generation and shared secret computation. */
+    EC_KEY_METHOD *ec_method = EC_KEY_METHOD_new(EC_KEY_get_default_method());
+    if (NULL == ec_method) {
+        QKD_error("EC_KEY_METHOD_new failed");
+        QKD_return_error("%d", 0);
+    }
+    EC_KEY_METHOD_set_keygen(ec_method, ec_keygen);
+    EC_KEY_METHOD_set_compute_key(ec_method, ec_compute_key);
+
+    result = ENGINE_set_EC(engine, ec_method);
+    if (1 != result) {
+        QKD_error("ENGINE_set_EC failed");
+        QKD_return_error("%d", 0);
+    }
+
     result = ENGINE_set_init_function(engine, engine_init);
     if (1 != result) {
         QKD_error("ENGINE_set_init_function failed");
         QKD_return_error("%d", 0);
     }
 
+    result = ENGINE_set_finish_function(engine, engine_finish);
+    if (1 != result) {
+        QKD_error("ENGINE_set_finish_function failed");
+        QKD_return_error("%d", 0);
+    }
+
     QKD_return_success("%d", 1);
 }
+
+/* Encoding of the public keys in hybrid mode. The leading magic byte is never zero, which makes
+ * sure that the encoding survives the conversion to and from a big number, and the encoded keys
+ * are longer than a plain key handle, which is how a client tells a hybrid server from a server
+ * that only does QKD.
+ *
+ *   Server public key: magic | flags | key handle (QKD_KEY_HANDLE_SIZE) | X25519 public key
+ *   Client public key: magic | flags | X25519 public key
+ */
+#define HYBRID_MAGIC 0x48
+#define HYBRID_SERVER_PUBLIC_KEY_SIZE (2 + QKD_KEY_HANDLE_SIZE + QKD_X25519_KEY_SIZE)
+#define HYBRID_CLIENT_PUBLIC_KEY_SIZE (2 + QKD_X25519_KEY_SIZE)
+
+/* Budget used by the client if the client itself does not set QKD_HYBRID_BUDGET_MS. */
+#define HYBRID_DEFAULT_BUDGET_MS 1000
+
+static const char hybrid_kdf_info[] = "QKD hybrid key exchange";
+
+static QKD_hybrid_counters_t hybrid_counters;
+
+/**
+ * Is hybrid mode enabled locally, i.e. is environment variable QKD_HYBRID_BUDGET_MS set?
+ */
+bool QKD_hybrid_enabled(void)
+{
+    return getenv("QKD_HYBRID_BUDGET_MS") != NULL;
+}
+
+/**
+ * The per-handshake latency budget for obtaining a QKD key in hybrid mode, in milliseconds.
+ */
+uint32_t QKD_hybrid_budget_ms(void)
+{
+    const char *str = getenv("QKD_HYBRID_BUDGET_MS");
+    if (str == NULL) {
+        return HYBRID_DEFAULT_BUDGET_MS;
+    }
+    long budget = strtol(str, NULL, 10);
+    return budget > 0 ? (uint32_t) budget : 1;
+}
+
+/**
+ * The part of the latency budget that remains when the handshake step started at the given time.
+ * Never returns zero, because a timeout of zero means "wait forever" in the ETSI QKD API.
+ */
+uint32_t QKD_hybrid_remaining_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed_ms = (now.tv_sec - start->tv_sec) * 1000 +
+                      (now.tv_nsec - start->tv_nsec) / 1000000;
+    long remaining_ms = (long) QKD_hybrid_budget_ms() - elapsed_ms;
+    return remaining_ms > 0 ? (uint32_t) remaining_ms : 1;
+}
+
+/**
+ * Generate an ephemeral X25519 key pair for the classical part of the hybrid key exchange.
+ * The raw keys are stored in private_key and public_key (QKD_X25519_KEY_SIZE bytes each).
+ *
+ * Returns 1 on success, 0 on failure.
+ */
+int QKD_hybrid_generate_classical_key(unsigned char *private_key, unsigned char *public_key)
+{
+    QKD_enter();
+    int success = 0;
+    EVP_PKEY *pkey = NULL;
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, NULL);
+    if (ctx == NULL || EVP_PKEY_keygen_init(ctx) != 1 || EVP_PKEY_keygen(ctx, &pkey) != 1) {
+        QKD_error("X25519 key generation failed");
+        goto done;
+    }
+    size_t private_key_size = QKD_X25519_KEY_SIZE;
+    size_t public_key_size = QKD_X25519_KEY_SIZE;
+    if (EVP_PKEY_get_raw_private_key(pkey, private_key, &private_key_size) != 1 ||
+        EVP_PKEY_get_raw_public_key(pkey, public_key, &public_key_size) != 1) {
+        QKD_error("X25519 raw key extraction failed");
+        goto done;
+    }
+    success = 1;
+done:
+    EVP_PKEY_free(pkey);
+    EVP_PKEY_CTX_free(ctx);
+    if (success) {
+        QKD_return_success("%d", 1);
+    }
+    QKD_return_error("%d", 0);
+}
+
+/**
+ * Derive the shared secret for the hybrid key exchange: compute the X25519 shared key from our
+ * private key and the peer's public key, and feed it, preceded by the QKD key (if any), into
+ * HKDF-SHA256 to produce secret_size bytes of shared secret. If qkd_key is NULL, the secret is
+ * derived from the classical key exchange alone. The QKD key and the classical share are mixed
+ * in such a way that the result is secure as long as at least one of them is.
+ *
+ * Returns 1 on success, 0 on failure.
+ */
+int QKD_hybrid_derive_secret(const unsigned char *private_key, const unsigned char *peer_public_key,
+                             const unsigned char *qkd_key, size_t qkd_key_size,
+                             unsigned char *secret, size_t secret_size)
+{
+    QKD_enter();
+    int success = 0;
+    EVP_PKEY *own = NULL;
+    EVP_PKEY *peer = NULL;
+    EVP_PKEY_CTX *derive_ctx = NULL;
+    EVP_PKEY_CTX *kdf_ctx = NULL;
+    unsigned char *ikm = NULL;
+    size_t classical_size = QKD_X25519_KEY_SIZE;
+    size_t ikm_size = (qkd_key ? qkd_key_size : 0) + classical_size;
+
+    ikm = QKD_secure_alloc(ikm_size);
+    if (ikm == NULL) {
+        QKD_error("QKD_secure_alloc failed");
+        goto done;
+    }
+    if (qkd_key) {
+        memcpy(ikm, qkd_key, qkd_key_size);
+    }
+
+    /* Classical share: X25519(private_key, peer_public_key) */
+    own = EVP_PKEY_new_raw_private_key(EVP_PKEY_X25519, NULL, private_key, QKD_X25519_KEY_SIZE);
+    peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, peer_public_key,
+                                       QKD_X25519_KEY_SIZE);
+    derive_ctx = own ? EVP_PKEY_CTX_new(own, NULL) : NULL;
+    if (derive_ctx == NULL || peer == NULL || EVP_PKEY_derive_init(derive_ctx) != 1 ||
+        EVP_PKEY_derive_set_peer(derive_ctx, peer) != 1 ||
+        EVP_PKEY_derive(derive_ctx, ikm + ikm_size - classical_size, &classical_size) != 1) {
+        QKD_error("X25519 derivation failed");
+        goto done;
+    }
+
+    /* Mix QKD key and classical share: HKDF-SHA256(ikm = qkd_key | classical_share). The info
+     * string includes whether QKD key was used, so that the two modes never produce the same
+     * secret. */
+    unsigned char info[sizeof(hybrid_kdf_info)];
+    memcpy(info, hybrid_kdf_info, sizeof(hybrid_kdf_info));
+    info[sizeof(info) - 1] = qkd_key ? QKD_HYBRID_FLAG_QKD : 0;
+    size_t out_size = secret_size;
+    kdf_ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    if (kdf_ctx == NULL || EVP_PKEY_derive_init(kdf_ctx) != 1 ||
+        EVP_PKEY_CTX_set_hkdf_md(kdf_ctx, EVP_sha256()) != 1 ||
+        EVP_PKEY_CTX_set1_hkdf_key(kdf_ctx, ikm, ikm_size) != 1 ||
+        EVP_PKEY_CTX_add1_hkdf_info(kdf_ctx, info, sizeof(info)) != 1 ||
+        EVP_PKEY_derive(kdf_ctx, secret, &out_size) != 1 || out_size != secret_size) {
+        QKD_error("HKDF derivation failed");
+        goto done;
+    }
+    success = 1;
+done:
+    QKD_secure_free(ikm);
+    EVP_PKEY_CTX_free(kdf_ctx);
+    EVP_PKEY_CTX_free(derive_ctx);
+    EVP_PKEY_free(peer);
+    EVP_PKEY_free(own);
+    if (success) {
+        QKD_return_success("%d", 1);
+    }
+    QKD_return_error("%d", 0);
+}
+
+/**
+ * Encode the server's hybrid public key into a big number.
+ *
+ * Returns 1 on success, 0 on failure.
+ */
+int QKD_hybrid_encode_server_public_key(unsigned char flags, const QKD_key_handle_t *key_handle,
+                                        const unsigned char *x25519_public_key, BIGNUM *bn)
+{
+    unsigned char bytes[HYBRID_SERVER_PUBLIC_KEY_SIZE];
+    bytes[0] = HYBRID_MAGIC;
+    bytes[1] = flags;
+    memcpy(bytes + 2, key_handle->bytes, QKD_KEY_HANDLE_SIZE);
+    memcpy(bytes + 2 + QKD_KEY_HANDLE_SIZE, x25519_public_key, QKD_X25519_KEY_SIZE);
+    return BN_bin2bn(bytes, sizeof(bytes), bn) != NULL;
+}
+
+/**
+ * Decode the server's public key. 
+ *
+ * Returns 1 if it is a hybrid public key, or 0 if it is not (in which case it is a plain key
+ * handle and the server does not do hybrid mode).
+ */
+int QKD_hybrid_decode_server_public_key(const BIGNUM *bn, unsigned char *flags,
+                                        QKD_key_handle_t *key_handle,
+                                        unsigned char *x25519_public_key)
+{
+    unsigned char bytes[HYBRID_SERVER_PUBLIC_KEY_SIZE];
+    if (BN_num_bytes(bn) != sizeof(bytes)) {
+        return 0;
+    }
+    BN_bn2bin(bn, bytes);
+    if (bytes[0] != HYBRID_MAGIC) {
+        return 0;
+    }
+    *flags = bytes[1];
+    memcpy(key_handle->bytes, bytes + 2, QKD_KEY_HANDLE_SIZE);
+    memcpy(x25519_public_key, bytes + 2 + QKD_KEY_HANDLE_SIZE, QKD_X25519_KEY_SIZE);
+    return 1;
+}
+
+/**
+ * Encode the client's hybrid public key into a big number.
+ *
+ * Returns 1 on success, 0 on failure.
+ */
+int QKD_hybrid_encode_client_public_key(unsigned char flags,
+                                        const unsigned char *x25519_public_key, BIGNUM *bn)
+{
+    unsigned char bytes[HYBRID_CLIENT_PUBLIC_KEY_SIZE];
+    bytes[0] = HYBRID_MAGIC;
+    bytes[1] = flags;
+    memcpy(bytes + 2, x25519_public_key, QKD_X25519_KEY_SIZE);
+    return BN_bin2bn(bytes, sizeof(bytes), bn) != NULL;
+}
+
+/**
+ * Decode the client's public key.
+ *
+ * Returns 1 if it is a hybrid public key, 0 if it is not.
+ */
+int QKD_hybrid_decode_client_public_key(const BIGNUM *bn, unsigned char *flags,
+                                        unsigned char *x25519_public_key)
+{
+    unsigned char bytes[HYBRID_CLIENT_PUBLIC_KEY_SIZE];
+    if (BN_num_bytes(bn) != sizeof(bytes)) {
+        return 0;
+    }
+    BN_bn2bin(bn, bytes);
+    if (bytes[0] != HYBRID_MAGIC) {
+        return 0;
+    }
+    *flags = bytes[1];
+    memcpy(x25519_public_key, bytes + 2, QKD_X25519_KEY_SIZE);
+    return 1;
+}
+
+/**
+ * Convert a hybrid path to a human readable string.
+ */
+const char *QKD_hybrid_path_str(QKD_hybrid_path_t path)
+{
+    switch (path) {
+        case QKD_HYBRID_PATH_MIXED:
+            return "qkd+classical";
+        case QKD_HYBRID_PATH_FALLBACK_TIMEOUT:
+            return "classical (qkd timeout)";
+        case QKD_HYBRID_PATH_FALLBACK_ERROR:
+            return "classical (qkd error)";
+        case QKD_HYBRID_PATH_FALLBACK_NOT_OFFERED:
+            return "classical (qkd not offered)";
+        default:
+            assert(false);
+    }
+}
+
+/**
+ * Count a hybrid handshake that took the given path.
+ */
+void QKD_hybrid_count_path(QKD_hybrid_path_t path)
+{
+    assert(path < QKD_HYBRID_NR_PATHS);
+    __atomic_add_fetch(&hybrid_counters.paths[path], 1, __ATOMIC_RELAXED);
+    QKD_debug("Hybrid path %s taken (mixed=%lu timeout=%lu error=%lu not-offered=%lu)",
+              QKD_hybrid_path_str(path),
+              hybrid_counters.paths[QKD_HYBRID_PATH_MIXED],
+              hybrid_counters.paths[QKD_HYBRID_PATH_FALLBACK_TIMEOUT],
+              hybrid_counters.paths[QKD_HYBRID_PATH_FALLBACK_ERROR],
+              hybrid_counters.paths[QKD_HYBRID_PATH_FALLBACK_NOT_OFFERED]);
+}
+
+/**
+ * Get a snapshot of the hybrid path counters.
+ */
+void QKD_hybrid_get_counters(QKD_hybrid_counters_t *counters)
+{
+    assert(counters != NULL);
+    for (int i = 0; i < QKD_HYBRID_NR_PATHS; i++) {
+        counters->paths[i] = __atomic_load_n(&hybrid_counters.paths[i], __ATOMIC_RELAXED);
+    }
+}
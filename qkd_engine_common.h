@@ -12,15 +12,36 @@
 #define ETSI_QKD_COMMON_H
 
 #include "qkd_api.h"
+#include <time.h>
 #include <openssl/dh.h>
+#include <openssl/ec.h>
 #include <openssl/engine.h>
 
 int QKD_shared_secret_nr_bytes(DH *dh);
 
+/* The ECDH key exchange is hijacked in the same way as the Diffie-Hellman one: the server's EC
+ * public key carries the key handle in its x coordinate (see qkd_engine_common.c for the
+ * encoding), and the shared secret (the x coordinate of the shared point) is the QKD key. */
+typedef int (*QKD_ec_keygen_t)(EC_KEY *key);
+typedef int (*QKD_ec_compute_key_t)(unsigned char **shared_secret, size_t *shared_secret_size,
+                                    const EC_POINT *pub_key, const EC_KEY *ecdh);
+
+int QKD_ec_shared_secret_nr_bytes(const EC_GROUP *group);
+int QKD_ec_hand_over_shared_secret(unsigned char *secret, size_t size,
+                                   unsigned char **shared_secret);
+int QKD_key_handle_to_ec_point(const QKD_key_handle_t *key_handle, const EC_GROUP *group,
+                               EC_POINT *point);
+int QKD_ec_point_to_key_handle(const EC_GROUP *group, const EC_POINT *point,
+                               QKD_key_handle_t *key_handle);
+
 int QKD_engine_bind(ENGINE *engine, const char *engine_id, const char *engine_name,
                     int (*generate_key) (DH *),
                     int (*compute_key) (unsigned char *key, const BIGNUM *pub_key, DH *dh),
-                    ENGINE_GEN_INT_FUNC_PTR engine_init);
+                    QKD_ec_keygen_t ec_keygen, QKD_ec_compute_key_t ec_compute_key,
+                    ENGINE_GEN_INT_FUNC_PTR engine_init,
+                    ENGINE_GEN_INT_FUNC_PTR engine_finish);
+
+void QKD_engine_finish_at_exit(void);
 
 int QKD_bignum_to_key_handle(const BIGNUM *bn, QKD_key_handle_t *key_handle);
 
@@ -35,4 +56,44 @@ extern const unsigned long QKD_fixed_private_key;
 /* When we run on SimulaQron, we do certain things differently than "in real life" (see below) */
 extern bool QKD_running_on_simulaqron;
 
+/* Hybrid mode: the shared secret is derived from both a QKD key and a classical X25519 key
+ * exchange, and the engines fall back to the classical key exchange alone if no QKD key can be
+ * obtained within a per-handshake latency budget. The server enables hybrid mode by setting
+ * environment variable QKD_HYBRID_BUDGET_MS; the client follows the server, which it can tell from
+ * the format of the server's public key (see qkd_engine_common.c for the encoding). */
+#define QKD_X25519_KEY_SIZE 32
+#define QKD_HYBRID_FLAG_QKD 0x01    /* QKD key offered (server) or used (client) */
+
+typedef enum {
+    QKD_HYBRID_PATH_MIXED = 0,          /* QKD key mixed with classical key */
+    QKD_HYBRID_PATH_FALLBACK_TIMEOUT,   /* Classical only: QKD key not obtained within budget */
+    QKD_HYBRID_PATH_FALLBACK_ERROR,     /* Classical only: QKD API returned an error */
+    QKD_HYBRID_PATH_FALLBACK_NOT_OFFERED,   /* Classical only: server could not offer QKD */
+    QKD_HYBRID_NR_PATHS
+} QKD_hybrid_path_t;
+
+typedef struct QKD_hybrid_counters_st {
+    unsigned long paths[QKD_HYBRID_NR_PATHS];
+} QKD_hybrid_counters_t;
+
+bool QKD_hybrid_enabled(void);
+uint32_t QKD_hybrid_budget_ms(void);
+uint32_t QKD_hybrid_remaining_ms(const struct timespec *start);
+int QKD_hybrid_generate_classical_key(unsigned char *private_key, unsigned char *public_key);
+int QKD_hybrid_derive_secret(const unsigned char *private_key, const unsigned char *peer_public_key,
+                             const unsigned char *qkd_key, size_t qkd_key_size,
+                             unsigned char *secret, size_t secret_size);
+int QKD_hybrid_encode_server_public_key(unsigned char flags, const QKD_key_handle_t *key_handle,
+                                        const unsigned char *x25519_public_key, BIGNUM *bn);
+int QKD_hybrid_decode_server_public_key(const BIGNUM *bn, unsigned char *flags,
+                                        QKD_key_handle_t *key_handle,
+                                        unsigned char *x25519_public_key);
+int QKD_hybrid_encode_client_public_key(unsigned char flags,
+                                        const unsigned char *x25519_public_key, BIGNUM *bn);
+int QKD_hybrid_decode_client_public_key(const BIGNUM *bn, unsigned char *flags,
+                                        unsigned char *x25519_public_key);
+void QKD_hybrid_count_path(QKD_hybrid_path_t path);
+void QKD_hybrid_get_counters(QKD_hybrid_counters_t *counters);
+const char *QKD_hybrid_path_str(QKD_hybrid_path_t path);
+
 #endif
\ No newline at end of file
@@ -2,7 +2,8 @@
  * qkd_engine_server.c
  * 
  * An OpenSSL Engine for OpenSSL servers that "hijacks" the existing Diffie-Helman key agreement
- * protocol in OpenSSL to implement a QKD key agreement on top of the ETSI QKD API.
+ * protocol in OpenSSL to implement a QKD key agreement on top of the ETSI QKD API. The elliptic
+ * curve Diffie-Hellman (ECDH) key agreement is hijacked in the same way.
  * There is a separate engine for OpenSSL clients (see qkd_engine_client.c).
  * See qkd_api.h for the definition of the ETSI QKD API.
  * 
@@ -12,10 +13,154 @@
 
 #include "qkd_engine_common.h"
 #include "qkd_debug.h"
+#include "qkd_ticket_keys.h"
 #include <assert.h>
 #include <string.h>
 #include <openssl/engine.h>
 
+/**
+ * Generate the server's public key in hybrid mode. The public key contains both a classical X25519
+ * public key and, if a QKD session could be opened, the key handle of that QKD session. The X25519
+ * private key is stored in the Diffie-Hellman private key.
+ * 
+ * Returns 1 on success, 0 on failure.
+ */
+static int server_generate_hybrid_key(DH *dh, BIGNUM *private_key, BIGNUM *public_key)
+{
+    QKD_enter();
+
+    unsigned char x25519_private_key[QKD_X25519_KEY_SIZE];
+    unsigned char x25519_public_key[QKD_X25519_KEY_SIZE];
+    if (QKD_hybrid_generate_classical_key(x25519_private_key, x25519_public_key) != 1) {
+        QKD_error("QKD_hybrid_generate_classical_key failed");
+        QKD_return_error("%d", 0);
+    }
+    BIGNUM *result_bn = BN_bin2bn(x25519_private_key, sizeof(x25519_private_key), private_key);
+    OPENSSL_cleanse(x25519_private_key, sizeof(x25519_private_key));
+    if (result_bn == NULL) {
+        QKD_error("BN_bin2bn (private_key) failed");
+        QKD_return_error("%d", 0);
+    }
+
+    /* Try to open a QKD session. If that fails, we don't offer QKD to the client, and the key
+     * exchange will be classical only. */
+    unsigned char flags = 0;
+    QKD_qos_t qos = {
+        .requested_length = DH_size(dh),
+        .max_bps = 0,
+        .priority = 0,
+        .timeout = QKD_hybrid_budget_ms()
+    };
+    QKD_key_handle_t key_handle = QKD_key_handle_null;
+    QKD_result_t qkd_result = QKD_open(NULL, qos, &key_handle);
+    if (QKD_RESULT_SUCCESS == qkd_result) {
+        QKD_debug("Allocated key handle: %s", QKD_key_handle_str(&key_handle));
+        flags |= QKD_HYBRID_FLAG_QKD;
+    } else {
+        QKD_debug("QKD_open failed (%s), do not offer QKD", QKD_result_str(qkd_result));
+        key_handle = QKD_key_handle_null;
+    }
+
+    if (QKD_hybrid_encode_server_public_key(flags, &key_handle, x25519_public_key,
+                                            public_key) != 1) {
+        QKD_error("QKD_hybrid_encode_server_public_key failed");
+        if (flags & QKD_HYBRID_FLAG_QKD) {
+            QKD_close(&key_handle);
+        }
+        QKD_return_error("%d", 0);
+    }
+
+    QKD_return_success("%d", 1);
+}
+
+/**
+ * Compute the shared secret in hybrid mode. The client tells us in its public key whether it
+ * obtained a QKD key within the latency budget. If it did, we get the same QKD key and mix it with
+ * the classical X25519 shared key. If it did not, we close the QKD session and use the classical
+ * shared key only.
+ * 
+ * Returns the size of the generated shared secret on success, -1 on failure.
+ */
+static int server_compute_hybrid_key(unsigned char *shared_secret, const BIGNUM *client_public_key,
+                                     DH *dh, unsigned char server_flags,
+                                     const QKD_key_handle_t *key_handle)
+{
+    QKD_enter();
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int shared_secret_size = DH_size(dh);
+
+    unsigned char client_flags;
+    unsigned char client_x25519_public_key[QKD_X25519_KEY_SIZE];
+    if (QKD_hybrid_decode_client_public_key(client_public_key, &client_flags,
+                                            client_x25519_public_key) != 1) {
+        QKD_error("Client public key is not a hybrid public key");
+        if (server_flags & QKD_HYBRID_FLAG_QKD) {
+            QKD_close(key_handle);
+        }
+        QKD_return_error("%d", -1);
+    }
+
+    const BIGNUM *private_key = NULL;
+    DH_get0_key(dh, NULL, &private_key);
+    assert(private_key != NULL);
+    unsigned char x25519_private_key[QKD_X25519_KEY_SIZE];
+    if (BN_bn2binpad(private_key, x25519_private_key, sizeof(x25519_private_key)) < 0) {
+        QKD_error("BN_bn2binpad (private_key) failed");
+        if (server_flags & QKD_HYBRID_FLAG_QKD) {
+            QKD_close(key_handle);
+        }
+        QKD_return_error("%d", -1);
+    }
+
+    /* Get the QKD key, if both we and the client agreed to use it. */
+    unsigned char *qkd_key = NULL;
+    QKD_hybrid_path_t path = QKD_HYBRID_PATH_FALLBACK_NOT_OFFERED;
+    if (client_flags & QKD_HYBRID_FLAG_QKD) {
+        if (!(server_flags & QKD_HYBRID_FLAG_QKD)) {
+            QKD_error("Client used QKD key which was not offered");
+            OPENSSL_cleanse(x25519_private_key, sizeof(x25519_private_key));
+            QKD_return_error("%d", -1);
+        }
+        qkd_key = QKD_secure_alloc(shared_secret_size);
+        QKD_result_t qkd_result = QKD_RESULT_OUT_OF_MEMORY;
+        if (qkd_key != NULL) {
+            qkd_result = QKD_connect_blocking(key_handle, QKD_hybrid_remaining_ms(&start));
+        }
+        if (QKD_RESULT_SUCCESS == qkd_result) {
+            qkd_result = QKD_get_key(key_handle, (char *) qkd_key);
+        }
+        QKD_close(key_handle);
+        if (QKD_RESULT_SUCCESS != qkd_result) {
+            /* The client already mixed the QKD key into its shared secret, so we cannot fall back
+             * to the classical key exchange anymore. */
+            QKD_error("Could not get QKD key used by client: %s", QKD_result_str(qkd_result));
+            QKD_hybrid_count_path(QKD_HYBRID_PATH_FALLBACK_ERROR);
+            QKD_secure_free(qkd_key);
+            OPENSSL_cleanse(x25519_private_key, sizeof(x25519_private_key));
+            QKD_return_error("%d", -1);
+        }
+        path = QKD_HYBRID_PATH_MIXED;
+    } else if (server_flags & QKD_HYBRID_FLAG_QKD) {
+        QKD_debug("Client did not obtain QKD key in time, close QKD session");
+        QKD_close(key_handle);
+        path = QKD_HYBRID_PATH_FALLBACK_TIMEOUT;
+    }
+
+    int result = QKD_hybrid_derive_secret(x25519_private_key, client_x25519_public_key, qkd_key,
+                                          qkd_key ? shared_secret_size : 0, shared_secret,
+                                          shared_secret_size);
+    OPENSSL_cleanse(x25519_private_key, sizeof(x25519_private_key));
+    QKD_secure_free(qkd_key);
+    if (result != 1) {
+        QKD_error("QKD_hybrid_derive_secret failed");
+        QKD_return_error("%d", -1);
+    }
+    QKD_hybrid_count_path(path);
+    QKD_debug_shared_secret("shared secret", shared_secret, shared_secret_size);
+    QKD_return_success("%d", shared_secret_size);
+}
+
 /**
  * Callback which registered in the client OpenSSL engine to be called when OpenSSL needs the engine
  * to generate a Diffie-Hellman private key and to derive the Diffie-Hellman public key from it.
@@ -42,7 +187,17 @@ static int server_generate_key(DH *dh)
         QKD_error("BN_secure_new (public_key) failed");
         QKD_return_error("%d", 0);
     }
-    if (QKD_return_fixed_key_for_testing) {
+    if (QKD_hybrid_enabled() && !QKD_return_fixed_key_for_testing) {
+
+        QKD_debug("Encode the hybrid public key (QKD key handle and X25519 public key)");
+        if (server_generate_hybrid_key(dh, private_key, public_key) != 1) {
+            QKD_error("server_generate_hybrid_key failed");
+            BN_clear_free(private_key);
+            BN_free(public_key);
+            QKD_return_error("%d", 0);
+        }
+
+    } else if (QKD_return_fixed_key_for_testing) {
 
         QKD_debug("Use fixed public key (for testing)");
         BN_set_word(public_key, QKD_fixed_public_key);
@@ -104,6 +259,20 @@ static int server_compute_key(unsigned char *shared_secret, const BIGNUM *client
     DH_get0_key(dh, &server_public_key, NULL);   
     assert(server_public_key != NULL);
     QKD_key_handle_t key_handle = QKD_key_handle_null;
+
+    /* In hybrid mode, our public key also contains the classical public key. */
+    unsigned char server_flags;
+    unsigned char x25519_public_key[QKD_X25519_KEY_SIZE];
+    if (QKD_hybrid_decode_server_public_key(server_public_key, &server_flags, &key_handle,
+                                            x25519_public_key)) {
+        int result = server_compute_hybrid_key(shared_secret, client_public_key, dh, server_flags,
+                                               &key_handle);
+        if (result < 0) {
+            QKD_return_error("%d", -1);
+        }
+        QKD_return_success("%d", result);
+    }
+
     int convert_result = QKD_bignum_to_key_handle(server_public_key, &key_handle);
     if (convert_result != 1) {
         QKD_error("QKD_bignum_to_key_handle failed (return code %d)", convert_result);
@@ -131,8 +300,7 @@ static int server_compute_key(unsigned char *shared_secret, const BIGNUM *client
         QKD_return_error("%d", -1);
     }
     int shared_secret_size = DH_size(dh);
-    QKD_debug("shared secret = %s", QKD_shared_secret_str((char *)shared_secret,
-                                                           shared_secret_size));
+    QKD_debug_shared_secret("shared secret", shared_secret, shared_secret_size);
 
     /* Close the QKD session. */
     qkd_result = QKD_close(&key_handle);
@@ -144,6 +312,91 @@ static int server_compute_key(unsigned char *shared_secret, const BIGNUM *client
     QKD_return_success("%d", shared_secret_size);
 }
 
+/**
+ * Callback which is registered in the server OpenSSL engine to be called when OpenSSL needs the
+ * engine to generate an ECDH key pair. The public key is a point on the curve that carries the key
+ * handle of a newly opened QKD session (hybrid mode is not supported for ECDH).
+ * 
+ * Returns 1 on success, 0 on failure.
+ */
+static int server_ec_generate_key(EC_KEY *ec_key)
+{
+    QKD_enter();
+    const EC_GROUP *group = EC_KEY_get0_group(ec_key);
+    QKD_qos_t qos = {
+        .requested_length = QKD_ec_shared_secret_nr_bytes(group),
+        .max_bps = 0,
+        .priority = 0,
+        .timeout = 0
+    };
+    QKD_key_handle_t key_handle = QKD_key_handle_null;
+    QKD_result_t qkd_result = QKD_open(NULL, qos, &key_handle);
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_error("QKD_open failed: %s", QKD_result_str(qkd_result));
+        QKD_return_error("%d", 0);
+    }
+    QKD_debug("Allocated key handle: %s", QKD_key_handle_str(&key_handle));
+
+    /* As for Diffie-Hellman, the private key is fixed; it is not used for anything. */
+    BIGNUM *private_key = BN_secure_new();
+    EC_POINT *public_key = EC_POINT_new(group);
+    int result = private_key != NULL && public_key != NULL &&
+                 BN_set_word(private_key, QKD_fixed_private_key) == 1 &&
+                 QKD_key_handle_to_ec_point(&key_handle, group, public_key) == 1 &&
+                 EC_KEY_set_private_key(ec_key, private_key) == 1 &&
+                 EC_KEY_set_public_key(ec_key, public_key) == 1;
+    BN_clear_free(private_key);
+    EC_POINT_free(public_key);
+    if (!result) {
+        QKD_error("Could not encode key handle in EC public key");
+        QKD_close(&key_handle);
+        QKD_return_error("%d", 0);
+    }
+    QKD_return_success("%d", 1);
+}
+
+/**
+ * Callback which is registered in the server OpenSSL engine to be called when OpenSSL needs the
+ * engine to compute the ECDH shared secret. The shared secret is the QKD key for the key handle in
+ * our own public key. OpenSSL frees the shared secret.
+ * 
+ * Returns 1 on success, 0 on failure.
+ */
+static int server_ec_compute_key(unsigned char **shared_secret, size_t *shared_secret_size,
+                                 const EC_POINT *client_public_key, const EC_KEY *ec_key)
+{
+    QKD_enter();
+    const EC_GROUP *group = EC_KEY_get0_group(ec_key);
+    QKD_key_handle_t key_handle;
+    if (QKD_ec_point_to_key_handle(group, EC_KEY_get0_public_key(ec_key), &key_handle) != 1) {
+        QKD_error("QKD_ec_point_to_key_handle failed");
+        QKD_return_error("%d", 0);
+    }
+    QKD_debug("Key handle = %s", QKD_key_handle_str(&key_handle));
+    size_t size = QKD_ec_shared_secret_nr_bytes(group);
+    unsigned char *secret = QKD_secure_alloc(size);
+    QKD_result_t qkd_result = QKD_RESULT_OUT_OF_MEMORY;
+    if (secret != NULL) {
+        qkd_result = QKD_connect_blocking(&key_handle, 0);
+    }
+    if (QKD_RESULT_SUCCESS == qkd_result) {
+        qkd_result = QKD_get_key(&key_handle, (char *) secret);
+    }
+    QKD_close(&key_handle);
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_error("Could not get QKD key: %s", QKD_result_str(qkd_result));
+        QKD_secure_free(secret);
+        QKD_return_error("%d", 0);
+    }
+    QKD_debug_shared_secret("shared secret", secret, size);
+    if (!QKD_ec_hand_over_shared_secret(secret, size, shared_secret)) {
+        QKD_error("OPENSSL_memdup failed");
+        QKD_return_error("%d", 0);
+    }
+    *shared_secret_size = size;
+    QKD_return_success("%d", 1);
+}
+
 /**
  * Initialize the engine.
  * 
@@ -157,6 +410,25 @@ static int server_engine_init(ENGINE *engine)
         QKD_error("QKD_init failed: ", QKD_result_str(qkd_result));
         QKD_return_error("%d", -1);
     }
+    /* Without session ticket keys, QKD_ticket_key_callback issues no tickets; that is all. */
+    QKD_ticket_keys_init();
+    QKD_engine_finish_at_exit();
+    QKD_return_success("%d", 1);
+}
+
+/**
+ * Finish the engine.
+ * 
+ * Returns 1 on success, 0 on failure.
+ */
+static int server_engine_finish(ENGINE *engine)
+{
+    QKD_enter();
+    QKD_result_t qkd_result = QKD_finish();
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_error("QKD_finish failed: %s", QKD_result_str(qkd_result));
+        QKD_return_error("%d", 0);
+    }
     QKD_return_success("%d", 1);
 }
 
@@ -168,7 +440,9 @@ static int server_engine_init(ENGINE *engine)
 {
     QKD_enter();
     int result = QKD_engine_bind(engine, "qkd_engine_server", "QKD Server Engine", server_generate_key,
-                                 server_compute_key, server_engine_init);
+                                 server_compute_key, server_ec_generate_key,
+                                 server_ec_compute_key, server_engine_init,
+                                 server_engine_finish);
     if (1 != result) {
         QKD_error("QKD_engine_bind failed (return code %d)", result);
         QKD_return_error("%d", 0);
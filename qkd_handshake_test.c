@@ -0,0 +1,642 @@
+/**
+ * qkd_handshake_test.c
+ *
+ * An in-process test of TLS handshakes with the QKD engines. Both engines are loaded into this one
+ * process, and a client and a server SSL object talk to each other through a BIO pair, so a
+ * handshake takes milliseconds and needs no network, no packet capture, and no sleeps.
+ *
+ * Every handshake is one of a matrix of variations: the cipher suite (DHE and ECDHE, on several
+ * curves), hybrid mode on or off (DHE only), and the size of the BIO pair buffers (small buffers
+ * make the handshake messages cross in many pieces). For every handshake the test asserts that:
+ *
+ *   - the handshake completes at both ends, with TLS 1.2 and the expected cipher suite;
+ *   - the key exchange is the expected one (DH, or EC on the expected curve) and was hijacked by
+ *     the engines: the server public key carries a QKD key handle instead of a normal public key;
+ *   - in hybrid mode, the client mixed a QKD key into the shared secret;
+ *   - both ends have the same master secret, and application data gets through in both directions.
+ *
+ * If the server engine provides session ticket keys (see qkd_ticket_keys.h), the test also checks
+ * that a session is resumed with its ticket, still after one rotation of the keys (when the ticket
+ * is renewed), and no longer once its key has been rotated out.
+ *
+ * OpenSSL picks the engine for a Diffie-Hellman or EC key when the key is created, from the default
+ * engine. The test therefore makes the client engine the default while it runs the client side of
+ * the handshake, and the server engine while it runs the server side.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#include "qkd_api.h"
+#include "qkd_engine_common.h"
+#include "qkd_ticket_keys.h"
+#include "qkd_util.h"
+#include <dlfcn.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/bn.h>
+#include <openssl/core_names.h>
+#include <openssl/dh.h>
+#include <openssl/engine.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+/* A handshake that needs more round trips than this is stuck. */
+#define MAX_ROUNDS 200
+
+#define HYBRID_BUDGET_MS "1000"
+
+typedef struct options_st {
+    const char *server_engine_path;
+    const char *client_engine_path;
+    int iterations;
+    const char *filter;
+    bool verbose;
+    bool debug;
+} options_t;
+
+typedef struct suite_st {
+    const char *cipher;
+    const char *group;                  /* NULL for DHE */
+    int curve_nid;
+} suite_t;
+
+typedef struct engine_st {
+    const char *path;
+    ENGINE *engine;
+    void *dl_handle;                    /* The engine library, for its counters */
+} test_engine_t;
+
+static const suite_t suites[] = {
+    {"DHE-RSA-AES128-GCM-SHA256", NULL, NID_undef},
+    {"DHE-RSA-AES256-GCM-SHA384", NULL, NID_undef},
+    {"DHE-RSA-CHACHA20-POLY1305", NULL, NID_undef},
+    {"ECDHE-RSA-AES128-GCM-SHA256", "P-256", NID_X9_62_prime256v1},
+    {"ECDHE-RSA-AES256-GCM-SHA384", "P-384", NID_secp384r1},
+    {"ECDHE-RSA-CHACHA20-POLY1305", "P-521", NID_secp521r1},
+};
+
+/* Sizes of the buffers of the BIO pair (0 is the OpenSSL default of 17 KB). */
+static const size_t bio_sizes[] = {0, 1024, 128};
+
+static options_t options = {
+    .server_engine_path = "./qkd_engine_server.so",
+    .client_engine_path = "./qkd_engine_client.so",
+    .iterations = 20
+};
+
+typedef int (*ticket_key_callback_t)(SSL *ssl, unsigned char *key_name, unsigned char *iv,
+                                     EVP_CIPHER_CTX *cipher_ctx, EVP_MAC_CTX *mac_ctx,
+                                     int encrypt);
+
+static test_engine_t server_engine;
+static test_engine_t client_engine;
+static SSL_CTX *server_ctx;
+static SSL_CTX *client_ctx;
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -s, --server-engine PATH   Server engine library (default ./qkd_engine_server.so)\n"
+            "  -c, --client-engine PATH   Client engine library (default ./qkd_engine_client.so)\n"
+            "  -n, --iterations N         Handshakes per variation (default 20)\n"
+            "  -f, --filter TEXT          Only run the variations whose name contains TEXT\n"
+            "  -v, --verbose              Report every variation, not just failures\n"
+            "  -d, --debug                Keep the debug output of the engines\n"
+            "  -h, --help                 Print this help\n",
+            program);
+}
+
+static void parse_options(int argc, char **argv)
+{
+    static struct option long_options[] = {
+        {"server-engine", required_argument, NULL, 's'},
+        {"client-engine", required_argument, NULL, 'c'},
+        {"iterations", required_argument, NULL, 'n'},
+        {"filter", required_argument, NULL, 'f'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"debug", no_argument, NULL, 'd'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:c:n:f:vdh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 's':
+                options.server_engine_path = optarg;
+                break;
+            case 'c':
+                options.client_engine_path = optarg;
+                break;
+            case 'n':
+                options.iterations = atoi(optarg);
+                break;
+            case 'f':
+                options.filter = optarg;
+                break;
+            case 'v':
+                options.verbose = true;
+                break;
+            case 'd':
+                options.debug = true;
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+    if (optind != argc || options.iterations < 1) {
+        usage(argv[0]);
+        exit(1);
+    }
+}
+
+/**
+ * Load an engine library through the dynamic engine, and initialize it.
+ */
+static bool load_engine(test_engine_t *test_engine, const char *path)
+{
+    test_engine->path = path;
+    ENGINE *engine = ENGINE_by_id("dynamic");
+    if (engine == NULL || !ENGINE_ctrl_cmd_string(engine, "SO_PATH", path, 0) ||
+        !ENGINE_ctrl_cmd_string(engine, "LOAD", NULL, 0)) {
+        fprintf(stderr, "Cannot load engine %s\n", path);
+        ERR_print_errors_fp(stderr);
+        ENGINE_free(engine);
+        return false;
+    }
+
+    /* The engine library is loaded already; get a handle on it for its functions. */
+    test_engine->dl_handle = dlopen(path, RTLD_NOW | RTLD_NOLOAD);
+    void (*set_debug)(bool) = test_engine->dl_handle ?
+                              dlsym(test_engine->dl_handle, "QKD_debug_set_enabled") : NULL;
+    if (set_debug != NULL) {
+        set_debug(options.debug);
+    }
+    if (!ENGINE_init(engine)) {
+        fprintf(stderr, "Cannot initialize engine %s\n", path);
+        ERR_print_errors_fp(stderr);
+        ENGINE_free(engine);
+        return false;
+    }
+    test_engine->engine = engine;
+    return true;
+}
+
+/**
+ * Make an engine the default for Diffie-Hellman and EC keys that are created from now on.
+ */
+static void use_engine(test_engine_t *test_engine)
+{
+    ENGINE_set_default(test_engine->engine, ENGINE_METHOD_DH | ENGINE_METHOD_EC);
+}
+
+/**
+ * The number of hybrid handshakes in which the client engine mixed a QKD key into the secret.
+ */
+static unsigned long client_mixed_count(void)
+{
+    void (*get_counters)(QKD_hybrid_counters_t *) =
+        dlsym(client_engine.dl_handle, "QKD_hybrid_get_counters");
+    if (get_counters == NULL) {
+        return 0;
+    }
+    QKD_hybrid_counters_t counters;
+    get_counters(&counters);
+    return counters.paths[QKD_HYBRID_PATH_MIXED];
+}
+
+/**
+ * Create a self-signed RSA certificate for the server, and trust it in the client.
+ */
+static bool create_certificate(void)
+{
+    EVP_PKEY *key = NULL;
+    EVP_PKEY_CTX *key_ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+    X509 *cert = X509_new();
+    X509_NAME *name = cert ? X509_get_subject_name(cert) : NULL;
+    bool ok = key_ctx != NULL && cert != NULL && EVP_PKEY_keygen_init(key_ctx) == 1 &&
+              EVP_PKEY_CTX_set_rsa_keygen_bits(key_ctx, 2048) == 1 &&
+              EVP_PKEY_keygen(key_ctx, &key) == 1 &&
+              X509_set_version(cert, 2) == 1 &&
+              ASN1_INTEGER_set(X509_get_serialNumber(cert), 1) == 1 &&
+              X509_gmtime_adj(X509_getm_notBefore(cert), -3600) != NULL &&
+              X509_gmtime_adj(X509_getm_notAfter(cert), 86400) != NULL &&
+              X509_NAME_add_entry_by_txt(name, "O", MBSTRING_ASC,
+                                         (const unsigned char *) "Example", -1, -1, 0) == 1 &&
+              X509_set_issuer_name(cert, name) == 1 &&
+              X509_set_pubkey(cert, key) == 1 &&
+              X509_sign(cert, key, EVP_sha256()) > 0 &&
+              SSL_CTX_use_certificate(server_ctx, cert) == 1 &&
+              SSL_CTX_use_PrivateKey(server_ctx, key) == 1 &&
+              X509_STORE_add_cert(SSL_CTX_get_cert_store(client_ctx), cert) == 1;
+    EVP_PKEY_CTX_free(key_ctx);
+    EVP_PKEY_free(key);
+    X509_free(cert);
+    return ok;
+}
+
+/**
+ * Create the SSL contexts. The Diffie-Hellman parameters of the server are a DH object of the
+ * server engine, with the 2048-bit prime of RFC 3526 but generator 5 instead of 2. OpenSSL knows
+ * the subgroup order of the named groups, and the client would then reject public keys that are
+ * not in the subgroup, such as half of the key handles.
+ */
+static bool create_contexts(void)
+{
+    server_ctx = SSL_CTX_new(TLS_server_method());
+    client_ctx = SSL_CTX_new(TLS_client_method());
+    if (server_ctx == NULL || client_ctx == NULL) {
+        return false;
+    }
+    SSL_CTX_set_min_proto_version(server_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(server_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_min_proto_version(client_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(client_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_verify(client_ctx, SSL_VERIFY_PEER, NULL);
+    SSL_CTX_set_security_level(server_ctx, 0);
+    SSL_CTX_set_security_level(client_ctx, 0);
+    DH *dh = DH_new_method(server_engine.engine);
+    BIGNUM *p = BN_get_rfc3526_prime_2048(NULL);
+    BIGNUM *g = BN_new();
+    bool ok = dh != NULL && p != NULL && g != NULL && BN_set_word(g, 5) == 1 &&
+              DH_set0_pqg(dh, p, NULL, g) == 1;
+    if (!ok) {
+        BN_free(p);
+        BN_free(g);
+        DH_free(dh);
+        return false;
+    }
+    ok = SSL_CTX_set_tmp_dh(server_ctx, dh) == 1 &&
+         SSL_CTX_set_cipher_list(server_ctx, "DHE:ECDHE") == 1 &&
+         create_certificate();
+    DH_free(dh);
+
+    /* Session tickets are encrypted with the keys of the server engine, if it has them. Sessions
+     * are only resumed with tickets, not from the session cache of the server. */
+    ticket_key_callback_t ticket_key_callback = dlsym(server_engine.dl_handle,
+                                                      "QKD_ticket_key_callback");
+    long (*ticket_lifetime)(void) = dlsym(server_engine.dl_handle, "QKD_ticket_lifetime_seconds");
+    if (ok && ticket_key_callback != NULL && ticket_lifetime != NULL) {
+        ok = SSL_CTX_set_tlsext_ticket_key_evp_cb(server_ctx, ticket_key_callback) == 1;
+        SSL_CTX_set_timeout(server_ctx, ticket_lifetime());
+        SSL_CTX_set_session_cache_mode(server_ctx, SSL_SESS_CACHE_OFF);
+    }
+    return ok;
+}
+
+/**
+ * Check that the key exchange was hijacked: the server public key carries a key handle.
+ *
+ * A DH public key is normally as long as the prime (256 bytes); a key handle (plus, in hybrid
+ * mode, a magic byte, flags and an X25519 key) is much shorter. An EC public key is a point whose
+ * x coordinate starts with a zero byte when it carries a key handle (see
+ * QKD_key_handle_to_ec_point), which a random point does only once in 256 handshakes.
+ */
+static const char *check_key_exchange(SSL *client, const suite_t *suite)
+{
+    EVP_PKEY *server_key = NULL;
+    if (!SSL_get_peer_tmp_key(client, &server_key)) {
+        return "no server key exchange";
+    }
+    const char *failure = NULL;
+    if (suite->group == NULL) {
+        BIGNUM *public_key = NULL;
+        if (EVP_PKEY_get_base_id(server_key) != EVP_PKEY_DH) {
+            failure = "key exchange is not DHE";
+        } else if (!EVP_PKEY_get_bn_param(server_key, OSSL_PKEY_PARAM_PUB_KEY, &public_key)) {
+            failure = "cannot get server DH public key";
+        } else if (BN_num_bytes(public_key) > 2 + QKD_KEY_HANDLE_SIZE + QKD_X25519_KEY_SIZE) {
+            failure = "server DH public key is not a key handle";
+        }
+        BN_free(public_key);
+    } else {
+        unsigned char point[1 + 2 * 66];
+        char group[64];
+        size_t point_size = 0;
+        if (EVP_PKEY_get_base_id(server_key) != EVP_PKEY_EC) {
+            failure = "key exchange is not ECDHE";
+        } else if (!EVP_PKEY_get_utf8_string_param(server_key, OSSL_PKEY_PARAM_GROUP_NAME,
+                                                   group, sizeof(group), NULL) ||
+                   OBJ_sn2nid(group) != suite->curve_nid) {
+            failure = "wrong curve";
+        } else if (!EVP_PKEY_get_octet_string_param(server_key,
+                                                    OSSL_PKEY_PARAM_ENCODED_PUBLIC_KEY, point,
+                                                    sizeof(point), &point_size) ||
+                   point_size < 2) {
+            failure = "cannot get server EC public key";
+        } else if (point[1] != 0) {
+            /* point[0] is the point conversion form; the x coordinate follows. */
+            failure = "server EC public key is not a key handle";
+        }
+    }
+    EVP_PKEY_free(server_key);
+    return failure;
+}
+
+/**
+ * Send a message from one end to the other through the BIO pair, and check that it arrives.
+ */
+static bool exchange_data(SSL *from, SSL *to, const char *message)
+{
+    char buffer[64];
+    size_t size = strlen(message);
+    return SSL_write(from, message, size) == (int) size &&
+           SSL_read(to, buffer, sizeof(buffer)) == (int) size && memcmp(buffer, message, size) == 0;
+}
+
+/**
+ * Create a client and a server SSL object for a suite, connected by a BIO pair.
+ *
+ * Returns true on success, false on failure.
+ */
+static bool create_ssl_pair(const suite_t *suite, size_t bio_size, SSL **client, SSL **server)
+{
+    *server = SSL_new(server_ctx);
+    *client = SSL_new(client_ctx);
+    BIO *server_bio = NULL;
+    BIO *client_bio = NULL;
+    if (*server == NULL || *client == NULL ||
+        !BIO_new_bio_pair(&server_bio, bio_size, &client_bio, bio_size) ||
+        !SSL_set_cipher_list(*client, suite->cipher) ||
+        !SSL_set1_groups_list(*client, suite->group ? suite->group : "P-256")) {
+        SSL_free(*server);
+        SSL_free(*client);
+        BIO_free(server_bio);
+        BIO_free(client_bio);
+        return false;
+    }
+    SSL_set_bio(*server, server_bio, server_bio);
+    SSL_set_bio(*client, client_bio, client_bio);
+    SSL_set_accept_state(*server);
+    SSL_set_connect_state(*client);
+    return true;
+}
+
+/**
+ * Run the handshake between a client and a server, one step at a time at each end.
+ *
+ * Returns NULL if the handshake completed, or a description of what failed.
+ */
+static const char *drive_handshake(SSL *client, SSL *server)
+{
+    bool client_done = false;
+    bool server_done = false;
+    for (int round = 0; round < MAX_ROUNDS && !(client_done && server_done); round++) {
+        use_engine(&client_engine);
+        int result = SSL_do_handshake(client);
+        client_done = result == 1;
+        int error = SSL_get_error(client, result);
+        if (!client_done && error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+            return "client handshake failed";
+        }
+        use_engine(&server_engine);
+        result = SSL_do_handshake(server);
+        server_done = result == 1;
+        error = SSL_get_error(server, result);
+        if (!server_done && error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+            return "server handshake failed";
+        }
+    }
+    return client_done && server_done ? NULL : "handshake did not complete";
+}
+
+/**
+ * Run one handshake of a variation and check it.
+ *
+ * Returns NULL if the handshake passed, or a description of what failed.
+ */
+static const char *run_handshake(const suite_t *suite, bool hybrid, size_t bio_size)
+{
+    SSL *server;
+    SSL *client;
+    if (!create_ssl_pair(suite, bio_size, &client, &server)) {
+        return "cannot create SSL objects";
+    }
+
+    unsigned long mixed_before = client_mixed_count();
+    const char *failure = drive_handshake(client, server);
+    unsigned char client_secret[SSL_MAX_MASTER_KEY_LENGTH];
+    unsigned char server_secret[SSL_MAX_MASTER_KEY_LENGTH];
+    if (failure != NULL) {
+        /* Already failed */
+    } else if (SSL_version(client) != TLS1_2_VERSION) {
+        failure = "protocol is not TLS 1.2";
+    } else if (strcmp(SSL_get_cipher_name(client), suite->cipher) != 0 ||
+               strcmp(SSL_get_cipher_name(server), suite->cipher) != 0) {
+        failure = "wrong cipher suite";
+    } else if (SSL_get_verify_result(client) != X509_V_OK) {
+        failure = "server certificate not verified";
+    } else if ((failure = check_key_exchange(client, suite)) != NULL) {
+        /* failure is set */
+    } else if (hybrid && client_mixed_count() != mixed_before + 1) {
+        failure = "hybrid handshake did not use a QKD key";
+    } else {
+        size_t client_size = SSL_SESSION_get_master_key(SSL_get_session(client), client_secret,
+                                                        sizeof(client_secret));
+        size_t server_size = SSL_SESSION_get_master_key(SSL_get_session(server), server_secret,
+                                                        sizeof(server_secret));
+        if (client_size == 0 || client_size != server_size ||
+            memcmp(client_secret, server_secret, client_size) != 0) {
+            failure = "master secrets differ";
+        } else if (!exchange_data(client, server, "ping") ||
+                   !exchange_data(server, client, "pong")) {
+            failure = "application data did not get through";
+        }
+    }
+    if (failure != NULL) {
+        ERR_print_errors_fp(stderr);
+    }
+    ERR_clear_error();
+    OPENSSL_cleanse(client_secret, sizeof(client_secret));
+    OPENSSL_cleanse(server_secret, sizeof(server_secret));
+    SSL_free(server);
+    SSL_free(client);
+    return failure;
+}
+
+/**
+ * Run all handshakes of a variation (unless it is filtered out), and add them to the totals.
+ */
+static void run_variation(const suite_t *suite, bool hybrid, size_t bio_size, int *nr_handshakes,
+                          int *nr_failed_handshakes)
+{
+    char name[128];
+    char bio_name[32] = "default";
+    if (bio_size > 0) {
+        snprintf(bio_name, sizeof(bio_name), "%zu", bio_size);
+    }
+    snprintf(name, sizeof(name), "%s %s %s bio=%s", suite->cipher,
+             suite->group ? suite->group : "ffdhe", hybrid ? "hybrid" : "qkd", bio_name);
+    if (options.filter != NULL && strstr(name, options.filter) == NULL) {
+        return;
+    }
+    if (hybrid) {
+        setenv("QKD_HYBRID_BUDGET_MS", HYBRID_BUDGET_MS, 1);
+    } else {
+        unsetenv("QKD_HYBRID_BUDGET_MS");
+    }
+    int nr_failures = 0;
+    const char *first_failure = NULL;
+    double start = QKD_monotonic_seconds();
+    for (int i = 0; i < options.iterations; i++) {
+        const char *failure = run_handshake(suite, hybrid, bio_size);
+        if (failure != NULL) {
+            nr_failures++;
+            first_failure = first_failure ? first_failure : failure;
+        }
+    }
+    double ms = (QKD_monotonic_seconds() - start) * 1e3 / options.iterations;
+    if (nr_failures > 0) {
+        printf("FAIL %-58s %d/%d failed (%s)\n", name, nr_failures, options.iterations,
+               first_failure);
+    } else if (options.verbose) {
+        printf("ok   %-58s %d handshakes, %.2f ms each\n", name, options.iterations, ms);
+    }
+    *nr_handshakes += options.iterations;
+    *nr_failed_handshakes += nr_failures;
+}
+
+/**
+ * Run a handshake that resumes the given session (if any), and get the new session.
+ *
+ * Returns NULL if the handshake passed, or a description of what failed.
+ */
+static const char *run_session(const suite_t *suite, SSL_SESSION *resume, SSL_SESSION **session,
+                               bool *reused)
+{
+    SSL *server;
+    SSL *client;
+    if (!create_ssl_pair(suite, 0, &client, &server)) {
+        return "cannot create SSL objects";
+    }
+    const char *failure = NULL;
+    if (resume != NULL && !SSL_set_session(client, resume)) {
+        failure = "cannot set session";
+    } else if ((failure = drive_handshake(client, server)) != NULL) {
+        /* failure is set */
+    } else if (!exchange_data(client, server, "ping") || !exchange_data(server, client, "pong")) {
+        failure = "application data did not get through";
+    } else {
+        /* A session that is not shut down cleanly cannot be resumed. */
+        SSL_shutdown(client);
+        SSL_shutdown(server);
+        *reused = SSL_session_reused(client);
+        *session = SSL_get1_session(client);
+    }
+    if (failure != NULL) {
+        ERR_print_errors_fp(stderr);
+    }
+    ERR_clear_error();
+    SSL_free(server);
+    SSL_free(client);
+    return failure;
+}
+
+/**
+ * Check session resumption with the session ticket keys of the server engine, if it has them:
+ * a ticket resumes the session, is renewed after a rotation of the keys, and is refused once its
+ * key has been rotated out.
+ */
+static void run_resumption(int *nr_handshakes, int *nr_failed_handshakes)
+{
+    const char *name = "DHE-RSA-AES128-GCM-SHA256 ffdhe qkd resumption";
+    bool (*rotate)(void) = dlsym(server_engine.dl_handle, "QKD_ticket_keys_rotate");
+    void (*get_stats)(QKD_ticket_stats_t *) = dlsym(server_engine.dl_handle,
+                                                    "QKD_ticket_get_stats");
+    if (rotate == NULL || get_stats == NULL ||
+        (options.filter != NULL && strstr(name, options.filter) == NULL)) {
+        return;
+    }
+    unsetenv("QKD_HYBRID_BUDGET_MS");
+    double start = QKD_monotonic_seconds();
+    SSL_SESSION *ticket = NULL;
+    SSL_SESSION *session = NULL;
+    bool reused = false;
+    QKD_ticket_stats_t before;
+    QKD_ticket_stats_t after;
+    int nr_sessions = 0;
+    const char *failure = run_session(&suites[0], NULL, &ticket, &reused);
+    nr_sessions++;
+    if (failure == NULL && (reused || !SSL_SESSION_has_ticket(ticket))) {
+        failure = "full handshake did not issue a ticket";
+    }
+    for (int step = 0; failure == NULL && step < 3; step++) {
+        /* Resume with the current key, after one rotation, and after it was rotated out. */
+        for (int i = 0; i < (step == 2 ? QKD_TICKET_NR_KEYS - 1 : step); i++) {
+            if (!rotate()) {
+                failure = "cannot rotate ticket keys";
+            }
+        }
+        get_stats(&before);
+        if (failure == NULL) {
+            failure = run_session(&suites[0], ticket, &session, &reused);
+            nr_sessions++;
+        }
+        SSL_SESSION_free(session);
+        session = NULL;
+        get_stats(&after);
+        if (failure != NULL) {
+            /* Already failed */
+        } else if (step == 0 && !(reused && after.nr_resumed == before.nr_resumed + 1)) {
+            failure = "session not resumed";
+        } else if (step == 1 && !(reused && after.nr_renewed == before.nr_renewed + 1)) {
+            failure = "session not resumed after rotation";
+        } else if (step == 2 && !(!reused && after.nr_unknown == before.nr_unknown + 1)) {
+            failure = "session resumed with a rotated-out key";
+        }
+    }
+    SSL_SESSION_free(ticket);
+    double ms = (QKD_monotonic_seconds() - start) * 1e3 / nr_sessions;
+    if (failure != NULL) {
+        printf("FAIL %-58s (%s)\n", name, failure);
+    } else if (options.verbose) {
+        printf("ok   %-58s %d handshakes, %.2f ms each\n", name, nr_sessions, ms);
+    }
+    *nr_handshakes += nr_sessions;
+    *nr_failed_handshakes += failure != NULL;
+}
+
+int main(int argc, char **argv)
+{
+    parse_options(argc, argv);
+    if (!load_engine(&server_engine, options.server_engine_path) ||
+        !load_engine(&client_engine, options.client_engine_path)) {
+        return 1;
+    }
+    if (!create_contexts()) {
+        fprintf(stderr, "Cannot create SSL contexts\n");
+        ERR_print_errors_fp(stderr);
+        return 1;
+    }
+
+    int nr_handshakes = 0;
+    int nr_failures = 0;
+    double start = QKD_monotonic_seconds();
+    for (size_t s = 0; s < sizeof(suites) / sizeof(suites[0]); s++) {
+        /* Hybrid mode needs room for an X25519 key next to the key handle: DHE only. */
+        for (int hybrid = 0; hybrid <= (suites[s].group == NULL); hybrid++) {
+            for (size_t b = 0; b < sizeof(bio_sizes) / sizeof(bio_sizes[0]); b++) {
+                run_variation(&suites[s], hybrid, bio_sizes[b], &nr_handshakes, &nr_failures);
+            }
+        }
+    }
+    run_resumption(&nr_handshakes, &nr_failures);
+    double seconds = QKD_monotonic_seconds() - start;
+    printf("%d handshakes, %d failed, %.2f ms per handshake\n", nr_handshakes, nr_failures,
+           nr_handshakes ? seconds * 1e3 / nr_handshakes : 0.0);
+
+    SSL_CTX_free(server_ctx);
+    SSL_CTX_free(client_ctx);
+    return nr_failures == 0 ? 0 : 1;
+}
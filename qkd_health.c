@@ -0,0 +1,439 @@
+/**
+ * qkd_health.c
+ *
+ * Continuous health tests on delivered key material (see qkd_health.h).
+ *
+ * Each window is counted in a single pass: the number of ones, and the number of transitions (bit
+ * i differs from bit i + 1), which gives the number of runs. The repetition count test needs the
+ * runs that cross word and window boundaries, so it works word by word on the longest run of equal
+ * bits, using shifts instead of a loop over the bits.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#include "qkd_health.h"
+#include "qkd_debug.h"
+#include "qkd_util.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_AVX2 1
+#endif
+
+#define WINDOW_WORDS (QKD_HEALTH_WINDOW_BITS / 64)
+#define WINDOW_BYTES (QKD_HEALTH_WINDOW_BITS / 8)
+#define METRICS_INTERVAL 1.0    /* Seconds between writes of the metrics file */
+
+typedef void (*count_window_t)(const uint64_t *words, unsigned *ones, unsigned *transitions);
+
+typedef struct health_config_st {
+    QKD_health_policy_t policy;
+    double max_statistic;               /* erfc(max_statistic) = alpha (monobit and runs) */
+    uint64_t repetition_cutoff;         /* Runs of this many equal bits fail */
+    unsigned proportion_cutoff;         /* This many bits equal to the first bit of a window fail */
+    const char *metrics_file;
+    count_window_t count_window;
+} health_config_t;
+
+typedef struct health_state_st {
+    pthread_mutex_t mutex;
+    uint64_t window[WINDOW_WORDS + 1];  /* The last word is always zero (padding) */
+    size_t window_size;                 /* Bytes in the window so far */
+    unsigned run_bit;                   /* Value and length of the run at the end of the stream */
+    uint64_t run_length;
+    QKD_health_stats_t stats;
+    double last_metrics_time;
+} health_state_t;
+
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+static health_config_t config;
+static health_state_t state = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static const char *test_names[QKD_HEALTH_NR_TESTS] = {
+    "monobit",
+    "runs",
+    "repetition_count",
+    "adaptive_proportion"
+};
+
+/**
+ * Return a human readable name for a test.
+ */
+const char *QKD_health_test_str(QKD_health_test_t test)
+{
+    return test < QKD_HEALTH_NR_TESTS ? test_names[test] : "unknown";
+}
+
+/**
+ * Count the ones and the transitions in a window (portable version).
+ */
+static void count_window_portable(const uint64_t *words, unsigned *ones, unsigned *transitions)
+{
+    unsigned nr_ones = 0;
+    unsigned nr_transitions = 0;
+    for (int i = 0; i < WINDOW_WORDS; i++) {
+        uint64_t next_bits = (words[i] >> 1) | (words[i + 1] << 63);
+        nr_ones += __builtin_popcountll(words[i]);
+        nr_transitions += __builtin_popcountll(words[i] ^ next_bits);
+    }
+    /* The last bit was compared with the padding. */
+    *ones = nr_ones;
+    *transitions = nr_transitions - (unsigned) (words[WINDOW_WORDS - 1] >> 63);
+}
+
+#ifdef HAVE_AVX2
+/**
+ * Count the bits set in each byte (nibble lookup table).
+ */
+__attribute__((target("avx2")))
+static inline __m256i popcount_bytes(__m256i v)
+{
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    __m256i low = _mm256_and_si256(v, low_mask);
+    __m256i high = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+    return _mm256_add_epi8(_mm256_shuffle_epi8(lookup, low), _mm256_shuffle_epi8(lookup, high));
+}
+
+__attribute__((target("avx2")))
+static inline unsigned horizontal_sum(__m256i byte_counts)
+{
+    __m256i sums = _mm256_sad_epu8(byte_counts, _mm256_setzero_si256());
+    __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+    return (unsigned) (_mm_cvtsi128_si64(sum) + _mm_extract_epi64(sum, 1));
+}
+
+/**
+ * AVX2 version of count_window_portable, with the same results.
+ */
+__attribute__((target("avx2")))
+static void count_window_avx2(const uint64_t *words, unsigned *ones, unsigned *transitions)
+{
+    /* Byte counts stay below 256: at most 8 per vector, WINDOW_WORDS / 4 vectors. */
+    __m256i one_counts = _mm256_setzero_si256();
+    __m256i transition_counts = _mm256_setzero_si256();
+    for (int i = 0; i < WINDOW_WORDS; i += 4) {
+        __m256i bits = _mm256_loadu_si256((const __m256i *) (words + i));
+        __m256i next_words = _mm256_loadu_si256((const __m256i *) (words + i + 1));
+        __m256i next_bits = _mm256_or_si256(_mm256_srli_epi64(bits, 1),
+                                            _mm256_slli_epi64(next_words, 63));
+        one_counts = _mm256_add_epi8(one_counts, popcount_bytes(bits));
+        transition_counts = _mm256_add_epi8(transition_counts,
+                                            popcount_bytes(_mm256_xor_si256(bits, next_bits)));
+    }
+    *ones = horizontal_sum(one_counts);
+    *transitions = horizontal_sum(transition_counts) - (unsigned) (words[WINDOW_WORDS - 1] >> 63);
+    /* Without optimization the compiler does not do this itself, and SSE code after it (e.g. log
+     * in the link emulator) would run several times slower. */
+    _mm256_zeroupper();
+}
+#endif
+
+/**
+ * The x for which erfc(x) = p (bisection; erfc is decreasing).
+ */
+static double inverse_erfc(double p)
+{
+    double low = 0.0;
+    double high = 10.0;
+    for (int i = 0; i < 100; i++) {
+        double middle = (low + high) / 2.0;
+        if (erfc(middle) > p) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return high;
+}
+
+/**
+ * The adaptive proportion cutoff for binary samples with full entropy: 1 + CRITBINOM(W, 1/2,
+ * 1 - alpha), that is one more than the smallest k with P(X <= k) >= 1 - alpha for X ~ B(W, 1/2).
+ */
+static unsigned proportion_cutoff(double alpha)
+{
+    const unsigned w = QKD_HEALTH_WINDOW_BITS;
+    double tail = 0.0;
+    for (unsigned k = w; k > 0; k--) {
+        /* tail is P(X > k) before adding P(X = k) */
+        double log_p = lgamma(w + 1.0) - lgamma(k + 1.0) - lgamma(w - k + 1.0) - w * log(2.0);
+        if (tail + exp(log_p) > alpha) {
+            return k + 1;
+        }
+        tail += exp(log_p);
+    }
+    return 1;
+}
+
+/**
+ * Read the configuration from the environment, compute the cutoffs, and choose the implementation
+ * of the window count: AVX2 if the CPU supports it, unless QKD_HEALTH_SIMD is set to 0.
+ */
+static void configure(void)
+{
+    config.policy = QKD_HEALTH_POLICY_LOG;
+    const char *policy = getenv("QKD_HEALTH_POLICY");
+    if (policy != NULL) {
+        if (strcasecmp(policy, "off") == 0) {
+            config.policy = QKD_HEALTH_POLICY_OFF;
+        } else if (strcasecmp(policy, "stop") == 0) {
+            config.policy = QKD_HEALTH_POLICY_STOP;
+        } else if (strcasecmp(policy, "log") != 0) {
+            QKD_error("Invalid QKD_HEALTH_POLICY %s (using log)", policy);
+        }
+    }
+    int alpha_log2 = QKD_HEALTH_DEFAULT_ALPHA_LOG2;
+    const char *alpha_str = getenv("QKD_HEALTH_ALPHA_LOG2");
+    if (alpha_str != NULL) {
+        alpha_log2 = atoi(alpha_str);
+        if (alpha_log2 < 10 || alpha_log2 > 60) {
+            QKD_error("Invalid QKD_HEALTH_ALPHA_LOG2 %s", alpha_str);
+            alpha_log2 = QKD_HEALTH_DEFAULT_ALPHA_LOG2;
+        }
+    }
+    double alpha = ldexp(1.0, -alpha_log2);
+    config.max_statistic = inverse_erfc(alpha);
+    /* SP 800-90B bounds the false positive rate per bit; a run can start anywhere in a window. */
+    config.repetition_cutoff = 1 + alpha_log2 + __builtin_ctz(QKD_HEALTH_WINDOW_BITS);
+    config.proportion_cutoff = proportion_cutoff(alpha);
+    config.metrics_file = getenv("QKD_HEALTH_METRICS_FILE");
+    config.count_window = count_window_portable;
+#ifdef HAVE_AVX2
+    const char *simd = getenv("QKD_HEALTH_SIMD");
+    if ((simd == NULL || strcmp(simd, "0") != 0) && __builtin_cpu_supports("avx2")) {
+        config.count_window = count_window_avx2;
+    }
+#endif
+    state.stats.policy = config.policy;
+}
+
+/**
+ * Is the SIMD (AVX2) implementation of the window count used?
+ */
+bool QKD_health_simd_enabled(void)
+{
+    pthread_once(&config_once, configure);
+    return config.count_window != count_window_portable;
+}
+
+/**
+ * Does x have a run of at least n consecutive ones (n >= 1)? Each step doubles the length of the
+ * runs that the remaining ones stand for.
+ */
+static bool has_run_of_ones(uint64_t x, uint64_t n)
+{
+    uint64_t length = 1;
+    while (x != 0 && length < n) {
+        uint64_t shift = length < n - length ? length : n - length;
+        if (shift >= 64) {
+            return false;
+        }
+        x &= x >> shift;
+        length += shift;
+    }
+    return x != 0;
+}
+
+/**
+ * Repetition count test over the words of a window, continuing the run at the end of the stream.
+ *
+ * Returns true if the test passes, false if there is a run of repetition_cutoff equal bits.
+ */
+static bool repetition_count_test(const uint64_t *words)
+{
+    bool passed = true;
+    for (int i = 0; i < WINDOW_WORDS; i++) {
+        uint64_t word = words[i];
+        uint64_t same = state.run_bit ? ~0ULL : 0;
+        if (word == same) {
+            state.run_length += 64;
+        } else {
+            state.run_length += __builtin_ctzll(word ^ same);
+            if (state.run_length >= config.repetition_cutoff) {
+                passed = false;
+            }
+            /* Bit j of equal is set if bits j and j + 1 of the word are equal. */
+            uint64_t equal = ~(word ^ (word >> 1)) & (~0ULL >> 1);
+            if (has_run_of_ones(equal, config.repetition_cutoff - 1)) {
+                passed = false;
+            }
+            state.run_bit = word >> 63;
+            state.run_length = __builtin_clzll(state.run_bit ? ~word : word);
+        }
+        if (state.run_length >= config.repetition_cutoff) {
+            passed = false;
+        }
+    }
+    if (!passed) {
+        state.run_length = 0;
+    }
+    return passed;
+}
+
+static void write_metrics(FILE *file, const QKD_health_stats_t *stats);
+
+/**
+ * Write the metrics file. Called with the mutex held.
+ */
+static void write_metrics_file(void)
+{
+    char tmp_name[4096];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", config.metrics_file);
+    FILE *file = fopen(tmp_name, "w");
+    if (file == NULL) {
+        QKD_error_with_errno("Could not open %s", tmp_name);
+        return;
+    }
+    write_metrics(file, &state.stats);
+    if (fclose(file) != 0 || rename(tmp_name, config.metrics_file) != 0) {
+        QKD_error_with_errno("Could not write %s", config.metrics_file);
+    }
+}
+
+/**
+ * Run all tests on the current window. Called with the mutex held.
+ */
+static void test_window(void)
+{
+    const uint64_t *words = state.window;
+    const double n = QKD_HEALTH_WINDOW_BITS;
+    unsigned ones, transitions;
+    config.count_window(words, &ones, &transitions);
+
+    bool failed[QKD_HEALTH_NR_TESTS] = {false};
+    failed[QKD_HEALTH_TEST_MONOBIT] = fabs(2.0 * ones - n) / sqrt(2.0 * n) > config.max_statistic;
+    double pi = ones / n;
+    if (fabs(pi - 0.5) < 2.0 / sqrt(n)) {
+        /* Without this prerequisite the runs test does not apply; the monobit test covers it. */
+        double runs = transitions + 1.0;
+        double expected = 2.0 * n * pi * (1.0 - pi);
+        failed[QKD_HEALTH_TEST_RUNS] = fabs(runs - expected) / (2.0 * sqrt(2.0 * n) * pi *
+                                       (1.0 - pi)) > config.max_statistic;
+    }
+    failed[QKD_HEALTH_TEST_REPETITION_COUNT] = !repetition_count_test(words);
+    unsigned first_bit_count = (words[0] & 1) ? ones : QKD_HEALTH_WINDOW_BITS - ones;
+    failed[QKD_HEALTH_TEST_ADAPTIVE_PROPORTION] = first_bit_count >= config.proportion_cutoff;
+
+    state.stats.nr_windows++;
+    state.stats.nr_bits += QKD_HEALTH_WINDOW_BITS;
+    bool any_failed = false;
+    for (int test = 0; test < QKD_HEALTH_NR_TESTS; test++) {
+        if (failed[test]) {
+            state.stats.nr_failures[test]++;
+            any_failed = true;
+            QKD_error("Key health test %s failed (window %llu, %u ones, %u transitions)",
+                      test_names[test], (unsigned long long) state.stats.nr_windows, ones,
+                      transitions);
+        }
+    }
+    if (any_failed && config.policy == QKD_HEALTH_POLICY_STOP && !state.stats.stopped) {
+        QKD_error("Key source failed health tests: no longer serving keys");
+        __atomic_store_n(&state.stats.stopped, true, __ATOMIC_RELEASE);
+    }
+    if (any_failed && config.metrics_file != NULL) {
+        write_metrics_file();
+        state.last_metrics_time = QKD_monotonic_seconds();
+    }
+}
+
+/**
+ * Feed key material that was delivered by the key source into the health tests. Bits are taken
+ * from each byte least significant bit first. Bytes that do not fill a window yet are kept for the
+ * next call.
+ */
+void QKD_health_feed(const void *key, size_t size)
+{
+    pthread_once(&config_once, configure);
+    if (config.policy == QKD_HEALTH_POLICY_OFF) {
+        return;
+    }
+    const unsigned char *bytes = key;
+    pthread_mutex_lock(&state.mutex);
+    while (size > 0) {
+        size_t piece = WINDOW_BYTES - state.window_size;
+        if (piece > size) {
+            piece = size;
+        }
+        memcpy((unsigned char *) state.window + state.window_size, bytes, piece);
+        state.window_size += piece;
+        bytes += piece;
+        size -= piece;
+        if (state.window_size == WINDOW_BYTES) {
+            test_window();
+            state.window_size = 0;
+        }
+    }
+    if (config.metrics_file != NULL) {
+        double now = QKD_monotonic_seconds();
+        if (now - state.last_metrics_time >= METRICS_INTERVAL) {
+            write_metrics_file();
+            state.last_metrics_time = now;
+        }
+    }
+    pthread_mutex_unlock(&state.mutex);
+}
+
+/**
+ * May keys be served? False once a health test has failed with policy stop.
+ */
+bool QKD_health_serving(void)
+{
+    return !__atomic_load_n(&state.stats.stopped, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Get the counters of the health tests.
+ */
+void QKD_health_get_stats(QKD_health_stats_t *stats)
+{
+    pthread_once(&config_once, configure);
+    pthread_mutex_lock(&state.mutex);
+    *stats = state.stats;
+    pthread_mutex_unlock(&state.mutex);
+}
+
+/**
+ * Write the given counters in the Prometheus text format.
+ */
+static void write_metrics(FILE *file, const QKD_health_stats_t *stats)
+{
+    fprintf(file,
+            "# HELP qkd_health_bits_total Key bits tested by the health tests.\n"
+            "# TYPE qkd_health_bits_total counter\n"
+            "qkd_health_bits_total %llu\n"
+            "# HELP qkd_health_windows_total Windows of %d bits tested.\n"
+            "# TYPE qkd_health_windows_total counter\n"
+            "qkd_health_windows_total %llu\n"
+            "# HELP qkd_health_failures_total Windows that failed a health test.\n"
+            "# TYPE qkd_health_failures_total counter\n",
+            (unsigned long long) stats->nr_bits, QKD_HEALTH_WINDOW_BITS,
+            (unsigned long long) stats->nr_windows);
+    for (int test = 0; test < QKD_HEALTH_NR_TESTS; test++) {
+        fprintf(file, "qkd_health_failures_total{test=\"%s\"} %llu\n", test_names[test],
+                (unsigned long long) stats->nr_failures[test]);
+    }
+    fprintf(file,
+            "# HELP qkd_health_serving Whether keys are served (0 after a failure with policy "
+            "stop).\n"
+            "# TYPE qkd_health_serving gauge\n"
+            "qkd_health_serving %d\n",
+            stats->stopped ? 0 : 1);
+}
+
+/**
+ * Write the counters of the health tests in the Prometheus text format.
+ */
+void QKD_health_write_metrics(FILE *file)
+{
+    QKD_health_stats_t stats;
+    QKD_health_get_stats(&stats);
+    write_metrics(file, &stats);
+}
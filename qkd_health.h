@@ -0,0 +1,73 @@
+/**
+ * qkd_health.h
+ *
+ * Continuous health tests on the key material that a QKD API implementation delivers, in the
+ * style of the health tests of NIST SP 800-90B (section 4.4) and the frequency and runs tests of
+ * NIST SP 800-22. The key stream is treated as a stream of bits that should be full entropy, and is
+ * tested in windows of QKD_HEALTH_WINDOW_BITS bits:
+ *
+ *   monobit                The number of ones in a window (SP 800-22 frequency test)
+ *   runs                   The number of runs of identical bits in a window (SP 800-22 runs test)
+ *   repetition count       No run of identical bits in the stream is longer than the cutoff
+ *                          (SP 800-90B repetition count test, across windows)
+ *   adaptive proportion    The first bit of a window does not occur too often in the window
+ *                          (SP 800-90B adaptive proportion test, with W = 1024)
+ *
+ * The false positive rate of each test is 2^-QKD_HEALTH_ALPHA_LOG2 per window (environment
+ * variable QKD_HEALTH_ALPHA_LOG2, default 30). The bits of a window are counted with a vectorized
+ * popcount (AVX2 when the CPU supports it, unless environment variable QKD_HEALTH_SIMD is 0).
+ *
+ * What happens when a test fails is set by environment variable QKD_HEALTH_POLICY: "off" (do not
+ * test), "log" (count and log the failure; the default), or "stop" (also stop serving keys until the
+ * process is restarted: QKD_health_serving returns false). If environment variable
+ * QKD_HEALTH_METRICS_FILE is set, the counters are written to that file in the Prometheus text
+ * format, at most once per second and after every failure.
+ *
+ * There is a single key stream per process: the key that the QKD API implementation in the process
+ * receives from its key source.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#ifndef QKD_HEALTH_H
+#define QKD_HEALTH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define QKD_HEALTH_WINDOW_BITS 1024
+#define QKD_HEALTH_DEFAULT_ALPHA_LOG2 30
+
+typedef enum {
+    QKD_HEALTH_TEST_MONOBIT = 0,
+    QKD_HEALTH_TEST_RUNS,
+    QKD_HEALTH_TEST_REPETITION_COUNT,
+    QKD_HEALTH_TEST_ADAPTIVE_PROPORTION,
+    QKD_HEALTH_NR_TESTS
+} QKD_health_test_t;
+
+typedef enum {
+    QKD_HEALTH_POLICY_OFF = 0,
+    QKD_HEALTH_POLICY_LOG,
+    QKD_HEALTH_POLICY_STOP
+} QKD_health_policy_t;
+
+typedef struct QKD_health_stats_st {
+    QKD_health_policy_t policy;
+    uint64_t nr_bits;                   /* Bits tested */
+    uint64_t nr_windows;
+    uint64_t nr_failures[QKD_HEALTH_NR_TESTS];
+    bool stopped;                       /* Keys are no longer served (policy stop) */
+} QKD_health_stats_t;
+
+void QKD_health_feed(const void *key, size_t size);
+bool QKD_health_serving(void);
+void QKD_health_get_stats(QKD_health_stats_t *stats);
+void QKD_health_write_metrics(FILE *file);
+const char *QKD_health_test_str(QKD_health_test_t test);
+bool QKD_health_simd_enabled(void);
+
+#endif /* QKD_HEALTH_H */
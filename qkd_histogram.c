@@ -0,0 +1,181 @@
+/**
+ * qkd_histogram.c
+ *
+ * Log-linear latency histogram with bounded relative error, used by the measurement tools in this
+ * repository (see qkd_load_generator.c).
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#include "qkd_histogram.h"
+#include <assert.h>
+#include <string.h>
+
+/**
+ * Map a value to the index of the bucket that counts it.
+ *
+ * Values below 2 * QKD_HISTOGRAM_SUB_BUCKETS each have their own bucket. Larger values share a
+ * bucket with the other values that have the same QKD_HISTOGRAM_SUB_BITS + 1 most significant bits.
+ */
+static size_t bucket_index(uint64_t value)
+{
+    if (value < 2 * QKD_HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - QKD_HISTOGRAM_SUB_BITS;
+    size_t index = (shift + 1) * QKD_HISTOGRAM_SUB_BUCKETS +
+                   ((value >> shift) - QKD_HISTOGRAM_SUB_BUCKETS);
+    assert(index < QKD_HISTOGRAM_NR_BUCKETS);
+    return index;
+}
+
+/**
+ * Return the highest value that is counted in the bucket with the given index.
+ */
+static uint64_t bucket_upper_value(size_t index)
+{
+    if (index < 2 * QKD_HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+    int shift = index / QKD_HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t lower = (uint64_t) (index % QKD_HISTOGRAM_SUB_BUCKETS + QKD_HISTOGRAM_SUB_BUCKETS)
+                     << shift;
+    return lower + (((uint64_t) 1 << shift) - 1);
+}
+
+/**
+ * Initialize an empty histogram.
+ */
+void QKD_histogram_init(QKD_histogram_t *histogram)
+{
+    assert(histogram != NULL);
+    memset(histogram, 0, sizeof(*histogram));
+    histogram->min = UINT64_MAX;
+}
+
+/**
+ * Record one value in a histogram.
+ */
+void QKD_histogram_record(QKD_histogram_t *histogram, uint64_t value)
+{
+    assert(histogram != NULL);
+    histogram->counts[bucket_index(value)]++;
+    histogram->total++;
+    histogram->sum += value;
+    if (value < histogram->min) {
+        histogram->min = value;
+    }
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+/**
+ * Add all values recorded in one histogram to another histogram.
+ */
+void QKD_histogram_merge(QKD_histogram_t *into, const QKD_histogram_t *from)
+{
+    assert(into != NULL);
+    assert(from != NULL);
+    for (size_t i = 0; i < QKD_HISTOGRAM_NR_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    if (from->min < into->min) {
+        into->min = from->min;
+    }
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+/**
+ * Return the value below which the given percentage (0.0 - 100.0) of the recorded values fall.
+ * The returned value is the upper bound of the bucket that contains the percentile, capped at the
+ * maximum recorded value.
+ *
+ * Returns 0 if the histogram is empty.
+ */
+uint64_t QKD_histogram_percentile(const QKD_histogram_t *histogram, double percentile)
+{
+    assert(histogram != NULL);
+    if (histogram->total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t) (percentile / 100.0 * histogram->total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < QKD_HISTOGRAM_NR_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            uint64_t value = bucket_upper_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+/**
+ * Return the mean of the recorded values, or 0.0 if the histogram is empty.
+ */
+double QKD_histogram_mean(const QKD_histogram_t *histogram)
+{
+    assert(histogram != NULL);
+    if (histogram->total == 0) {
+        return 0.0;
+    }
+    return histogram->sum / histogram->total;
+}
+
+/**
+ * Print a one-line summary of a histogram: count, min, mean, common percentiles, and max.
+ */
+void QKD_histogram_print_summary(const QKD_histogram_t *histogram, FILE *file, const char *label,
+                                 const char *unit)
+{
+    assert(histogram != NULL);
+    if (histogram->total == 0) {
+        fprintf(file, "%-20s n=0\n", label);
+        return;
+    }
+    fprintf(file,
+            "%-20s n=%llu min=%llu mean=%.1f p50=%llu p90=%llu p99=%llu p99.9=%llu max=%llu (%s)\n",
+            label,
+            (unsigned long long) histogram->total,
+            (unsigned long long) histogram->min,
+            QKD_histogram_mean(histogram),
+            (unsigned long long) QKD_histogram_percentile(histogram, 50.0),
+            (unsigned long long) QKD_histogram_percentile(histogram, 90.0),
+            (unsigned long long) QKD_histogram_percentile(histogram, 99.0),
+            (unsigned long long) QKD_histogram_percentile(histogram, 99.9),
+            (unsigned long long) histogram->max,
+            unit);
+}
+
+/**
+ * Print the full distribution of a histogram: one line per non-empty bucket with the upper bound
+ * of the bucket, the count in the bucket, and the cumulative percentage.
+ */
+void QKD_histogram_print_distribution(const QKD_histogram_t *histogram, FILE *file,
+                                      const char *label, const char *unit)
+{
+    assert(histogram != NULL);
+    fprintf(file, "%s distribution (%s):\n", label, unit);
+    fprintf(file, "  %12s %12s %10s\n", "value<=", "count", "cumul%");
+    uint64_t seen = 0;
+    for (size_t i = 0; i < QKD_HISTOGRAM_NR_BUCKETS; i++) {
+        if (histogram->counts[i] == 0) {
+            continue;
+        }
+        seen += histogram->counts[i];
+        fprintf(file, "  %12llu %12llu %9.3f%%\n",
+                (unsigned long long) bucket_upper_value(i),
+                (unsigned long long) histogram->counts[i],
+                100.0 * seen / histogram->total);
+    }
+}
@@ -0,0 +1,41 @@
+/**
+ * qkd_histogram.h
+ *
+ * Log-linear latency histogram with bounded relative error, used by the measurement tools in this
+ * repository (see qkd_load_generator.c).
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#ifndef QKD_HISTOGRAM_H
+#define QKD_HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Every power of two is split into 2^QKD_HISTOGRAM_SUB_BITS linear sub-buckets, which bounds the
+ * relative error of a recorded value to 1 / 2^QKD_HISTOGRAM_SUB_BITS (about 1.6%). */
+#define QKD_HISTOGRAM_SUB_BITS 6
+#define QKD_HISTOGRAM_SUB_BUCKETS (1 << QKD_HISTOGRAM_SUB_BITS)
+#define QKD_HISTOGRAM_NR_BUCKETS ((64 - QKD_HISTOGRAM_SUB_BITS + 1) * QKD_HISTOGRAM_SUB_BUCKETS)
+
+typedef struct QKD_histogram_st {
+    uint64_t counts[QKD_HISTOGRAM_NR_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+} QKD_histogram_t;
+
+void QKD_histogram_init(QKD_histogram_t *histogram);
+void QKD_histogram_record(QKD_histogram_t *histogram, uint64_t value);
+void QKD_histogram_merge(QKD_histogram_t *into, const QKD_histogram_t *from);
+uint64_t QKD_histogram_percentile(const QKD_histogram_t *histogram, double percentile);
+double QKD_histogram_mean(const QKD_histogram_t *histogram);
+void QKD_histogram_print_summary(const QKD_histogram_t *histogram, FILE *file, const char *label,
+                                 const char *unit);
+void QKD_histogram_print_distribution(const QKD_histogram_t *histogram, FILE *file,
+                                      const char *label, const char *unit);
+
+#endif /* QKD_HISTOGRAM_H */
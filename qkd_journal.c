@@ -0,0 +1,764 @@
+/**
+ * qkd_journal.c
+ *
+ * Crash-safe journal of consumed keys (see qkd_journal.h).
+ *
+ * Segment file DIR/KIND-NUMBER.journal (NUMBER is 16 hex digits):
+ *   header: magic "QKDJRNL1" (8 bytes) | segment number (64 bits) | LSN of the first record (64
+ *           bits) | CRC-32C of the preceding 24 bytes (32 bits) | zero (32 bits)
+ *   records: LSN (64 bits) | digest of the key handle (16 bytes) | CRC-32C of the preceding 24
+ *            bytes (32 bits) | zero (32 bits)
+ * All integers are in network byte order. The log sequence numbers (LSNs) of the records are
+ * consecutive and start at 1. Replaying a segment stops at the first record that has a bad CRC or
+ * an unexpected LSN: that is where the last sync before a crash ended (or the zero fill).
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#include "qkd_journal.h"
+#include "qkd_debug.h"
+#include "qkd_util.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
+#define JOURNAL_MAGIC "QKDJRNL1"
+#define RECORD_SIZE 32              /* The header has the same size as a record */
+#define DIGEST_SIZE 16
+#define ZERO_FILL_CHUNK (64 * 1024)
+#define INITIAL_SET_CAPACITY 1024
+
+typedef struct segment_st {
+    uint64_t number;
+    uint64_t first_lsn;
+} segment_t;
+
+/* An entry of the consumed set (open addressing, linear probing). lsn 0 marks an empty slot. */
+typedef struct consumed_st {
+    unsigned char digest[DIGEST_SIZE];
+    uint64_t lsn;
+} consumed_t;
+
+typedef struct journal_st {
+    pthread_mutex_t mutex;
+    pthread_cond_t synced;          /* Signalled when a sync ends */
+    bool enabled;
+    bool broken;                    /* A write or sync failed: nothing is durable any more */
+    bool syncing;                   /* A thread (the leader) is writing and syncing a batch */
+    char *dir;
+    char *kind;
+    int dir_fd;
+    size_t segment_bytes;
+    size_t max_segments;
+    segment_t *segments;            /* Oldest first; the last one is being written */
+    size_t nr_segments;
+    size_t segments_capacity;
+    int fd;                         /* The segment being written (leader only) */
+    size_t write_offset;
+    unsigned char *pending;         /* Records that are waiting for the next sync */
+    size_t nr_pending;
+    size_t pending_capacity;
+    unsigned char *batch;           /* Records that the leader is syncing (or a spare buffer) */
+    size_t batch_capacity;
+    uint64_t next_lsn;
+    uint64_t synced_lsn;            /* All records up to this LSN are durable */
+    consumed_t *consumed;
+    size_t consumed_capacity;       /* Power of 2 */
+    QKD_journal_stats_t stats;
+} journal_t;
+
+static journal_t journal = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .synced = PTHREAD_COND_INITIALIZER,
+    .dir_fd = -1,
+    .fd = -1
+};
+
+static uint32_t crc32c_table[256];
+
+static void crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+        }
+        crc32c_table[i] = crc;
+    }
+}
+
+static uint32_t crc32c(const unsigned char *data, size_t size)
+{
+    uint32_t crc = 0xffffffff;
+    for (size_t i = 0; i < size; i++) {
+        crc = (crc >> 8) ^ crc32c_table[(crc ^ data[i]) & 0xff];
+    }
+    return ~crc;
+}
+
+/**
+ * Fill in the CRC of a header or record (of which the first 24 bytes have been filled in).
+ */
+static void seal(unsigned char *record)
+{
+    QKD_put_uint32(record + 24, crc32c(record, 24));
+    QKD_put_uint32(record + 28, 0);
+}
+
+static bool sealed(const unsigned char *record)
+{
+    return QKD_get_uint32(record + 24) == crc32c(record, 24);
+}
+
+/**
+ * The digest of a key handle (truncated SHA-256).
+ */
+static bool key_handle_digest(const QKD_key_handle_t *key_handle, unsigned char *digest)
+{
+    unsigned char full_digest[EVP_MAX_MD_SIZE];
+    if (!EVP_Digest(key_handle->bytes, QKD_KEY_HANDLE_SIZE, full_digest, NULL, EVP_sha256(),
+                    NULL)) {
+        QKD_error("EVP_Digest failed");
+        return false;
+    }
+    memcpy(digest, full_digest, DIGEST_SIZE);
+    return true;
+}
+
+/**
+ * Find the slot of a digest in the consumed set: the slot that holds it, or the empty slot where
+ * it would go.
+ */
+static consumed_t *consumed_slot(consumed_t *set, size_t capacity, const unsigned char *digest)
+{
+    size_t mask = capacity - 1;
+    size_t index = QKD_get_uint64(digest) & mask;
+    while (set[index].lsn != 0 && memcmp(set[index].digest, digest, DIGEST_SIZE) != 0) {
+        index = (index + 1) & mask;
+    }
+    return &set[index];
+}
+
+/**
+ * Rebuild the consumed set with the given capacity, dropping the entries older than min_lsn.
+ */
+static bool rebuild_consumed(size_t capacity, uint64_t min_lsn)
+{
+    consumed_t *set = calloc(capacity, sizeof(*set));
+    if (set == NULL) {
+        QKD_error("calloc failed");
+        return false;
+    }
+    size_t nr_consumed = 0;
+    for (size_t i = 0; i < journal.consumed_capacity; i++) {
+        consumed_t *entry = &journal.consumed[i];
+        if (entry->lsn >= min_lsn && entry->lsn != 0) {
+            *consumed_slot(set, capacity, entry->digest) = *entry;
+            nr_consumed++;
+        }
+    }
+    free(journal.consumed);
+    journal.consumed = set;
+    journal.consumed_capacity = capacity;
+    journal.stats.nr_consumed = nr_consumed;
+    return true;
+}
+
+/**
+ * Add a digest to the consumed set (the set is kept at most half full).
+ */
+static bool add_consumed(const unsigned char *digest, uint64_t lsn)
+{
+    if (2 * (journal.stats.nr_consumed + 1) > journal.consumed_capacity &&
+        !rebuild_consumed(2 * journal.consumed_capacity, 1)) {
+        return false;
+    }
+    consumed_t *slot = consumed_slot(journal.consumed, journal.consumed_capacity, digest);
+    if (slot->lsn == 0) {
+        memcpy(slot->digest, digest, DIGEST_SIZE);
+        journal.stats.nr_consumed++;
+    }
+    slot->lsn = lsn;
+    return true;
+}
+
+static bool is_consumed(const unsigned char *digest)
+{
+    return consumed_slot(journal.consumed, journal.consumed_capacity, digest)->lsn != 0;
+}
+
+static char *segment_file_name(uint64_t number)
+{
+    size_t size = strlen(journal.dir) + strlen(journal.kind) + 32;
+    char *file_name = malloc(size);
+    if (file_name != NULL) {
+        snprintf(file_name, size, "%s/%s-%016" PRIx64 ".journal", journal.dir, journal.kind,
+                 number);
+    }
+    return file_name;
+}
+
+static int compare_numbers(const void *a, const void *b)
+{
+    uint64_t number_a = *(const uint64_t *) a;
+    uint64_t number_b = *(const uint64_t *) b;
+    return (number_a > number_b) - (number_a < number_b);
+}
+
+/**
+ * List the numbers of the segments of this kind in the journal directory, in ascending order.
+ *
+ * Returns the number of segments, or -1 on failure. The caller must free *numbers.
+ */
+static ssize_t list_segments(uint64_t **numbers)
+{
+    DIR *dir = opendir(journal.dir);
+    if (dir == NULL) {
+        QKD_error_with_errno("Cannot open journal directory %s", journal.dir);
+        return -1;
+    }
+    size_t kind_size = strlen(journal.kind);
+    size_t nr_numbers = 0;
+    size_t capacity = 16;
+    *numbers = malloc(capacity * sizeof(**numbers));
+    struct dirent *entry;
+    while (*numbers != NULL && (entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        char *end;
+        if (strncmp(name, journal.kind, kind_size) != 0 || name[kind_size] != '-' ||
+            strlen(name) != kind_size + 1 + 16 + strlen(".journal")) {
+            continue;
+        }
+        uint64_t number = strtoull(name + kind_size + 1, &end, 16);
+        if (strcmp(end, ".journal") != 0) {
+            continue;
+        }
+        if (nr_numbers == capacity) {
+            capacity *= 2;
+            uint64_t *more = realloc(*numbers, capacity * sizeof(**numbers));
+            if (more == NULL) {
+                free(*numbers);
+            }
+            *numbers = more;
+            if (more == NULL) {
+                break;
+            }
+        }
+        (*numbers)[nr_numbers++] = number;
+    }
+    closedir(dir);
+    if (*numbers == NULL) {
+        QKD_error("malloc failed");
+        return -1;
+    }
+    qsort(*numbers, nr_numbers, sizeof(**numbers), compare_numbers);
+    return nr_numbers;
+}
+
+/**
+ * Replay one segment into the consumed set.
+ *
+ * Returns the number of valid records, or -1 if the segment has no valid header (it was being
+ * created during a crash).
+ */
+static ssize_t replay_segment(uint64_t number, uint64_t *first_lsn, unsigned char *buffer)
+{
+    char *file_name = segment_file_name(number);
+    int fd = file_name ? open(file_name, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd == -1) {
+        QKD_error_with_errno("Cannot open journal segment %s", file_name ? file_name : "");
+        free(file_name);
+        return -1;
+    }
+    free(file_name);
+    ssize_t nr_records = -1;
+    uint64_t lsn = 0;
+    size_t offset = 0;
+    while (true) {
+        ssize_t nr_read = pread(fd, buffer, ZERO_FILL_CHUNK, offset);
+        if (nr_read < RECORD_SIZE) {
+            break;
+        }
+        size_t i = 0;
+        if (offset == 0) {
+            if (memcmp(buffer, JOURNAL_MAGIC, 8) != 0 || !sealed(buffer) ||
+                QKD_get_uint64(buffer + 8) != number) {
+                break;
+            }
+            lsn = *first_lsn = QKD_get_uint64(buffer + 16);
+            nr_records = 0;
+            i = RECORD_SIZE;
+        }
+        for (; i + RECORD_SIZE <= (size_t) nr_read; i += RECORD_SIZE) {
+            const unsigned char *record = buffer + i;
+            if (!sealed(record) || QKD_get_uint64(record) != lsn) {
+                close(fd);
+                return nr_records;
+            }
+            if (!add_consumed(record + 8, lsn)) {
+                close(fd);
+                return -1;
+            }
+            lsn++;
+            nr_records++;
+        }
+        offset += nr_read;
+    }
+    close(fd);
+    return nr_records;
+}
+
+/**
+ * Sync the journal directory, so that a created or deleted segment file stays created or deleted.
+ */
+static bool sync_dir(void)
+{
+    if (fsync(journal.dir_fd) != 0) {
+        QKD_error_with_errno("fsync of journal directory %s failed", journal.dir);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Create a segment, zero-filled to its full size and with its header synced, and make it the
+ * segment that is being written. Called by the leader (or by init).
+ */
+static bool create_segment(uint64_t number, uint64_t first_lsn)
+{
+    QKD_enter();
+    char *file_name = segment_file_name(number);
+    unsigned char *zeros = calloc(1, ZERO_FILL_CHUNK);
+    int fd = file_name && zeros ? open(file_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600) :
+                                  -1;
+    bool ok = fd != -1;
+    for (size_t offset = 0; ok && offset < journal.segment_bytes; offset += ZERO_FILL_CHUNK) {
+        size_t size = journal.segment_bytes - offset;
+        size = size < ZERO_FILL_CHUNK ? size : ZERO_FILL_CHUNK;
+        ok = pwrite(fd, zeros, size, offset) == (ssize_t) size;
+    }
+    unsigned char header[RECORD_SIZE];
+    memcpy(header, JOURNAL_MAGIC, 8);
+    QKD_put_uint64(header + 8, number);
+    QKD_put_uint64(header + 16, first_lsn);
+    seal(header);
+    ok = ok && pwrite(fd, header, RECORD_SIZE, 0) == RECORD_SIZE && fdatasync(fd) == 0 &&
+         sync_dir();
+    if (!ok) {
+        QKD_error_with_errno("Cannot create journal segment %s", file_name ? file_name : "");
+        if (fd != -1) {
+            close(fd);
+        }
+        free(file_name);
+        free(zeros);
+        QKD_return_error("%d", false);
+    }
+    free(file_name);
+    free(zeros);
+    if (journal.fd != -1) {
+        close(journal.fd);
+    }
+    journal.fd = fd;
+    journal.write_offset = RECORD_SIZE;
+    pthread_mutex_lock(&journal.mutex);
+    if (journal.nr_segments == journal.segments_capacity) {
+        /* A batch can fill more than one segment before the old ones are pruned. */
+        size_t capacity = 2 * journal.segments_capacity;
+        segment_t *segments = realloc(journal.segments, capacity * sizeof(*segments));
+        if (segments == NULL) {
+            pthread_mutex_unlock(&journal.mutex);
+            QKD_error("realloc failed");
+            QKD_return_error("%d", false);
+        }
+        journal.segments = segments;
+        journal.segments_capacity = capacity;
+    }
+    journal.segments[journal.nr_segments].number = number;
+    journal.segments[journal.nr_segments].first_lsn = first_lsn;
+    journal.nr_segments++;
+    journal.stats.nr_segments = journal.nr_segments;
+    pthread_mutex_unlock(&journal.mutex);
+    QKD_debug("Created journal segment %016" PRIx64 " at LSN %" PRIu64, number, first_lsn);
+    QKD_return_success("%d", true);
+}
+
+/**
+ * Delete the oldest segments beyond max_segments, and forget their records. Called with the mutex
+ * held.
+ */
+static void prune_segments(void)
+{
+    if (journal.nr_segments <= journal.max_segments) {
+        return;
+    }
+    size_t nr_pruned = journal.nr_segments - journal.max_segments;
+    for (size_t i = 0; i < nr_pruned; i++) {
+        char *file_name = segment_file_name(journal.segments[i].number);
+        if (file_name == NULL || unlink(file_name) != 0) {
+            QKD_error_with_errno("Cannot delete journal segment %s", file_name ? file_name : "");
+        }
+        free(file_name);
+    }
+    memmove(journal.segments, journal.segments + nr_pruned,
+            journal.max_segments * sizeof(*journal.segments));
+    journal.nr_segments = journal.max_segments;
+    journal.stats.nr_segments = journal.nr_segments;
+    rebuild_consumed(journal.consumed_capacity, journal.segments[0].first_lsn);
+    sync_dir();
+}
+
+/**
+ * Write a batch of records to the segments, starting new segments as they fill up, and sync it.
+ * Called by the leader, without the mutex.
+ */
+static bool write_batch(const unsigned char *records, size_t nr_records)
+{
+    size_t segment_end = journal.segment_bytes - journal.segment_bytes % RECORD_SIZE;
+    while (nr_records > 0) {
+        if (journal.write_offset == segment_end) {
+            uint64_t next_number = journal.segments[journal.nr_segments - 1].number + 1;
+            if (fdatasync(journal.fd) != 0 ||
+                !create_segment(next_number, QKD_get_uint64(records))) {
+                QKD_error_with_errno("Cannot start a new journal segment");
+                return false;
+            }
+        }
+        size_t nr_fit = (segment_end - journal.write_offset) / RECORD_SIZE;
+        size_t nr_write = nr_records < nr_fit ? nr_records : nr_fit;
+        size_t size = nr_write * RECORD_SIZE;
+        if (pwrite(journal.fd, records, size, journal.write_offset) != (ssize_t) size) {
+            QKD_error_with_errno("Writing journal failed");
+            return false;
+        }
+        journal.write_offset += size;
+        records += size;
+        nr_records -= nr_write;
+    }
+    if (fdatasync(journal.fd) != 0) {
+        QKD_error_with_errno("Syncing journal failed");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Wait until the record with the given LSN is durable. Called with the mutex held.
+ *
+ * If no sync is in progress, this thread becomes the leader: it takes all pending records (its own
+ * and those of other threads), and writes and syncs them without the mutex. Records that are
+ * appended meanwhile wait for the next sync. This is the group commit: under load, each sync
+ * covers the records of many handshakes.
+ */
+static bool wait_synced(uint64_t lsn)
+{
+    while (journal.synced_lsn < lsn && !journal.broken) {
+        if (journal.syncing) {
+            pthread_cond_wait(&journal.synced, &journal.mutex);
+            continue;
+        }
+        journal.syncing = true;
+        unsigned char *records = journal.pending;
+        size_t nr_records = journal.nr_pending;
+        size_t capacity = journal.pending_capacity;
+        uint64_t last_lsn = journal.next_lsn - 1;
+        journal.pending = journal.batch;
+        journal.pending_capacity = journal.batch_capacity;
+        journal.nr_pending = 0;
+        pthread_mutex_unlock(&journal.mutex);
+        bool ok = write_batch(records, nr_records);
+        pthread_mutex_lock(&journal.mutex);
+        journal.batch = records;
+        journal.batch_capacity = capacity;
+        journal.syncing = false;
+        if (ok) {
+            journal.synced_lsn = last_lsn;
+            journal.stats.nr_commits++;
+            prune_segments();
+        } else {
+            journal.broken = true;
+        }
+        pthread_cond_broadcast(&journal.synced);
+    }
+    return !journal.broken;
+}
+
+/**
+ * Append a record for a consumed key to the pending records. Called with the mutex held.
+ *
+ * Returns the LSN of the record, or 0 on failure.
+ */
+static uint64_t append_record(const unsigned char *digest)
+{
+    if (journal.nr_pending == journal.pending_capacity) {
+        size_t capacity = journal.pending_capacity ? 2 * journal.pending_capacity : 64;
+        unsigned char *pending = realloc(journal.pending, capacity * RECORD_SIZE);
+        if (pending == NULL) {
+            QKD_error("realloc failed");
+            return 0;
+        }
+        journal.pending = pending;
+        journal.pending_capacity = capacity;
+    }
+    uint64_t lsn = journal.next_lsn;
+    if (!add_consumed(digest, lsn)) {
+        return 0;
+    }
+    unsigned char *record = journal.pending + journal.nr_pending * RECORD_SIZE;
+    QKD_put_uint64(record, lsn);
+    memcpy(record + 8, digest, DIGEST_SIZE);
+    seal(record);
+    journal.nr_pending++;
+    journal.next_lsn++;
+    journal.stats.nr_records++;
+    return lsn;
+}
+
+/**
+ * Open the journal of the given kind (for example "mock-server"), if QKD_JOURNAL_DIR is set, and
+ * replay it to rebuild the set of consumed keys. New records are appended to the newest segment.
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_journal_init(const char *kind)
+{
+    QKD_enter();
+    QKD_journal_finish();
+    const char *dir = getenv("QKD_JOURNAL_DIR");
+    if (dir == NULL) {
+        QKD_return_success_qkd();
+    }
+    crc32c_init();
+    memset(&journal.stats, 0, sizeof(journal.stats));
+    journal.segment_bytes = QKD_env_size("QKD_JOURNAL_SEGMENT_BYTES",
+                                         QKD_JOURNAL_DEFAULT_SEGMENT_BYTES, 2 * RECORD_SIZE);
+    journal.max_segments = QKD_env_size("QKD_JOURNAL_MAX_SEGMENTS",
+                                        QKD_JOURNAL_DEFAULT_MAX_SEGMENTS, 1);
+    journal.dir = strdup(dir);
+    journal.kind = strdup(kind);
+    journal.segments_capacity = journal.max_segments + 1;
+    journal.segments = malloc(journal.segments_capacity * sizeof(*journal.segments));
+    journal.consumed = calloc(INITIAL_SET_CAPACITY, sizeof(*journal.consumed));
+    journal.consumed_capacity = INITIAL_SET_CAPACITY;
+    unsigned char *buffer = malloc(ZERO_FILL_CHUNK);
+    if (journal.dir == NULL || journal.kind == NULL || journal.segments == NULL ||
+        journal.consumed == NULL || buffer == NULL) {
+        free(buffer);
+        QKD_journal_finish();
+        QKD_error("malloc failed");
+        QKD_return_error_qkd(QKD_RESULT_OUT_OF_MEMORY);
+    }
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        QKD_error_with_errno("Cannot create journal directory %s", dir);
+    }
+    journal.dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    uint64_t *numbers = NULL;
+    ssize_t nr_numbers = journal.dir_fd == -1 ? -1 : list_segments(&numbers);
+    if (nr_numbers < 0) {
+        free(buffer);
+        QKD_journal_finish();
+        QKD_error_with_errno("Cannot open journal directory %s", dir);
+        QKD_return_error_qkd(QKD_RESULT_JOURNAL_FAILED);
+    }
+
+    /* Replay the segments; only the newest max_segments are kept. */
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ssize_t first = nr_numbers > (ssize_t) journal.max_segments ?
+                    nr_numbers - (ssize_t) journal.max_segments : 0;
+    ssize_t nr_records = -1;
+    journal.next_lsn = 1;
+    for (ssize_t i = 0; i < nr_numbers; i++) {
+        uint64_t first_lsn = 0;
+        nr_records = i < first ? -1 : replay_segment(numbers[i], &first_lsn, buffer);
+        if (nr_records < 0) {
+            char *file_name = segment_file_name(numbers[i]);
+            if (file_name) {
+                unlink(file_name);
+            }
+            free(file_name);
+            continue;
+        }
+        journal.segments[journal.nr_segments].number = numbers[i];
+        journal.segments[journal.nr_segments].first_lsn = first_lsn;
+        journal.nr_segments++;
+        journal.stats.nr_replayed += nr_records;
+        journal.next_lsn = first_lsn + nr_records;
+    }
+    free(buffer);
+    journal.synced_lsn = journal.next_lsn - 1;
+    journal.stats.nr_segments = journal.nr_segments;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    QKD_debug("Replayed %" PRIu64 " journal records from %zu segments in %.3f ms",
+              journal.stats.nr_replayed, journal.nr_segments,
+              (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+
+    /* Continue in the newest segment (overwriting a torn record, if any), or start a new one. */
+    bool ok;
+    if (journal.nr_segments > 0 && nr_records >= 0) {
+        char *file_name = segment_file_name(journal.segments[journal.nr_segments - 1].number);
+        journal.fd = file_name ? open(file_name, O_WRONLY | O_CLOEXEC) : -1;
+        free(file_name);
+        journal.write_offset = (journal.next_lsn - journal.segments[journal.nr_segments - 1].
+                                first_lsn + 1) * RECORD_SIZE;
+        ok = journal.fd != -1;
+    } else {
+        uint64_t number = nr_numbers > 0 ? numbers[nr_numbers - 1] + 1 : 0;
+        ok = create_segment(number, journal.next_lsn);
+    }
+    free(numbers);
+    if (!ok) {
+        QKD_journal_finish();
+        QKD_error_with_errno("Cannot open journal for writing");
+        QKD_return_error_qkd(QKD_RESULT_JOURNAL_FAILED);
+    }
+    journal.enabled = true;
+    QKD_return_success_qkd();
+}
+
+/**
+ * Close the journal. Every record has been synced already.
+ */
+void QKD_journal_finish(void)
+{
+    QKD_enter();
+    if (journal.fd != -1) {
+        close(journal.fd);
+    }
+    if (journal.dir_fd != -1) {
+        close(journal.dir_fd);
+    }
+    free(journal.dir);
+    free(journal.kind);
+    free(journal.segments);
+    free(journal.pending);
+    free(journal.batch);
+    free(journal.consumed);
+    journal = (journal_t) {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .synced = PTHREAD_COND_INITIALIZER,
+        .dir_fd = -1,
+        .fd = -1,
+        .stats = journal.stats
+    };
+    QKD_return_success_void();
+}
+
+bool QKD_journal_enabled(void)
+{
+    return journal.enabled;
+}
+
+/**
+ * Is the key with the given handle in the journal?
+ */
+bool QKD_journal_is_consumed(const QKD_key_handle_t *key_handle)
+{
+    unsigned char digest[DIGEST_SIZE];
+    if (!journal.enabled || !key_handle_digest(key_handle, digest)) {
+        return false;
+    }
+    pthread_mutex_lock(&journal.mutex);
+    bool consumed = is_consumed(digest);
+    pthread_mutex_unlock(&journal.mutex);
+    return consumed;
+}
+
+/**
+ * Zeroize key i in the key buffers: key_sizes[i] bytes, or key_buffer_size bytes if key_sizes is
+ * NULL.
+ */
+static void zeroize_key(char *key_buffers, size_t key_buffer_size, const size_t *key_sizes,
+                        size_t i)
+{
+    OPENSSL_cleanse(key_buffers + i * key_buffer_size, key_sizes ? key_sizes[i] : key_buffer_size);
+}
+
+/**
+ * Record that keys are consumed, and wait until the records are durable. Only the keys for which
+ * results[i] is QKD_RESULT_SUCCESS are recorded. A key that was consumed before gets result
+ * QKD_RESULT_KEY_ALREADY_USED, and keys that could not be recorded get QKD_RESULT_JOURNAL_FAILED.
+ * The keys that are refused here are zeroized in their buffers: key_sizes[i] bytes for key i, or
+ * the whole buffer if key_sizes is NULL. Keys that had failed already are left alone.
+ *
+ * Returns the first result that is not QKD_RESULT_SUCCESS, or QKD_RESULT_SUCCESS.
+ */
+QKD_result_t QKD_journal_consume(size_t nr_keys, const QKD_key_handle_t *key_handles,
+                                 char *key_buffers, size_t key_buffer_size,
+                                 const size_t *key_sizes, QKD_result_t *results)
+{
+    QKD_enter();
+    if (!journal.enabled) {
+        QKD_return_success_qkd();
+    }
+    unsigned char *digests = malloc(nr_keys * DIGEST_SIZE);
+    for (size_t i = 0; i < nr_keys; i++) {
+        if (QKD_RESULT_SUCCESS == results[i] &&
+            (digests == NULL || !key_handle_digest(&key_handles[i], digests + i * DIGEST_SIZE))) {
+            results[i] = QKD_RESULT_JOURNAL_FAILED;
+            zeroize_key(key_buffers, key_buffer_size, key_sizes, i);
+        }
+    }
+    pthread_mutex_lock(&journal.mutex);
+    uint64_t last_lsn = 0;
+    for (size_t i = 0; i < nr_keys; i++) {
+        if (QKD_RESULT_SUCCESS != results[i]) {
+            continue;
+        }
+        const unsigned char *digest = digests + i * DIGEST_SIZE;
+        if (journal.broken) {
+            results[i] = QKD_RESULT_JOURNAL_FAILED;
+        } else if (is_consumed(digest)) {
+            QKD_error("Key %s was consumed before", QKD_key_handle_str(&key_handles[i]));
+            journal.stats.nr_refused++;
+            results[i] = QKD_RESULT_KEY_ALREADY_USED;
+        } else {
+            uint64_t lsn = append_record(digest);
+            if (lsn == 0) {
+                results[i] = QKD_RESULT_JOURNAL_FAILED;
+            } else {
+                last_lsn = lsn;
+            }
+        }
+        if (QKD_RESULT_SUCCESS != results[i]) {
+            zeroize_key(key_buffers, key_buffer_size, key_sizes, i);
+        }
+    }
+    bool synced = last_lsn == 0 || wait_synced(last_lsn);
+    pthread_mutex_unlock(&journal.mutex);
+    free(digests);
+    QKD_result_t qkd_result = QKD_RESULT_SUCCESS;
+    for (size_t i = 0; i < nr_keys; i++) {
+        if (!synced && QKD_RESULT_SUCCESS == results[i]) {
+            results[i] = QKD_RESULT_JOURNAL_FAILED;
+            zeroize_key(key_buffers, key_buffer_size, key_sizes, i);
+        }
+        if (QKD_RESULT_SUCCESS != results[i] && QKD_RESULT_SUCCESS == qkd_result) {
+            qkd_result = results[i];
+        }
+    }
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_return_error_qkd(qkd_result);
+    }
+    QKD_return_success_qkd();
+}
+
+/**
+ * Get the counters of the journal.
+ */
+void QKD_journal_get_stats(QKD_journal_stats_t *stats)
+{
+    pthread_mutex_lock(&journal.mutex);
+    *stats = journal.stats;
+    pthread_mutex_unlock(&journal.mutex);
+}
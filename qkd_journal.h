@@ -0,0 +1,54 @@
+/**
+ * qkd_journal.h
+ *
+ * A crash-safe journal of consumed keys, so that an implementation of the QKD API never hands out
+ * the same key twice, not even after a crash or a restart. QKD_get_key(s) records the handle of
+ * every key in the journal, and does not return the key until the record is on stable storage. A
+ * key whose handle is already in the journal is refused.
+ *
+ * The journal is enabled by setting environment variable QKD_JOURNAL_DIR to the directory that
+ * holds it. It is an append-only sequence of segment files of QKD_JOURNAL_SEGMENT_BYTES bytes
+ * each (default 4 MB), which are preallocated and zero-filled when they are created, so that
+ * appending a record does not change any file system metadata. Only the newest
+ * QKD_JOURNAL_MAX_SEGMENTS segments (default 64) are kept: a key must be unusable for other
+ * reasons (expired in the key manager, evicted from the key store) by the time its record is
+ * dropped.
+ *
+ * The records of concurrent calls are written and synced together (group commit): while one
+ * thread syncs a batch of records, the records of other threads queue up for the next batch. At
+ * QKD_init the segments are replayed to rebuild the set of consumed keys in memory.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#ifndef QKD_JOURNAL_H
+#define QKD_JOURNAL_H
+
+#include "qkd_api.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define QKD_JOURNAL_DEFAULT_SEGMENT_BYTES (4 * 1024 * 1024)
+#define QKD_JOURNAL_DEFAULT_MAX_SEGMENTS 64
+
+typedef struct QKD_journal_stats_st {
+    uint64_t nr_records;                /* Records written since QKD_journal_init */
+    uint64_t nr_commits;                /* Syncs (batches of records) */
+    uint64_t nr_replayed;               /* Records replayed by QKD_journal_init */
+    uint64_t nr_refused;                /* Keys refused because they were consumed before */
+    size_t nr_consumed;                 /* Keys in the consumed set */
+    size_t nr_segments;
+} QKD_journal_stats_t;
+
+QKD_result_t QKD_journal_init(const char *kind);
+void QKD_journal_finish(void);
+bool QKD_journal_enabled(void);
+bool QKD_journal_is_consumed(const QKD_key_handle_t *key_handle);
+QKD_result_t QKD_journal_consume(size_t nr_keys, const QKD_key_handle_t *key_handles,
+                                 char *key_buffers, size_t key_buffer_size,
+                                 const size_t *key_sizes, QKD_result_t *results);
+void QKD_journal_get_stats(QKD_journal_stats_t *stats);
+
+#endif /* QKD_JOURNAL_H */
@@ -0,0 +1,513 @@
+/**
+ * qkd_kernel_test.c
+ *
+ * A test of the vectorized post-processing kernels: GHASH for the authentication of the messages
+ * on the link (PCLMULQDQ, see qkd_auth.h), LDPC decoding (AVX2, see qkd_ldpc.h), the window counts
+ * of the health tests (AVX2, see qkd_health.h), and the packing of sifted bits (AVX2, see
+ * qkd_sifting.h). Each of them promises exactly the same results as its portable implementation,
+ * which is the one that runs when its environment variable is set to 0.
+ *
+ * A kernel chooses its implementation once per process, so the test runs all kernels on the same
+ * deterministic inputs in two child processes: one with the default choice, and one with
+ * QKD_AUTH_CLMUL, QKD_LDPC_SIMD, QKD_HEALTH_SIMD, and QKD_SIFT_SIMD set to 0. Each child sends back
+ * a digest of the outputs of every kernel, and the test checks that the digests of the two
+ * children are equal. Within each child, the test also checks that:
+ *
+ *   - GHASH gives the AES-GCM tag of a known answer test from the NIST CAVP vectors for SP 800-38D
+ *     (no plaintext, 128 bits of additional authenticated data), and the same tags as the AES-GCM
+ *     of OpenSSL for random messages of many sizes, whole, in random pieces, and in batches;
+ *   - LDPC decoding corrects the frames that it says it decoded, and leaves the others alone;
+ *   - unpacking sifted bits gives back the bits that were packed.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#include "qkd_auth.h"
+#include "qkd_health.h"
+#include "qkd_ldpc.h"
+#include "qkd_sifting.h"
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <openssl/evp.h>
+
+#define MAX_FAILURE_LEN 80
+#define DIGEST_SIZE 32                  /* SHA-256 */
+
+/* The first AES-GCM test of gcmEncryptExtIV128.rsp with PTlen = 0 and AADlen = 128. */
+#define KAT_KEY "77be63708971c4e240d1cb79e8d77feb"
+#define KAT_IV "e0e00f19fed7ba0136a797f3"
+#define KAT_AAD "7a43ec1d9c0a5a78a0b16533a6213cab"
+#define KAT_TAG "209fcc8d3675ed938e9c7166709dd946"
+
+#define AUTH_MAX_MESSAGE_SIZE 4096
+#define AUTH_BATCH_SIZE 8
+#define LDPC_FRAME_BITS 4096
+#define LDPC_NR_FRAMES (2 * QKD_LDPC_LANES + 5)     /* Two full groups of lanes and a partial one */
+#define HEALTH_WINDOW_BYTES (QKD_HEALTH_WINDOW_BITS / 8)
+#define HEALTH_NR_RANDOM_WINDOWS 1000
+#define SIFT_MAX_BITS 1100
+
+typedef enum {
+    KERNEL_AUTH = 0,
+    KERNEL_LDPC,
+    KERNEL_HEALTH,
+    KERNEL_SIFTING,
+    NR_KERNELS
+} kernel_t;
+
+static const char *kernel_names[NR_KERNELS] = {"auth", "ldpc", "health", "sifting"};
+static const char *kernel_simd_names[NR_KERNELS] = {"PCLMULQDQ", "AVX2", "AVX2", "AVX2"};
+static const char *kernel_env_names[NR_KERNELS] = {"QKD_AUTH_CLMUL", "QKD_LDPC_SIMD",
+                                                   "QKD_HEALTH_SIMD", "QKD_SIFT_SIMD"};
+
+/* What a child process finds out about a kernel. */
+typedef struct kernel_result_st {
+    bool simd;                          /* The vectorized implementation was used */
+    char failure[MAX_FAILURE_LEN];      /* Empty if all checks within the child passed */
+    unsigned char digest[DIGEST_SIZE];  /* Of the outputs of the kernel */
+} kernel_result_t;
+
+/**
+ * A deterministic pseudo-random number generator (splitmix64), so that both children get the
+ * same inputs.
+ */
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void random_bytes(uint64_t *state, unsigned char *bytes, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        bytes[i] = next_random(state);
+    }
+}
+
+static void hex_to_bytes(const char *hex, unsigned char *bytes)
+{
+    for (size_t i = 0; hex[2 * i] != '\0'; i++) {
+        sscanf(hex + 2 * i, "%2hhx", &bytes[i]);
+    }
+}
+
+static void fail(kernel_result_t *result, const char *failure)
+{
+    if (result->failure[0] == '\0') {
+        snprintf(result->failure, sizeof(result->failure), "%s", failure);
+    }
+}
+
+/**
+ * Start a digest of the outputs of a kernel (SHA-256). Exits the child process on failure.
+ */
+static EVP_MD_CTX *new_digest(void)
+{
+    EVP_MD_CTX *digest = EVP_MD_CTX_new();
+    if (digest == NULL || EVP_DigestInit_ex(digest, EVP_sha256(), NULL) != 1) {
+        _exit(1);
+    }
+    return digest;
+}
+
+static void final_digest(EVP_MD_CTX *digest, kernel_result_t *result)
+{
+    if (EVP_DigestFinal_ex(digest, result->digest, NULL) != 1) {
+        fail(result, "digest failed");
+    }
+    EVP_MD_CTX_free(digest);
+}
+
+/**
+ * Encrypt a single block with AES-128.
+ */
+static bool aes_block(const unsigned char *key, const unsigned char *in, unsigned char *out)
+{
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int size;
+    bool ok = ctx != NULL && EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, key, NULL) == 1 &&
+              EVP_CIPHER_CTX_set_padding(ctx, 0) == 1 &&
+              EVP_EncryptUpdate(ctx, out, &size, in, 16) == 1 && size == 16;
+    EVP_CIPHER_CTX_free(ctx);
+    return ok;
+}
+
+/**
+ * Compute the AES-GCM tag of a message as additional authenticated data, without plaintext, with
+ * OpenSSL.
+ */
+static bool openssl_gcm_tag(const unsigned char *key, const unsigned char *iv,
+                            const unsigned char *message, size_t size, unsigned char *tag)
+{
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int out_size;
+    bool ok = ctx != NULL && EVP_EncryptInit_ex(ctx, EVP_aes_128_gcm(), NULL, key, iv) == 1 &&
+              (size == 0 || EVP_EncryptUpdate(ctx, NULL, &out_size, message, size) == 1) &&
+              EVP_EncryptFinal_ex(ctx, tag, &out_size) == 1 &&
+              EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, QKD_AUTH_TAG_SIZE, tag) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+    return ok;
+}
+
+/**
+ * Compute the tag of a message with qkd_auth, with the hash key and the pad that AES-GCM would
+ * use for the given AES key and 96-bit IV: H = AES_K(0) and P = AES_K(IV || 1).
+ */
+static bool auth_gcm_tag(const unsigned char *key, const unsigned char *iv,
+                         const unsigned char *message, size_t size, unsigned char *tag)
+{
+    unsigned char zero[16] = {0};
+    unsigned char counter[16] = {0};
+    unsigned char hash_key[QKD_AUTH_KEY_SIZE];
+    unsigned char pad[QKD_AUTH_PAD_SIZE];
+    memcpy(counter, iv, 12);
+    counter[15] = 1;
+    if (!aes_block(key, zero, hash_key) || !aes_block(key, counter, pad)) {
+        return false;
+    }
+    QKD_auth_key_t auth_key;
+    QKD_auth_key_init(&auth_key, hash_key);
+    QKD_auth_tag(&auth_key, message, size, pad, tag);
+    QKD_auth_key_cleanse(&auth_key);
+    return true;
+}
+
+static void test_auth(kernel_result_t *result)
+{
+    result->simd = QKD_auth_clmul_enabled();
+    EVP_MD_CTX *digest = new_digest();
+
+    unsigned char key[16], iv[12], aad[16], expected_tag[QKD_AUTH_TAG_SIZE];
+    unsigned char tag[QKD_AUTH_TAG_SIZE];
+    hex_to_bytes(KAT_KEY, key);
+    hex_to_bytes(KAT_IV, iv);
+    hex_to_bytes(KAT_AAD, aad);
+    hex_to_bytes(KAT_TAG, expected_tag);
+    if (!auth_gcm_tag(key, iv, aad, sizeof(aad), tag) || memcmp(tag, expected_tag, 16) != 0) {
+        fail(result, "known answer");
+    }
+
+    /* Every size up to a few blocks of four, then larger ones. */
+    uint64_t random_state = 1;
+    unsigned char *message = malloc(AUTH_MAX_MESSAGE_SIZE);
+    for (size_t size = 0; message != NULL && size <= AUTH_MAX_MESSAGE_SIZE;
+         size += size < 600 ? 1 : 251) {
+        random_bytes(&random_state, key, sizeof(key));
+        random_bytes(&random_state, iv, sizeof(iv));
+        random_bytes(&random_state, message, size);
+        if (!openssl_gcm_tag(key, iv, message, size, expected_tag) ||
+            !auth_gcm_tag(key, iv, message, size, tag) || memcmp(tag, expected_tag, 16) != 0) {
+            fail(result, "tag differs from OpenSSL AES-GCM");
+        }
+        EVP_DigestUpdate(digest, tag, sizeof(tag));
+    }
+
+    /* The same messages in random pieces, and in batches. */
+    unsigned char hash_key[QKD_AUTH_KEY_SIZE];
+    unsigned char pads[AUTH_BATCH_SIZE * QKD_AUTH_PAD_SIZE];
+    unsigned char tags[AUTH_BATCH_SIZE * QKD_AUTH_TAG_SIZE];
+    const void *messages[AUTH_BATCH_SIZE];
+    size_t sizes[AUTH_BATCH_SIZE];
+    QKD_auth_key_t auth_key;
+    random_bytes(&random_state, hash_key, sizeof(hash_key));
+    QKD_auth_key_init(&auth_key, hash_key);
+    for (int round = 0; message != NULL && round < 50; round++) {
+        random_bytes(&random_state, message, AUTH_MAX_MESSAGE_SIZE);
+        random_bytes(&random_state, pads, sizeof(pads));
+        for (int i = 0; i < AUTH_BATCH_SIZE; i++) {
+            sizes[i] = next_random(&random_state) % (AUTH_MAX_MESSAGE_SIZE / AUTH_BATCH_SIZE);
+            messages[i] = message + i * (AUTH_MAX_MESSAGE_SIZE / AUTH_BATCH_SIZE);
+        }
+        QKD_auth_tag_batch(&auth_key, messages, sizes, AUTH_BATCH_SIZE, pads, tags);
+        EVP_DigestUpdate(digest, tags, sizeof(tags));
+        for (int i = 0; i < AUTH_BATCH_SIZE; i++) {
+            QKD_auth_t auth;
+            QKD_auth_init(&auth, &auth_key);
+            for (size_t done = 0; done < sizes[i];) {
+                size_t piece = 1 + next_random(&random_state) % 40;
+                if (piece > sizes[i] - done) {
+                    piece = sizes[i] - done;
+                }
+                QKD_auth_update(&auth, (const unsigned char *) messages[i] + done, piece);
+                done += piece;
+            }
+            QKD_auth_final(&auth, pads + i * QKD_AUTH_PAD_SIZE, tag);
+            if (!QKD_auth_tags_equal(tag, tags + i * QKD_AUTH_TAG_SIZE)) {
+                fail(result, "tag of pieces or batch differs");
+            }
+        }
+    }
+    QKD_auth_key_cleanse(&auth_key);
+    if (message == NULL) {
+        fail(result, "malloc failed");
+    }
+    free(message);
+    final_digest(digest, result);
+}
+
+static void test_ldpc(kernel_result_t *result)
+{
+    result->simd = QKD_ldpc_simd_enabled();
+    EVP_MD_CTX *digest = new_digest();
+    const size_t frame_size = LDPC_FRAME_BITS / 8;
+    const size_t block_size = LDPC_NR_FRAMES * frame_size;
+    const double qbers[] = {0.01, 0.03, 0.05, 0.08};
+    unsigned char *alice = malloc(block_size);
+    unsigned char *noisy = malloc(block_size);
+    unsigned char *bob = malloc(block_size);
+    unsigned char *syndromes = malloc(block_size);
+    uint64_t random_state = 2;
+    for (size_t q = 0; alice != NULL && noisy != NULL && bob != NULL && syndromes != NULL &&
+                       q < sizeof(qbers) / sizeof(qbers[0]); q++) {
+        size_t syndrome_bits = QKD_ldpc_choose_syndrome_bits(LDPC_FRAME_BITS, qbers[q],
+                                                             QKD_LDPC_DEFAULT_EFFICIENCY);
+        const QKD_ldpc_code_t *code = QKD_ldpc_code_get(LDPC_FRAME_BITS, syndrome_bits);
+        if (code == NULL) {
+            fail(result, "no code");
+            break;
+        }
+        size_t syndrome_size = (QKD_ldpc_syndrome_bits(code) + 7) / 8;
+        random_bytes(&random_state, alice, block_size);
+        memcpy(noisy, alice, block_size);
+        uint64_t threshold = (uint64_t) (qbers[q] * 18446744073709551615.0);
+        for (size_t bit = 0; bit < LDPC_NR_FRAMES * LDPC_FRAME_BITS; bit++) {
+            if (next_random(&random_state) < threshold) {
+                noisy[bit / 8] ^= 1 << (bit % 8);
+            }
+        }
+        for (size_t frame = 0; frame < LDPC_NR_FRAMES; frame++) {
+            QKD_ldpc_syndrome(code, alice + frame * frame_size,
+                              syndromes + frame * syndrome_size);
+        }
+        memcpy(bob, noisy, block_size);
+        bool decoded[LDPC_NR_FRAMES];
+        uint64_t nr_decoded = QKD_ldpc_decode(code, bob, syndromes, LDPC_NR_FRAMES, qbers[q],
+                                              QKD_LDPC_DEFAULT_MAX_ITERATIONS, 1, decoded);
+
+        /* A decoded frame must be the other end's frame (at these QBERs the chance that it
+         * satisfies the syndrome otherwise is negligible), and any other frame must be left
+         * alone. */
+        uint64_t nr_flagged = 0;
+        for (size_t frame = 0; frame < LDPC_NR_FRAMES; frame++) {
+            const unsigned char *expected = decoded[frame] ? alice : noisy;
+            nr_flagged += decoded[frame];
+            if (memcmp(bob + frame * frame_size, expected + frame * frame_size,
+                       frame_size) != 0) {
+                fail(result, decoded[frame] ? "decoded frame is wrong" : "frame changed");
+            }
+        }
+        if (nr_decoded != nr_flagged || nr_decoded == 0) {
+            fail(result, "wrong number of frames decoded");
+        }
+        EVP_DigestUpdate(digest, &nr_decoded, sizeof(nr_decoded));
+        EVP_DigestUpdate(digest, decoded, sizeof(decoded));
+        EVP_DigestUpdate(digest, bob, block_size);
+    }
+    if (alice == NULL || noisy == NULL || bob == NULL || syndromes == NULL) {
+        fail(result, "malloc failed");
+    }
+    free(alice);
+    free(noisy);
+    free(bob);
+    free(syndromes);
+    final_digest(digest, result);
+}
+
+/**
+ * Feed a window into the health tests, and add which tests it failed to the digest.
+ */
+static void health_feed_window(const unsigned char *window, EVP_MD_CTX *digest)
+{
+    QKD_health_stats_t stats;
+    QKD_health_feed(window, HEALTH_WINDOW_BYTES);
+    QKD_health_get_stats(&stats);
+    EVP_DigestUpdate(digest, &stats.nr_windows, sizeof(stats.nr_windows));
+    EVP_DigestUpdate(digest, stats.nr_failures, sizeof(stats.nr_failures));
+}
+
+static void test_health(kernel_result_t *result)
+{
+    result->simd = QKD_health_simd_enabled();
+    EVP_MD_CTX *digest = new_digest();
+    unsigned char window[HEALTH_WINDOW_BYTES];
+    uint16_t positions[QKD_HEALTH_WINDOW_BITS];
+    uint64_t random_state = 3;
+
+    /* Every number of ones (crossing the cutoffs of the monobit test), at random positions. */
+    for (size_t nr_ones = 0; nr_ones <= QKD_HEALTH_WINDOW_BITS; nr_ones++) {
+        for (size_t i = 0; i < QKD_HEALTH_WINDOW_BITS; i++) {
+            positions[i] = i;
+        }
+        memset(window, 0, sizeof(window));
+        for (size_t i = 0; i < nr_ones; i++) {
+            size_t j = i + next_random(&random_state) % (QKD_HEALTH_WINDOW_BITS - i);
+            uint16_t position = positions[j];
+            positions[j] = positions[i];
+            window[position / 8] |= 1 << (position % 8);
+        }
+        health_feed_window(window, digest);
+    }
+
+    /* Every number of transitions (crossing the cutoffs of the runs test). */
+    for (size_t nr_transitions = 0; nr_transitions < QKD_HEALTH_WINDOW_BITS; nr_transitions++) {
+        unsigned bit = next_random(&random_state) & 1;
+        size_t left = QKD_HEALTH_WINDOW_BITS - 1;
+        size_t transitions_left = nr_transitions;
+        memset(window, 0, sizeof(window));
+        for (size_t i = 0; i < QKD_HEALTH_WINDOW_BITS; i++) {
+            window[i / 8] |= bit << (i % 8);
+            if (i + 1 < QKD_HEALTH_WINDOW_BITS) {
+                if (next_random(&random_state) % left < transitions_left) {
+                    bit ^= 1;
+                    transitions_left--;
+                }
+                left--;
+            }
+        }
+        health_feed_window(window, digest);
+    }
+
+    for (int i = 0; i < HEALTH_NR_RANDOM_WINDOWS; i++) {
+        random_bytes(&random_state, window, sizeof(window));
+        health_feed_window(window, digest);
+    }
+    final_digest(digest, result);
+}
+
+static void test_sifting(kernel_result_t *result)
+{
+    result->simd = QKD_sift_simd_enabled();
+    EVP_MD_CTX *digest = new_digest();
+    const size_t large_sizes[] = {4096, 65536 + 13, 1000003};
+    size_t max_bits = large_sizes[sizeof(large_sizes) / sizeof(large_sizes[0]) - 1];
+    unsigned char *bits = malloc(max_bits);
+    unsigned char *unpacked = malloc(max_bits);
+    unsigned char *packed = malloc(QKD_sift_packed_size(max_bits));
+    uint64_t random_state = 4;
+    for (size_t i = 0; bits != NULL && unpacked != NULL && packed != NULL &&
+                       i <= SIFT_MAX_BITS + sizeof(large_sizes) / sizeof(large_sizes[0]); i++) {
+        size_t nr_bits = i <= SIFT_MAX_BITS ? i : large_sizes[i - SIFT_MAX_BITS - 1];
+        for (size_t j = 0; j < nr_bits; j++) {
+            bits[j] = next_random(&random_state) & 1;
+        }
+        size_t packed_size = QKD_sift_packed_size(nr_bits);
+        QKD_sift_pack_bits(bits, nr_bits, packed);
+        QKD_sift_unpack_bits(packed, nr_bits, unpacked);
+        if (memcmp(bits, unpacked, nr_bits) != 0) {
+            fail(result, "unpacked bits differ");
+        }
+        EVP_DigestUpdate(digest, packed, packed_size);
+    }
+    if (bits == NULL || unpacked == NULL || packed == NULL) {
+        fail(result, "malloc failed");
+    }
+    free(bits);
+    free(unpacked);
+    free(packed);
+    final_digest(digest, result);
+}
+
+/**
+ * Run all kernels in a child process, with the portable implementations or the default ones, and
+ * collect what it finds out.
+ *
+ * Returns true on success, false if the child process failed.
+ */
+static bool run_child(bool portable, kernel_result_t *results)
+{
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return false;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return false;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        for (int kernel = 0; portable && kernel < NR_KERNELS; kernel++) {
+            setenv(kernel_env_names[kernel], "0", 1);
+        }
+        /* The health tests log every window that fails, and the test makes many of them fail. */
+        setenv("QKD_HEALTH_POLICY", "log", 1);
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd != -1) {
+            dup2(null_fd, STDERR_FILENO);
+        }
+        memset(results, 0, NR_KERNELS * sizeof(*results));
+        test_auth(&results[KERNEL_AUTH]);
+        test_ldpc(&results[KERNEL_LDPC]);
+        test_health(&results[KERNEL_HEALTH]);
+        test_sifting(&results[KERNEL_SIFTING]);
+        ssize_t size = NR_KERNELS * sizeof(*results);
+        _exit(write(fds[1], results, size) == size ? 0 : 1);
+    }
+    close(fds[1]);
+    size_t size = NR_KERNELS * sizeof(*results);
+    size_t done = 0;
+    ssize_t bytes_read;
+    while (done < size && (bytes_read = read(fds[0], (char *) results + done, size - done)) > 0) {
+        done += bytes_read;
+    }
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    return done == size && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char **argv)
+{
+    kernel_result_t results[2][NR_KERNELS];
+    if (!run_child(false, results[0]) || !run_child(true, results[1])) {
+        printf("FAIL child process failed\n");
+        return 1;
+    }
+    int nr_checks = 0;
+    int nr_failures = 0;
+    for (int kernel = 0; kernel < NR_KERNELS; kernel++) {
+        for (int portable = 0; portable <= 1; portable++) {
+            const kernel_result_t *result = &results[portable][kernel];
+            if (portable && !results[0][kernel].simd) {
+                continue;
+            }
+            nr_checks++;
+            const char *implementation = result->simd ? kernel_simd_names[kernel] : "portable";
+            if (result->failure[0] != '\0') {
+                nr_failures++;
+                printf("FAIL %-8s %-10s %s\n", kernel_names[kernel], implementation,
+                       result->failure);
+            } else {
+                printf("ok   %-8s %-10s\n", kernel_names[kernel], implementation);
+            }
+        }
+        if (!results[0][kernel].simd) {
+            printf("skip %-8s %-10s not supported by this CPU\n", kernel_names[kernel],
+                   kernel_simd_names[kernel]);
+            continue;
+        }
+        nr_checks++;
+        if (results[1][kernel].simd ||
+            memcmp(results[0][kernel].digest, results[1][kernel].digest,
+                   DIGEST_SIZE) != 0) {
+            nr_failures++;
+            printf("FAIL %-8s %-10s differs from portable\n", kernel_names[kernel],
+                   kernel_simd_names[kernel]);
+        } else {
+            printf("ok   %-8s %-10s same as portable\n", kernel_names[kernel],
+                   kernel_simd_names[kernel]);
+        }
+    }
+    printf("%d checks, %d failed\n", nr_checks, nr_failures);
+    return nr_failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,349 @@
+/**
+ * qkd_key_store.c
+ *
+ * Per-peer stores of QKD key material (see qkd_key_store.h).
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#include "qkd_key_store.h"
+#include "qkd_debug.h"
+#include "qkd_secure_arena.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct key_entry_st {
+    struct key_entry_st *next;
+    QKD_key_handle_t key_handle;
+    size_t key_size;
+    size_t consumed_size;           /* See QKD_key_store_consume */
+    char *key;                      /* Allocated from the secure arena */
+    unsigned char consumed[];       /* A bit for every byte of the key: has it been consumed? */
+} key_entry_t;
+
+typedef struct peer_store_st {
+    struct peer_store_st *next;
+    char *peer;
+    key_entry_t *oldest;            /* Keys are kept in order of arrival */
+    key_entry_t *newest;
+    size_t nr_keys;
+    size_t nr_bytes;
+} peer_store_t;
+
+static pthread_mutex_t key_store_mutex = PTHREAD_MUTEX_INITIALIZER;
+static peer_store_t *peer_stores = NULL;
+static unsigned long nr_evicted = 0;
+
+/**
+ * The cap on the key material stored per peer, in bytes.
+ */
+static size_t peer_cap_bytes(void)
+{
+    const char *cap_str = getenv("QKD_KEY_STORE_PEER_CAP_BYTES");
+    if (cap_str == NULL) {
+        return QKD_KEY_STORE_DEFAULT_PEER_CAP_BYTES;
+    }
+    return strtoul(cap_str, NULL, 10);
+}
+
+/**
+ * Find the store for a peer, and optionally create it if it does not exist yet. A NULL peer
+ * means "any peer". Must be called with the key store mutex held.
+ *
+ * Returns the store, or NULL if it does not exist (or could not be created).
+ */
+static peer_store_t *find_peer_store(const char *peer, bool create)
+{
+    if (peer == NULL) {
+        peer = "";
+    }
+    for (peer_store_t *store = peer_stores; store != NULL; store = store->next) {
+        if (strcmp(store->peer, peer) == 0) {
+            return store;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    peer_store_t *store = calloc(1, sizeof(*store));
+    if (store == NULL) {
+        return NULL;
+    }
+    store->peer = strdup(peer);
+    if (store->peer == NULL) {
+        free(store);
+        return NULL;
+    }
+    store->next = peer_stores;
+    peer_stores = store;
+    return store;
+}
+
+/**
+ * Unlink the entry (which follows prev, or is the oldest if prev is NULL) from a peer store and
+ * free it. Must be called with the key store mutex held.
+ */
+static void remove_entry(peer_store_t *store, key_entry_t *prev, key_entry_t *entry)
+{
+    if (prev == NULL) {
+        store->oldest = entry->next;
+    } else {
+        prev->next = entry->next;
+    }
+    if (store->newest == entry) {
+        store->newest = prev;
+    }
+    store->nr_keys--;
+    store->nr_bytes -= entry->key_size;
+    QKD_secure_free(entry->key);
+    free(entry);
+}
+
+/**
+ * Store a copy of a key for a peer. If the store of the peer would exceed its cap, the oldest keys
+ * of the peer are evicted first.
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_key_store_put(const char *peer, const QKD_key_handle_t *key_handle,
+                               const char *key, size_t key_size)
+{
+    QKD_enter();
+    assert(key_handle != NULL);
+    assert(key != NULL);
+    size_t cap = peer_cap_bytes();
+    if (key_size > cap) {
+        QKD_error("Key of %zu bytes exceeds per-peer cap of %zu bytes", key_size, cap);
+        QKD_return_error_qkd(QKD_RESULT_OUT_OF_MEMORY);
+    }
+    key_entry_t *entry = calloc(1, sizeof(*entry) + (key_size + 7) / 8);
+    if (entry == NULL) {
+        QKD_error("malloc failed");
+        QKD_return_error_qkd(QKD_RESULT_OUT_OF_MEMORY);
+    }
+    entry->next = NULL;
+    entry->key_handle = *key_handle;
+    entry->key_size = key_size;
+    entry->consumed_size = 0;
+    entry->key = QKD_secure_alloc(key_size);
+    if (entry->key == NULL) {
+        free(entry);
+        QKD_error("QKD_secure_alloc failed");
+        QKD_return_error_qkd(QKD_RESULT_OUT_OF_MEMORY);
+    }
+    memcpy(entry->key, key, key_size);
+
+    pthread_mutex_lock(&key_store_mutex);
+    peer_store_t *store = find_peer_store(peer, true);
+    if (store == NULL) {
+        pthread_mutex_unlock(&key_store_mutex);
+        QKD_secure_free(entry->key);
+        free(entry);
+        QKD_error("find_peer_store failed");
+        QKD_return_error_qkd(QKD_RESULT_OUT_OF_MEMORY);
+    }
+    while (store->nr_bytes + key_size > cap) {
+        QKD_debug("Evict oldest key %s", QKD_key_handle_str(&store->oldest->key_handle));
+        remove_entry(store, NULL, store->oldest);
+        nr_evicted++;
+    }
+    if (store->newest) {
+        store->newest->next = entry;
+    } else {
+        store->oldest = entry;
+    }
+    store->newest = entry;
+    store->nr_keys++;
+    store->nr_bytes += key_size;
+    pthread_mutex_unlock(&key_store_mutex);
+    QKD_return_success_qkd();
+}
+
+/**
+ * Take the key with the given key handle out of the store of a peer: copy it into key (which must
+ * be key_size bytes) and remove it from the store.
+ *
+ * Returns true if the key was found, false otherwise.
+ */
+bool QKD_key_store_take(const char *peer, const QKD_key_handle_t *key_handle, char *key,
+                        size_t key_size)
+{
+    QKD_enter();
+    assert(key_handle != NULL);
+    assert(key != NULL);
+    pthread_mutex_lock(&key_store_mutex);
+    peer_store_t *store = find_peer_store(peer, false);
+    key_entry_t *prev = NULL;
+    key_entry_t *entry = store ? store->oldest : NULL;
+    while (entry != NULL && (QKD_key_handle_compare(&entry->key_handle, key_handle) != 0 ||
+                             entry->key_size != key_size)) {
+        prev = entry;
+        entry = entry->next;
+    }
+    if (entry == NULL) {
+        pthread_mutex_unlock(&key_store_mutex);
+        QKD_return_success("%d", false);
+    }
+    memcpy(key, entry->key, key_size);
+    remove_entry(store, prev, entry);
+    pthread_mutex_unlock(&key_store_mutex);
+    QKD_return_success("%d", true);
+}
+
+/**
+ * Has any byte in the range [offset, offset + size) of a key been consumed?
+ */
+static bool range_consumed(const key_entry_t *entry, size_t offset, size_t size)
+{
+    size_t end = offset + size;
+    for (size_t i = offset; i < end; i++) {
+        if (i % 8 == 0 && end - i >= 8) {
+            if (entry->consumed[i / 8] != 0) {
+                return true;
+            }
+            i += 7;
+        } else if (entry->consumed[i / 8] & (1 << (i % 8))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Mark the bytes in the range [offset, offset + size) of a key as consumed.
+ */
+static void mark_consumed(key_entry_t *entry, size_t offset, size_t size)
+{
+    size_t end = offset + size;
+    for (size_t i = offset; i < end; i++) {
+        if (i % 8 == 0 && end - i >= 8) {
+            entry->consumed[i / 8] = 0xff;
+            i += 7;
+        } else {
+            entry->consumed[i / 8] |= 1 << (i % 8);
+        }
+    }
+}
+
+/**
+ * Consume a piece of a stored key. A piece that overlaps a piece that was consumed before is
+ * refused, and *used is set (if used is not NULL). Must be called with the key store mutex held.
+ *
+ * Returns true if the key was found and the piece is within the key and was not consumed before,
+ * false otherwise.
+ */
+static bool consume_piece(peer_store_t *store, const QKD_key_handle_t *key_handle, size_t offset,
+                          char *key, size_t key_size, bool *used)
+{
+    key_entry_t *prev = NULL;
+    key_entry_t *entry = store ? store->oldest : NULL;
+    while (entry != NULL && QKD_key_handle_compare(&entry->key_handle, key_handle) != 0) {
+        prev = entry;
+        entry = entry->next;
+    }
+    if (entry == NULL || offset > entry->key_size || key_size > entry->key_size - offset) {
+        return false;
+    }
+    if (range_consumed(entry, offset, key_size)) {
+        if (used != NULL) {
+            *used = true;
+        }
+        return false;
+    }
+    if (key != NULL) {
+        memcpy(key, entry->key + offset, key_size);
+    }
+    memset(entry->key + offset, 0, key_size);
+    mark_consumed(entry, offset, key_size);
+    entry->consumed_size += key_size;
+    assert(entry->consumed_size <= entry->key_size);
+    if (entry->consumed_size == entry->key_size) {
+        remove_entry(store, prev, entry);
+    }
+    return true;
+}
+
+/**
+ * Consume part of a stored key: copy key_size bytes starting at offset into key (unless key is
+ * NULL) and zeroize them in the store. This is used for keys that are really blocks of a key
+ * stream, which are handed out in pieces. Each byte can be consumed only once: a piece that
+ * overlaps a piece that was consumed before is refused. The key is removed from the store once all
+ * of it has been consumed. Pieces that are never consumed are reclaimed when the key is evicted.
+ *
+ * Returns true if the key was found, the piece is within the key, and it was not consumed before;
+ * false otherwise.
+ */
+bool QKD_key_store_consume(const char *peer, const QKD_key_handle_t *key_handle, size_t offset,
+                           char *key, size_t key_size)
+{
+    QKD_enter();
+    assert(key_handle != NULL);
+    pthread_mutex_lock(&key_store_mutex);
+    bool found = consume_piece(find_peer_store(peer, false), key_handle, offset, key, key_size,
+                               NULL);
+    pthread_mutex_unlock(&key_store_mutex);
+    QKD_return_success("%d", found);
+}
+
+/**
+ * Consume several pieces of stored keys (see QKD_key_store_consume) while taking the key store
+ * lock only once. The found field of each piece says whether that piece was consumed, and the used
+ * field whether it was refused because (part of) it had been consumed before.
+ *
+ * Returns the number of pieces that were found.
+ */
+size_t QKD_key_store_consume_batch(const char *peer, QKD_key_store_piece_t *pieces,
+                                   size_t nr_pieces)
+{
+    QKD_enter();
+    assert(pieces != NULL || nr_pieces == 0);
+    size_t nr_found = 0;
+    pthread_mutex_lock(&key_store_mutex);
+    peer_store_t *store = find_peer_store(peer, false);
+    for (size_t i = 0; i < nr_pieces; i++) {
+        QKD_key_store_piece_t *piece = &pieces[i];
+        piece->used = false;
+        piece->found = consume_piece(store, &piece->key_handle, piece->offset, piece->key,
+                                     piece->key_size, &piece->used);
+        if (piece->found) {
+            nr_found++;
+        }
+    }
+    pthread_mutex_unlock(&key_store_mutex);
+    QKD_return_success("%zu", nr_found);
+}
+
+/**
+ * Discard (and zeroize) all keys stored for a peer.
+ */
+void QKD_key_store_discard_peer(const char *peer)
+{
+    QKD_enter();
+    pthread_mutex_lock(&key_store_mutex);
+    peer_store_t *store = find_peer_store(peer, false);
+    while (store != NULL && store->oldest != NULL) {
+        remove_entry(store, NULL, store->oldest);
+    }
+    pthread_mutex_unlock(&key_store_mutex);
+    QKD_return_success_void();
+}
+
+/**
+ * Get the number of peers, keys, and bytes in the store, and the number of evicted keys.
+ */
+void QKD_key_store_get_stats(QKD_key_store_stats_t *stats)
+{
+    assert(stats != NULL);
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&key_store_mutex);
+    for (peer_store_t *store = peer_stores; store != NULL; store = store->next) {
+        stats->nr_peers++;
+        stats->nr_keys += store->nr_keys;
+        stats->nr_bytes += store->nr_bytes;
+    }
+    stats->nr_evicted = nr_evicted;
+    pthread_mutex_unlock(&key_store_mutex);
+}
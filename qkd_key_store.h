@@ -0,0 +1,52 @@
+/**
+ * qkd_key_store.h
+ *
+ * Per-peer stores of QKD key material that has been delivered by the key manager but that has not
+ * been consumed yet. The key material is kept in the secure arena (see qkd_secure_arena.h). The
+ * memory used by the store of each peer is capped; when adding a key would exceed the cap, the
+ * oldest keys of that peer are evicted (and zeroized).
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#ifndef QKD_KEY_STORE_H
+#define QKD_KEY_STORE_H
+
+#include "qkd_api.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Default cap on the key material stored per peer. Can be overridden with environment variable
+ * QKD_KEY_STORE_PEER_CAP_BYTES. */
+#define QKD_KEY_STORE_DEFAULT_PEER_CAP_BYTES (64 * 1024)
+
+typedef struct QKD_key_store_stats_st {
+    size_t nr_peers;
+    size_t nr_keys;
+    size_t nr_bytes;
+    unsigned long nr_evicted;
+} QKD_key_store_stats_t;
+
+/* A piece of a stored key, for QKD_key_store_consume_batch. */
+typedef struct QKD_key_store_piece_st {
+    QKD_key_handle_t key_handle;
+    size_t offset;
+    char *key;                      /* Where to copy the piece to, or NULL to discard it */
+    size_t key_size;
+    bool found;                     /* Set by QKD_key_store_consume_batch */
+    bool used;                      /* Set if (part of) the piece was consumed before */
+} QKD_key_store_piece_t;
+
+QKD_result_t QKD_key_store_put(const char *peer, const QKD_key_handle_t *key_handle,
+                               const char *key, size_t key_size);
+bool QKD_key_store_take(const char *peer, const QKD_key_handle_t *key_handle, char *key,
+                        size_t key_size);
+bool QKD_key_store_consume(const char *peer, const QKD_key_handle_t *key_handle, size_t offset,
+                           char *key, size_t key_size);
+size_t QKD_key_store_consume_batch(const char *peer, QKD_key_store_piece_t *pieces,
+                                   size_t nr_pieces);
+void QKD_key_store_discard_peer(const char *peer);
+void QKD_key_store_get_stats(QKD_key_store_stats_t *stats);
+
+#endif /* QKD_KEY_STORE_H */
@@ -0,0 +1,607 @@
+/**
+ * qkd_ldpc.c
+ *
+ * One-way information reconciliation with LDPC codes (see qkd_ldpc.h).
+ *
+ * The parity-check matrices are random with column weight 3 and (nearly) constant row weight,
+ * stored row by row: for each check (row) the list of variables (columns, i.e. bits of the frame)
+ * that it covers. Syndrome decoding is belief propagation with the syndrome bit of each check
+ * flipping the sign of its messages.
+ *
+ * The decoder works on QKD_LDPC_LANES frames at once: every message is a vector of 16-bit fixed
+ * point log-likelihood ratios, one per frame, so that one AVX2 instruction processes the same
+ * message for all frames. Positive values mean that the bit is more likely zero. The checks are
+ * processed one by one (layered schedule), which converges in about half the iterations of the
+ * classic flooding schedule. Check-to-variable messages are the minimum of the other incoming
+ * magnitudes, scaled by 3/4 (normalized min-sum).
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#include "qkd_ldpc.h"
+#include "qkd_debug.h"
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_AVX2 1
+#endif
+
+#define COLUMN_WEIGHT 3
+#define LLR_SCALE 16.0          /* Fixed point units per unit of log-likelihood ratio */
+#define LLR_MAX 32767           /* Messages are kept in [-LLR_MAX, LLR_MAX] */
+#define MIN_QBER 0.001          /* Lower bound on the QBER used for choosing codes and LLRs */
+#define MAX_CODES 128           /* Maximum number of codes in the family (cache) */
+#define MAX_SHUFFLE_PASSES 100
+
+struct QKD_ldpc_code_st {
+    size_t frame_bits;
+    size_t syndrome_bits;
+    size_t nr_edges;
+    size_t max_row_degree;
+    uint32_t *row_start;        /* Row j covers edges row_start[j] up to row_start[j + 1] */
+    uint32_t *edge_variable;    /* The variable (bit of the frame) of each edge */
+};
+
+/* One message (or belief) for each of the frames that are decoded together. */
+typedef struct lanes_st {
+    int16_t lane[QKD_LDPC_LANES];
+} __attribute__((aligned(32))) lanes_t;
+
+/* The working memory of one decoder thread. */
+typedef struct decoder_st {
+    lanes_t *beliefs;           /* Per variable */
+    lanes_t *messages;          /* Per edge: check to variable */
+    lanes_t *row_tmp;           /* Per edge of the current row: variable to check */
+    lanes_t *syndrome_signs;    /* Per check: 0 or -1 (syndrome bit set) */
+} decoder_t;
+
+/* A batch of frames, decoded by one or more threads that take groups of frames in turn. */
+typedef struct decode_job_st {
+    const QKD_ldpc_code_t *code;
+    unsigned char *frames;
+    const unsigned char *syndromes;
+    size_t nr_frames;
+    int16_t channel_llr;
+    int max_iterations;
+    bool *decoded;
+    size_t next_group;          /* Taken atomically */
+    size_t nr_decoded;          /* Updated atomically */
+} decode_job_t;
+
+typedef void (*row_update_t)(const uint32_t *edge_variable, size_t first_edge, size_t degree,
+                             lanes_t *beliefs, lanes_t *messages, lanes_t *row_tmp,
+                             const lanes_t *syndrome_sign);
+
+static QKD_ldpc_code_t *codes[MAX_CODES];
+static size_t nr_codes = 0;
+static pthread_mutex_t codes_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t row_update_once = PTHREAD_ONCE_INIT;
+static row_update_t row_update = NULL;
+
+static bool get_bit(const unsigned char *bits, size_t index)
+{
+    return (bits[index / 8] >> (index % 8)) & 1;
+}
+
+static void set_bit(unsigned char *bits, size_t index, bool value)
+{
+    unsigned char mask = 1 << (index % 8);
+    bits[index / 8] = value ? (bits[index / 8] | mask) : (bits[index / 8] & ~mask);
+}
+
+/**
+ * Binary entropy function.
+ */
+static double binary_entropy(double p)
+{
+    if (p <= 0.0 || p >= 1.0) {
+        return 0.0;
+    }
+    return -p * log2(p) - (1.0 - p) * log2(1.0 - p);
+}
+
+/**
+ * The splitmix64 pseudo random number generator. Codes must be the same at both ends, so they are
+ * constructed with this instead of a source of real randomness.
+ */
+static uint64_t splitmix64(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Does a variable have the same check on more than one of its edges? (Two such edges would
+ * cancel out.)
+ */
+static bool has_double_edge(const uint32_t *socket_check, size_t variable)
+{
+    const uint32_t *checks = socket_check + variable * COLUMN_WEIGHT;
+    for (int a = 1; a < COLUMN_WEIGHT; a++) {
+        for (int b = 0; b < a; b++) {
+            if (checks[a] == checks[b]) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * Construct the code with the given frame size and number of syndrome bits. Every variable has
+ * COLUMN_WEIGHT edges ("sockets"); the sockets are assigned to the checks round robin (so that all
+ * checks have the same number of edges, give or take one) and then shuffled.
+ *
+ * Returns the code, or NULL on failure.
+ */
+static QKD_ldpc_code_t *code_new(size_t frame_bits, size_t syndrome_bits)
+{
+    QKD_enter();
+    size_t nr_edges = frame_bits * COLUMN_WEIGHT;
+    QKD_ldpc_code_t *code = calloc(1, sizeof(*code));
+    uint32_t *socket_check = malloc(nr_edges * sizeof(*socket_check));
+    if (code == NULL || socket_check == NULL) {
+        QKD_error("malloc failed");
+        free(code);
+        free(socket_check);
+        QKD_return_error("%p", NULL);
+    }
+    code->frame_bits = frame_bits;
+    code->syndrome_bits = syndrome_bits;
+    code->nr_edges = nr_edges;
+
+    uint64_t seed = ((uint64_t) frame_bits << 32) ^ syndrome_bits;
+    for (size_t socket = 0; socket < nr_edges; socket++) {
+        socket_check[socket] = socket % syndrome_bits;
+    }
+    for (size_t socket = nr_edges - 1; socket > 0; socket--) {
+        size_t other = splitmix64(&seed) % (socket + 1);
+        uint32_t check = socket_check[socket];
+        socket_check[socket] = socket_check[other];
+        socket_check[other] = check;
+    }
+    for (int pass = 0; pass < MAX_SHUFFLE_PASSES; pass++) {
+        bool changed = false;
+        for (size_t variable = 0; variable < frame_bits; variable++) {
+            if (has_double_edge(socket_check, variable)) {
+                size_t socket = variable * COLUMN_WEIGHT + splitmix64(&seed) % COLUMN_WEIGHT;
+                size_t other = splitmix64(&seed) % nr_edges;
+                uint32_t check = socket_check[socket];
+                socket_check[socket] = socket_check[other];
+                socket_check[other] = check;
+                changed = true;
+            }
+        }
+        if (!changed) {
+            break;
+        }
+    }
+
+    /* Group the edges by check. */
+    code->row_start = calloc(syndrome_bits + 1, sizeof(*code->row_start));
+    code->edge_variable = malloc(nr_edges * sizeof(*code->edge_variable));
+    if (code->row_start == NULL || code->edge_variable == NULL) {
+        QKD_error("malloc failed");
+        free(socket_check);
+        free(code->row_start);
+        free(code->edge_variable);
+        free(code);
+        QKD_return_error("%p", NULL);
+    }
+    for (size_t socket = 0; socket < nr_edges; socket++) {
+        code->row_start[socket_check[socket] + 1]++;
+    }
+    for (size_t check = 0; check < syndrome_bits; check++) {
+        size_t degree = code->row_start[check + 1];
+        if (degree > code->max_row_degree) {
+            code->max_row_degree = degree;
+        }
+        code->row_start[check + 1] += code->row_start[check];
+    }
+    uint32_t *fill = malloc(syndrome_bits * sizeof(*fill));
+    if (fill == NULL) {
+        QKD_error("malloc failed");
+        free(socket_check);
+        free(code->row_start);
+        free(code->edge_variable);
+        free(code);
+        QKD_return_error("%p", NULL);
+    }
+    memcpy(fill, code->row_start, syndrome_bits * sizeof(*fill));
+    for (size_t socket = 0; socket < nr_edges; socket++) {
+        code->edge_variable[fill[socket_check[socket]]++] = socket / COLUMN_WEIGHT;
+    }
+    free(fill);
+    free(socket_check);
+    QKD_debug("Constructed LDPC code n=%zu m=%zu (max row degree %zu)", frame_bits, syndrome_bits,
+              code->max_row_degree);
+    QKD_return_success("%p", code);
+}
+
+/**
+ * Choose the number of syndrome bits for reconciling frames of frame_bits bits at the given QBER
+ * with the given efficiency (the number of syndrome bits divided by the theoretical minimum
+ * frame_bits * h(QBER); real codes need 1.1 or more, and more for smaller frames). The result is
+ * rounded up to the next rate of the code family.
+ *
+ * Returns the number of syndrome bits.
+ */
+size_t QKD_ldpc_choose_syndrome_bits(size_t frame_bits, double qber, double efficiency)
+{
+    size_t step = frame_bits / QKD_LDPC_RATE_STEPS;
+    if (step < COLUMN_WEIGHT) {
+        step = COLUMN_WEIGHT;
+    }
+    double needed = efficiency * frame_bits * binary_entropy(fmax(qber, MIN_QBER));
+    size_t syndrome_bits = (size_t) ceil(needed / step) * step;
+    if (syndrome_bits < step) {
+        syndrome_bits = step;
+    }
+    if (syndrome_bits > frame_bits - step) {
+        syndrome_bits = frame_bits - step;
+    }
+    return syndrome_bits;
+}
+
+/**
+ * Get the code of the family with the given frame size and number of syndrome bits. Codes are
+ * constructed when they are first used, and kept for the lifetime of the process.
+ *
+ * Returns the code, or NULL on failure.
+ */
+const QKD_ldpc_code_t *QKD_ldpc_code_get(size_t frame_bits, size_t syndrome_bits)
+{
+    QKD_enter();
+    if (frame_bits == 0 || frame_bits % 8 != 0 || syndrome_bits < COLUMN_WEIGHT ||
+        syndrome_bits >= frame_bits) {
+        QKD_error("Invalid LDPC code size n=%zu m=%zu", frame_bits, syndrome_bits);
+        QKD_return_error("%p", NULL);
+    }
+    pthread_mutex_lock(&codes_mutex);
+    QKD_ldpc_code_t *code = NULL;
+    for (size_t i = 0; i < nr_codes; i++) {
+        if (codes[i]->frame_bits == frame_bits && codes[i]->syndrome_bits == syndrome_bits) {
+            code = codes[i];
+            break;
+        }
+    }
+    if (code == NULL && nr_codes < MAX_CODES) {
+        code = code_new(frame_bits, syndrome_bits);
+        if (code != NULL) {
+            codes[nr_codes++] = code;
+        }
+    }
+    pthread_mutex_unlock(&codes_mutex);
+    if (code == NULL) {
+        QKD_error("No LDPC code n=%zu m=%zu", frame_bits, syndrome_bits);
+        QKD_return_error("%p", NULL);
+    }
+    QKD_return_success("%p", code);
+}
+
+size_t QKD_ldpc_frame_bits(const QKD_ldpc_code_t *code)
+{
+    return code->frame_bits;
+}
+
+size_t QKD_ldpc_syndrome_bits(const QKD_ldpc_code_t *code)
+{
+    return code->syndrome_bits;
+}
+
+/**
+ * The efficiency of reconciliation with a code at a given QBER: the number of bits disclosed in
+ * the syndrome divided by the theoretical minimum.
+ */
+double QKD_ldpc_efficiency(const QKD_ldpc_code_t *code, double qber)
+{
+    return code->syndrome_bits / (code->frame_bits * binary_entropy(fmax(qber, MIN_QBER)));
+}
+
+/**
+ * Compute the syndrome of a frame.
+ */
+void QKD_ldpc_syndrome(const QKD_ldpc_code_t *code, const unsigned char *frame,
+                       unsigned char *syndrome)
+{
+    memset(syndrome, 0, (code->syndrome_bits + 7) / 8);
+    for (size_t check = 0; check < code->syndrome_bits; check++) {
+        bool parity = false;
+        for (size_t edge = code->row_start[check]; edge < code->row_start[check + 1]; edge++) {
+            parity ^= get_bit(frame, code->edge_variable[edge]);
+        }
+        set_bit(syndrome, check, parity);
+    }
+}
+
+static int16_t saturate(int32_t value)
+{
+    return value > LLR_MAX ? LLR_MAX : (value < -LLR_MAX ? -LLR_MAX : value);
+}
+
+/**
+ * Process one check (row) of the layered min-sum decoder for all lanes: compute the messages from
+ * the variables to the check (belief minus the previous message from the check), then the new
+ * messages from the check to the variables, and add those to the beliefs. Portable version.
+ */
+static void row_update_portable(const uint32_t *edge_variable, size_t first_edge, size_t degree,
+                                lanes_t *beliefs, lanes_t *messages, lanes_t *row_tmp,
+                                const lanes_t *syndrome_sign)
+{
+    for (int l = 0; l < QKD_LDPC_LANES; l++) {
+        int16_t min1 = LLR_MAX;
+        int16_t min2 = LLR_MAX;
+        int16_t min_index = -1;
+        int16_t sign = syndrome_sign->lane[l];
+        for (size_t k = 0; k < degree; k++) {
+            int16_t belief = beliefs[edge_variable[first_edge + k]].lane[l];
+            int16_t in = saturate((int32_t) belief - messages[first_edge + k].lane[l]);
+            int16_t magnitude = in < 0 ? -in : in;
+            row_tmp[k].lane[l] = in;
+            sign ^= in < 0 ? -1 : 0;
+            if (magnitude < min1) {
+                min2 = min1;
+                min1 = magnitude;
+                min_index = k;
+            } else if (magnitude < min2) {
+                min2 = magnitude;
+            }
+        }
+        for (size_t k = 0; k < degree; k++) {
+            int16_t in = row_tmp[k].lane[l];
+            int16_t magnitude = (min_index == (int16_t) k) ? min2 : min1;
+            magnitude -= magnitude >> 2;
+            int16_t out_sign = sign ^ (in < 0 ? -1 : 0);
+            int16_t out = (magnitude ^ out_sign) - out_sign;
+            messages[first_edge + k].lane[l] = out;
+            beliefs[edge_variable[first_edge + k]].lane[l] = saturate((int32_t) in + out);
+        }
+    }
+}
+
+#ifdef HAVE_AVX2
+/**
+ * AVX2 version of row_update_portable, with exactly the same results.
+ */
+__attribute__((target("avx2")))
+static void row_update_avx2(const uint32_t *edge_variable, size_t first_edge, size_t degree,
+                            lanes_t *beliefs, lanes_t *messages, lanes_t *row_tmp,
+                            const lanes_t *syndrome_sign)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i neg_max = _mm256_set1_epi16(-LLR_MAX);
+    __m256i min1 = _mm256_set1_epi16(LLR_MAX);
+    __m256i min2 = min1;
+    __m256i min_index = _mm256_set1_epi16(-1);
+    __m256i sign = _mm256_load_si256((const __m256i *) syndrome_sign);
+    for (size_t k = 0; k < degree; k++) {
+        __m256i belief = _mm256_load_si256((__m256i *) &beliefs[edge_variable[first_edge + k]]);
+        __m256i message = _mm256_load_si256((__m256i *) &messages[first_edge + k]);
+        __m256i in = _mm256_max_epi16(_mm256_subs_epi16(belief, message), neg_max);
+        _mm256_store_si256((__m256i *) &row_tmp[k], in);
+        __m256i magnitude = _mm256_abs_epi16(in);
+        sign = _mm256_xor_si256(sign, _mm256_cmpgt_epi16(zero, in));
+        __m256i below_min1 = _mm256_cmpgt_epi16(min1, magnitude);
+        min2 = _mm256_blendv_epi8(_mm256_min_epi16(min2, magnitude), min1, below_min1);
+        min1 = _mm256_min_epi16(min1, magnitude);
+        min_index = _mm256_blendv_epi8(min_index, _mm256_set1_epi16(k), below_min1);
+    }
+    for (size_t k = 0; k < degree; k++) {
+        __m256i in = _mm256_load_si256((__m256i *) &row_tmp[k]);
+        __m256i is_min = _mm256_cmpeq_epi16(min_index, _mm256_set1_epi16(k));
+        __m256i magnitude = _mm256_blendv_epi8(min1, min2, is_min);
+        magnitude = _mm256_sub_epi16(magnitude, _mm256_srai_epi16(magnitude, 2));
+        __m256i out_sign = _mm256_xor_si256(sign, _mm256_cmpgt_epi16(zero, in));
+        __m256i out = _mm256_sub_epi16(_mm256_xor_si256(magnitude, out_sign), out_sign);
+        _mm256_store_si256((__m256i *) &messages[first_edge + k], out);
+        _mm256_store_si256((__m256i *) &beliefs[edge_variable[first_edge + k]],
+                           _mm256_max_epi16(_mm256_adds_epi16(in, out), neg_max));
+    }
+}
+#endif
+
+/**
+ * Choose the implementation of the row update: AVX2 if the CPU supports it, unless environment
+ * variable QKD_LDPC_SIMD is set to 0.
+ */
+static void choose_row_update(void)
+{
+    row_update = row_update_portable;
+#ifdef HAVE_AVX2
+    const char *simd = getenv("QKD_LDPC_SIMD");
+    if ((simd == NULL || strcmp(simd, "0") != 0) && __builtin_cpu_supports("avx2")) {
+        row_update = row_update_avx2;
+    }
+#endif
+}
+
+/**
+ * Is the SIMD (AVX2) implementation of the decoder used?
+ */
+bool QKD_ldpc_simd_enabled(void)
+{
+    pthread_once(&row_update_once, choose_row_update);
+    return row_update != row_update_portable;
+}
+
+/**
+ * Which lanes satisfy all checks with the hard decisions of their current beliefs?
+ *
+ * Returns a bit mask of lanes.
+ */
+static uint32_t satisfied_lanes(const QKD_ldpc_code_t *code, const decoder_t *decoder)
+{
+    uint32_t unsatisfied = 0;
+    for (size_t check = 0; check < code->syndrome_bits; check++) {
+        lanes_t parity = decoder->syndrome_signs[check];
+        for (size_t edge = code->row_start[check]; edge < code->row_start[check + 1]; edge++) {
+            const lanes_t *belief = &decoder->beliefs[code->edge_variable[edge]];
+            for (int l = 0; l < QKD_LDPC_LANES; l++) {
+                parity.lane[l] ^= belief->lane[l] < 0 ? -1 : 0;
+            }
+        }
+        for (int l = 0; l < QKD_LDPC_LANES; l++) {
+            unsatisfied |= (parity.lane[l] != 0) << l;
+        }
+    }
+    return ~unsatisfied & ((1u << QKD_LDPC_LANES) - 1);
+}
+
+/**
+ * Decode a group of up to QKD_LDPC_LANES frames, correcting them in place. Frames that could not
+ * be decoded are left unchanged.
+ *
+ * Returns the number of frames that were decoded.
+ */
+static size_t decode_group(const decode_job_t *job, decoder_t *decoder, size_t first_frame)
+{
+    const QKD_ldpc_code_t *code = job->code;
+    size_t frame_bytes = code->frame_bits / 8;
+    size_t syndrome_bytes = (code->syndrome_bits + 7) / 8;
+    size_t nr_lanes = job->nr_frames - first_frame;
+    if (nr_lanes > QKD_LDPC_LANES) {
+        nr_lanes = QKD_LDPC_LANES;
+    }
+    unsigned char *frames = job->frames + first_frame * frame_bytes;
+    const unsigned char *syndromes = job->syndromes + first_frame * syndrome_bytes;
+
+    /* Unused lanes decode an all-zero frame with an all-zero syndrome, which is trivially done. */
+    for (size_t variable = 0; variable < code->frame_bits; variable++) {
+        for (size_t l = 0; l < QKD_LDPC_LANES; l++) {
+            int16_t llr = job->channel_llr;
+            if (l < nr_lanes && get_bit(frames + l * frame_bytes, variable)) {
+                llr = -llr;
+            }
+            decoder->beliefs[variable].lane[l] = llr;
+        }
+    }
+    for (size_t check = 0; check < code->syndrome_bits; check++) {
+        for (size_t l = 0; l < QKD_LDPC_LANES; l++) {
+            bool bit = l < nr_lanes && get_bit(syndromes + l * syndrome_bytes, check);
+            decoder->syndrome_signs[check].lane[l] = bit ? -1 : 0;
+        }
+    }
+    memset(decoder->messages, 0, code->nr_edges * sizeof(lanes_t));
+
+    /* A lane is done as soon as it satisfies all checks; store its frame right away, since later
+     * iterations (for the other lanes) could in theory move it away again. */
+    uint32_t all_lanes = (1u << QKD_LDPC_LANES) - 1;
+    uint32_t done = 0;
+    for (int iteration = 0; ; iteration++) {
+        uint32_t satisfied = satisfied_lanes(code, decoder) & ~done;
+        for (size_t l = 0; l < nr_lanes; l++) {
+            if (satisfied & (1u << l)) {
+                for (size_t variable = 0; variable < code->frame_bits; variable++) {
+                    set_bit(frames + l * frame_bytes, variable,
+                            decoder->beliefs[variable].lane[l] < 0);
+                }
+            }
+        }
+        done |= satisfied;
+        if (done == all_lanes || iteration == job->max_iterations) {
+            break;
+        }
+        for (size_t check = 0; check < code->syndrome_bits; check++) {
+            size_t first_edge = code->row_start[check];
+            row_update(code->edge_variable, first_edge, code->row_start[check + 1] - first_edge,
+                       decoder->beliefs, decoder->messages, decoder->row_tmp,
+                       &decoder->syndrome_signs[check]);
+        }
+    }
+    size_t nr_decoded = 0;
+    for (size_t l = 0; l < nr_lanes; l++) {
+        job->decoded[first_frame + l] = done & (1u << l);
+        nr_decoded += job->decoded[first_frame + l];
+    }
+    return nr_decoded;
+}
+
+/**
+ * A decoder thread: allocate working memory, and decode groups of frames until there are none
+ * left.
+ */
+static void *decode_thread(void *arg)
+{
+    decode_job_t *job = arg;
+    const QKD_ldpc_code_t *code = job->code;
+    decoder_t decoder;
+    decoder.beliefs = aligned_alloc(sizeof(lanes_t), code->frame_bits * sizeof(lanes_t));
+    decoder.messages = aligned_alloc(sizeof(lanes_t), code->nr_edges * sizeof(lanes_t));
+    decoder.row_tmp = aligned_alloc(sizeof(lanes_t), code->max_row_degree * sizeof(lanes_t));
+    decoder.syndrome_signs = aligned_alloc(sizeof(lanes_t),
+                                           code->syndrome_bits * sizeof(lanes_t));
+    if (decoder.beliefs && decoder.messages && decoder.row_tmp && decoder.syndrome_signs) {
+        size_t nr_groups = (job->nr_frames + QKD_LDPC_LANES - 1) / QKD_LDPC_LANES;
+        size_t group;
+        while ((group = __atomic_fetch_add(&job->next_group, 1, __ATOMIC_RELAXED)) < nr_groups) {
+            size_t nr_decoded = decode_group(job, &decoder, group * QKD_LDPC_LANES);
+            __atomic_add_fetch(&job->nr_decoded, nr_decoded, __ATOMIC_RELAXED);
+        }
+    } else {
+        QKD_error("aligned_alloc failed");
+    }
+    free(decoder.beliefs);
+    free(decoder.messages);
+    free(decoder.row_tmp);
+    free(decoder.syndrome_signs);
+    return NULL;
+}
+
+/**
+ * Decode frames of raw key against the syndromes of the other end's frames, correcting the errors
+ * in place. Frames are decoded in groups of QKD_LDPC_LANES, spread over up to nr_threads threads.
+ * If decoded is not NULL, decoded[i] tells whether frame i was decoded; frames that were not
+ * decoded are left unchanged. Note that a decoded frame satisfies the syndrome, which is very
+ * likely but not certain to mean that it is equal to the other end's frame; the caller should
+ * verify that (e.g. with a hash) if it matters.
+ *
+ * Returns the number of frames that were decoded.
+ */
+size_t QKD_ldpc_decode(const QKD_ldpc_code_t *code, unsigned char *frames,
+                       const unsigned char *syndromes, size_t nr_frames, double qber,
+                       int max_iterations, int nr_threads, bool *decoded)
+{
+    QKD_enter();
+    assert(code != NULL);
+    pthread_once(&row_update_once, choose_row_update);
+    bool *decoded_buffer = decoded ? NULL : malloc(nr_frames * sizeof(bool));
+    double p = fmax(qber, MIN_QBER);
+    decode_job_t job = {
+        .code = code,
+        .frames = frames,
+        .syndromes = syndromes,
+        .nr_frames = nr_frames,
+        .channel_llr = saturate(lround(LLR_SCALE * log((1.0 - p) / p))),
+        .max_iterations = max_iterations,
+        .decoded = decoded ? decoded : decoded_buffer,
+        .next_group = 0,
+        .nr_decoded = 0
+    };
+    if (job.decoded == NULL) {
+        QKD_error("malloc failed");
+        QKD_return_error("%d", 0);
+    }
+    size_t nr_groups = (nr_frames + QKD_LDPC_LANES - 1) / QKD_LDPC_LANES;
+    int nr_extra_threads = (nr_threads < (int) nr_groups ? nr_threads : (int) nr_groups) - 1;
+    pthread_t threads[nr_extra_threads > 0 ? nr_extra_threads : 1];
+    int nr_started = 0;
+    while (nr_started < nr_extra_threads &&
+           pthread_create(&threads[nr_started], NULL, decode_thread, &job) == 0) {
+        nr_started++;
+    }
+    decode_thread(&job);
+    for (int i = 0; i < nr_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(decoded_buffer);
+    QKD_debug("Decoded %zu of %zu frames", job.nr_decoded, nr_frames);
+    QKD_return_success("%zu", job.nr_decoded);
+}
@@ -0,0 +1,53 @@
+/**
+ * qkd_ldpc.h
+ *
+ * One-way information reconciliation with LDPC (low-density parity-check) codes. The sender
+ * computes the syndrome of each frame of its raw key and sends all syndromes in a single message;
+ * the receiver corrects the errors in its own copy of the raw key by decoding it against the
+ * syndromes. Unlike interactive reconciliation (e.g. Cascade) this takes a single round trip, which
+ * matters more than CPU time on long-distance links.
+ *
+ * The codes form a rate-adaptive family: for a given QBER and target efficiency, pick the number
+ * of syndrome bits with QKD_ldpc_choose_syndrome_bits, and get the code with QKD_ldpc_code_get.
+ * Codes are constructed deterministically from the frame size and the number of syndrome bits, so
+ * both ends get the same code without exchanging it.
+ *
+ * The decoder is a layered normalized min-sum belief-propagation decoder with 16-bit fixed point
+ * messages. It decodes QKD_LDPC_LANES frames at once, one frame per SIMD lane (AVX2 when the CPU
+ * supports it, and a portable implementation with the same results otherwise), and can spread
+ * groups of frames over several threads.
+ *
+ * Frames and syndromes are bit strings, packed 8 bits per byte, least significant bit first.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#ifndef QKD_LDPC_H
+#define QKD_LDPC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define QKD_LDPC_LANES 16                   /* Frames decoded together */
+#define QKD_LDPC_RATE_STEPS 32              /* Syndrome sizes are multiples of frame_bits / this */
+#define QKD_LDPC_DEFAULT_EFFICIENCY 1.6     /* Syndrome bits / (frame bits * h(QBER)) */
+#define QKD_LDPC_DEFAULT_MAX_ITERATIONS 50
+
+typedef struct QKD_ldpc_code_st QKD_ldpc_code_t;
+
+size_t QKD_ldpc_choose_syndrome_bits(size_t frame_bits, double qber, double efficiency);
+const QKD_ldpc_code_t *QKD_ldpc_code_get(size_t frame_bits, size_t syndrome_bits);
+size_t QKD_ldpc_frame_bits(const QKD_ldpc_code_t *code);
+size_t QKD_ldpc_syndrome_bits(const QKD_ldpc_code_t *code);
+double QKD_ldpc_efficiency(const QKD_ldpc_code_t *code, double qber);
+
+void QKD_ldpc_syndrome(const QKD_ldpc_code_t *code, const unsigned char *frame,
+                       unsigned char *syndrome);
+size_t QKD_ldpc_decode(const QKD_ldpc_code_t *code, unsigned char *frames,
+                       const unsigned char *syndromes, size_t nr_frames, double qber,
+                       int max_iterations, int nr_threads, bool *decoded);
+bool QKD_ldpc_simd_enabled(void);
+
+#endif /* QKD_LDPC_H */
@@ -0,0 +1,562 @@
+/**
+ * qkd_link_emulator.c
+ *
+ * Emulation of the key delivery characteristics of a QKD link (see qkd_link_emulator.h).
+ *
+ * The key production of the link is modeled as a fluid: between two consecutive "change points"
+ * (the start or end of an outage, or a change of QBER) the link produces secret key at a constant
+ * rate, namely the configured key rate multiplied by the secret key fraction for the current QBER.
+ * Produced key accumulates in a buffer of limited size; key produced while the buffer is full is
+ * lost. Consumers may reserve key that has not been produced yet, which makes the amount of
+ * available key negative and makes subsequent consumers wait longer (first come, first served).
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#include "qkd_link_emulator.h"
+#include "qkd_debug.h"
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LINE_LEN 256
+
+/* Upper bound on the number of rate change points that QKD_link_emulator_time_available looks
+ * ahead, to guarantee termination when recurring outages are combined with a QBER that never
+ * allows key to be produced again. */
+#define MAX_LOOK_AHEAD_SEGMENTS 100000
+
+/**
+ * Set a link emulator configuration to the default values: an ideal link that produces 1 Mbit/s
+ * of key, buffers up to 10 Mbit, and has no latency, no outages, and no errors.
+ */
+void QKD_link_emulator_config_set_defaults(QKD_link_emulator_config_t *config)
+{
+    assert(config != NULL);
+    memset(config, 0, sizeof(*config));
+    config->key_rate_bps = 1e6;
+    config->key_buffer_bits = 1e7;
+    config->initial_key_bits = 0.0;
+    config->rendezvous_latency_ms = 0.0;
+    config->jitter_distribution = QKD_JITTER_NONE;
+    config->jitter_ms = 0.0;
+    config->pareto_shape = 2.5;
+    config->qber_threshold = 0.11;
+    config->reconciliation = QKD_RECONCILIATION_NONE;
+    config->reconciliation_efficiency = 1.0;
+    config->seed = 1;
+}
+
+/**
+ * Parse a jitter distribution name.
+ *
+ * Returns true on success, false if the name is not known.
+ */
+static bool parse_jitter_distribution(const char *str, QKD_jitter_distribution_t *distribution)
+{
+    static const struct {
+        const char *name;
+        QKD_jitter_distribution_t distribution;
+    } names[] = {
+        {"none", QKD_JITTER_NONE},
+        {"uniform", QKD_JITTER_UNIFORM},
+        {"normal", QKD_JITTER_NORMAL},
+        {"exponential", QKD_JITTER_EXPONENTIAL},
+        {"pareto", QKD_JITTER_PARETO}
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(str, names[i].name) == 0) {
+            *distribution = names[i].distribution;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Parse a reconciliation method name.
+ *
+ * Returns true on success, false if the name is not known.
+ */
+static bool parse_reconciliation(const char *str, QKD_reconciliation_t *reconciliation)
+{
+    if (strcmp(str, "none") == 0) {
+        *reconciliation = QKD_RECONCILIATION_NONE;
+    } else if (strcmp(str, "ldpc") == 0) {
+        *reconciliation = QKD_RECONCILIATION_LDPC;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Parse a value consisting of a given number of whitespace separated non-negative numbers.
+ *
+ * Returns true on success, false on failure.
+ */
+static bool parse_numbers(const char *str, double *numbers, int nr_numbers)
+{
+    const char *p = str;
+    for (int i = 0; i < nr_numbers; i++) {
+        char *end;
+        errno = 0;
+        numbers[i] = strtod(p, &end);
+        if (end == p || errno != 0 || numbers[i] < 0.0) {
+            return false;
+        }
+        p = end;
+    }
+    while (isspace((unsigned char) *p)) {
+        p++;
+    }
+    return *p == '\0';
+}
+
+/**
+ * Strip leading and trailing white space from a string (in place).
+ *
+ * Returns a pointer to the first non-white-space character.
+ */
+static char *strip(char *str)
+{
+    while (isspace((unsigned char) *str)) {
+        str++;
+    }
+    char *end = str + strlen(str);
+    while (end > str && isspace((unsigned char) end[-1])) {
+        *--end = '\0';
+    }
+    return str;
+}
+
+/**
+ * Apply one "name = value" line of a configuration file to a configuration.
+ *
+ * Returns true on success, false on failure.
+ */
+static bool apply_config_line(QKD_link_emulator_config_t *config, const char *name,
+                              const char *value)
+{
+    double numbers[2];
+    if (strcmp(name, "jitter_distribution") == 0) {
+        return parse_jitter_distribution(value, &config->jitter_distribution);
+    }
+    if (strcmp(name, "reconciliation") == 0) {
+        return parse_reconciliation(value, &config->reconciliation);
+    }
+    if (strcmp(name, "outage") == 0) {
+        if (config->nr_outages >= QKD_LINK_EMULATOR_MAX_OUTAGES ||
+            !parse_numbers(value, numbers, 2)) {
+            return false;
+        }
+        config->outages[config->nr_outages].start = numbers[0];
+        config->outages[config->nr_outages].duration = numbers[1];
+        config->nr_outages++;
+        return true;
+    }
+    if (strcmp(name, "qber") == 0) {
+        if (config->nr_qber_points >= QKD_LINK_EMULATOR_MAX_QBER_POINTS ||
+            !parse_numbers(value, numbers, 2) || numbers[1] > 0.5) {
+            return false;
+        }
+        size_t nr = config->nr_qber_points;
+        if (nr > 0 && config->qber_points[nr - 1].time >= numbers[0]) {
+            return false;   /* QBER points must be in increasing order of time */
+        }
+        config->qber_points[nr].time = numbers[0];
+        config->qber_points[nr].qber = numbers[1];
+        config->nr_qber_points++;
+        return true;
+    }
+    if (!parse_numbers(value, numbers, 1)) {
+        return false;
+    }
+    if (strcmp(name, "key_rate_bps") == 0) {
+        config->key_rate_bps = numbers[0];
+    } else if (strcmp(name, "key_buffer_bits") == 0) {
+        config->key_buffer_bits = numbers[0];
+    } else if (strcmp(name, "initial_key_bits") == 0) {
+        config->initial_key_bits = numbers[0];
+    } else if (strcmp(name, "rendezvous_latency_ms") == 0) {
+        config->rendezvous_latency_ms = numbers[0];
+    } else if (strcmp(name, "jitter_ms") == 0) {
+        config->jitter_ms = numbers[0];
+    } else if (strcmp(name, "pareto_shape") == 0) {
+        config->pareto_shape = numbers[0];
+    } else if (strcmp(name, "outage_period") == 0) {
+        config->outage_period = numbers[0];
+    } else if (strcmp(name, "outage_duration") == 0) {
+        config->outage_duration = numbers[0];
+    } else if (strcmp(name, "qber_threshold") == 0) {
+        config->qber_threshold = numbers[0];
+    } else if (strcmp(name, "reconciliation_efficiency") == 0) {
+        if (numbers[0] < 1.0) {
+            return false;
+        }
+        config->reconciliation_efficiency = numbers[0];
+    } else if (strcmp(name, "detection_probability") == 0) {
+        if (numbers[0] < 0.0 || numbers[0] > 1.0) {
+            return false;
+        }
+        config->detection_probability = numbers[0];
+    } else if (strcmp(name, "seed") == 0) {
+        config->seed = (uint64_t) numbers[0];
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Read a link emulator configuration file (see link_emulator.cnf for an example). Parameters that
+ * do not appear in the file keep the value they already had in config.
+ *
+ * Returns true on success, false on failure.
+ */
+bool QKD_link_emulator_read_config(const char *file_name, QKD_link_emulator_config_t *config)
+{
+    QKD_enter();
+    assert(file_name != NULL);
+    assert(config != NULL);
+
+    FILE *file = fopen(file_name, "r");
+    if (file == NULL) {
+        QKD_error_with_errno("fopen %s failed", file_name);
+        QKD_return_error("%d", false);
+    }
+
+    char line[MAX_LINE_LEN];
+    int line_nr = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_nr++;
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char *stripped = strip(line);
+        if (*stripped == '\0') {
+            continue;
+        }
+        char *equals = strchr(stripped, '=');
+        if (equals == NULL) {
+            QKD_error("%s:%d: expected name = value", file_name, line_nr);
+            fclose(file);
+            QKD_return_error("%d", false);
+        }
+        *equals = '\0';
+        char *name = strip(stripped);
+        char *value = strip(equals + 1);
+        if (!apply_config_line(config, name, value)) {
+            QKD_error("%s:%d: invalid parameter %s = %s", file_name, line_nr, name, value);
+            fclose(file);
+            QKD_return_error("%d", false);
+        }
+    }
+    fclose(file);
+
+    if (config->outage_period > 0.0 && config->outage_duration >= config->outage_period) {
+        QKD_error("%s: outage_duration must be less than outage_period", file_name);
+        QKD_return_error("%d", false);
+    }
+
+    QKD_return_success("%d", true);
+}
+
+/**
+ * Initialize a link emulator. The emulated time starts at zero.
+ */
+void QKD_link_emulator_init(QKD_link_emulator_t *emulator,
+                            const QKD_link_emulator_config_t *config)
+{
+    assert(emulator != NULL);
+    assert(config != NULL);
+    emulator->config = *config;
+    emulator->time = 0.0;
+    emulator->available_bits = fmin(config->initial_key_bits, config->key_buffer_bits);
+    emulator->random_state = config->seed ? config->seed : 1;
+}
+
+/**
+ * Binary entropy function.
+ */
+static double binary_entropy(double p)
+{
+    if (p <= 0.0 || p >= 1.0) {
+        return 0.0;
+    }
+    return -p * log2(p) - (1.0 - p) * log2(1.0 - p);
+}
+
+/**
+ * The fraction of the sifted key that remains as secret key after error correction and privacy
+ * amplification for a given QBER, using the asymptotic BB84 bound 1 - h(QBER) - f h(QBER), where
+ * f is the reconciliation efficiency (1 for ideal error correction). No key at all is produced at
+ * or above the configured QBER threshold.
+ */
+double QKD_link_emulator_secret_fraction(const QKD_link_emulator_t *emulator, double qber)
+{
+    if (qber >= emulator->config.qber_threshold) {
+        return 0.0;
+    }
+    double h = binary_entropy(qber);
+    return fmax(0.0, 1.0 - h - emulator->config.reconciliation_efficiency * h);
+}
+
+/**
+ * The QBER at a given time. The configured QBER points form a step function; before the first
+ * point the QBER is zero.
+ */
+double QKD_link_emulator_qber(const QKD_link_emulator_t *emulator, double time)
+{
+    double qber = 0.0;
+    for (size_t i = 0; i < emulator->config.nr_qber_points; i++) {
+        if (emulator->config.qber_points[i].time > time) {
+            break;
+        }
+        qber = emulator->config.qber_points[i].qber;
+    }
+    return qber;
+}
+
+/**
+ * Is the link in an outage at the given time? If so, and outage_end is not NULL, the end of the
+ * outage is stored in outage_end.
+ */
+bool QKD_link_emulator_in_outage(const QKD_link_emulator_t *emulator, double time,
+                                 double *outage_end)
+{
+    const QKD_link_emulator_config_t *config = &emulator->config;
+    bool in_outage = false;
+    double end = time;
+    for (size_t i = 0; i < config->nr_outages; i++) {
+        const QKD_outage_t *outage = &config->outages[i];
+        if (time >= outage->start && time < outage->start + outage->duration) {
+            in_outage = true;
+            end = fmax(end, outage->start + outage->duration);
+        }
+    }
+    if (config->outage_period > 0.0) {
+        double phase = fmod(time, config->outage_period);
+        if (phase >= config->outage_period - config->outage_duration) {
+            in_outage = true;
+            end = fmax(end, time - phase + config->outage_period);
+        }
+    }
+    if (outage_end) {
+        *outage_end = end;
+    }
+    return in_outage;
+}
+
+/**
+ * The rate (in bits/s) at which the link produces secret key at the given time.
+ */
+double QKD_link_emulator_key_rate(const QKD_link_emulator_t *emulator, double time)
+{
+    if (QKD_link_emulator_in_outage(emulator, time, NULL)) {
+        return 0.0;
+    }
+    double qber = QKD_link_emulator_qber(emulator, time);
+    return emulator->config.key_rate_bps * QKD_link_emulator_secret_fraction(emulator, qber);
+}
+
+/**
+ * The first time strictly after the given time at which the key rate may change, or INFINITY if
+ * the key rate never changes again.
+ */
+static double next_change_point(const QKD_link_emulator_t *emulator, double time)
+{
+    const QKD_link_emulator_config_t *config = &emulator->config;
+    double next = INFINITY;
+    for (size_t i = 0; i < config->nr_outages; i++) {
+        double start = config->outages[i].start;
+        double end = start + config->outages[i].duration;
+        if (start > time) {
+            next = fmin(next, start);
+        } else if (end > time) {
+            next = fmin(next, end);
+        }
+    }
+    if (config->outage_period > 0.0) {
+        double period_start = time - fmod(time, config->outage_period);
+        double outage_start = period_start + config->outage_period - config->outage_duration;
+        double outage_end = period_start + config->outage_period;
+        next = fmin(next, outage_start > time ? outage_start : outage_end);
+    }
+    for (size_t i = 0; i < config->nr_qber_points; i++) {
+        if (config->qber_points[i].time > time) {
+            next = fmin(next, config->qber_points[i].time);
+            break;
+        }
+    }
+    return next;
+}
+
+/**
+ * Advance the emulated link to the given time, adding the key produced in the meantime to the
+ * buffer. Time never goes backwards; advancing to an earlier time has no effect.
+ */
+static void advance(QKD_link_emulator_t *emulator, double time)
+{
+    double buffer = emulator->config.key_buffer_bits;
+    while (emulator->time < time) {
+        double segment_end = fmin(time, next_change_point(emulator, emulator->time));
+        double rate = QKD_link_emulator_key_rate(emulator, emulator->time);
+        double bits = emulator->available_bits + rate * (segment_end - emulator->time);
+        emulator->available_bits = fmin(bits, buffer);
+        emulator->time = segment_end;
+    }
+}
+
+/**
+ * The amount of key (in bits) available in the link at the given time. This is negative if more
+ * key has been reserved than has been produced so far.
+ */
+double QKD_link_emulator_available_bits(QKD_link_emulator_t *emulator, double time)
+{
+    advance(emulator, time);
+    return emulator->available_bits;
+}
+
+/**
+ * The earliest time, not before the given time, at which the given amount of key will be
+ * available (assuming nobody else consumes key in the meantime).
+ *
+ * Returns the time, or INFINITY if the key will never become available (the request is larger
+ * than the buffer, or the link stops producing key forever).
+ */
+double QKD_link_emulator_time_available(QKD_link_emulator_t *emulator, double bits, double time)
+{
+    advance(emulator, time);
+    if (emulator->available_bits >= bits) {
+        return time;
+    }
+    if (bits > emulator->config.key_buffer_bits || emulator->config.key_rate_bps <= 0.0) {
+        return INFINITY;
+    }
+    double available = emulator->available_bits;
+    double now = time;
+    for (int segment = 0; segment < MAX_LOOK_AHEAD_SEGMENTS; segment++) {
+        double rate = QKD_link_emulator_key_rate(emulator, now);
+        double segment_end = next_change_point(emulator, now);
+        if (rate > 0.0) {
+            double needed_time = (bits - available) / rate;
+            if (now + needed_time <= segment_end) {
+                return now + needed_time;
+            }
+        }
+        if (isinf(segment_end)) {
+            return INFINITY;
+        }
+        available = fmin(available + rate * (segment_end - now), emulator->config.key_buffer_bits);
+        now = segment_end;
+    }
+    return INFINITY;
+}
+
+/**
+ * Consume (or reserve, if it has not been produced yet) the given amount of key at the given time.
+ */
+void QKD_link_emulator_consume(QKD_link_emulator_t *emulator, double bits, double time)
+{
+    advance(emulator, time);
+    emulator->available_bits -= bits;
+}
+
+/**
+ * Return a uniformly distributed random number in the interval (0, 1). This uses xorshift64*,
+ * which is more than good enough for emulation and makes runs reproducible for a given seed.
+ */
+static double random_uniform(QKD_link_emulator_t *emulator)
+{
+    uint64_t x = emulator->random_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    emulator->random_state = x;
+    uint64_t r = x * 0x2545F4914F6CDD1DULL;
+    return ((r >> 11) + 0.5) / 9007199254740992.0;
+}
+
+/**
+ * Sample a rendezvous latency (in seconds): the fixed latency plus a random jitter drawn from the
+ * configured distribution. For the uniform distribution jitter_ms is the maximum deviation in
+ * either direction, for the normal distribution it is the standard deviation, and for the
+ * exponential and Pareto distributions it is the mean. The result is never negative.
+ */
+double QKD_link_emulator_sample_latency(QKD_link_emulator_t *emulator)
+{
+    const QKD_link_emulator_config_t *config = &emulator->config;
+    double jitter_ms = 0.0;
+    switch (config->jitter_distribution) {
+        case QKD_JITTER_NONE:
+            break;
+        case QKD_JITTER_UNIFORM:
+            jitter_ms = (2.0 * random_uniform(emulator) - 1.0) * config->jitter_ms;
+            break;
+        case QKD_JITTER_NORMAL: {
+            double u1 = random_uniform(emulator);
+            double u2 = random_uniform(emulator);
+            jitter_ms = sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2) * config->jitter_ms;
+            break;
+        }
+        case QKD_JITTER_EXPONENTIAL:
+            jitter_ms = -log(random_uniform(emulator)) * config->jitter_ms;
+            break;
+        case QKD_JITTER_PARETO: {
+            /* Lomax (Pareto type II) distribution scaled so that its mean is jitter_ms. */
+            double shape = config->pareto_shape > 1.0 ? config->pareto_shape : 1.01;
+            double scale = config->jitter_ms * (shape - 1.0);
+            jitter_ms = scale * (pow(random_uniform(emulator), -1.0 / shape) - 1.0);
+            break;
+        }
+    }
+    return fmax(0.0, config->rendezvous_latency_ms + jitter_ms) / 1000.0;
+}
+
+/**
+ * Flip each bit of a byte string with probability qber, as the quantum channel does to the raw key
+ * of the receiving end. The number of bits to skip until the next error is geometrically
+ * distributed, so this costs one random number per error rather than one per bit.
+ */
+void QKD_link_emulator_add_errors(QKD_link_emulator_t *emulator, unsigned char *bytes,
+                                  size_t nr_bytes, double qber)
+{
+    if (qber <= 0.0) {
+        return;
+    }
+    double nr_bits = nr_bytes * 8.0;
+    double log_keep = log1p(-fmin(qber, 0.5));
+    double bit = floor(log(random_uniform(emulator)) / log_keep);
+    while (bit < nr_bits) {
+        size_t index = (size_t) bit;
+        bytes[index / 8] ^= 1 << (index % 8);
+        bit += 1.0 + floor(log(random_uniform(emulator)) / log_keep);
+    }
+}
+
+/**
+ * Sample the next pulse, at or after the given pulse, in which the receiving end detects a photon,
+ * and the basis (0 or 1) in which it measures it. Like the errors in QKD_link_emulator_add_errors,
+ * the number of pulses until the next detection is geometrically distributed. The detection
+ * probability must be greater than zero.
+ *
+ * Returns the number of the pulse.
+ */
+uint64_t QKD_link_emulator_next_detection(QKD_link_emulator_t *emulator, uint64_t pulse,
+                                          unsigned char *basis)
+{
+    double probability = emulator->config.detection_probability;
+    assert(probability > 0.0);
+    if (probability < 1.0) {
+        pulse += (uint64_t) floor(log(random_uniform(emulator)) / log1p(-probability));
+    }
+    *basis = random_uniform(emulator) < 0.5;
+    return pulse;
+}
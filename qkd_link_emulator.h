@@ -0,0 +1,100 @@
+/**
+ * qkd_link_emulator.h
+ *
+ * Emulation of the key delivery characteristics of a QKD link: the rate at which the link produces
+ * secret key, how much key the link can buffer, the rendezvous latency and its jitter, outage
+ * windows, and changes of the Quantum Bit Error Rate (QBER) over time, which change the secret key
+ * rate. It can also inject bit errors at the current QBER, for exercising information
+ * reconciliation, and sample the detections of the receiving end, for exercising sifting. The mock
+ * implementation of the ETSI QKD API (see qkd_api_mock.c) uses it to make the mock link behave
+ * like a real link instead of delivering key instantly.
+ *
+ * The emulator does not read any clock itself. All functions take the current time (in seconds
+ * since the start of the emulation) as a parameter, so the emulator can also be driven by a
+ * simulated clock.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#ifndef QKD_LINK_EMULATOR_H
+#define QKD_LINK_EMULATOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define QKD_LINK_EMULATOR_MAX_OUTAGES 32
+#define QKD_LINK_EMULATOR_MAX_QBER_POINTS 32
+
+typedef enum {
+    QKD_JITTER_NONE = 0,
+    QKD_JITTER_UNIFORM,
+    QKD_JITTER_NORMAL,
+    QKD_JITTER_EXPONENTIAL,
+    QKD_JITTER_PARETO
+} QKD_jitter_distribution_t;
+
+typedef enum {
+    QKD_RECONCILIATION_NONE = 0,        /* Both ends get the same key (errors are not emulated) */
+    QKD_RECONCILIATION_LDPC             /* Errors are emulated and corrected (see qkd_ldpc.h) */
+} QKD_reconciliation_t;
+
+typedef struct QKD_outage_st {
+    double start;
+    double duration;
+} QKD_outage_t;
+
+typedef struct QKD_qber_point_st {
+    double time;
+    double qber;
+} QKD_qber_point_t;
+
+typedef struct QKD_link_emulator_config_st {
+    double key_rate_bps;                /* Key rate in bits/s when the QBER is zero */
+    double key_buffer_bits;             /* Maximum amount of unused key buffered by the link */
+    double initial_key_bits;            /* Amount of key buffered when the emulation starts */
+    double rendezvous_latency_ms;       /* Fixed part of the rendezvous latency */
+    QKD_jitter_distribution_t jitter_distribution;
+    double jitter_ms;                   /* Scale of the random part of the rendezvous latency */
+    double pareto_shape;                /* Shape parameter for Pareto distributed jitter */
+    size_t nr_outages;
+    QKD_outage_t outages[QKD_LINK_EMULATOR_MAX_OUTAGES];
+    double outage_period;               /* Period of recurring outages in seconds (0 = none) */
+    double outage_duration;             /* Duration of each recurring outage in seconds */
+    size_t nr_qber_points;
+    QKD_qber_point_t qber_points[QKD_LINK_EMULATOR_MAX_QBER_POINTS];
+    double qber_threshold;              /* No key is produced at or above this QBER */
+    QKD_reconciliation_t reconciliation;
+    double reconciliation_efficiency;   /* Bits disclosed for reconciliation / (h(QBER) * bits) */
+    double detection_probability;       /* Per pulse, for emulating sifting (0 = not emulated) */
+    uint64_t seed;
+} QKD_link_emulator_config_t;
+
+typedef struct QKD_link_emulator_st {
+    QKD_link_emulator_config_t config;
+    double time;                        /* Time up to which available_bits has been computed */
+    double available_bits;              /* Negative if key has been reserved ahead of production */
+    uint64_t random_state;
+} QKD_link_emulator_t;
+
+void QKD_link_emulator_config_set_defaults(QKD_link_emulator_config_t *config);
+bool QKD_link_emulator_read_config(const char *file_name, QKD_link_emulator_config_t *config);
+
+void QKD_link_emulator_init(QKD_link_emulator_t *emulator,
+                            const QKD_link_emulator_config_t *config);
+double QKD_link_emulator_secret_fraction(const QKD_link_emulator_t *emulator, double qber);
+double QKD_link_emulator_qber(const QKD_link_emulator_t *emulator, double time);
+bool QKD_link_emulator_in_outage(const QKD_link_emulator_t *emulator, double time,
+                                 double *outage_end);
+double QKD_link_emulator_key_rate(const QKD_link_emulator_t *emulator, double time);
+double QKD_link_emulator_available_bits(QKD_link_emulator_t *emulator, double time);
+double QKD_link_emulator_time_available(QKD_link_emulator_t *emulator, double bits, double time);
+void QKD_link_emulator_consume(QKD_link_emulator_t *emulator, double bits, double time);
+double QKD_link_emulator_sample_latency(QKD_link_emulator_t *emulator);
+void QKD_link_emulator_add_errors(QKD_link_emulator_t *emulator, unsigned char *bytes,
+                                  size_t nr_bytes, double qber);
+uint64_t QKD_link_emulator_next_detection(QKD_link_emulator_t *emulator, uint64_t pulse,
+                                          unsigned char *basis);
+
+#endif /* QKD_LINK_EMULATOR_H */
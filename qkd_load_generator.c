@@ -0,0 +1,717 @@
+/**
+ * qkd_load_generator.c
+ *
+ * A TLS load generator for sizing QKD-backed servers. It opens many concurrent TLS 1.2 connections
+ * (by default using the DHE-RSA-AES128-GCM-SHA256 cipher suite; the QKD engines also hijack ECDHE
+ * suites on the NIST curves, see --curves) to a server such as the OpenSSL demonstration server
+ * started by start_server.sh, and reports the achieved handshake and request rates, full latency
+ * distributions, and a breakdown of errors.
+ *
+ * The QKD client engine is loaded through the OpenSSL configuration file, in the same way as for
+ * openssl s_client (see run_load_test.sh).
+ *
+ * Each worker thread owns at most one connection at a time. For every request the worker either
+ * re-uses its current connection (keep-alive) or closes it and performs a new TCP connect and TLS
+ * handshake. The --keep-alive option sets the fraction of requests that re-use a connection.
+ *
+ * When a target rate is configured, requests are scheduled at fixed intervals across all workers
+ * (open loop) and latency is measured from the scheduled start time, so that queueing delay caused
+ * by a slow server is included in the reported latency instead of silently lowering the offered
+ * load.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#include "qkd_histogram.h"
+#include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_USEC 1000ULL
+
+#define MAX_ERROR_REASONS 32
+#define MAX_ERROR_REASON_LEN 128
+#define MAX_HEADER_LEN 8192
+
+typedef struct options_st {
+    char *host;
+    char *port;
+    int concurrency;
+    double rate;
+    double duration;
+    double keep_alive_ratio;
+    char *cipher;
+    char *curves;
+    char *ca_file;
+    int timeout_ms;
+    bool print_distribution;
+} options_t;
+
+typedef enum {
+    LOAD_ERROR_TCP_CONNECT = 0,
+    LOAD_ERROR_HANDSHAKE,
+    LOAD_ERROR_WRITE,
+    LOAD_ERROR_READ,
+    LOAD_ERROR_TIMEOUT,
+    LOAD_ERROR_NR_CATEGORIES
+} load_error_t;
+
+static const char *load_error_str[LOAD_ERROR_NR_CATEGORIES] = {
+    "tcp connect",
+    "tls handshake",
+    "write",
+    "read",
+    "timeout"
+};
+
+typedef struct error_reason_st {
+    load_error_t category;
+    char reason[MAX_ERROR_REASON_LEN];
+    uint64_t count;
+} error_reason_t;
+
+typedef struct stats_st {
+    uint64_t nr_handshakes;
+    uint64_t nr_requests;
+    uint64_t nr_reused;
+    uint64_t nr_server_closed;
+    uint64_t nr_errors[LOAD_ERROR_NR_CATEGORIES];
+    error_reason_t reasons[MAX_ERROR_REASONS];
+    size_t nr_reasons;
+    QKD_histogram_t handshake_latency;
+    QKD_histogram_t request_latency;
+} stats_t;
+
+typedef struct worker_st {
+    pthread_t thread;
+    int id;
+    unsigned int seed;
+    int sock;
+    SSL *ssl;
+    stats_t stats;
+} worker_t;
+
+typedef struct scheduler_st {
+    pthread_mutex_t mutex;
+    uint64_t next_ns;
+    uint64_t interval_ns;
+} scheduler_t;
+
+static options_t options = {
+    .host = "localhost",
+    .port = "44330",
+    .concurrency = 1,
+    .rate = 0.0,
+    .duration = 10.0,
+    .keep_alive_ratio = 0.0,
+    .cipher = "DHE-RSA-AES128-GCM-SHA256",
+    .curves = NULL,
+    .ca_file = "cert.pem",
+    .timeout_ms = 5000,
+    .print_distribution = false
+};
+
+static SSL_CTX *ssl_ctx = NULL;
+static struct addrinfo *server_address = NULL;
+static scheduler_t scheduler = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+static uint64_t end_ns = 0;
+static const char *request_str = "GET / HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n";
+
+/**
+ * Return the current time of the monotonic clock in nanoseconds.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * Sleep until the monotonic clock reaches the given time.
+ */
+static void sleep_until_ns(uint64_t when_ns)
+{
+    struct timespec ts = {
+        .tv_sec = when_ns / NSEC_PER_SEC,
+        .tv_nsec = when_ns % NSEC_PER_SEC
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+/**
+ * Claim the start time for the next request. If no target rate is configured, the start time is
+ * now (closed loop). Otherwise the start time is the next free slot in the global schedule, and
+ * this function sleeps until that slot.
+ *
+ * Returns the scheduled start time in nanoseconds.
+ */
+static uint64_t schedule_request(void)
+{
+    if (scheduler.interval_ns == 0) {
+        return now_ns();
+    }
+    pthread_mutex_lock(&scheduler.mutex);
+    uint64_t slot_ns = scheduler.next_ns;
+    scheduler.next_ns += scheduler.interval_ns;
+    pthread_mutex_unlock(&scheduler.mutex);
+    sleep_until_ns(slot_ns);
+    return slot_ns;
+}
+
+/**
+ * Count an error in the statistics of a worker, together with the most specific reason that we
+ * can find for it (the OpenSSL error queue, errno, or a fixed description).
+ */
+static void record_error(worker_t *worker, load_error_t category, const char *reason)
+{
+    char reason_buf[MAX_ERROR_REASON_LEN];
+    unsigned long ssl_error = ERR_get_error();
+    if (reason == NULL && ssl_error != 0) {
+        const char *ssl_reason = ERR_reason_error_string(ssl_error);
+        snprintf(reason_buf, sizeof(reason_buf), "%s", ssl_reason ? ssl_reason : "unknown");
+        reason = reason_buf;
+    } else if (reason == NULL) {
+        snprintf(reason_buf, sizeof(reason_buf), "%s", errno ? strerror(errno) : "unknown");
+        reason = reason_buf;
+    }
+    ERR_clear_error();
+
+    stats_t *stats = &worker->stats;
+    stats->nr_errors[category]++;
+    for (size_t i = 0; i < stats->nr_reasons; i++) {
+        if (stats->reasons[i].category == category &&
+            strcmp(stats->reasons[i].reason, reason) == 0) {
+            stats->reasons[i].count++;
+            return;
+        }
+    }
+    if (stats->nr_reasons < MAX_ERROR_REASONS) {
+        error_reason_t *new_reason = &stats->reasons[stats->nr_reasons++];
+        new_reason->category = category;
+        snprintf(new_reason->reason, sizeof(new_reason->reason), "%s", reason);
+        new_reason->count = 1;
+    }
+}
+
+/**
+ * Close the current connection of a worker, if it has one.
+ */
+static void close_connection(worker_t *worker)
+{
+    if (worker->ssl != NULL) {
+        SSL_shutdown(worker->ssl);
+        SSL_free(worker->ssl);
+        worker->ssl = NULL;
+    }
+    if (worker->sock != -1) {
+        close(worker->sock);
+        worker->sock = -1;
+    }
+}
+
+/**
+ * Open a new connection for a worker: TCP connect followed by a full TLS handshake. The time taken
+ * by both is recorded in the handshake latency histogram.
+ *
+ * Returns true on success, false on failure (the error has been recorded).
+ */
+static bool open_connection(worker_t *worker)
+{
+    assert(worker->ssl == NULL);
+    assert(worker->sock == -1);
+    uint64_t start_ns = now_ns();
+
+    int sock = socket(server_address->ai_family, SOCK_STREAM, 0);
+    if (sock == -1) {
+        record_error(worker, LOAD_ERROR_TCP_CONNECT, NULL);
+        return false;
+    }
+    struct timeval timeout = {
+        .tv_sec = options.timeout_ms / 1000,
+        .tv_usec = (options.timeout_ms % 1000) * 1000
+    };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    int on = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(sock, server_address->ai_addr, server_address->ai_addrlen) != 0) {
+        record_error(worker, LOAD_ERROR_TCP_CONNECT, NULL);
+        close(sock);
+        return false;
+    }
+    worker->sock = sock;
+
+    worker->ssl = SSL_new(ssl_ctx);
+    if (worker->ssl == NULL) {
+        record_error(worker, LOAD_ERROR_HANDSHAKE, NULL);
+        close_connection(worker);
+        return false;
+    }
+    SSL_set_fd(worker->ssl, sock);
+    SSL_set_tlsext_host_name(worker->ssl, options.host);
+    int result = SSL_connect(worker->ssl);
+    if (result != 1) {
+        int ssl_error = SSL_get_error(worker->ssl, result);
+        if (ssl_error == SSL_ERROR_SYSCALL && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            record_error(worker, LOAD_ERROR_TIMEOUT, "handshake timed out");
+        } else {
+            record_error(worker, LOAD_ERROR_HANDSHAKE, NULL);
+        }
+        close_connection(worker);
+        return false;
+    }
+
+    worker->stats.nr_handshakes++;
+    QKD_histogram_record(&worker->stats.handshake_latency, (now_ns() - start_ns) / NSEC_PER_USEC);
+    return true;
+}
+
+/**
+ * Parse the value of the Content-Length header from a buffer containing the complete response
+ * headers.
+ *
+ * Returns the content length, or -1 if there is no Content-Length header.
+ */
+static long parse_content_length(const char *headers)
+{
+    const char *p = headers;
+    while ((p = strchr(p, '\n')) != NULL) {
+        p++;
+        if (strncasecmp(p, "Content-Length:", 15) == 0) {
+            return strtol(p + 15, NULL, 10);
+        }
+    }
+    return -1;
+}
+
+/**
+ * Read one response from the current connection of a worker. The response is complete when the
+ * announced Content-Length has been received, or when the server closes the connection (which is
+ * what the OpenSSL demonstration server does after every response). In the latter case
+ * server_closed is set to true and the connection can not be re-used.
+ *
+ * Returns true if a response was received, false on failure (the error has been recorded).
+ */
+static bool read_response(worker_t *worker, bool *server_closed)
+{
+    char headers[MAX_HEADER_LEN + 1];
+    size_t headers_len = 0;
+    long header_end = -1;
+    long content_length = -1;
+    size_t total_len = 0;
+    char buffer[16384];
+
+    *server_closed = false;
+    while (true) {
+        int result = SSL_read(worker->ssl, buffer, sizeof(buffer));
+        if (result <= 0) {
+            int ssl_error = SSL_get_error(worker->ssl, result);
+            if (ssl_error == SSL_ERROR_ZERO_RETURN ||
+                (ssl_error == SSL_ERROR_SYSCALL && errno == 0)) {
+                *server_closed = true;
+                if (total_len == 0) {
+                    record_error(worker, LOAD_ERROR_READ, "connection closed before response");
+                    return false;
+                }
+                return true;
+            }
+            if (ssl_error == SSL_ERROR_SYSCALL && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                record_error(worker, LOAD_ERROR_TIMEOUT, "response timed out");
+            } else {
+                record_error(worker, LOAD_ERROR_READ, NULL);
+            }
+            return false;
+        }
+        total_len += result;
+        if (header_end < 0) {
+            size_t copy_len = result;
+            if (copy_len > MAX_HEADER_LEN - headers_len) {
+                copy_len = MAX_HEADER_LEN - headers_len;
+            }
+            memcpy(headers + headers_len, buffer, copy_len);
+            headers_len += copy_len;
+            headers[headers_len] = '\0';
+            char *end = strstr(headers, "\r\n\r\n");
+            if (end != NULL) {
+                header_end = end - headers + 4;
+                content_length = parse_content_length(headers);
+            }
+        }
+        if (header_end >= 0 && content_length >= 0 &&
+            total_len >= (size_t) header_end + content_length) {
+            return true;
+        }
+    }
+}
+
+/**
+ * Send one request on the current connection of a worker and wait for the response.
+ *
+ * Returns true on success, false on failure (the error has been recorded and the connection has
+ * been closed).
+ */
+static bool do_request(worker_t *worker)
+{
+    int request_len = strlen(request_str);
+    int result = SSL_write(worker->ssl, request_str, request_len);
+    if (result != request_len) {
+        record_error(worker, LOAD_ERROR_WRITE, NULL);
+        close_connection(worker);
+        return false;
+    }
+    bool server_closed = false;
+    if (!read_response(worker, &server_closed)) {
+        close_connection(worker);
+        return false;
+    }
+    if (server_closed) {
+        worker->stats.nr_server_closed++;
+        close_connection(worker);
+    }
+    return true;
+}
+
+/**
+ * Main loop of a worker thread: issue requests until the configured duration has passed.
+ */
+static void *worker_main(void *arg)
+{
+    worker_t *worker = arg;
+    while (true) {
+        uint64_t start_ns = schedule_request();
+        if (start_ns >= end_ns) {
+            break;
+        }
+        bool reuse = false;
+        if (worker->ssl != NULL) {
+            double draw = rand_r(&worker->seed) / (RAND_MAX + 1.0);
+            reuse = draw < options.keep_alive_ratio;
+        }
+        if (reuse) {
+            worker->stats.nr_reused++;
+        } else {
+            close_connection(worker);
+            if (!open_connection(worker)) {
+                continue;
+            }
+        }
+        if (do_request(worker)) {
+            worker->stats.nr_requests++;
+            QKD_histogram_record(&worker->stats.request_latency,
+                                 (now_ns() - start_ns) / NSEC_PER_USEC);
+        }
+    }
+    close_connection(worker);
+    return NULL;
+}
+
+/**
+ * Add the statistics of one worker to the totals.
+ */
+static void merge_stats(stats_t *total, const stats_t *stats)
+{
+    total->nr_handshakes += stats->nr_handshakes;
+    total->nr_requests += stats->nr_requests;
+    total->nr_reused += stats->nr_reused;
+    total->nr_server_closed += stats->nr_server_closed;
+    for (int i = 0; i < LOAD_ERROR_NR_CATEGORIES; i++) {
+        total->nr_errors[i] += stats->nr_errors[i];
+    }
+    for (size_t i = 0; i < stats->nr_reasons; i++) {
+        const error_reason_t *reason = &stats->reasons[i];
+        size_t j;
+        for (j = 0; j < total->nr_reasons; j++) {
+            if (total->reasons[j].category == reason->category &&
+                strcmp(total->reasons[j].reason, reason->reason) == 0) {
+                total->reasons[j].count += reason->count;
+                break;
+            }
+        }
+        if (j == total->nr_reasons && total->nr_reasons < MAX_ERROR_REASONS) {
+            total->reasons[total->nr_reasons++] = *reason;
+        }
+    }
+    QKD_histogram_merge(&total->handshake_latency, &stats->handshake_latency);
+    QKD_histogram_merge(&total->request_latency, &stats->request_latency);
+}
+
+/**
+ * Print the final report.
+ */
+static void print_report(const stats_t *total, double elapsed)
+{
+    printf("Target:      %s:%s cipher %s\n", options.host, options.port, options.cipher);
+    printf("Load:        concurrency %d, rate ", options.concurrency);
+    if (options.rate > 0.0) {
+        printf("%.1f req/s", options.rate);
+    } else {
+        printf("unlimited");
+    }
+    printf(", keep-alive ratio %.2f, duration %.2f s\n", options.keep_alive_ratio, elapsed);
+    printf("Handshakes:  %llu (%.1f /s)\n", (unsigned long long) total->nr_handshakes,
+           total->nr_handshakes / elapsed);
+    printf("Requests:    %llu (%.1f /s), %llu on re-used connections, %llu connections closed by "
+           "server\n",
+           (unsigned long long) total->nr_requests, total->nr_requests / elapsed,
+           (unsigned long long) total->nr_reused, (unsigned long long) total->nr_server_closed);
+    QKD_histogram_print_summary(&total->handshake_latency, stdout, "Handshake latency", "us");
+    QKD_histogram_print_summary(&total->request_latency, stdout, "Request latency", "us");
+
+    uint64_t nr_errors = 0;
+    for (int i = 0; i < LOAD_ERROR_NR_CATEGORIES; i++) {
+        nr_errors += total->nr_errors[i];
+    }
+    printf("Errors:      %llu\n", (unsigned long long) nr_errors);
+    for (int i = 0; i < LOAD_ERROR_NR_CATEGORIES; i++) {
+        if (total->nr_errors[i] == 0) {
+            continue;
+        }
+        printf("  %-14s %llu\n", load_error_str[i], (unsigned long long) total->nr_errors[i]);
+        for (size_t j = 0; j < total->nr_reasons; j++) {
+            if (total->reasons[j].category == (load_error_t) i) {
+                printf("    %8llu  %s\n", (unsigned long long) total->reasons[j].count,
+                       total->reasons[j].reason);
+            }
+        }
+    }
+
+    if (options.print_distribution) {
+        QKD_histogram_print_distribution(&total->handshake_latency, stdout, "Handshake latency",
+                                         "us");
+        QKD_histogram_print_distribution(&total->request_latency, stdout, "Request latency", "us");
+    }
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -c, --connect HOST:PORT    Server to connect to (default localhost:44330)\n"
+            "  -n, --concurrency N        Number of concurrent connections (default 1)\n"
+            "  -r, --rate R               Target request rate per second across all\n"
+            "                             connections; 0 means as fast as possible (default 0)\n"
+            "  -d, --duration SECONDS     Duration of the test (default 10)\n"
+            "  -k, --keep-alive RATIO     Fraction of requests (0.0 - 1.0) that re-use an open\n"
+            "                             connection instead of doing a new handshake (default 0)\n"
+            "  -C, --cipher LIST          TLS 1.2 cipher list (default DHE-RSA-AES128-GCM-SHA256)\n"
+            "  -G, --curves LIST          Curves offered for ECDHE cipher suites, e.g. P-256\n"
+            "                             (default: the OpenSSL default list)\n"
+            "  -A, --CAfile FILE          CA certificate file for verifying the server; empty\n"
+            "                             string disables verification (default cert.pem)\n"
+            "  -t, --timeout MS           Socket timeout in milliseconds (default 5000)\n"
+            "  -H, --histogram            Also print the full latency distributions\n"
+            "  -h, --help                 Print this help\n",
+            program);
+}
+
+/**
+ * Parse the command line options into the global options.
+ *
+ * Returns true on success, false on failure.
+ */
+static bool parse_options(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"connect", required_argument, NULL, 'c'},
+        {"concurrency", required_argument, NULL, 'n'},
+        {"rate", required_argument, NULL, 'r'},
+        {"duration", required_argument, NULL, 'd'},
+        {"keep-alive", required_argument, NULL, 'k'},
+        {"cipher", required_argument, NULL, 'C'},
+        {"curves", required_argument, NULL, 'G'},
+        {"CAfile", required_argument, NULL, 'A'},
+        {"timeout", required_argument, NULL, 't'},
+        {"histogram", no_argument, NULL, 'H'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:n:r:d:k:C:G:A:t:Hh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'c': {
+                char *colon = strrchr(optarg, ':');
+                if (colon == NULL) {
+                    fprintf(stderr, "Invalid --connect value %s (expected HOST:PORT)\n", optarg);
+                    return false;
+                }
+                *colon = '\0';
+                options.host = optarg;
+                options.port = colon + 1;
+                break;
+            }
+            case 'n':
+                options.concurrency = atoi(optarg);
+                break;
+            case 'r':
+                options.rate = atof(optarg);
+                break;
+            case 'd':
+                options.duration = atof(optarg);
+                break;
+            case 'k':
+                options.keep_alive_ratio = atof(optarg);
+                break;
+            case 'C':
+                options.cipher = optarg;
+                break;
+            case 'G':
+                options.curves = optarg;
+                break;
+            case 'A':
+                options.ca_file = optarg;
+                break;
+            case 't':
+                options.timeout_ms = atoi(optarg);
+                break;
+            case 'H':
+                options.print_distribution = true;
+                break;
+            default:
+                return false;
+        }
+    }
+    if (options.concurrency < 1 || options.duration <= 0.0 || options.rate < 0.0 ||
+        options.keep_alive_ratio < 0.0 || options.keep_alive_ratio > 1.0 ||
+        options.timeout_ms < 1) {
+        fprintf(stderr, "Invalid option value\n");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Create the TLS client context shared by all workers. Session caching and tickets are disabled so
+ * that every new connection performs a full handshake (and hence a full QKD key exchange).
+ *
+ * Returns true on success, false on failure.
+ */
+static bool create_ssl_ctx(void)
+{
+    /* Loading the configuration file (OPENSSL_CONF) loads the QKD client engine. */
+    if (OPENSSL_init_ssl(OPENSSL_INIT_LOAD_CONFIG, NULL) != 1) {
+        ERR_print_errors_fp(stderr);
+        return false;
+    }
+    ssl_ctx = SSL_CTX_new(TLS_client_method());
+    if (ssl_ctx == NULL) {
+        ERR_print_errors_fp(stderr);
+        return false;
+    }
+    SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(ssl_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_TICKET);
+    if (SSL_CTX_set_cipher_list(ssl_ctx, options.cipher) != 1) {
+        fprintf(stderr, "Invalid cipher list %s\n", options.cipher);
+        return false;
+    }
+    if (options.curves != NULL && SSL_CTX_set1_curves_list(ssl_ctx, options.curves) != 1) {
+        fprintf(stderr, "Invalid curves list %s\n", options.curves);
+        return false;
+    }
+    if (options.ca_file != NULL && options.ca_file[0] != '\0') {
+        if (SSL_CTX_load_verify_locations(ssl_ctx, options.ca_file, NULL) != 1) {
+            fprintf(stderr, "Could not load CA file %s\n", options.ca_file);
+            ERR_print_errors_fp(stderr);
+            return false;
+        }
+        SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_PEER, NULL);
+    }
+    return true;
+}
+
+/**
+ * Resolve the server address once, up front, so that name resolution is not part of the measured
+ * latency.
+ *
+ * Returns true on success, false on failure.
+ */
+static bool resolve_server_address(void)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int result = getaddrinfo(options.host, options.port, &hints, &server_address);
+    if (result != 0) {
+        fprintf(stderr, "Could not resolve %s:%s: %s\n", options.host, options.port,
+                gai_strerror(result));
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (!parse_options(argc, argv)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!create_ssl_ctx() || !resolve_server_address()) {
+        return 1;
+    }
+
+    worker_t *workers = calloc(options.concurrency, sizeof(worker_t));
+    if (workers == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    uint64_t start_ns = now_ns();
+    end_ns = start_ns + (uint64_t) (options.duration * NSEC_PER_SEC);
+    scheduler.next_ns = start_ns;
+    scheduler.interval_ns = options.rate > 0.0 ? (uint64_t) (NSEC_PER_SEC / options.rate) : 0;
+
+    for (int i = 0; i < options.concurrency; i++) {
+        worker_t *worker = &workers[i];
+        worker->id = i;
+        worker->seed = (unsigned int) (start_ns + i);
+        worker->sock = -1;
+        worker->ssl = NULL;
+        QKD_histogram_init(&worker->stats.handshake_latency);
+        QKD_histogram_init(&worker->stats.request_latency);
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            return 1;
+        }
+    }
+
+    stats_t *total = calloc(1, sizeof(stats_t));
+    if (total == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    QKD_histogram_init(&total->handshake_latency);
+    QKD_histogram_init(&total->request_latency);
+    for (int i = 0; i < options.concurrency; i++) {
+        pthread_join(workers[i].thread, NULL);
+        merge_stats(total, &workers[i].stats);
+    }
+    double elapsed = (now_ns() - start_ns) / (double) NSEC_PER_SEC;
+
+    print_report(total, elapsed);
+
+    free(total);
+    free(workers);
+    freeaddrinfo(server_address);
+    SSL_CTX_free(ssl_ctx);
+    return 0;
+}
@@ -0,0 +1,149 @@
+/**
+ * qkd_mock.h
+ *
+ * The internals of the mock implementation of the QKD API that its files share: the links (see
+ * qkd_api_mock.c), the link protocol (see qkd_mock_protocol.h), the per-thread magazines of key
+ * stream (see qkd_mock_magazine.h), and the replication of the server's key manager (see
+ * qkd_mock_replication.h). Nothing outside the mock implementation includes this file.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#ifndef QKD_MOCK_H
+#define QKD_MOCK_H
+
+#include "qkd_api.h"
+#include "qkd_auth.h"
+#include "qkd_key_store.h"
+#include "qkd_ldpc.h"
+#include "qkd_secure_arena.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* The server generates the key stream in blocks of this size. Keys are allocated such that they
+ * never straddle two blocks, so this is also the maximum key size. */
+#define KEY_BLOCK_SIZE QKD_SECURE_ARENA_MAX_SIZE
+
+/* The most blocks of the key stream that a link has in flight (see QKD_mock_pipeline_window). */
+#define MAX_PIPELINE_WINDOW 16
+
+/* Reconciliation of emulated errors (see send_block_ldpc in qkd_mock_protocol.c): each block
+ * consists of a few frames, which are decoded together. Longer frames need fewer syndrome bits;
+ * 4096 bits is enough to correct nearly all frames at a reconciliation efficiency of 1.6. */
+#define LDPC_FRAMES_PER_BLOCK 4
+#define LDPC_FRAME_SIZE (KEY_BLOCK_SIZE / LDPC_FRAMES_PER_BLOCK)
+#define LDPC_FRAME_BITS (8 * LDPC_FRAME_SIZE)
+#define LDPC_DIGEST_SIZE 32
+#define LDPC_PARAMS_SIZE (16 + LDPC_DIGEST_SIZE)
+
+/* Links to several key manager endpoints (see link_endpoints in qkd_api_mock.c). */
+#define MAX_LINKS 16
+#define MAX_ENDPOINT_LEN 63
+
+/* The most blocks of a previous link that are resumed (see RESUME_STATE). */
+#define MAX_RESUME_BLOCKS (QKD_KEY_STORE_DEFAULT_PEER_CAP_BYTES / KEY_BLOCK_SIZE)
+
+/* Key handles start with a magic byte (which also keeps them non-null). The key store (see
+ * qkd_key_store.h) uses the same format to identify the blocks of the key stream and the chunks of
+ * authentication pads. */
+#define KEY_HANDLE_MAGIC 0x49   /* Link id, offset, length (64 bits each), magazine (8 bits, the
+                                 * index plus one, 0 if the key is in the key store) */
+#define BLOCK_HANDLE_MAGIC 0x42 /* Link id, block index (64 bits) */
+#define AUTH_HANDLE_MAGIC 0x41  /* Direction (8 bits), chunk index (64 bits) */
+
+/* Blocks of a previous link that were synchronized but never allocated, and that can become the
+ * first blocks of the next link to the same endpoint. They are kept in the key store of the
+ * resume_peer of the link under their block handles of the previous link. */
+typedef struct resume_state_st {
+    uint64_t link_id;
+    uint64_t first_block;
+    uint64_t nr_blocks;
+} RESUME_STATE;
+
+/* The authentication state of a link (see qkd_mock_protocol.h): the chunks of one-time pads of
+ * each direction are kept in the key store of the auth_peer of the link. */
+typedef struct link_auth_st {
+    QKD_auth_t receiving;               /* Running hash of the message being received */
+    uint64_t next_pad[2];               /* Per direction */
+    uint64_t nr_chunks;                 /* Per direction */
+} LINK_AUTH;
+
+typedef struct qkd_link_st QKD_LINK;
+
+/* Client: a block in the pipeline of a link, from when it is received until it is added to the key
+ * stream (or rejected). The blocks of a link are kept in a ring of jobs, by sequence number, and
+ * the buffers of the jobs are reused for the blocks that come after them. */
+typedef struct block_job_st {
+    QKD_LINK *link;
+    unsigned char *block;               /* In secure memory */
+    unsigned char *syndromes;           /* For LDPC reconciliation */
+    const QKD_ldpc_code_t *code;
+    double qber;
+    unsigned char digest[LDPC_DIGEST_SIZE];
+    bool corrected;
+    bool done;                          /* Set by the worker thread, atomically */
+} BLOCK_JOB;
+
+struct qkd_link_st {
+    char endpoint[MAX_ENDPOINT_LEN + 1];    /* Host name or address, optionally with a port, or
+                                         * several alternatives (see endpoint_alternative in
+                                         * qkd_api_mock.c) */
+    size_t alternative;                 /* Client: the alternative that was connected last */
+    uint16_t port;                      /* Server: the port of the endpoint, which it listens on */
+    int listen_sock;                    /* Server */
+    pthread_t thread;                   /* Client: the link thread of this link */
+    bool up;
+    int sock;
+    uint64_t id;                        /* Chosen by the server, new for every link connection */
+    char peer[MAX_ENDPOINT_LEN + 1];    /* The blocks are kept in the key store of this peer */
+    char resume_peer[16];
+    char auth_peer[16];
+    char next_auth_peer[16];            /* Server: for the pads of the next link connection, until
+                                         * it replaces the current one */
+    uint64_t nr_blocks_synced;          /* Blocks that are present at both ends */
+    uint64_t next_offset;               /* Server: first unallocated offset in the key stream */
+    uint64_t next_block_seq;            /* The sequence number of the next block to be sent (the
+                                         * client: to be received) */
+    uint64_t oldest_block_seq;          /* Server: the oldest block that has not been acked yet
+                                         * (the client: that has not been added or rejected) */
+    unsigned char *blocks_in_flight[MAX_PIPELINE_WINDOW];   /* Server: by sequence number */
+    double block_sent_times[MAX_PIPELINE_WINDOW];
+    unsigned char *sift_results[MAX_PIPELINE_WINDOW];   /* Server: the MESSAGE_SIFT_RESULT that
+                                         * is expected for a block in flight, until it arrives */
+    size_t sift_result_sizes[MAX_PIPELINE_WINDOW];
+    BLOCK_JOB *jobs;                    /* Client: the ring of jobs, by sequence number */
+    int done_pipe[2];                   /* Client: a worker writes to it when a job is done */
+    double block_ready_time;            /* Server: when the emulated link has produced the next
+                                         * block (NAN if it has not been reserved yet) */
+    unsigned nr_waiting;                /* Server: QKD_open calls waiting for key on this link */
+    uint64_t nr_allocated;              /* Server: keys allocated from this link (not counting the
+                                         * keys in magazines until their chunk is discarded) */
+    uint64_t watermark;                 /* Active server: while replicating, key is allocated only
+                                         * below this offset (acknowledged by the standby) */
+    uint64_t watermark_requested;       /* Active server: the watermark sent to the standby */
+    uint64_t watermark_seq;             /* Active server: its replication record (0 if acked) */
+    RESUME_STATE resume;                /* Standby server: the replicated blocks of the link */
+    LINK_AUTH auth;
+};
+
+/* The links, and the state that goes with them (see qkd_api_mock.c). */
+extern QKD_LINK QKD_mock_links[MAX_LINKS];
+extern size_t QKD_mock_nr_links;
+extern pthread_mutex_t QKD_mock_link_mutex;
+extern pthread_cond_t QKD_mock_link_changed;
+extern bool QKD_mock_server;
+extern uint64_t QKD_mock_pipeline_window;
+
+void QKD_mock_encode_key_handle(uint64_t link_id, uint64_t offset, uint32_t length,
+                                unsigned magazine, QKD_key_handle_t *key_handle);
+void QKD_mock_encode_block_handle(uint64_t link_id, uint64_t block_index,
+                                  QKD_key_handle_t *block_handle);
+QKD_LINK *QKD_mock_choose_link(uint32_t length);
+uint64_t QKD_mock_allocation_offset(const QKD_LINK *link, uint32_t length);
+void QKD_mock_wake_link_thread(void);
+QKD_result_t QKD_mock_server_start_links(void);
+
+#endif /* QKD_MOCK_H */
@@ -0,0 +1,401 @@
+/**
+ * qkd_mock_magazine.c
+ *
+ * Per-thread magazines of key stream for the server of the mock implementation of the QKD API (see
+ * qkd_mock_magazine.h).
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#include "qkd_mock_magazine.h"
+#include "qkd_mock_replication.h"
+#include "qkd_debug.h"
+#include "qkd_key_store.h"
+#include "qkd_secure_arena.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Per-thread magazines of reserved key stream (see MAGAZINE). */
+#define MAX_MAGAZINES 255       /* The index plus one must fit in a byte of the key handle */
+#define MAGAZINE_MAX_CHUNKS 8
+#define DEFAULT_MAGAZINE_BYTES (KEY_BLOCK_SIZE / 2)
+#define MAGAZINE_SHARE 4        /* A refill takes at most 1/MAGAZINE_SHARE of the available key */
+
+/* Server: a magazine is a small stash of key stream that one thread has reserved from a link, in
+ * the style of the per-thread caches of a memory allocator (see also qkd_secure_arena.c). A refill
+ * (see magazine_refill) allocates a chunk of up to magazine_bytes from a link under
+ * QKD_mock_link_mutex, as QKD_open would for a single key, and takes the key material of the chunk
+ * out of the key store. QKD_open then allocates the keys of the thread from its magazine, and
+ * QKD_connect_blocking and QKD_get_key read them from it, without taking QKD_mock_link_mutex or the
+ * key store lock. The key handle says which magazine holds the key, so that another thread can
+ * still get it.
+ *
+ * For the client, and for the resumption and replication of the key stream, a reserved chunk is
+ * allocated key like any other: the client keeps its copy in its key store until it is obtained
+ * or evicted, and the key that was reserved but not handed out is never allocated again.
+ *
+ * Each magazine has a mutex of its own. Only its owner takes it, except to get a key that was
+ * allocated by another thread, and to discard the chunks of a link that is down (see
+ * QKD_mock_magazines_discard). A thread claims a magazine the first time it needs one, and its
+ * chunks are discarded when it exits (see magazine_release). */
+typedef struct magazine_chunk_st {
+    size_t link_index;
+    uint64_t link_id;
+    uint64_t start;                     /* The offset of the chunk in the key stream */
+    uint64_t next;                      /* The first offset that has not been allocated yet */
+    uint64_t end;
+    uint64_t consumed;                  /* Bytes of allocated keys that were obtained */
+    uint64_t nr_keys;                   /* Keys that were allocated */
+    char *key;                          /* The key stream from start to end, in secure memory */
+    unsigned char obtained[KEY_BLOCK_SIZE / 8];     /* A bit for every byte that was obtained */
+} MAGAZINE_CHUNK;
+
+typedef struct magazine_st {
+    pthread_mutex_t mutex;
+    bool owned;                         /* Claimed by a thread (set atomically) */
+    size_t nr_chunks;
+    MAGAZINE_CHUNK chunks[MAGAZINE_MAX_CHUNKS];     /* Oldest first, allocating from the newest */
+} __attribute__((aligned(64))) MAGAZINE;
+
+static MAGAZINE magazines[MAX_MAGAZINES];
+static size_t magazine_bytes;           /* 0 if magazines are disabled */
+static pthread_once_t magazine_once = PTHREAD_ONCE_INIT;
+static pthread_key_t magazine_thread_key;
+static bool magazine_key_created = false;
+static __thread MAGAZINE *thread_magazine = NULL;
+static __thread bool thread_magazine_claimed = false;
+
+/**
+ * Server: is the link that a magazine chunk was reserved from still up? The fields up and id of
+ * the link are read without taking QKD_mock_link_mutex (see QKD_mock_links).
+ */
+static bool chunk_current(const MAGAZINE_CHUNK *chunk)
+{
+    const QKD_LINK *link = &QKD_mock_links[chunk->link_index];
+    return __atomic_load_n(&link->up, __ATOMIC_ACQUIRE) &&
+           __atomic_load_n(&link->id, __ATOMIC_ACQUIRE) == chunk->link_id;
+}
+
+/**
+ * Server: discard (and zeroize) a chunk of a magazine, and count the keys that were allocated
+ * from it. Must be called with the mutex of the magazine held.
+ */
+static void remove_chunk(MAGAZINE *magazine, size_t index)
+{
+    MAGAZINE_CHUNK *chunk = &magazine->chunks[index];
+    __atomic_add_fetch(&QKD_mock_links[chunk->link_index].nr_allocated, chunk->nr_keys,
+                       __ATOMIC_RELAXED);
+    QKD_secure_free(chunk->key);
+    memmove(chunk, chunk + 1, (magazine->nr_chunks - index - 1) * sizeof(*chunk));
+    magazine->nr_chunks--;
+}
+
+/**
+ * Server: discard the chunks of all magazines that were reserved from a link, or all chunks if
+ * link is NULL.
+ */
+void QKD_mock_magazines_discard(const QKD_LINK *link)
+{
+    for (size_t i = 0; i < MAX_MAGAZINES; i++) {
+        MAGAZINE *magazine = &magazines[i];
+        pthread_mutex_lock(&magazine->mutex);
+        for (size_t j = magazine->nr_chunks; j > 0; j--) {
+            size_t link_index = magazine->chunks[j - 1].link_index;
+            if (link == NULL || link_index == (size_t) (link - QKD_mock_links)) {
+                remove_chunk(magazine, j - 1);
+            }
+        }
+        pthread_mutex_unlock(&magazine->mutex);
+    }
+}
+
+/**
+ * Server: release the magazine of an exiting thread, and discard its chunks.
+ */
+static void magazine_release(void *arg)
+{
+    MAGAZINE *magazine = arg;
+    pthread_mutex_lock(&magazine->mutex);
+    while (magazine->nr_chunks > 0) {
+        remove_chunk(magazine, magazine->nr_chunks - 1);
+    }
+    pthread_mutex_unlock(&magazine->mutex);
+    __atomic_store_n(&magazine->owned, false, __ATOMIC_RELEASE);
+}
+
+/**
+ * When the engine is unloaded, make sure threads that exit later don't call magazine_release
+ * (which is unloaded with the engine).
+ */
+__attribute__((destructor)) static void magazines_unload(void)
+{
+    if (magazine_key_created) {
+        pthread_key_delete(magazine_thread_key);
+    }
+}
+
+/**
+ * Create the mutexes of the magazines, and the thread key that releases them, once per process.
+ */
+static void magazines_create(void)
+{
+    for (size_t i = 0; i < MAX_MAGAZINES; i++) {
+        pthread_mutex_init(&magazines[i].mutex, NULL);
+    }
+    magazine_key_created = (pthread_key_create(&magazine_thread_key, magazine_release) == 0);
+}
+
+/**
+ * Server: the magazine of the calling thread, which claims a free one the first time.
+ *
+ * Returns the magazine, or NULL if the thread has none (all MAX_MAGAZINES are taken).
+ */
+static MAGAZINE *own_magazine(void)
+{
+    if (!thread_magazine_claimed && magazine_key_created) {
+        thread_magazine_claimed = true;
+        for (size_t i = 0; i < MAX_MAGAZINES; i++) {
+            bool owned = false;
+            if (__atomic_compare_exchange_n(&magazines[i].owned, &owned, true, false,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                thread_magazine = &magazines[i];
+                pthread_setspecific(magazine_thread_key, thread_magazine);
+                break;
+            }
+        }
+    }
+    return thread_magazine;
+}
+
+/**
+ * Server: has any byte in the range [offset, offset + length) of a magazine chunk (relative to the
+ * start of the chunk) been obtained?
+ */
+static bool chunk_range_obtained(const MAGAZINE_CHUNK *chunk, uint64_t offset, uint32_t length)
+{
+    uint64_t end = offset + length;
+    for (uint64_t i = offset; i < end; i++) {
+        if (i % 8 == 0 && end - i >= 8) {
+            if (chunk->obtained[i / 8] != 0) {
+                return true;
+            }
+            i += 7;
+        } else if (chunk->obtained[i / 8] & (1 << (i % 8))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Server: mark the range [offset, offset + length) of a magazine chunk (relative to the start of
+ * the chunk) as obtained.
+ */
+static void chunk_mark_obtained(MAGAZINE_CHUNK *chunk, uint64_t offset, uint32_t length)
+{
+    uint64_t end = offset + length;
+    for (uint64_t i = offset; i < end; i++) {
+        if (i % 8 == 0 && end - i >= 8) {
+            chunk->obtained[i / 8] = 0xff;
+            i += 7;
+        } else {
+            chunk->obtained[i / 8] |= 1 << (i % 8);
+        }
+    }
+}
+
+/**
+ * Server: find the key with the given key handle (which decodes to link_id, offset, and length) in
+ * the magazine that the key handle names, and unless key is NULL, copy it into key and zeroize it
+ * in the magazine. Each key can be obtained only once: if (part of) it was obtained before, *used
+ * is set. A chunk is discarded once all of its keys have been obtained, and when its link turns
+ * out to be down.
+ *
+ * Returns true if the key was found, false if it is not in a magazine (but in the key store, or
+ * gone), or it was obtained before.
+ */
+bool QKD_mock_magazine_find(const QKD_key_handle_t *key_handle, uint64_t link_id,
+                            uint64_t offset, uint32_t length, char *key, bool *used)
+{
+    *used = false;
+    unsigned index = ((const unsigned char *) key_handle->bytes)[25];
+    if (!QKD_mock_server || index == 0 || index > MAX_MAGAZINES) {
+        return false;
+    }
+    MAGAZINE *magazine = &magazines[index - 1];
+    bool found = false;
+    pthread_mutex_lock(&magazine->mutex);
+    for (size_t i = 0; i < magazine->nr_chunks; i++) {
+        MAGAZINE_CHUNK *chunk = &magazine->chunks[i];
+        if (chunk->link_id != link_id || offset < chunk->start || offset + length > chunk->next) {
+            continue;
+        }
+        if (!chunk_current(chunk)) {
+            remove_chunk(magazine, i);
+            break;
+        }
+        if (chunk_range_obtained(chunk, offset - chunk->start, length)) {
+            *used = true;
+            break;
+        }
+        found = true;
+        if (key != NULL) {
+            memcpy(key, chunk->key + (offset - chunk->start), length);
+            memset(chunk->key + (offset - chunk->start), 0, length);
+            chunk_mark_obtained(chunk, offset - chunk->start, length);
+            chunk->consumed += length;
+            bool full = (chunk->next == chunk->end || i + 1 < magazine->nr_chunks);
+            if (full && chunk->consumed == chunk->next - chunk->start) {
+                remove_chunk(magazine, i);
+            }
+        }
+        break;
+    }
+    pthread_mutex_unlock(&magazine->mutex);
+    return found;
+}
+
+/**
+ * Server: the size of the chunks of key stream that the per-thread magazines are refilled with:
+ * environment variable QKD_MOCK_MAGAZINE_BYTES (0 disables the magazines), or
+ * DEFAULT_MAGAZINE_BYTES. It is at most a block.
+ */
+static size_t magazine_size(void)
+{
+    const char *size_str = getenv("QKD_MOCK_MAGAZINE_BYTES");
+    if (size_str != NULL) {
+        long size = strtol(size_str, NULL, 10);
+        if (size >= 0 && size <= KEY_BLOCK_SIZE) {
+            return (size_t) size;
+        }
+        QKD_error("Invalid QKD_MOCK_MAGAZINE_BYTES %s", size_str);
+    }
+    return DEFAULT_MAGAZINE_BYTES;
+}
+
+/**
+ * Server: refill a magazine with a chunk for a key of the given length: allocate up to
+ * magazine_bytes of the key stream of a link, chosen as for a single key (see QKD_open), and take
+ * it out of the key store. A chunk does not extend beyond the block of the key, nor take more than
+ * 1/MAGAZINE_SHARE of the key that the link has available, so that the magazines of some threads
+ * do not starve the others when key is scarce. If the magazine is full, its oldest chunk is
+ * discarded: keys allocated from it that were not obtained yet are lost, as if they had been
+ * evicted from the key store.
+ *
+ * Returns true on success, false if no link has enough key (or the key could not be taken).
+ */
+static bool magazine_refill(MAGAZINE *magazine, uint32_t length)
+{
+    QKD_enter();
+    pthread_mutex_lock(&QKD_mock_link_mutex);
+    QKD_LINK *link = QKD_mock_choose_link(length);
+    uint64_t offset = link != NULL ? QKD_mock_allocation_offset(link, length) : 0;
+    uint64_t limit = link != NULL ? QKD_mock_allocation_limit(link) : 0;
+    if (link == NULL || offset + length > limit) {
+        pthread_mutex_unlock(&QKD_mock_link_mutex);
+        QKD_return_success("%d", false);
+    }
+    uint64_t size = (limit - offset) / MAGAZINE_SHARE;
+    if (size > magazine_bytes) {
+        size = magazine_bytes;
+    }
+    if (size > KEY_BLOCK_SIZE - offset % KEY_BLOCK_SIZE) {
+        size = KEY_BLOCK_SIZE - offset % KEY_BLOCK_SIZE;
+    }
+    if (size < length) {
+        size = length;
+    }
+    link->next_offset = offset + size;
+    QKD_mock_request_watermark(link);
+    MAGAZINE_CHUNK chunk = {.link_index = link - QKD_mock_links, .link_id = link->id,
+                            .start = offset, .next = offset, .end = offset + size};
+    char peer[sizeof(link->peer)];
+    strcpy(peer, link->peer);
+    pthread_mutex_unlock(&QKD_mock_link_mutex);
+    QKD_mock_wake_link_thread();
+
+    /* The chunk is allocated, so nobody else takes it out of the key store. If the link went down
+     * in the meantime, it is gone. */
+    QKD_key_handle_t block_handle;
+    QKD_mock_encode_block_handle(chunk.link_id, offset / KEY_BLOCK_SIZE, &block_handle);
+    chunk.key = QKD_secure_alloc(size);
+    if (chunk.key == NULL ||
+        !QKD_key_store_consume(peer, &block_handle, offset % KEY_BLOCK_SIZE, chunk.key, size)) {
+        QKD_secure_free(chunk.key);
+        QKD_error("Could not take reserved key stream out of the key store");
+        QKD_return_error("%d", false);
+    }
+    pthread_mutex_lock(&magazine->mutex);
+    if (magazine->nr_chunks == MAGAZINE_MAX_CHUNKS) {
+        remove_chunk(magazine, 0);
+    }
+    magazine->chunks[magazine->nr_chunks++] = chunk;
+    pthread_mutex_unlock(&magazine->mutex);
+    QKD_debug("Reserved key stream offset %llu length %llu from the link to %s",
+              (unsigned long long) offset, (unsigned long long) size, peer);
+    QKD_return_success("%d", true);
+}
+
+/**
+ * Server: allocate a key of the given length from the newest chunk of a magazine, after
+ * discarding the chunks of links that are down.
+ *
+ * Returns true on success, false if the magazine needs a refill.
+ */
+static bool magazine_allocate(MAGAZINE *magazine, uint32_t length, QKD_key_handle_t *key_handle)
+{
+    bool allocated = false;
+    pthread_mutex_lock(&magazine->mutex);
+    for (size_t i = magazine->nr_chunks; i > 0; i--) {
+        if (!chunk_current(&magazine->chunks[i - 1])) {
+            remove_chunk(magazine, i - 1);
+        }
+    }
+    if (magazine->nr_chunks > 0) {
+        MAGAZINE_CHUNK *chunk = &magazine->chunks[magazine->nr_chunks - 1];
+        if (chunk->next + length <= chunk->end) {
+            QKD_mock_encode_key_handle(chunk->link_id, chunk->next, length,
+                                       (unsigned) (magazine - magazines + 1), key_handle);
+            chunk->next += length;
+            chunk->nr_keys++;
+            allocated = true;
+        }
+    }
+    pthread_mutex_unlock(&magazine->mutex);
+    return allocated;
+}
+
+/**
+ * Server: allocate a key of the given length from the magazine of the calling thread, refilling it
+ * if needed.
+ *
+ * Returns true on success, false if the key must be allocated from a link directly: the magazines
+ * are disabled, the key is longer than magazine_bytes, the thread has no magazine, or no link has
+ * enough key right now.
+ */
+bool QKD_mock_magazine_open(uint32_t length, QKD_key_handle_t *key_handle)
+{
+    if (length > magazine_bytes) {
+        return false;
+    }
+    MAGAZINE *magazine = own_magazine();
+    if (magazine == NULL) {
+        return false;
+    }
+    if (magazine_allocate(magazine, length, key_handle)) {
+        return true;
+    }
+    return magazine_refill(magazine, length) && magazine_allocate(magazine, length, key_handle);
+}
+
+/**
+ * Server: enable the magazines, with the size from environment variable QKD_MOCK_MAGAZINE_BYTES
+ * (see magazine_size). The client does not use them.
+ */
+void QKD_mock_magazines_init(void)
+{
+    magazine_bytes = QKD_mock_server ? magazine_size() : 0;
+    pthread_once(&magazine_once, magazines_create);
+}
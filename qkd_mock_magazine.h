@@ -0,0 +1,26 @@
+/**
+ * qkd_mock_magazine.h
+ *
+ * Per-thread magazines of key stream for the server of the mock implementation of the QKD API (see
+ * qkd_api_mock.c). Each thread that calls QKD_open reserves chunks of the key stream of a link now
+ * and then, and allocates its keys from them without taking the locks of the links and the key
+ * store. The key handle of such a key names the magazine that holds it.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#ifndef QKD_MOCK_MAGAZINE_H
+#define QKD_MOCK_MAGAZINE_H
+
+#include "qkd_mock.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+void QKD_mock_magazines_init(void);
+bool QKD_mock_magazine_open(uint32_t length, QKD_key_handle_t *key_handle);
+bool QKD_mock_magazine_find(const QKD_key_handle_t *key_handle, uint64_t link_id,
+                            uint64_t offset, uint32_t length, char *key, bool *used);
+void QKD_mock_magazines_discard(const QKD_LINK *link);
+
+#endif /* QKD_MOCK_MAGAZINE_H */
@@ -0,0 +1,1194 @@
+/**
+ * qkd_mock_protocol.c
+ *
+ * The protocol on the links of the mock implementation of the QKD API (see qkd_mock_protocol.h):
+ * the messages and their authentication, the blocks of the key stream with emulated sifting and
+ * errors, and the resumption of the blocks of a previous link.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#include "qkd_mock_protocol.h"
+#include "qkd_debug.h"
+#include "qkd_link_emulator.h"
+#include "qkd_sifting.h"
+#include "qkd_util.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#define MESSAGE_HEADER_SIZE 9
+#define MAX_MESSAGE_PIECES 3    /* Pieces of the payload of a message after the header */
+
+/* Emulated BB84 sifting (see send_sift): a block is the sifted key of the detections in which both
+ * ends used the same basis, about half of them. */
+#define SIFT_BITS (8 * KEY_BLOCK_SIZE)
+#define SIFT_MAX_DETECTIONS (4 * SIFT_BITS)
+#define SIFT_MAX_CODE_BITS 65   /* The longest gamma code of a detection position */
+#define SIFT_PARAMS_SIZE 24
+
+/* Authentication of the messages on the link (see auth_key). */
+#define AUTH_SERVER_TO_CLIENT 0
+#define AUTH_CLIENT_TO_SERVER 1
+#define AUTH_CHUNK_SIZE (KEY_BLOCK_SIZE / 2)
+#define AUTH_PADS_PER_CHUNK (AUTH_CHUNK_SIZE / QKD_AUTH_PAD_SIZE)
+#define AUTH_REFILL_PADS 16     /* The server refills when a direction has fewer pads than this */
+#define AUTH_PRESHARED_PADS_SIZE (2 * AUTH_CHUNK_SIZE)  /* A chunk for each direction */
+#define AUTH_INDEX_SIZE 8       /* The index of the pre-shared pads that a link starts from */
+#define AUTH_MAX_PADS_AHEAD 16  /* How far beyond its own index an end follows the other end */
+
+/* Resuming blocks of a previous link (see RESUME_STATE). */
+#define RESUME_DIGEST_SIZE 32
+
+/* Optional emulation of the key rate, latency, jitter, outages, and QBER of a real QKD link (see
+ * qkd_link_emulator.h). It is enabled by setting environment variable QKD_LINK_EMULATOR_CONF to the
+ * name of a link emulator configuration file (see link_emulator.cnf for an example). In this mock
+ * implementation the server originates the key stream, so the emulation only has an effect on the
+ * server side: it paces the blocks of the key stream, delays the establishment of the link, and
+ * (with LDPC reconciliation) adds errors to the copy of each block that it sends to the client. */
+static bool link_emulator_enabled = false;
+static QKD_link_emulator_t link_emulator;
+static double link_emulator_start_time;
+static pthread_mutex_t link_emulator_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Optional Wegman-Carter authentication of the messages on the link (see qkd_auth.h). It is
+ * enabled by setting environment variable QKD_AUTH_KEY_FILE, at both ends, to the name of a file
+ * that holds the pre-shared key: the hash key, followed by any number of pre-shared pads of
+ * AUTH_PRESHARED_PADS_SIZE bytes (a chunk of one-time pads for each direction). Every message ends
+ * with a tag that uses up the next pad of its direction. The chunks of pads are kept in the key
+ * store (see LINK_AUTH); when a direction runs low on pads, the server turns the next block of the
+ * key stream into a new chunk of pads for each direction (MESSAGE_AUTH_BLOCK).
+ *
+ * Each link connection starts from pre-shared pads that no connection used before (see
+ * QKD_mock_auth_link_up). The number of pre-shared pads that each end has used is kept in a file
+ * next to the key file (used_file_name), so that pads are not used again after a restart either.
+ * Once all pre-shared pads are used, links can no longer come up. This is only changed by QKD_init
+ * and QKD_finish, when the link threads are not running. */
+typedef struct auth_key_st {
+    bool enabled;
+    QKD_auth_key_t key;
+    char *file_name;
+    char *used_file_name;
+    uint64_t nr_preshared_pads;
+} AUTH_KEY;
+
+static AUTH_KEY auth_key = {0};
+
+/**
+ * Initialize the link emulator if environment variable QKD_LINK_EMULATOR_CONF is set.
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_mock_link_emulator_init(void)
+{
+    QKD_enter();
+    const char *file_name = getenv("QKD_LINK_EMULATOR_CONF");
+    if (file_name == NULL) {
+        QKD_debug("Link emulator not enabled");
+        QKD_return_success_qkd();
+    }
+    QKD_link_emulator_config_t config;
+    QKD_link_emulator_config_set_defaults(&config);
+    if (!QKD_link_emulator_read_config(file_name, &config)) {
+        QKD_error("QKD_link_emulator_read_config %s failed", file_name);
+        QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+    }
+    QKD_link_emulator_init(&link_emulator, &config);
+    link_emulator_start_time = QKD_monotonic_seconds();
+    link_emulator_enabled = true;
+    QKD_debug("Link emulator enabled (key rate %.0f bps, latency %.1f ms)", config.key_rate_bps,
+              config.rendezvous_latency_ms);
+    QKD_return_success_qkd();
+}
+
+/**
+ * Emulate the rendezvous of the two ends of the link: wait for the end of an ongoing outage (if
+ * any) and for the emulated rendezvous latency, but not longer than the timeout (in seconds).
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_mock_link_emulator_rendezvous(double timeout)
+{
+    QKD_enter();
+    if (!link_emulator_enabled) {
+        QKD_return_success_qkd();
+    }
+    pthread_mutex_lock(&link_emulator_mutex);
+    double now = QKD_monotonic_seconds() - link_emulator_start_time;
+    double ready = now;
+    QKD_link_emulator_in_outage(&link_emulator, now, &ready);
+    double wait = ready - now + QKD_link_emulator_sample_latency(&link_emulator);
+    pthread_mutex_unlock(&link_emulator_mutex);
+    QKD_debug("Emulated rendezvous takes %.3f ms", wait * 1000.0);
+    if (wait > timeout) {
+        QKD_sleep_seconds(timeout);
+        QKD_return_error_qkd(QKD_RESULT_TIMEOUT);
+    }
+    QKD_sleep_seconds(wait);
+    QKD_return_success_qkd();
+}
+
+/**
+ * Reserve the given amount of key on the emulated link.
+ *
+ * Returns the time (of the monotonic clock) at which the link will have produced the key, which
+ * is the current time if the link emulator is not enabled, or INFINITY if the link will never
+ * produce the key (in which case nothing is reserved).
+ */
+double QKD_mock_link_emulator_reserve_key(size_t nr_bytes)
+{
+    QKD_enter();
+    if (!link_emulator_enabled) {
+        QKD_return_success("%f", QKD_monotonic_seconds());
+    }
+    /* The key is reserved in chunks no bigger than the key buffer of the link, since the link
+     * never has more than that available at once. */
+    double bits = 8.0 * nr_bytes;
+    double max_chunk_bits = link_emulator.config.key_buffer_bits;
+    pthread_mutex_lock(&link_emulator_mutex);
+    double now = QKD_monotonic_seconds() - link_emulator_start_time;
+    double available = now;
+    while (bits > 0.0 && available != INFINITY) {
+        double chunk_bits = bits < max_chunk_bits ? bits : max_chunk_bits;
+        available = QKD_link_emulator_time_available(&link_emulator, chunk_bits, now);
+        if (available != INFINITY) {
+            QKD_link_emulator_consume(&link_emulator, chunk_bits, now);
+        }
+        bits -= chunk_bits;
+    }
+    pthread_mutex_unlock(&link_emulator_mutex);
+    QKD_debug("Emulated key delivery takes %.3f ms", (available - now) * 1000.0);
+    QKD_return_success("%f", link_emulator_start_time + available);
+}
+
+/**
+ * The handle under which a chunk of authentication pads is kept in the key store.
+ */
+static void encode_auth_handle(int direction, uint64_t chunk_index, QKD_key_handle_t *auth_handle)
+{
+    unsigned char *bytes = (unsigned char *) auth_handle->bytes;
+    QKD_key_handle_set_null(auth_handle);
+    bytes[0] = AUTH_HANDLE_MAGIC;
+    bytes[1] = direction;
+    QKD_put_uint64(bytes + 2, chunk_index);
+}
+
+/**
+ * Read the pre-shared authentication key if environment variable QKD_AUTH_KEY_FILE is set. Only
+ * the hash key is read; the pre-shared pads are read when a link comes up (see
+ * QKD_mock_auth_link_up).
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_mock_auth_init(void)
+{
+    QKD_enter();
+    const char *file_name = getenv("QKD_AUTH_KEY_FILE");
+    if (file_name == NULL) {
+        QKD_debug("Link authentication not enabled");
+        QKD_return_success_qkd();
+    }
+    FILE *file = fopen(file_name, "rb");
+    if (file == NULL) {
+        QKD_error_with_errno("fopen %s failed", file_name);
+        QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+    }
+    struct stat file_stat;
+    unsigned char hash_key[QKD_AUTH_KEY_SIZE];
+    bool ok = fstat(fileno(file), &file_stat) == 0 &&
+              file_stat.st_size >= QKD_AUTH_KEY_SIZE + AUTH_PRESHARED_PADS_SIZE &&
+              (file_stat.st_size - QKD_AUTH_KEY_SIZE) % AUTH_PRESHARED_PADS_SIZE == 0 &&
+              fread(hash_key, 1, sizeof(hash_key), file) == sizeof(hash_key);
+    fclose(file);
+    if (!ok) {
+        QKD_error("%s must contain %d bytes followed by a multiple of %d bytes", file_name,
+                  QKD_AUTH_KEY_SIZE, AUTH_PRESHARED_PADS_SIZE);
+        OPENSSL_cleanse(hash_key, sizeof(hash_key));
+        QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+    }
+    size_t used_file_name_size = strlen(file_name) + sizeof(".server-used");
+    auth_key.file_name = strdup(file_name);
+    auth_key.used_file_name = malloc(used_file_name_size);
+    if (auth_key.file_name == NULL || auth_key.used_file_name == NULL) {
+        QKD_error("malloc failed");
+        OPENSSL_cleanse(hash_key, sizeof(hash_key));
+        free(auth_key.file_name);
+        free(auth_key.used_file_name);
+        memset(&auth_key, 0, sizeof(auth_key));
+        QKD_return_error_qkd(QKD_RESULT_OUT_OF_MEMORY);
+    }
+    snprintf(auth_key.used_file_name, used_file_name_size, "%s.%s-used", file_name,
+             QKD_mock_server ? "server" : "client");
+    auth_key.nr_preshared_pads = (file_stat.st_size - QKD_AUTH_KEY_SIZE) / AUTH_PRESHARED_PADS_SIZE;
+    QKD_auth_key_init(&auth_key.key, hash_key);
+    OPENSSL_cleanse(hash_key, sizeof(hash_key));
+    auth_key.enabled = true;
+    QKD_debug("Link authentication enabled (%s)",
+              QKD_auth_clmul_enabled() ? "PCLMULQDQ" : "portable");
+    QKD_return_success_qkd();
+}
+
+/**
+ * Forget the authentication key, and the pads of all links.
+ */
+void QKD_mock_auth_finish(void)
+{
+    if (auth_key.enabled) {
+        for (size_t i = 0; i < QKD_mock_nr_links; i++) {
+            QKD_key_store_discard_peer(QKD_mock_links[i].auth_peer);
+        }
+        QKD_auth_key_cleanse(&auth_key.key);
+        free(auth_key.file_name);
+        free(auth_key.used_file_name);
+        memset(&auth_key, 0, sizeof(auth_key));
+    }
+}
+
+/**
+ * Forget the pads of a link that is down (or that never came up).
+ */
+void QKD_mock_auth_link_down(QKD_LINK *link)
+{
+    if (auth_key.enabled) {
+        QKD_key_store_discard_peer(link->auth_peer);
+    }
+}
+
+/**
+ * Add a chunk of authentication pads to a link for each direction: the first half of chunks for
+ * the server to client direction, the second half for the other direction.
+ *
+ * Returns true on success, false on failure.
+ */
+static bool auth_add_chunks(QKD_LINK *link, const unsigned char *chunks)
+{
+    for (int direction = AUTH_SERVER_TO_CLIENT; direction <= AUTH_CLIENT_TO_SERVER; direction++) {
+        QKD_key_handle_t auth_handle;
+        encode_auth_handle(direction, link->auth.nr_chunks, &auth_handle);
+        if (QKD_key_store_put(link->auth_peer, &auth_handle,
+                              (const char *) chunks + direction * AUTH_CHUNK_SIZE,
+                              AUTH_CHUNK_SIZE) != QKD_RESULT_SUCCESS) {
+            QKD_error("QKD_key_store_put failed");
+            return false;
+        }
+    }
+    link->auth.nr_chunks++;
+    return true;
+}
+
+/**
+ * Reserve pre-shared pads: the first ones that this end has not used yet, but not before index
+ * at_least. The reservation is recorded in used_file_name (and synced) before the pads are used.
+ * The file is locked, so that other processes that use the same file do not reserve the same pads.
+ *
+ * Returns true on success, false on failure or if the pre-shared pads are exhausted.
+ */
+static bool auth_reserve_pads(uint64_t at_least, uint64_t *index)
+{
+    int fd = open(auth_key.used_file_name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        QKD_error_with_errno("open %s failed", auth_key.used_file_name);
+        return false;
+    }
+    unsigned char bytes[8];
+    ssize_t bytes_read = -1;
+    bool ok = flock(fd, LOCK_EX) == 0 && (bytes_read = pread(fd, bytes, sizeof(bytes), 0)) >= 0;
+    if (!ok || (bytes_read != 0 && bytes_read != sizeof(bytes))) {
+        QKD_error_with_errno("reading %s failed", auth_key.used_file_name);
+        close(fd);
+        return false;
+    }
+    uint64_t next = bytes_read == 0 ? 0 : QKD_get_uint64(bytes);
+    *index = next > at_least ? next : at_least;
+    if (*index >= auth_key.nr_preshared_pads) {
+        QKD_error("The pre-shared authentication pads in %s are exhausted", auth_key.file_name);
+        close(fd);
+        return false;
+    }
+    QKD_put_uint64(bytes, *index + 1);
+    if (pwrite(fd, bytes, sizeof(bytes), 0) != sizeof(bytes) || fsync(fd) != 0) {
+        QKD_error_with_errno("writing %s failed", auth_key.used_file_name);
+        close(fd);
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+/**
+ * Reserve exactly the pre-shared pads at index (see auth_reserve_pads).
+ *
+ * Returns true on success, false on failure or if this end already used those pads.
+ */
+static bool auth_reserve_exact_pads(uint64_t index)
+{
+    uint64_t reserved;
+    if (!auth_reserve_pads(index, &reserved)) {
+        return false;
+    }
+    if (reserved != index) {
+        QKD_error("Pre-shared authentication pads %llu were already used",
+                  (unsigned long long) index);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Get the index of the first pre-shared pads that this end has not used yet, without reserving
+ * them.
+ *
+ * Returns true on success, false on failure.
+ */
+static bool auth_next_pads(uint64_t *index)
+{
+    int fd = open(auth_key.used_file_name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 && errno == ENOENT) {
+        *index = 0;
+        return true;
+    }
+    unsigned char bytes[8];
+    ssize_t bytes_read = -1;
+    bool ok = fd != -1 && flock(fd, LOCK_SH) == 0 &&
+              (bytes_read = pread(fd, bytes, sizeof(bytes), 0)) >= 0;
+    if (!ok || (bytes_read != 0 && bytes_read != sizeof(bytes))) {
+        QKD_error_with_errno("reading %s failed", auth_key.used_file_name);
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    close(fd);
+    *index = bytes_read == 0 ? 0 : QKD_get_uint64(bytes);
+    return true;
+}
+
+/**
+ * Read pre-shared pads from the key file into pads (AUTH_PRESHARED_PADS_SIZE bytes).
+ *
+ * Returns true on success, false on failure.
+ */
+static bool auth_read_pads(uint64_t index, unsigned char *pads)
+{
+    int fd = open(auth_key.file_name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        QKD_error_with_errno("open %s failed", auth_key.file_name);
+        return false;
+    }
+    off_t offset = QKD_AUTH_KEY_SIZE + index * AUTH_PRESHARED_PADS_SIZE;
+    bool ok = pread(fd, pads, AUTH_PRESHARED_PADS_SIZE, offset) == AUTH_PRESHARED_PADS_SIZE;
+    if (!ok) {
+        QKD_error_with_errno("reading %s failed", auth_key.file_name);
+    }
+    close(fd);
+    return ok;
+}
+
+/**
+ * Does the server need to send a new chunk of pads on a link, because a direction is running low?
+ */
+bool QKD_mock_auth_needs_refill(const QKD_LINK *link)
+{
+    if (!auth_key.enabled) {
+        return false;
+    }
+    uint64_t nr_pads = link->auth.nr_chunks * AUTH_PADS_PER_CHUNK;
+    return nr_pads - link->auth.next_pad[AUTH_SERVER_TO_CLIENT] < AUTH_REFILL_PADS ||
+           nr_pads - link->auth.next_pad[AUTH_CLIENT_TO_SERVER] < AUTH_REFILL_PADS;
+}
+
+/**
+ * Take the next one-time pad of a direction of a link out of the key store.
+ *
+ * Returns true on success, false if there are no pads left.
+ */
+static bool auth_take_pad(QKD_LINK *link, int direction, unsigned char *pad)
+{
+    uint64_t index = link->auth.next_pad[direction]++;
+    QKD_key_handle_t auth_handle;
+    encode_auth_handle(direction, index / AUTH_PADS_PER_CHUNK, &auth_handle);
+    if (!QKD_key_store_consume(link->auth_peer, &auth_handle,
+                               (index % AUTH_PADS_PER_CHUNK) * QKD_AUTH_PAD_SIZE, (char *) pad,
+                               QKD_AUTH_PAD_SIZE)) {
+        QKD_error("No authentication pad %llu", (unsigned long long) index);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Send a message over the link: the header, the pieces of the payload (if any), and the tag (if
+ * authentication is enabled).
+ *
+ * Returns true on success, false on failure.
+ */
+static bool send_message(QKD_LINK *link, unsigned char type, uint64_t value,
+                         const struct iovec *payload, int nr_pieces)
+{
+    assert(nr_pieces <= MAX_MESSAGE_PIECES);
+    unsigned char header[MESSAGE_HEADER_SIZE];
+    unsigned char tag[QKD_AUTH_TAG_SIZE];
+    struct iovec iov[MAX_MESSAGE_PIECES + 2];
+    header[0] = type;
+    QKD_put_uint64(header + 1, value);
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    for (int i = 0; i < nr_pieces; i++) {
+        iov[1 + i] = payload[i];
+    }
+    int iovcnt = 1 + nr_pieces;
+    if (auth_key.enabled) {
+        int direction = QKD_mock_server ? AUTH_SERVER_TO_CLIENT : AUTH_CLIENT_TO_SERVER;
+        unsigned char pad[QKD_AUTH_PAD_SIZE];
+        if (!auth_take_pad(link, direction, pad)) {
+            return false;
+        }
+        QKD_auth_t auth;
+        QKD_auth_init(&auth, &auth_key.key);
+        for (int i = 0; i < iovcnt; i++) {
+            QKD_auth_update(&auth, iov[i].iov_base, iov[i].iov_len);
+        }
+        QKD_auth_final(&auth, pad, tag);
+        OPENSSL_cleanse(pad, sizeof(pad));
+        iov[iovcnt].iov_base = tag;
+        iov[iovcnt].iov_len = sizeof(tag);
+        iovcnt++;
+    }
+    return QKD_send_all(link->sock, iov, iovcnt);
+}
+
+/**
+ * Send a message without payload over the link.
+ *
+ * Returns true on success, false on failure.
+ */
+bool QKD_mock_send_message_header(QKD_LINK *link, unsigned char type, uint64_t value)
+{
+    return send_message(link, type, value, NULL, 0);
+}
+
+/**
+ * Send a block of the key stream over the link.
+ *
+ * Returns true on success, false on failure.
+ */
+static bool send_block(QKD_LINK *link, uint64_t block_seq, const unsigned char *block)
+{
+    struct iovec payload = {.iov_base = (void *) block, .iov_len = KEY_BLOCK_SIZE};
+    return send_message(link, MESSAGE_BLOCK, block_seq, &payload, 1);
+}
+
+/**
+ * Receive a message header of any type from the link. The rest of the message must be received
+ * with QKD_mock_receive_payload and QKD_mock_receive_message_end.
+ *
+ * Returns true on success, false on failure.
+ */
+bool QKD_mock_receive_any_message_header(QKD_LINK *link, unsigned char *type, uint64_t *value)
+{
+    unsigned char header[MESSAGE_HEADER_SIZE];
+    if (!QKD_receive_all(link->sock, header, sizeof(header))) {
+        return false;
+    }
+    if (auth_key.enabled) {
+        QKD_auth_init(&link->auth.receiving, &auth_key.key);
+        QKD_auth_update(&link->auth.receiving, header, sizeof(header));
+    }
+    *type = header[0];
+    *value = QKD_get_uint64(header + 1);
+    return true;
+}
+
+/**
+ * Receive the next piece of the payload of a message from the link.
+ *
+ * Returns true on success, false on failure.
+ */
+bool QKD_mock_receive_payload(QKD_LINK *link, void *buffer, size_t size)
+{
+    if (!QKD_receive_all(link->sock, buffer, size)) {
+        return false;
+    }
+    if (auth_key.enabled) {
+        QKD_auth_update(&link->auth.receiving, buffer, size);
+    }
+    return true;
+}
+
+/**
+ * Receive the end of a message from the link: the tag, if authentication is enabled. Nothing in
+ * the message may be acted upon before this succeeds.
+ *
+ * Returns true if the message is authentic, false otherwise.
+ */
+bool QKD_mock_receive_message_end(QKD_LINK *link)
+{
+    if (!auth_key.enabled) {
+        return true;
+    }
+    int direction = QKD_mock_server ? AUTH_CLIENT_TO_SERVER : AUTH_SERVER_TO_CLIENT;
+    unsigned char tag[QKD_AUTH_TAG_SIZE];
+    unsigned char expected_tag[QKD_AUTH_TAG_SIZE];
+    unsigned char pad[QKD_AUTH_PAD_SIZE];
+    if (!QKD_receive_all(link->sock, tag, sizeof(tag)) || !auth_take_pad(link, direction, pad)) {
+        return false;
+    }
+    QKD_auth_final(&link->auth.receiving, pad, expected_tag);
+    OPENSSL_cleanse(pad, sizeof(pad));
+    if (!QKD_auth_tags_equal(tag, expected_tag)) {
+        QKD_error("Message authentication failed");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Receive a message header of the expected type from the link.
+ *
+ * Returns true on success, false on failure.
+ */
+bool QKD_mock_receive_message_header(QKD_LINK *link, unsigned char type, uint64_t *value)
+{
+    unsigned char received_type;
+    if (!QKD_mock_receive_any_message_header(link, &received_type, value)) {
+        return false;
+    }
+    if (received_type != type) {
+        QKD_error("Received message type %d, expected %d", received_type, type);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Server: turn a block of key into a chunk of authentication pads for each direction, and send it
+ * to the client (MESSAGE_AUTH_BLOCK). The block is overwritten.
+ *
+ * Returns true on success, false on failure.
+ */
+bool QKD_mock_send_auth_block(QKD_LINK *link, unsigned char *block)
+{
+    struct iovec payload = {.iov_base = block, .iov_len = KEY_BLOCK_SIZE};
+    if (RAND_bytes(block, KEY_BLOCK_SIZE) != 1 || !auth_add_chunks(link, block) ||
+        !send_message(link, MESSAGE_AUTH_BLOCK, link->auth.nr_chunks - 1, &payload, 1)) {
+        return false;
+    }
+    QKD_debug("Sent authentication block %llu", (unsigned long long) link->auth.nr_chunks - 1);
+    return true;
+}
+
+/**
+ * Client: receive the rest of a MESSAGE_AUTH_BLOCK message, and add its chunks of authentication
+ * pads to the link. The block is received into scratch (KEY_BLOCK_SIZE bytes).
+ *
+ * Returns true on success, false on failure.
+ */
+bool QKD_mock_receive_auth_block(QKD_LINK *link, uint64_t chunk_index, unsigned char *scratch)
+{
+    if (!auth_key.enabled || chunk_index != link->auth.nr_chunks ||
+        !QKD_mock_receive_payload(link, scratch, KEY_BLOCK_SIZE) ||
+        !QKD_mock_receive_message_end(link) || !auth_add_chunks(link, scratch)) {
+        return false;
+    }
+    QKD_debug("Received authentication block %llu", (unsigned long long) chunk_index);
+    return true;
+}
+
+/**
+ * Compute the digest of a block that the two ends compare before resuming it. The mock link is
+ * not secret anyway; a real key manager would compare the blocks with an authenticated protocol.
+ *
+ * Returns true on success, false on failure.
+ */
+static bool block_digest(const unsigned char *block, unsigned char *digest)
+{
+    return EVP_Digest(block, KEY_BLOCK_SIZE, digest, NULL, EVP_sha256(), NULL) == 1;
+}
+
+/**
+ * Send a block of the key stream over the link as the raw key of a real QKD link would arrive:
+ * with bit errors at the current QBER of the emulated link. The client corrects the errors with
+ * the syndromes of the frames of the block, which are sent along in the same message (one-way
+ * reconciliation, see qkd_ldpc.h), and checks the result against the digest of the block.
+ *
+ * Returns true on success, false on failure.
+ */
+static bool send_block_ldpc(QKD_LINK *link, uint64_t block_seq, const unsigned char *block)
+{
+    QKD_enter();
+    pthread_mutex_lock(&link_emulator_mutex);
+    double now = QKD_monotonic_seconds() - link_emulator_start_time;
+    double qber = QKD_link_emulator_qber(&link_emulator, now);
+    double efficiency = link_emulator.config.reconciliation_efficiency;
+    pthread_mutex_unlock(&link_emulator_mutex);
+    size_t syndrome_bits = QKD_ldpc_choose_syndrome_bits(LDPC_FRAME_BITS, qber, efficiency);
+    const QKD_ldpc_code_t *code = QKD_ldpc_code_get(LDPC_FRAME_BITS, syndrome_bits);
+    if (code == NULL) {
+        QKD_error("QKD_ldpc_code_get failed");
+        QKD_return_error("%d", false);
+    }
+    size_t syndrome_size = (syndrome_bits + 7) / 8;
+    unsigned char *syndromes = malloc(LDPC_FRAMES_PER_BLOCK * syndrome_size);
+    unsigned char *noisy_block = QKD_secure_alloc(KEY_BLOCK_SIZE);
+    unsigned char params[LDPC_PARAMS_SIZE];
+    bool ok = syndromes != NULL && noisy_block != NULL && block_digest(block, params + 16);
+    if (ok) {
+        for (size_t frame = 0; frame < LDPC_FRAMES_PER_BLOCK; frame++) {
+            QKD_ldpc_syndrome(code, block + frame * LDPC_FRAME_SIZE,
+                              syndromes + frame * syndrome_size);
+        }
+        memcpy(noisy_block, block, KEY_BLOCK_SIZE);
+        pthread_mutex_lock(&link_emulator_mutex);
+        QKD_link_emulator_add_errors(&link_emulator, noisy_block, KEY_BLOCK_SIZE, qber);
+        pthread_mutex_unlock(&link_emulator_mutex);
+        QKD_put_uint64(params, (uint64_t) lround(qber * 1e6));
+        QKD_put_uint64(params + 8, syndrome_bits);
+        struct iovec payload[3] = {
+            {.iov_base = params, .iov_len = sizeof(params)},
+            {.iov_base = noisy_block, .iov_len = KEY_BLOCK_SIZE},
+            {.iov_base = syndromes, .iov_len = LDPC_FRAMES_PER_BLOCK * syndrome_size}
+        };
+        ok = send_message(link, MESSAGE_BLOCK_LDPC, block_seq, payload, 3);
+    } else {
+        QKD_error("Preparing block %llu failed", (unsigned long long) block_seq);
+    }
+    free(syndromes);
+    QKD_secure_free(noisy_block);
+    QKD_return_success("%d", ok);
+}
+
+/**
+ * Emulated sifting: the basis (0 or 1) in which the sending end of the quantum channel (the
+ * client) prepared a pulse of the sifting of a block. Both ends compute it from the link id, the
+ * sequence number of the block and the pulse number, as if the link emulator had told them; the
+ * detections and the bases of the receiving end (the server) come from the link emulator.
+ */
+static unsigned char sender_basis(uint64_t link_id, uint64_t block_seq, uint64_t pulse)
+{
+    /* SplitMix64 of the 64 pulses around the given one. */
+    uint64_t x = link_id ^ (block_seq << 40) ^ (pulse / 64);
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return (x >> (pulse % 64)) & 1;
+}
+
+/**
+ * Send the sifting of the block that is about to be sent, as a real QKD link would have to before
+ * it has the raw key of the block: the server samples detections from the link emulator until
+ * SIFT_BITS of them were measured in the same basis at both ends, and announces their positions
+ * and its bases (MESSAGE_SIFT). The client answers with the detections that it keeps
+ * (MESSAGE_SIFT_RESULT), which must be the ones that the server expects.
+ *
+ * The sifted bits themselves are not emulated: the block that follows is the sifted key.
+ *
+ * Returns true on success, false on failure.
+ */
+static bool send_sift(QKD_LINK *link, uint64_t block_seq)
+{
+    QKD_enter();
+    uint64_t *positions = malloc(SIFT_MAX_DETECTIONS * sizeof(uint64_t));
+    unsigned char *bases = malloc(SIFT_MAX_DETECTIONS);
+    unsigned char *matches = malloc(SIFT_MAX_DETECTIONS);
+    unsigned char *packed_bases = malloc(QKD_sift_packed_size(SIFT_MAX_DETECTIONS));
+    unsigned char *result = malloc(QKD_sift_packed_size(SIFT_MAX_DETECTIONS));
+    unsigned char *encoded = NULL;
+    bool ok = false;
+    if (positions == NULL || bases == NULL || matches == NULL || packed_bases == NULL ||
+        result == NULL) {
+        QKD_error("malloc failed");
+        goto done;
+    }
+    size_t nr_detections = 0;
+    size_t nr_sifted = 0;
+    uint64_t nr_pulses = 0;
+    pthread_mutex_lock(&link_emulator_mutex);
+    while (nr_sifted < SIFT_BITS && nr_detections < SIFT_MAX_DETECTIONS) {
+        uint64_t pulse = QKD_link_emulator_next_detection(&link_emulator, nr_pulses,
+                                                          &bases[nr_detections]);
+        positions[nr_detections] = pulse;
+        matches[nr_detections] = bases[nr_detections] == sender_basis(link->id, block_seq, pulse);
+        nr_sifted += matches[nr_detections];
+        nr_detections++;
+        nr_pulses = pulse + 1;
+    }
+    pthread_mutex_unlock(&link_emulator_mutex);
+    if (nr_sifted < SIFT_BITS || nr_pulses > QKD_SIFT_MAX_PULSES) {
+        QKD_error("Sifting block %llu needs too many pulses", (unsigned long long) block_seq);
+        goto done;
+    }
+    size_t positions_size = QKD_sift_positions_size(positions, nr_detections, nr_pulses);
+    encoded = malloc(positions_size);
+    if (encoded == NULL) {
+        QKD_error("malloc failed");
+        goto done;
+    }
+    QKD_sift_encode_positions(positions, nr_detections, nr_pulses, encoded);
+    QKD_sift_pack_bits(bases, nr_detections, packed_bases);
+    QKD_sift_pack_bits(matches, nr_detections, result);
+    unsigned char params[SIFT_PARAMS_SIZE];
+    QKD_put_uint64(params, nr_pulses);
+    QKD_put_uint64(params + 8, nr_detections);
+    QKD_put_uint64(params + 16, positions_size);
+    struct iovec payload[3] = {
+        {.iov_base = params, .iov_len = sizeof(params)},
+        {.iov_base = encoded, .iov_len = positions_size},
+        {.iov_base = packed_bases, .iov_len = QKD_sift_packed_size(nr_detections)}
+    };
+    if (!send_message(link, MESSAGE_SIFT, block_seq, payload, 3)) {
+        goto done;
+    }
+    QKD_debug("Sifting of block %llu: %llu pulses, %zu detections, %zu bytes of positions",
+              (unsigned long long) block_seq, (unsigned long long) nr_pulses, nr_detections,
+              positions_size);
+    size_t slot = block_seq % QKD_mock_pipeline_window;
+    free(link->sift_results[slot]);
+    link->sift_results[slot] = result;
+    link->sift_result_sizes[slot] = QKD_sift_packed_size(nr_detections);
+    result = NULL;
+    ok = true;
+done:
+    free(positions);
+    free(bases);
+    free(matches);
+    free(packed_bases);
+    free(result);
+    free(encoded);
+    QKD_return_success("%d", ok);
+}
+
+/**
+ * Server: send a block of the key stream to the client, as the link emulator is configured to:
+ * preceded by its sifting (see send_sift), and with emulated errors (see send_block_ldpc).
+ *
+ * Returns true on success, false on failure.
+ */
+bool QKD_mock_send_key_block(QKD_LINK *link, uint64_t block_seq, const unsigned char *block)
+{
+    bool ldpc = link_emulator_enabled &&
+                link_emulator.config.reconciliation == QKD_RECONCILIATION_LDPC;
+    bool sift = link_emulator_enabled && link_emulator.config.detection_probability > 0.0;
+    return (!sift || send_sift(link, block_seq)) &&
+           (ldpc ? send_block_ldpc(link, block_seq, block) : send_block(link, block_seq, block));
+}
+
+/**
+ * Client: receive the rest of a MESSAGE_SIFT message (see send_sift) for the next block, and
+ * answer it with the detections in which both ends used the same basis.
+ *
+ * Returns true on success, false if the link failed.
+ */
+bool QKD_mock_receive_sift(QKD_LINK *link, uint64_t block_seq)
+{
+    QKD_enter();
+    unsigned char params[SIFT_PARAMS_SIZE];
+    if (block_seq != link->next_block_seq ||
+        !QKD_mock_receive_payload(link, params, sizeof(params))) {
+        QKD_error("Receiving sifting of block %llu failed", (unsigned long long) block_seq);
+        QKD_return_error("%d", false);
+    }
+    uint64_t nr_pulses = QKD_get_uint64(params);
+    uint64_t nr_detections = QKD_get_uint64(params + 8);
+    uint64_t positions_size = QKD_get_uint64(params + 16);
+    if (nr_pulses > QKD_SIFT_MAX_PULSES || nr_detections < SIFT_BITS ||
+        nr_detections > SIFT_MAX_DETECTIONS || positions_size < 1 ||
+        positions_size > 1 + QKD_sift_packed_size(SIFT_MAX_CODE_BITS * nr_detections)) {
+        QKD_error("Invalid sifting of block %llu", (unsigned long long) block_seq);
+        QKD_return_error("%d", false);
+    }
+    size_t packed_size = QKD_sift_packed_size(nr_detections);
+    unsigned char *encoded = malloc(positions_size);
+    uint64_t *positions = malloc(nr_detections * sizeof(uint64_t));
+    unsigned char *bases = malloc(nr_detections);
+    unsigned char *packed = malloc(packed_size);
+    bool ok = encoded != NULL && positions != NULL && bases != NULL && packed != NULL &&
+              QKD_mock_receive_payload(link, encoded, positions_size) &&
+              QKD_mock_receive_payload(link, packed, packed_size) &&
+              QKD_mock_receive_message_end(link) &&
+              QKD_sift_decode_positions(encoded, positions_size, nr_pulses, nr_detections,
+                                        positions);
+    size_t nr_sifted = 0;
+    if (ok) {
+        QKD_sift_unpack_bits(packed, nr_detections, bases);
+        for (size_t i = 0; i < nr_detections; i++) {
+            bases[i] = bases[i] == sender_basis(link->id, block_seq, positions[i]);
+            nr_sifted += bases[i];
+        }
+        ok = nr_sifted == SIFT_BITS;
+        if (!ok) {
+            QKD_error("Sifting of block %llu yielded %zu bits", (unsigned long long) block_seq,
+                      nr_sifted);
+        }
+    }
+    if (ok) {
+        QKD_sift_pack_bits(bases, nr_detections, packed);
+        struct iovec payload = {.iov_base = packed, .iov_len = packed_size};
+        ok = send_message(link, MESSAGE_SIFT_RESULT, block_seq, &payload, 1);
+    }
+    free(encoded);
+    free(positions);
+    free(bases);
+    free(packed);
+    if (!ok) {
+        QKD_return_error("%d", false);
+    }
+    QKD_return_success("%d", true);
+}
+
+/**
+ * Receive the rest of a MESSAGE_BLOCK_LDPC message (see send_block_ldpc) into a job, to be
+ * corrected by QKD_mock_reconcile_block.
+ *
+ * Returns true on success, false if the link failed.
+ */
+bool QKD_mock_receive_block_ldpc(QKD_LINK *link, BLOCK_JOB *job)
+{
+    QKD_enter();
+    unsigned char params[LDPC_PARAMS_SIZE];
+    if (!QKD_mock_receive_payload(link, params, sizeof(params))) {
+        QKD_return_error("%d", false);
+    }
+    job->qber = QKD_get_uint64(params) / 1e6;
+    uint64_t syndrome_bits = QKD_get_uint64(params + 8);
+    job->code = NULL;
+    if (syndrome_bits < LDPC_FRAME_BITS) {
+        job->code = QKD_ldpc_code_get(LDPC_FRAME_BITS, syndrome_bits);
+    }
+    if (job->code == NULL) {
+        QKD_error("Invalid number of syndrome bits %llu", (unsigned long long) syndrome_bits);
+        QKD_return_error("%d", false);
+    }
+    memcpy(job->digest, params + 16, LDPC_DIGEST_SIZE);
+    size_t syndrome_size = (syndrome_bits + 7) / 8;
+    if (!QKD_mock_receive_payload(link, job->block, KEY_BLOCK_SIZE) ||
+        !QKD_mock_receive_payload(link, job->syndromes, LDPC_FRAMES_PER_BLOCK * syndrome_size) ||
+        !QKD_mock_receive_message_end(link)) {
+        QKD_return_error("%d", false);
+    }
+    QKD_return_success("%d", true);
+}
+
+/**
+ * Tell the link thread that a job is done.
+ */
+static void finish_block_job(BLOCK_JOB *job)
+{
+    __atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
+    unsigned char byte = 0;
+    if (write(job->link->done_pipe[1], &byte, 1) != 1 && errno != EAGAIN) {
+        QKD_error("write failed (errno=%d)", errno);
+    }
+}
+
+/**
+ * Correct the errors in the block of a job, with the syndromes of its frames, and check the result
+ * against the digest of the block. Runs in a worker thread of the pipeline (or in the link thread,
+ * without one); touches nothing but the job.
+ */
+void QKD_mock_reconcile_block(void *arg)
+{
+    QKD_enter();
+    BLOCK_JOB *job = arg;
+    size_t nr_decoded = QKD_ldpc_decode(job->code, job->block, job->syndromes,
+                                        LDPC_FRAMES_PER_BLOCK, job->qber,
+                                        QKD_LDPC_DEFAULT_MAX_ITERATIONS, 1, NULL);
+    unsigned char digest[LDPC_DIGEST_SIZE];
+    job->corrected = nr_decoded == LDPC_FRAMES_PER_BLOCK && block_digest(job->block, digest) &&
+                     CRYPTO_memcmp(digest, job->digest, LDPC_DIGEST_SIZE) == 0;
+    QKD_debug("Reconciliation at QBER %.4f with %llu syndrome bits per frame %s", job->qber,
+              (unsigned long long) QKD_ldpc_syndrome_bits(job->code),
+              job->corrected ? "succeeded" : "failed");
+    finish_block_job(job);
+    QKD_return_success_void();
+}
+
+/**
+ * Keep the blocks of the link that is going down that may be resumed by the next link: on the
+ * server the synchronized blocks that were not allocated from at all, on the client all blocks
+ * that it still has (the server decides which of them are resumed). Must be called with
+ * QKD_mock_link_mutex held, while the link is still up.
+ */
+void QKD_mock_retain_for_resume(QKD_LINK *link)
+{
+    QKD_enter();
+    QKD_key_store_discard_peer(link->resume_peer);
+    uint64_t first_block = 0;
+    if (QKD_mock_server) {
+        first_block = (link->next_offset + KEY_BLOCK_SIZE - 1) / KEY_BLOCK_SIZE;
+    }
+    if (link->nr_blocks_synced > MAX_RESUME_BLOCKS &&
+        first_block < link->nr_blocks_synced - MAX_RESUME_BLOCKS) {
+        first_block = link->nr_blocks_synced - MAX_RESUME_BLOCKS;
+    }
+    link->resume.link_id = link->id;
+    link->resume.first_block = first_block;
+    link->resume.nr_blocks = 0;
+    char *block = QKD_secure_alloc(KEY_BLOCK_SIZE);
+    if (block == NULL) {
+        QKD_error("QKD_secure_alloc failed");
+        QKD_return_success_void();
+    }
+    for (uint64_t index = first_block; index < link->nr_blocks_synced; index++) {
+        QKD_key_handle_t block_handle;
+        QKD_mock_encode_block_handle(link->id, index, &block_handle);
+        if (QKD_key_store_take(link->peer, &block_handle, block, KEY_BLOCK_SIZE) &&
+            QKD_key_store_put(link->resume_peer, &block_handle, block, KEY_BLOCK_SIZE) ==
+                QKD_RESULT_SUCCESS) {
+            link->resume.nr_blocks = index + 1 - first_block;
+        }
+    }
+    QKD_secure_free(block);
+    QKD_debug("Retained %llu blocks for resumption", (unsigned long long) link->resume.nr_blocks);
+    QKD_return_success_void();
+}
+
+/**
+ * Forget the blocks that could have been resumed by the next link to the same endpoint.
+ */
+void QKD_mock_discard_resume(QKD_LINK *link)
+{
+    QKD_key_store_discard_peer(link->resume_peer);
+    link->resume.nr_blocks = 0;
+}
+
+/**
+ * Start authenticating a new link connection from pre-shared pads that neither end used before.
+ * Each end proposes the first pre-shared pads that it has not used yet, by sending their index to
+ * the other end before anything else and without a tag. Both ends then start from the larger of
+ * the two indexes, so that each pre-shared pad is used for one link connection only, also across
+ * restarts. An index more than AUTH_MAX_PADS_AHEAD beyond the own proposal is rejected.
+ *
+ * The indexes themselves are not authentic, so neither end may record pads as used on the word of
+ * the other end alone. The client records them before it sends the first tagged message
+ * (MESSAGE_AUTH_START, with the index that it starts from). The server records nothing until
+ * that message is authentic, so a connection from anyone who does not hold the key uses up no
+ * pads of the server. A client can only be made to skip up to AUTH_MAX_PADS_AHEAD pads per
+ * connection by whoever it connects to.
+ *
+ * Returns true on success, false on failure.
+ */
+bool QKD_mock_auth_link_up(QKD_LINK *link)
+{
+    if (!auth_key.enabled) {
+        return true;
+    }
+    QKD_key_store_discard_peer(link->auth_peer);
+    link->auth.next_pad[AUTH_SERVER_TO_CLIENT] = 0;
+    link->auth.next_pad[AUTH_CLIENT_TO_SERVER] = 0;
+    link->auth.nr_chunks = 0;
+    uint64_t index;
+    unsigned char bytes[AUTH_INDEX_SIZE];
+    if (!(QKD_mock_server ? auth_next_pads(&index) : auth_reserve_pads(0, &index))) {
+        return false;
+    }
+    QKD_put_uint64(bytes, index);
+    struct iovec iov = {.iov_base = bytes, .iov_len = sizeof(bytes)};
+    if (!QKD_send_all(link->sock, &iov, 1) || !QKD_receive_all(link->sock, bytes, sizeof(bytes))) {
+        return false;
+    }
+    uint64_t peer_index = QKD_get_uint64(bytes);
+    if (peer_index > index + AUTH_MAX_PADS_AHEAD) {
+        QKD_error("The other end wants to skip from pre-shared authentication pads %llu to %llu",
+                  (unsigned long long) index, (unsigned long long) peer_index);
+        return false;
+    }
+    if (peer_index > index) {
+        index = peer_index;
+        if (!QKD_mock_server && !auth_reserve_exact_pads(index)) {
+            return false;
+        }
+    }
+    if (index >= auth_key.nr_preshared_pads) {
+        QKD_error("The pre-shared authentication pads in %s are exhausted", auth_key.file_name);
+        return false;
+    }
+    QKD_debug("Starting from pre-shared authentication pads %llu", (unsigned long long) index);
+    unsigned char *pads = QKD_secure_alloc(AUTH_PRESHARED_PADS_SIZE);
+    bool ok = pads != NULL && auth_read_pads(index, pads) && auth_add_chunks(link, pads);
+    QKD_secure_free(pads);
+    if (!ok) {
+        return false;
+    }
+    if (!QKD_mock_server) {
+        return QKD_mock_send_message_header(link, MESSAGE_AUTH_START, index);
+    }
+    uint64_t start_index;
+    if (!QKD_mock_receive_message_header(link, MESSAGE_AUTH_START, &start_index) ||
+        !QKD_mock_receive_message_end(link)) {
+        return false;
+    }
+    if (start_index != index) {
+        QKD_error("The client starts from pre-shared authentication pads %llu, expected %llu",
+                  (unsigned long long) start_index, (unsigned long long) index);
+        return false;
+    }
+    return auth_reserve_exact_pads(index);
+}
+
+/**
+ * Server: offer the retained blocks of the previous link to the client, and make the blocks that
+ * the client confirms the first blocks of the new link (with the given id and peer, on the
+ * connection link->sock). Called after sending the hello message.
+ *
+ * Returns true on success (storing the number of resumed blocks in nr_resumed), false on failure.
+ */
+bool QKD_mock_server_resume(QKD_LINK *link, uint64_t link_id, const char *peer,
+                            uint64_t *nr_resumed)
+{
+    QKD_enter();
+    uint64_t nr_blocks = link->resume.nr_blocks;
+    size_t message_size = 16 + nr_blocks * RESUME_DIGEST_SIZE;
+    unsigned char *message = malloc(message_size);
+    char *block = QKD_secure_alloc(KEY_BLOCK_SIZE);
+    if (message == NULL || block == NULL) {
+        QKD_error("Allocating resume message failed");
+        free(message);
+        QKD_secure_free(block);
+        QKD_mock_discard_resume(link);
+        QKD_return_error("%d", false);
+    }
+    QKD_put_uint64(message, link->resume.link_id);
+    QKD_put_uint64(message + 8, link->resume.first_block);
+    for (uint64_t i = 0; i < nr_blocks; i++) {
+        QKD_key_handle_t old_handle;
+        QKD_key_handle_t new_handle;
+        QKD_mock_encode_block_handle(link->resume.link_id, link->resume.first_block + i,
+                                     &old_handle);
+        QKD_mock_encode_block_handle(link_id, i, &new_handle);
+        if (!QKD_key_store_take(link->resume_peer, &old_handle, block, KEY_BLOCK_SIZE) ||
+            !block_digest((unsigned char *) block, message + 16 + i * RESUME_DIGEST_SIZE) ||
+            QKD_key_store_put(peer, &new_handle, block, KEY_BLOCK_SIZE) != QKD_RESULT_SUCCESS) {
+            nr_blocks = i;
+            break;
+        }
+    }
+    QKD_secure_free(block);
+    QKD_mock_discard_resume(link);
+    uint64_t nr_confirmed = 0;
+    struct iovec payload = {.iov_base = message, .iov_len = 16 + nr_blocks * RESUME_DIGEST_SIZE};
+    bool ok = send_message(link, MESSAGE_RESUME, nr_blocks, &payload, 1) &&
+              QKD_mock_receive_message_header(link, MESSAGE_RESUME_ACK, &nr_confirmed) &&
+              QKD_mock_receive_message_end(link) && nr_confirmed <= nr_blocks;
+    free(message);
+    for (uint64_t i = ok ? nr_confirmed : 0; i < nr_blocks; i++) {
+        QKD_key_handle_t new_handle;
+        QKD_mock_encode_block_handle(link_id, i, &new_handle);
+        QKD_key_store_consume(peer, &new_handle, 0, NULL, KEY_BLOCK_SIZE);
+    }
+    if (!ok) {
+        QKD_error("Resuming blocks failed");
+        QKD_return_error("%d", false);
+    }
+    *nr_resumed = nr_confirmed;
+    QKD_debug("Resumed %llu of %llu blocks", (unsigned long long) nr_confirmed,
+              (unsigned long long) nr_blocks);
+    QKD_return_success("%d", true);
+}
+
+/**
+ * Client: receive the blocks of the previous link that the server offers to resume, and confirm
+ * the ones that the client has as well (up to the first one that it does not have). Those become
+ * the first blocks of the new link (with the given id and peer, on the connection link->sock).
+ * Called after receiving the hello message.
+ *
+ * Returns true on success (storing the number of resumed blocks in nr_resumed), false on failure.
+ */
+bool QKD_mock_client_resume(QKD_LINK *link, uint64_t link_id, const char *peer,
+                            uint64_t *nr_resumed)
+{
+    QKD_enter();
+    uint64_t nr_blocks;
+    if (!QKD_mock_receive_message_header(link, MESSAGE_RESUME, &nr_blocks) ||
+        nr_blocks > MAX_RESUME_BLOCKS) {
+        QKD_mock_discard_resume(link);
+        QKD_return_error("%d", false);
+    }
+    size_t message_size = 16 + nr_blocks * RESUME_DIGEST_SIZE;
+    unsigned char *message = malloc(message_size);
+    char *block = QKD_secure_alloc(KEY_BLOCK_SIZE);
+    if (message == NULL || block == NULL ||
+        !QKD_mock_receive_payload(link, message, message_size) ||
+        !QKD_mock_receive_message_end(link)) {
+        QKD_error("Receiving resume message failed");
+        free(message);
+        QKD_secure_free(block);
+        QKD_mock_discard_resume(link);
+        QKD_return_error("%d", false);
+    }
+    uint64_t old_link_id = QKD_get_uint64(message);
+    uint64_t first_block = QKD_get_uint64(message + 8);
+    uint64_t nr_confirmed = 0;
+    if (link->resume.nr_blocks > 0 && old_link_id == link->resume.link_id) {
+        for (uint64_t i = 0; i < nr_blocks; i++) {
+            QKD_key_handle_t old_handle;
+            QKD_key_handle_t new_handle;
+            unsigned char digest[RESUME_DIGEST_SIZE];
+            QKD_mock_encode_block_handle(old_link_id, first_block + i, &old_handle);
+            QKD_mock_encode_block_handle(link_id, i, &new_handle);
+            if (!QKD_key_store_take(link->resume_peer, &old_handle, block, KEY_BLOCK_SIZE) ||
+                !block_digest((unsigned char *) block, digest) ||
+                memcmp(digest, message + 16 + i * RESUME_DIGEST_SIZE, sizeof(digest)) != 0 ||
+                QKD_key_store_put(peer, &new_handle, block, KEY_BLOCK_SIZE) !=
+                    QKD_RESULT_SUCCESS) {
+                break;
+            }
+            nr_confirmed++;
+        }
+    }
+    free(message);
+    QKD_secure_free(block);
+    QKD_mock_discard_resume(link);
+    if (!QKD_mock_send_message_header(link, MESSAGE_RESUME_ACK, nr_confirmed)) {
+        QKD_return_error("%d", false);
+    }
+    *nr_resumed = nr_confirmed;
+    QKD_debug("Resumed %llu of %llu blocks", (unsigned long long) nr_confirmed,
+              (unsigned long long) nr_blocks);
+    QKD_return_success("%d", true);
+}
+
+/**
+ * Server: receive the rest of a MESSAGE_SIFT_RESULT message (see send_sift), and check that the
+ * client kept the detections that the server expects.
+ *
+ * Returns true on success, false if the link failed.
+ */
+bool QKD_mock_receive_sift_result(QKD_LINK *link, uint64_t block_seq)
+{
+    QKD_enter();
+    size_t slot = block_seq % QKD_mock_pipeline_window;
+    pthread_mutex_lock(&QKD_mock_link_mutex);
+    bool in_flight = block_seq >= link->oldest_block_seq && block_seq < link->next_block_seq;
+    pthread_mutex_unlock(&QKD_mock_link_mutex);
+    if (!in_flight || link->sift_results[slot] == NULL) {
+        QKD_error("Unexpected sifting result for block %llu", (unsigned long long) block_seq);
+        QKD_return_error("%d", false);
+    }
+    size_t size = link->sift_result_sizes[slot];
+    unsigned char *result = malloc(size);
+    bool ok = result != NULL && QKD_mock_receive_payload(link, result, size) &&
+              QKD_mock_receive_message_end(link);
+    if (ok && memcmp(result, link->sift_results[slot], size) != 0) {
+        QKD_error("Sifting of block %llu does not match", (unsigned long long) block_seq);
+        ok = false;
+    }
+    free(result);
+    if (!ok) {
+        QKD_return_error("%d", false);
+    }
+    free(link->sift_results[slot]);
+    link->sift_results[slot] = NULL;
+    QKD_return_success("%d", true);
+}
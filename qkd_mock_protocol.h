@@ -0,0 +1,89 @@
+/**
+ * qkd_mock_protocol.h
+ *
+ * The protocol on the links of the mock implementation of the QKD API (see qkd_api_mock.c). Each
+ * message starts with a type byte followed by a 64-bit number, and (with authentication enabled)
+ * ends with a Wegman-Carter tag (see qkd_auth.h) that uses up a one-time pad of its direction.
+ * Each link connection starts from pre-shared pads, and the server turns blocks of the key stream
+ * into new pads when a direction runs low.
+ *
+ * The server sends the blocks of the key stream as a real QKD link would produce them, as far as
+ * the link emulator (see qkd_link_emulator.h) is configured to: each block preceded by the BB84
+ * sifting that would have produced it (answered by the client in the compact encoding of
+ * qkd_sifting.h), and with bit errors at the emulated QBER, together with the syndromes that the
+ * client needs to correct them (see qkd_ldpc.h).
+ *
+ * When a link comes up, the server offers the blocks of the previous link to the same endpoint
+ * that were synchronized but never allocated, the client confirms the ones that it still has, and
+ * those become the first blocks of the new link.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#ifndef QKD_MOCK_PROTOCOL_H
+#define QKD_MOCK_PROTOCOL_H
+
+#include "qkd_mock.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Messages on the link. Each message starts with a type byte followed by a 64-bit number. Blocks
+ * are numbered in the order in which they are sent (the sequence number); a block only gets its
+ * index in the key stream when the client acknowledges it, so that a rejected block leaves no
+ * gap. */
+#define MESSAGE_HELLO 1         /* Server to client: link id */
+#define MESSAGE_BLOCK 2         /* Server to client: sequence number, followed by the block */
+#define MESSAGE_ACK 3           /* Client to server: sequence number */
+#define MESSAGE_RESUME 4        /* Server to client: number of blocks, followed by the previous
+                                 * link id, the index of the first block, and a digest per block */
+#define MESSAGE_RESUME_ACK 5    /* Client to server: number of blocks resumed */
+#define MESSAGE_BLOCK_LDPC 6    /* Server to client: sequence number, followed by the QBER (parts
+                                 * per million), the number of syndrome bits per frame, the digest
+                                 * of the block, the block with errors, and the syndromes */
+#define MESSAGE_REJECT 7        /* Client to server: sequence number (the block could not be
+                                 * corrected, and is dropped at both ends) */
+#define MESSAGE_AUTH_BLOCK 8    /* Server to client: chunk index, followed by a block of key that
+                                 * becomes a chunk of authentication pads for each direction */
+#define MESSAGE_SIFT 9          /* Server to client: sequence number of the block that follows,
+                                 * followed by the number of pulses, the number of detections, the
+                                 * size of the positions, the positions, and the bases */
+#define MESSAGE_SIFT_RESULT 10  /* Client to server: sequence number, followed by a bitmap of the
+                                 * detections in which both ends used the same basis */
+#define MESSAGE_AUTH_START 11   /* Client to server: the index of the pre-shared pads that the
+                                 * link starts from (the first tagged message, see
+                                 * QKD_mock_auth_link_up) */
+
+QKD_result_t QKD_mock_link_emulator_init(void);
+QKD_result_t QKD_mock_link_emulator_rendezvous(double timeout);
+double QKD_mock_link_emulator_reserve_key(size_t nr_bytes);
+
+QKD_result_t QKD_mock_auth_init(void);
+void QKD_mock_auth_finish(void);
+bool QKD_mock_auth_link_up(QKD_LINK *link);
+void QKD_mock_auth_link_down(QKD_LINK *link);
+bool QKD_mock_auth_needs_refill(const QKD_LINK *link);
+bool QKD_mock_send_auth_block(QKD_LINK *link, unsigned char *block);
+bool QKD_mock_receive_auth_block(QKD_LINK *link, uint64_t chunk_index, unsigned char *scratch);
+
+bool QKD_mock_send_message_header(QKD_LINK *link, unsigned char type, uint64_t value);
+bool QKD_mock_receive_any_message_header(QKD_LINK *link, unsigned char *type, uint64_t *value);
+bool QKD_mock_receive_message_header(QKD_LINK *link, unsigned char type, uint64_t *value);
+bool QKD_mock_receive_payload(QKD_LINK *link, void *buffer, size_t size);
+bool QKD_mock_receive_message_end(QKD_LINK *link);
+
+bool QKD_mock_send_key_block(QKD_LINK *link, uint64_t block_seq, const unsigned char *block);
+bool QKD_mock_receive_sift(QKD_LINK *link, uint64_t block_seq);
+bool QKD_mock_receive_sift_result(QKD_LINK *link, uint64_t block_seq);
+bool QKD_mock_receive_block_ldpc(QKD_LINK *link, BLOCK_JOB *job);
+void QKD_mock_reconcile_block(void *arg);
+
+void QKD_mock_retain_for_resume(QKD_LINK *link);
+void QKD_mock_discard_resume(QKD_LINK *link);
+bool QKD_mock_server_resume(QKD_LINK *link, uint64_t link_id, const char *peer,
+                            uint64_t *nr_resumed);
+bool QKD_mock_client_resume(QKD_LINK *link, uint64_t link_id, const char *peer,
+                            uint64_t *nr_resumed);
+
+#endif /* QKD_MOCK_PROTOCOL_H */
@@ -0,0 +1,339 @@
+/**
+ * qkd_mock_replication.c
+ *
+ * Replication of the server's key manager of the mock implementation of the QKD API to a standby
+ * node (see qkd_mock_replication.h).
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#include "qkd_mock_replication.h"
+#include "qkd_mock_protocol.h"
+#include "qkd_debug.h"
+#include "qkd_replication.h"
+#include "qkd_util.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+/* Replication of the server's key manager (see qkd_replication.h). Each record starts with the
+ * index and the id of the link that it is about. */
+#define REPLICATION_LINK 1      /* A new link is up (id 0: the link is down) */
+#define REPLICATION_BLOCK 2     /* Block index, followed by the block */
+#define REPLICATION_WATERMARK 3 /* Offset: no key is allocated beyond it until further notice */
+#define REPLICATION_SYNCED 4    /* No link: the full state has been sent */
+#define REPLICATION_PROTECTED 5 /* No link: key is allocated below the watermarks from now on */
+#define REPLICATION_HEADER_SIZE 24
+#define DEFAULT_REPLICATION_LEASE_BYTES (4 * KEY_BLOCK_SIZE)
+
+static uint64_t replication_lease_bytes;
+static bool replication_protected;      /* Active server: allocating below the watermarks only
+                                         * (protected by QKD_mock_link_mutex) */
+static uint64_t replication_synced_seq; /* Active server: the end of the full state (protected by
+                                         * QKD_mock_link_mutex) */
+static bool replica_protected = false;  /* Standby server: the active server is protected */
+
+/**
+ * Active server: append a replication record about a link (see REPLICATION_LINK and following),
+ * with the given link id and value, optionally followed by a block. Must be called with
+ * QKD_mock_link_mutex held, so that the records of a link are in the order of the changes that
+ * they describe.
+ *
+ * Returns the sequence number of the record, or 0 if there is no standby to replicate to.
+ */
+static uint64_t replicate(unsigned char type, const QKD_LINK *link, uint64_t link_id,
+                          uint64_t value, const unsigned char *block)
+{
+    unsigned char header[REPLICATION_HEADER_SIZE];
+    QKD_put_uint64(header, (uint64_t) (link - QKD_mock_links));
+    QKD_put_uint64(header + 8, link_id);
+    QKD_put_uint64(header + 16, value);
+    struct iovec pieces[2] = {{.iov_base = header, .iov_len = sizeof(header)},
+                              {.iov_base = (void *) block, .iov_len = KEY_BLOCK_SIZE}};
+    return QKD_replication_append(type, pieces, block != NULL ? 2 : 1);
+}
+
+/**
+ * Active server: when the key allocated from a link gets close to its watermark, replicate a new
+ * watermark, replication_lease_bytes beyond the allocated key. As long as the standby acknowledges
+ * it before the lease runs out, allocation does not wait for the standby. Must be called with
+ * QKD_mock_link_mutex held.
+ */
+void QKD_mock_request_watermark(QKD_LINK *link)
+{
+    if (!replication_protected ||
+        link->next_offset + replication_lease_bytes / 2 <= link->watermark_requested) {
+        return;
+    }
+    uint64_t watermark = link->next_offset + replication_lease_bytes;
+    uint64_t seq = replicate(REPLICATION_WATERMARK, link, link->id, watermark, NULL);
+    if (seq != 0) {
+        link->watermark_requested = watermark;
+        link->watermark_seq = seq;
+    }
+}
+
+/**
+ * Active server: replicate the state of a link: its id, the blocks of its key stream that have not
+ * been allocated from, and (if protected) a new watermark. Until the standby acknowledges the
+ * watermark, no key is allocated beyond the key that was allocated already. Must be called with
+ * QKD_mock_link_mutex held.
+ */
+void QKD_mock_replicate_link(QKD_LINK *link)
+{
+    if (!link->up) {
+        replicate(REPLICATION_LINK, link, 0, 0, NULL);
+        return;
+    }
+    replicate(REPLICATION_LINK, link, link->id, 0, NULL);
+    char *block = QKD_secure_alloc(KEY_BLOCK_SIZE);
+    for (uint64_t index = (link->next_offset + KEY_BLOCK_SIZE - 1) / KEY_BLOCK_SIZE;
+         block != NULL && index < link->nr_blocks_synced; index++) {
+        /* The key store has no way to read a block without taking it, so put it back. */
+        QKD_key_handle_t block_handle;
+        QKD_mock_encode_block_handle(link->id, index, &block_handle);
+        if (QKD_key_store_take(link->peer, &block_handle, block, KEY_BLOCK_SIZE) &&
+            QKD_key_store_put(link->peer, &block_handle, block, KEY_BLOCK_SIZE) ==
+                QKD_RESULT_SUCCESS) {
+            replicate(REPLICATION_BLOCK, link, link->id, index, (unsigned char *) block);
+        }
+    }
+    QKD_secure_free(block);
+    link->watermark = link->next_offset;
+    link->watermark_requested = link->next_offset;
+    link->watermark_seq = 0;
+    QKD_mock_request_watermark(link);
+}
+
+/**
+ * Active server: replicate a block that was just added to the key stream of a link. Must be called
+ * with QKD_mock_link_mutex held.
+ */
+void QKD_mock_replicate_block(const QKD_LINK *link, uint64_t block_index,
+                              const unsigned char *block)
+{
+    replicate(REPLICATION_BLOCK, link, link->id, block_index, block);
+}
+
+/**
+ * Server: the end of the key stream of a link that key can be allocated from: the synchronized
+ * key, but while replicating to a standby, not beyond the watermark that the standby acknowledged,
+ * so that the standby never offers key that may have been allocated. Must be called with
+ * QKD_mock_link_mutex held.
+ */
+uint64_t QKD_mock_allocation_limit(const QKD_LINK *link)
+{
+    uint64_t limit = link->nr_blocks_synced * KEY_BLOCK_SIZE;
+    if (replication_protected && link->watermark < limit) {
+        limit = link->watermark;
+    }
+    return limit;
+}
+
+/**
+ * Active server: a standby connected; replicate the state of every link to it. Allocation is not
+ * held back by the standby until it has acknowledged this full state (see replication_acked), so
+ * that a standby that connects but does not respond cannot stall allocation more than once.
+ */
+static void replication_sync(void)
+{
+    QKD_enter();
+    pthread_mutex_lock(&QKD_mock_link_mutex);
+    replication_protected = false;
+    for (size_t i = 0; i < QKD_mock_nr_links; i++) {
+        QKD_mock_replicate_link(&QKD_mock_links[i]);
+    }
+    replication_synced_seq = QKD_replication_append(REPLICATION_SYNCED, NULL, 0);
+    pthread_mutex_unlock(&QKD_mock_link_mutex);
+    QKD_return_success_void();
+}
+
+/**
+ * Active server: the standby applied the replication records up to seq. Once it has the full state,
+ * start allocating below the watermarks only: replicate a watermark for each link, beyond all key
+ * allocated so far, and then tell the standby that it can take over from now on. Later, raise the
+ * watermarks that the standby acknowledged.
+ */
+static void replication_acked(uint64_t seq)
+{
+    pthread_mutex_lock(&QKD_mock_link_mutex);
+    bool changed = false;
+    if (!replication_protected && replication_synced_seq != 0 && seq >= replication_synced_seq) {
+        replication_protected = true;
+        for (size_t i = 0; i < QKD_mock_nr_links; i++) {
+            QKD_LINK *link = &QKD_mock_links[i];
+            link->watermark = link->next_offset;
+            link->watermark_requested = link->next_offset;
+            link->watermark_seq = 0;
+            if (link->up) {
+                QKD_mock_request_watermark(link);
+            }
+        }
+        QKD_replication_append(REPLICATION_PROTECTED, NULL, 0);
+    }
+    for (size_t i = 0; i < QKD_mock_nr_links; i++) {
+        QKD_LINK *link = &QKD_mock_links[i];
+        if (link->watermark_seq != 0 && link->watermark_seq <= seq) {
+            link->watermark = link->watermark_requested;
+            link->watermark_seq = 0;
+            changed = true;
+        }
+    }
+    if (changed) {
+        pthread_cond_broadcast(&QKD_mock_link_changed);
+    }
+    pthread_mutex_unlock(&QKD_mock_link_mutex);
+}
+
+/**
+ * Active server: the standby is gone, so the watermarks no longer hold back allocation.
+ */
+static void replication_disconnected(void)
+{
+    pthread_mutex_lock(&QKD_mock_link_mutex);
+    replication_protected = false;
+    replication_synced_seq = 0;
+    pthread_cond_broadcast(&QKD_mock_link_changed);
+    pthread_mutex_unlock(&QKD_mock_link_mutex);
+}
+
+/**
+ * Standby server: apply a replication record from the active server. The replicated blocks of
+ * each link are kept as if they had been retained for resumption, except for the blocks below the
+ * watermark (which key may have been allocated from), so that taking over is the same as starting
+ * with the blocks of a snapshot.
+ */
+static void replication_apply(unsigned char type, const unsigned char *payload, size_t size)
+{
+    if (type == REPLICATION_SYNCED) {
+        return;
+    }
+    if (type == REPLICATION_PROTECTED) {
+        replica_protected = true;
+        return;
+    }
+    if (size < REPLICATION_HEADER_SIZE || QKD_get_uint64(payload) >= QKD_mock_nr_links) {
+        QKD_error("Invalid replication record of type %d", type);
+        return;
+    }
+    QKD_LINK *link = &QKD_mock_links[QKD_get_uint64(payload)];
+    RESUME_STATE *resume = &link->resume;
+    uint64_t link_id = QKD_get_uint64(payload + 8);
+    uint64_t value = QKD_get_uint64(payload + 16);
+    if (type == REPLICATION_LINK) {
+        QKD_mock_discard_resume(link);
+        resume->link_id = link_id;
+        resume->first_block = 0;
+        return;
+    }
+    if (link_id == 0 || link_id != resume->link_id) {
+        /* A record that was appended before the full state of the link. */
+        return;
+    }
+    uint64_t end_block = resume->first_block + resume->nr_blocks;
+    QKD_key_handle_t block_handle;
+    QKD_mock_encode_block_handle(link_id, value, &block_handle);
+    switch (type) {
+    case REPLICATION_BLOCK:
+        if (size != REPLICATION_HEADER_SIZE + KEY_BLOCK_SIZE || value < resume->first_block) {
+            break;
+        }
+        QKD_key_store_consume(link->resume_peer, &block_handle, 0, NULL, KEY_BLOCK_SIZE);
+        if (QKD_key_store_put(link->resume_peer, &block_handle,
+                              (const char *) payload + REPLICATION_HEADER_SIZE,
+                              KEY_BLOCK_SIZE) == QKD_RESULT_SUCCESS && value >= end_block) {
+            resume->nr_blocks = value + 1 - resume->first_block;
+        }
+        break;
+    case REPLICATION_WATERMARK: {
+        uint64_t first_block = (value + KEY_BLOCK_SIZE - 1) / KEY_BLOCK_SIZE;
+        if (first_block <= resume->first_block) {
+            break;
+        }
+        for (uint64_t index = resume->first_block; index < first_block && index < end_block;
+             index++) {
+            QKD_mock_encode_block_handle(link_id, index, &block_handle);
+            QKD_key_store_consume(link->resume_peer, &block_handle, 0, NULL, KEY_BLOCK_SIZE);
+        }
+        resume->nr_blocks = end_block > first_block ? end_block - first_block : 0;
+        resume->first_block = first_block;
+        break;
+    }
+    default:
+        QKD_error("Unknown replication record type %d", type);
+    }
+}
+
+/**
+ * Standby server: the active server is gone. If it was protected (see replication_acked), and it
+ * did not dismiss the standby, take over: start listening on the endpoints, and offer the
+ * replicated blocks of each link to the client when the link connects, as after a restart.
+ *
+ * Returns true if the standby took over, false if it keeps waiting for an active server.
+ */
+static bool replication_active_lost(bool dismissed)
+{
+    QKD_enter();
+    if (dismissed) {
+        replica_protected = false;
+        QKD_return_success("%d", false);
+    }
+    if (!replica_protected) {
+        QKD_error("Lost the active server before it was protected, not taking over");
+        QKD_return_success("%d", false);
+    }
+    uint64_t nr_blocks = 0;
+    for (size_t i = 0; i < QKD_mock_nr_links; i++) {
+        if (QKD_mock_links[i].resume.nr_blocks > MAX_RESUME_BLOCKS) {
+            QKD_mock_links[i].resume.nr_blocks = MAX_RESUME_BLOCKS;
+        }
+        nr_blocks += QKD_mock_links[i].resume.nr_blocks;
+    }
+    if (QKD_RESULT_SUCCESS != QKD_mock_server_start_links()) {
+        QKD_error("Taking over from the active server failed");
+        QKD_return_error("%d", false);
+    }
+    QKD_debug("Took over from the active server with %llu replicated blocks",
+              (unsigned long long) nr_blocks);
+    QKD_return_success("%d", true);
+}
+
+static const QKD_replication_callbacks_t replication_callbacks = {
+    .sync = replication_sync,
+    .acked = replication_acked,
+    .disconnected = replication_disconnected,
+    .apply = replication_apply,
+    .active_lost = replication_active_lost
+};
+
+/**
+ * The lease of key stream that the active server may allocate ahead of the standby: environment
+ * variable QKD_MOCK_REPLICATION_LEASE_BYTES, or DEFAULT_REPLICATION_LEASE_BYTES. It is at least
+ * two blocks, so that a key always fits.
+ */
+static uint64_t replication_lease(void)
+{
+    const char *lease_str = getenv("QKD_MOCK_REPLICATION_LEASE_BYTES");
+    if (lease_str != NULL) {
+        long long lease = strtoll(lease_str, NULL, 10);
+        if (lease >= 2 * KEY_BLOCK_SIZE) {
+            return (uint64_t) lease;
+        }
+        QKD_error("Invalid QKD_MOCK_REPLICATION_LEASE_BYTES %s", lease_str);
+    }
+    return DEFAULT_REPLICATION_LEASE_BYTES;
+}
+
+/**
+ * Server: start replicating to (or from) the other node of the key manager, if one is configured
+ * (see qkd_replication.h).
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_mock_replication_start(void)
+{
+    replication_lease_bytes = replication_lease();
+    replica_protected = false;
+    return QKD_replication_start(&replication_callbacks);
+}
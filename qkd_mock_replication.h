@@ -0,0 +1,27 @@
+/**
+ * qkd_mock_replication.h
+ *
+ * Replication of the server's key manager of the mock implementation of the QKD API (see
+ * qkd_api_mock.c) to a standby node (see qkd_replication.h). The active server replicates the
+ * links, the blocks of their key streams, and watermarks below which it allocates key. A standby
+ * keeps the replicated blocks above the watermarks as if they had been retained for resumption, and
+ * when the active server is lost, it takes over the links and offers those blocks to the clients.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#ifndef QKD_MOCK_REPLICATION_H
+#define QKD_MOCK_REPLICATION_H
+
+#include "qkd_mock.h"
+#include <stdint.h>
+
+QKD_result_t QKD_mock_replication_start(void);
+void QKD_mock_replicate_link(QKD_LINK *link);
+void QKD_mock_replicate_block(const QKD_LINK *link, uint64_t block_index,
+                              const unsigned char *block);
+void QKD_mock_request_watermark(QKD_LINK *link);
+uint64_t QKD_mock_allocation_limit(const QKD_LINK *link);
+
+#endif /* QKD_MOCK_REPLICATION_H */
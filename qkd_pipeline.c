@@ -0,0 +1,219 @@
+/**
+ * qkd_pipeline.c
+ *
+ * A pool of worker threads for a stage of a pipeline (see qkd_pipeline.h).
+ *
+ * The queue is the bounded multi-producer multi-consumer queue of Dmitry Vyukov: a ring of cells,
+ * each with a sequence number that says whether the cell is free for the producer of a given
+ * position, or holds the job for the consumer of that position. Producers and consumers claim a
+ * position with a compare-and-swap on the tail or the head, and then hand the cell over by storing
+ * its sequence number.
+ *
+ * A worker that finds the queue empty goes to sleep on a condition variable. It first counts itself
+ * as sleeping and then looks at the queue once more, while a producer first enqueues and then
+ * looks at the count, so that at least one of the two sees the other (both use sequentially
+ * consistent fences for this).
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#include "qkd_pipeline.h"
+#include "qkd_debug.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+typedef struct cell_st {
+    size_t sequence;
+    QKD_pipeline_work_t work;
+    void *job;
+} cell_t;
+
+struct QKD_pipeline_st {
+    cell_t *cells;
+    size_t mask;                        /* The number of cells (a power of two) minus one */
+    char pad_1[64];
+    size_t tail;                        /* Next position to enqueue at */
+    char pad_2[64];
+    size_t head;                        /* Next position to dequeue from */
+    char pad_3[64];
+    unsigned nr_sleeping;
+    bool stopping;
+    pthread_mutex_t mutex;
+    pthread_cond_t wakeup;
+    pthread_t workers[QKD_PIPELINE_MAX_WORKERS];
+    int nr_workers;
+};
+
+/**
+ * Enqueue a job.
+ *
+ * Returns true on success, false if the queue is full.
+ */
+static bool enqueue(QKD_pipeline_t *pipeline, QKD_pipeline_work_t work, void *job)
+{
+    size_t position = __atomic_load_n(&pipeline->tail, __ATOMIC_RELAXED);
+    cell_t *cell;
+    while (true) {
+        cell = &pipeline->cells[position & pipeline->mask];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t difference = (intptr_t) sequence - (intptr_t) position;
+        if (difference == 0) {
+            if (__atomic_compare_exchange_n(&pipeline->tail, &position, position + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (difference < 0) {
+            return false;
+        } else {
+            position = __atomic_load_n(&pipeline->tail, __ATOMIC_RELAXED);
+        }
+    }
+    cell->work = work;
+    cell->job = job;
+    __atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Dequeue a job.
+ *
+ * Returns true on success, false if the queue is empty.
+ */
+static bool dequeue(QKD_pipeline_t *pipeline, QKD_pipeline_work_t *work, void **job)
+{
+    size_t position = __atomic_load_n(&pipeline->head, __ATOMIC_RELAXED);
+    cell_t *cell;
+    while (true) {
+        cell = &pipeline->cells[position & pipeline->mask];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t difference = (intptr_t) sequence - (intptr_t) (position + 1);
+        if (difference == 0) {
+            if (__atomic_compare_exchange_n(&pipeline->head, &position, position + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (difference < 0) {
+            return false;
+        } else {
+            position = __atomic_load_n(&pipeline->head, __ATOMIC_RELAXED);
+        }
+    }
+    *work = cell->work;
+    *job = cell->job;
+    __atomic_store_n(&cell->sequence, position + pipeline->mask + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static void *worker_thread(void *arg)
+{
+    QKD_pipeline_t *pipeline = arg;
+    while (true) {
+        QKD_pipeline_work_t work;
+        void *job;
+        if (dequeue(pipeline, &work, &job)) {
+            work(job);
+            continue;
+        }
+        pthread_mutex_lock(&pipeline->mutex);
+        __atomic_add_fetch(&pipeline->nr_sleeping, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        while (!pipeline->stopping && !dequeue(pipeline, &work, &job)) {
+            pthread_cond_wait(&pipeline->wakeup, &pipeline->mutex);
+        }
+        __atomic_sub_fetch(&pipeline->nr_sleeping, 1, __ATOMIC_SEQ_CST);
+        bool stopping = pipeline->stopping;
+        pthread_mutex_unlock(&pipeline->mutex);
+        if (stopping) {
+            /* Jobs that were submitted before the pool was freed still run. */
+            while (dequeue(pipeline, &work, &job)) {
+                work(job);
+            }
+            break;
+        }
+        work(job);
+    }
+    return NULL;
+}
+
+/**
+ * Create a pool of nr_workers worker threads, with a queue of at least capacity jobs.
+ *
+ * Returns the pool, or NULL on failure.
+ */
+QKD_pipeline_t *QKD_pipeline_new(int nr_workers, size_t capacity)
+{
+    QKD_enter();
+    if (nr_workers < 1 || nr_workers > QKD_PIPELINE_MAX_WORKERS) {
+        QKD_error("Invalid number of pipeline workers %d", nr_workers);
+        QKD_return_error("%p", NULL);
+    }
+    size_t nr_cells = 2;
+    while (nr_cells < capacity) {
+        nr_cells *= 2;
+    }
+    QKD_pipeline_t *pipeline = calloc(1, sizeof(*pipeline));
+    cell_t *cells = calloc(nr_cells, sizeof(cell_t));
+    if (pipeline == NULL || cells == NULL) {
+        QKD_error("calloc failed");
+        free(pipeline);
+        free(cells);
+        QKD_return_error("%p", NULL);
+    }
+    for (size_t i = 0; i < nr_cells; i++) {
+        cells[i].sequence = i;
+    }
+    pipeline->cells = cells;
+    pipeline->mask = nr_cells - 1;
+    pthread_mutex_init(&pipeline->mutex, NULL);
+    pthread_cond_init(&pipeline->wakeup, NULL);
+    for (; pipeline->nr_workers < nr_workers; pipeline->nr_workers++) {
+        if (pthread_create(&pipeline->workers[pipeline->nr_workers], NULL, worker_thread,
+                           pipeline) != 0) {
+            QKD_error("pthread_create failed");
+            QKD_pipeline_free(pipeline);
+            QKD_return_error("%p", NULL);
+        }
+    }
+    QKD_debug("Started %d pipeline workers", nr_workers);
+    QKD_return_success("%p", pipeline);
+}
+
+/**
+ * Submit a job: call work(job) in one of the worker threads, or in the calling thread if the queue
+ * is full.
+ */
+void QKD_pipeline_submit(QKD_pipeline_t *pipeline, QKD_pipeline_work_t work, void *job)
+{
+    if (!enqueue(pipeline, work, job)) {
+        work(job);
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pipeline->nr_sleeping, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&pipeline->mutex);
+        pthread_cond_signal(&pipeline->wakeup);
+        pthread_mutex_unlock(&pipeline->mutex);
+    }
+}
+
+/**
+ * Stop the worker threads, after they have run the jobs in the queue, and free the pool.
+ */
+void QKD_pipeline_free(QKD_pipeline_t *pipeline)
+{
+    if (pipeline == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pipeline->mutex);
+    pipeline->stopping = true;
+    pthread_cond_broadcast(&pipeline->wakeup);
+    pthread_mutex_unlock(&pipeline->mutex);
+    for (int i = 0; i < pipeline->nr_workers; i++) {
+        pthread_join(pipeline->workers[i], NULL);
+    }
+    pthread_mutex_destroy(&pipeline->mutex);
+    pthread_cond_destroy(&pipeline->wakeup);
+    free(pipeline->cells);
+    free(pipeline);
+}
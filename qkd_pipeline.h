@@ -0,0 +1,36 @@
+/**
+ * qkd_pipeline.h
+ *
+ * A pool of worker threads for a CPU-intensive stage of a pipeline, such as the reconciliation of
+ * the blocks of raw key of a QKD link. The stage before it submits jobs to the pool, the workers
+ * run them in parallel, and each job tells the stage after it that it is done (typically through
+ * a pipe, so that the stage after it can wait for jobs and sockets at the same time). Jobs finish
+ * in any order; a stage that needs them in order keeps its jobs in a ring, in the order in which
+ * they were submitted, and collects them from the ring.
+ *
+ * Jobs are passed to the workers through a bounded lock-free queue: submitting a job and taking
+ * one are a compare-and-swap each, and a lock is only taken to wake up a sleeping worker. When the
+ * queue is full, the job runs in the submitting thread instead, which slows down the stage before
+ * the pool (backpressure) without blocking it.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#ifndef QKD_PIPELINE_H
+#define QKD_PIPELINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define QKD_PIPELINE_MAX_WORKERS 64
+
+typedef struct QKD_pipeline_st QKD_pipeline_t;
+typedef void (*QKD_pipeline_work_t)(void *job);
+
+QKD_pipeline_t *QKD_pipeline_new(int nr_workers, size_t capacity);
+void QKD_pipeline_submit(QKD_pipeline_t *pipeline, QKD_pipeline_work_t work, void *job);
+void QKD_pipeline_free(QKD_pipeline_t *pipeline);
+
+#endif /* QKD_PIPELINE_H */
@@ -0,0 +1,957 @@
+/**
+ * qkd_postprocessing_benchmark.c
+ *
+ * A benchmark of the post-processing kernels that turn the raw key of a QKD link into secret key:
+ * sifting, error estimation, reconciliation (computing the LDPC syndromes at one end and decoding
+ * at the other, see qkd_ldpc.h), privacy amplification, and authentication of the classical
+ * messages (see qkd_auth.h). Whichever kernel is slowest limits the secret key rate of a link, no
+ * matter how fast its detectors are.
+ *
+ * Sifting, error estimation and privacy amplification are not implemented elsewhere in this
+ * repository yet. The benchmark has straightforward implementations of them, which serve as the
+ * baselines for faster ones:
+ *
+ *  - Sifting keeps the detections in which both ends used the same basis. It compresses the bits
+ *    of 64 detections at a time under the mask of matching bases (with the PEXT instruction if the
+ *    CPU has BMI2, and a portable loop otherwise).
+ *
+ *  - Error estimation compares a random sample of the sifted key, and removes the sample from it.
+ *
+ *  - Privacy amplification multiplies the reconciled key with a random Toeplitz matrix. For every
+ *    bit of the key that is set, it XORs a window of the seed of the matrix into the final key,
+ *    using 64 copies of the seed, one for each shift within a word.
+ *
+ * The kernels run on synthetic data: random detections and bases at both ends, with bit errors at
+ * the given QBER at the receiving end. A block is block_bits bits of sifted key, and the throughput
+ * of every kernel is counted in bits of sifted key, so that the kernels can be compared with each
+ * other. For every block size, QBER, and number of threads, every thread runs the kernel on the
+ * same block, over and over, for a fixed time. Besides the throughput, the benchmark measures the
+ * efficiency of each block size and QBER: the efficiency of reconciliation (f_EC), the fraction of
+ * frames that fail to decode, and the fraction of the sifted key that is left as final key after
+ * the finite-size bound on the estimated QBER, the syndromes, and the key used for authentication.
+ *
+ * The results are printed as JSON, so that runs can be compared with each other by a script.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#include "qkd_auth.h"
+#include "qkd_debug.h"
+#include "qkd_ldpc.h"
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_BMI2 1
+#endif
+
+#define NSEC_PER_SEC 1000000000ULL
+#define MAX_POINTS 64
+#define WORD_BITS 64
+#define SECURITY_PARAMETER_LOG2 32      /* Failure probability of estimation and amplification */
+#define NR_AUTHENTICATED_MESSAGES 3     /* Bases, estimation sample, and syndromes */
+#define MIN_EFFICIENCY_FRAMES 256       /* Frames decoded to measure the frame error rate */
+
+typedef struct options_st {
+    double block_bits[MAX_POINTS];
+    size_t nr_block_sizes;
+    double qbers[MAX_POINTS];
+    size_t nr_qbers;
+    double threads[MAX_POINTS];
+    size_t nr_thread_counts;
+    const char *kernels;                /* Comma-separated, NULL for all */
+    double duration;
+    size_t frame_bits;
+    double efficiency;
+    double sample_fraction;
+    int max_iterations;
+    uint64_t seed;
+    const char *output;
+} options_t;
+
+/* The data of one block size and QBER. The kernels only read it. */
+typedef struct block_data_st {
+    size_t block_bits;
+    size_t nr_words;
+    double qber;
+
+    /* Sifting: the detections that yield the block of sifted key, at both ends */
+    size_t nr_detections;
+    uint64_t *alice_bases;
+    uint64_t *bob_bases;
+    uint64_t *bob_detections;
+
+    /* Error estimation and reconciliation: the sifted key, at both ends */
+    uint64_t *alice_key;
+    uint64_t *bob_key;
+    size_t sample_bits;
+
+    const QKD_ldpc_code_t *code;
+    size_t nr_frames;
+    size_t syndrome_size;               /* Bytes per frame */
+    unsigned char *syndromes;
+
+    /* Privacy amplification: the Toeplitz matrix, as its seed shifted by 0 to 63 bits */
+    size_t final_bits;
+    size_t seed_words;
+    uint64_t *toeplitz[WORD_BITS];
+
+    /* Authentication: the classical messages of the block, concatenated */
+    QKD_auth_key_t auth_key;
+    unsigned char *messages;
+    size_t messages_size;
+
+    /* Efficiency */
+    double sifted_fraction;
+    double qber_estimate;
+    double qber_bound;
+    double f_ec;
+    double frame_error_rate;
+    double final_key_fraction;
+} block_data_t;
+
+/* The working memory of one thread. */
+typedef struct scratch_st {
+    uint64_t random_state;
+    uint64_t *key;
+    uint64_t *mask;
+    unsigned char *frames;
+    unsigned char *syndromes;
+    bool *decoded;
+    uint64_t *final_key;
+    unsigned char tag[QKD_AUTH_TAG_SIZE];
+    uint64_t sink;                      /* Results, so that the compiler cannot drop the work */
+} scratch_t;
+
+typedef struct kernel_st {
+    const char *name;
+    void (*run)(const block_data_t *data, scratch_t *scratch);
+} kernel_t;
+
+typedef struct worker_st {
+    pthread_t thread;
+    pthread_barrier_t *barrier;
+    const kernel_t *kernel;
+    const block_data_t *data;
+    scratch_t scratch;
+    uint64_t nr_runs;
+    double elapsed;
+} worker_t;
+
+typedef size_t (*compress_t)(const uint64_t *bits, const uint64_t *keep, size_t nr_words,
+                             uint64_t *out);
+
+static options_t options = {
+    .block_bits = { 16384.0, 65536.0 },
+    .nr_block_sizes = 2,
+    .qbers = { 0.01, 0.03, 0.05 },
+    .nr_qbers = 3,
+    .nr_thread_counts = 0,              /* 1, 2, 4, ... up to the number of CPUs */
+    .kernels = NULL,
+    .duration = 0.2,
+    .frame_bits = 4096,
+    .efficiency = QKD_LDPC_DEFAULT_EFFICIENCY,
+    .sample_fraction = 0.1,
+    .max_iterations = QKD_LDPC_DEFAULT_MAX_ITERATIONS,
+    .seed = 1,
+    .output = NULL
+};
+
+static compress_t compress = NULL;
+static bool compress_bmi2_enabled = false;
+
+/**
+ * Return the current time of the monotonic clock in nanoseconds.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * Binary entropy function.
+ */
+static double binary_entropy(double p)
+{
+    if (p <= 0.0 || p >= 1.0) {
+        return 0.0;
+    }
+    return -p * log2(p) - (1.0 - p) * log2(1.0 - p);
+}
+
+/**
+ * The splitmix64 pseudo random number generator.
+ */
+static uint64_t splitmix64(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static double random_uniform(uint64_t *state)
+{
+    return (splitmix64(state) >> 11) / 9007199254740992.0;
+}
+
+static void *checked_calloc(size_t nr_elements, size_t element_size)
+{
+    void *memory = calloc(nr_elements ? nr_elements : 1, element_size);
+    if (memory == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return memory;
+}
+
+static size_t words(size_t bits)
+{
+    return (bits + WORD_BITS - 1) / WORD_BITS;
+}
+
+static uint64_t pext_portable(uint64_t bits, uint64_t mask)
+{
+    uint64_t result = 0;
+    for (uint64_t out_bit = 1; mask != 0; out_bit <<= 1) {
+        uint64_t lowest = mask & -mask;
+        if (bits & lowest) {
+            result |= out_bit;
+        }
+        mask ^= lowest;
+    }
+    return result;
+}
+
+/**
+ * Append the bits of bits that are set in keep to out, in order.
+ *
+ * Returns the number of bits appended.
+ */
+static inline __attribute__((always_inline))
+size_t compress_with(const uint64_t *bits, const uint64_t *keep, size_t nr_words, uint64_t *out,
+                     uint64_t (*pext)(uint64_t bits, uint64_t mask))
+{
+    uint64_t partial = 0;
+    unsigned partial_bits = 0;
+    size_t nr_out_words = 0;
+    for (size_t i = 0; i < nr_words; i++) {
+        uint64_t selected = pext(bits[i], keep[i]);
+        unsigned nr_selected = __builtin_popcountll(keep[i]);
+        partial |= selected << partial_bits;
+        if (partial_bits + nr_selected >= WORD_BITS) {
+            out[nr_out_words++] = partial;
+            partial = partial_bits ? selected >> (WORD_BITS - partial_bits) : 0;
+            partial_bits = partial_bits + nr_selected - WORD_BITS;
+        } else {
+            partial_bits += nr_selected;
+        }
+    }
+    if (partial_bits > 0) {
+        out[nr_out_words] = partial;
+    }
+    return nr_out_words * WORD_BITS + partial_bits;
+}
+
+static size_t compress_portable(const uint64_t *bits, const uint64_t *keep, size_t nr_words,
+                                uint64_t *out)
+{
+    return compress_with(bits, keep, nr_words, out, pext_portable);
+}
+
+#ifdef HAVE_BMI2
+__attribute__((target("bmi2")))
+static uint64_t pext_bmi2(uint64_t bits, uint64_t mask)
+{
+    return _pext_u64(bits, mask);
+}
+
+__attribute__((target("bmi2")))
+static size_t compress_bmi2(const uint64_t *bits, const uint64_t *keep, size_t nr_words,
+                            uint64_t *out)
+{
+    return compress_with(bits, keep, nr_words, out, pext_bmi2);
+}
+#endif
+
+/**
+ * Choose the implementation of bit compression: PEXT if the CPU supports BMI2.
+ */
+static void choose_compress(void)
+{
+    compress = compress_portable;
+#ifdef HAVE_BMI2
+    if (__builtin_cpu_supports("bmi2")) {
+        compress = compress_bmi2;
+        compress_bmi2_enabled = true;
+    }
+#endif
+}
+
+/**
+ * Sifting at the receiving end: keep the detections in which both ends used the same basis.
+ */
+static void run_sifting(const block_data_t *data, scratch_t *scratch)
+{
+    uint64_t *keep = scratch->mask;
+    size_t nr_words = words(data->nr_detections);
+    for (size_t i = 0; i < nr_words; i++) {
+        keep[i] = ~(data->alice_bases[i] ^ data->bob_bases[i]);
+    }
+    size_t tail = data->nr_detections % WORD_BITS;
+    if (tail) {
+        keep[nr_words - 1] &= (1ULL << tail) - 1;
+    }
+    scratch->sink += compress(data->bob_detections, keep, nr_words, scratch->key);
+}
+
+/**
+ * Error estimation: count the errors in a random sample of the sifted key, and remove the sample
+ * from the key.
+ */
+static void run_estimation(const block_data_t *data, scratch_t *scratch)
+{
+    uint64_t *sample = scratch->mask;
+    memset(sample, 0, data->nr_words * sizeof(uint64_t));
+    for (size_t i = 0; i < data->sample_bits; i++) {
+        size_t position = splitmix64(&scratch->random_state) % data->block_bits;
+        sample[position / WORD_BITS] |= 1ULL << (position % WORD_BITS);
+    }
+    uint64_t nr_errors = 0;
+    for (size_t i = 0; i < data->nr_words; i++) {
+        nr_errors += __builtin_popcountll((data->alice_key[i] ^ data->bob_key[i]) & sample[i]);
+        sample[i] = ~sample[i];
+    }
+    scratch->sink += nr_errors + compress(data->bob_key, sample, data->nr_words, scratch->key);
+}
+
+/**
+ * Reconciliation at the sending end: compute the syndrome of every frame.
+ */
+static void run_syndrome(const block_data_t *data, scratch_t *scratch)
+{
+    const unsigned char *key = (const unsigned char *) data->alice_key;
+    size_t frame_size = options.frame_bits / 8;
+    for (size_t frame = 0; frame < data->nr_frames; frame++) {
+        QKD_ldpc_syndrome(data->code, key + frame * frame_size,
+                          scratch->syndromes + frame * data->syndrome_size);
+    }
+    scratch->sink += scratch->syndromes[0];
+}
+
+/**
+ * Reconciliation at the receiving end: correct the errors in every frame, single-threaded (the
+ * benchmark runs several blocks in parallel instead).
+ */
+static void run_decoding(const block_data_t *data, scratch_t *scratch)
+{
+    memcpy(scratch->frames, data->bob_key, data->block_bits / 8);
+    scratch->sink += QKD_ldpc_decode(data->code, scratch->frames, data->syndromes,
+                                     data->nr_frames, data->qber, options.max_iterations, 1,
+                                     scratch->decoded);
+}
+
+/**
+ * Privacy amplification: multiply the reconciled key with the Toeplitz matrix. Bit i of the final
+ * key is the XOR over all set bits j of the key of bit i + block_bits - 1 - j of the seed.
+ */
+static void run_amplification(const block_data_t *data, scratch_t *scratch)
+{
+    size_t nr_final_words = words(data->final_bits);
+    uint64_t *final_key = scratch->final_key;
+    memset(final_key, 0, nr_final_words * sizeof(uint64_t));
+    for (size_t i = 0; i < data->nr_words; i++) {
+        uint64_t word = data->alice_key[i];
+        while (word != 0) {
+            size_t j = i * WORD_BITS + __builtin_ctzll(word);
+            word &= word - 1;
+            size_t offset = data->block_bits - 1 - j;
+            const uint64_t *window = data->toeplitz[offset % WORD_BITS] + offset / WORD_BITS;
+            for (size_t k = 0; k < nr_final_words; k++) {
+                final_key[k] ^= window[k];
+            }
+        }
+    }
+    size_t tail = data->final_bits % WORD_BITS;
+    if (tail) {
+        final_key[nr_final_words - 1] &= (1ULL << tail) - 1;
+    }
+    scratch->sink += final_key[0];
+}
+
+/**
+ * Authentication: tag the classical messages of the block.
+ */
+static void run_authentication(const block_data_t *data, scratch_t *scratch)
+{
+    static const unsigned char pad[QKD_AUTH_PAD_SIZE];
+    QKD_auth_tag(&data->auth_key, data->messages, data->messages_size, pad, scratch->tag);
+    scratch->sink += scratch->tag[0];
+}
+
+static const kernel_t kernels[] = {
+    { "sifting", run_sifting },
+    { "estimation", run_estimation },
+    { "syndrome", run_syndrome },
+    { "decoding", run_decoding },
+    { "amplification", run_amplification },
+    { "authentication", run_authentication }
+};
+#define NR_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static void random_bits(uint64_t *bits, size_t nr_bits, uint64_t *random_state)
+{
+    for (size_t i = 0; i < words(nr_bits); i++) {
+        bits[i] = splitmix64(random_state);
+    }
+    if (nr_bits % WORD_BITS) {
+        bits[nr_bits / WORD_BITS] &= (1ULL << (nr_bits % WORD_BITS)) - 1;
+    }
+}
+
+static void add_errors(uint64_t *bits, size_t nr_bits, double qber, uint64_t *random_state)
+{
+    for (size_t i = 0; i < nr_bits; i++) {
+        if (random_uniform(random_state) < qber) {
+            bits[i / WORD_BITS] ^= 1ULL << (i % WORD_BITS);
+        }
+    }
+}
+
+static void scratch_init(scratch_t *scratch, const block_data_t *data, uint64_t seed)
+{
+    scratch->random_state = seed;
+    scratch->key = checked_calloc(words(data->nr_detections) + 1, sizeof(uint64_t));
+    scratch->mask = checked_calloc(words(data->nr_detections), sizeof(uint64_t));
+    scratch->frames = checked_calloc(data->block_bits / 8, 1);
+    scratch->syndromes = checked_calloc(data->nr_frames * data->syndrome_size, 1);
+    scratch->decoded = checked_calloc(data->nr_frames, sizeof(bool));
+    scratch->final_key = checked_calloc(words(data->final_bits), sizeof(uint64_t));
+    scratch->sink = 0;
+}
+
+static void scratch_free(scratch_t *scratch)
+{
+    free(scratch->key);
+    free(scratch->mask);
+    free(scratch->frames);
+    free(scratch->syndromes);
+    free(scratch->decoded);
+    free(scratch->final_key);
+}
+
+/**
+ * Measure the efficiency of a block size and QBER: estimate the QBER from a sample (and bound it),
+ * decode enough frames to measure the frame error rate, and compute how much of the sifted key is
+ * left as final key. This determines the length of the final key for privacy amplification.
+ */
+static void measure_efficiency(block_data_t *data)
+{
+    scratch_t scratch;
+    scratch_init(&scratch, data, options.seed);
+
+    size_t nr_sifted = 0;
+    for (size_t i = 0; i < words(data->nr_detections); i++) {
+        scratch.mask[i] = ~(data->alice_bases[i] ^ data->bob_bases[i]);
+        nr_sifted += __builtin_popcountll(scratch.mask[i]);
+    }
+    data->sifted_fraction = (double) nr_sifted / data->nr_detections;
+
+    uint64_t nr_sampled = 0;
+    uint64_t nr_errors = 0;
+    for (size_t i = 0; i < data->sample_bits; i++) {
+        size_t position = splitmix64(&scratch.random_state) % data->block_bits;
+        uint64_t bit = 1ULL << (position % WORD_BITS);
+        nr_sampled++;
+        nr_errors += ((data->alice_key[position / WORD_BITS] ^
+                       data->bob_key[position / WORD_BITS]) & bit) != 0;
+    }
+    data->qber_estimate = nr_sampled ? (double) nr_errors / nr_sampled : 0.0;
+    double deviation = nr_sampled ? sqrt(SECURITY_PARAMETER_LOG2 * log(2.0) / (2.0 * nr_sampled)) :
+                                    0.5;
+    data->qber_bound = fmin(0.5, data->qber_estimate + deviation);
+
+    data->f_ec = QKD_ldpc_efficiency(data->code, data->qber);
+    size_t nr_runs = (MIN_EFFICIENCY_FRAMES + data->nr_frames - 1) / data->nr_frames;
+    size_t nr_failed = 0;
+    for (size_t run = 0; run < nr_runs; run++) {
+        if (run > 0) {
+            /* Other errors in the same key */
+            memcpy(data->bob_key, data->alice_key, data->block_bits / 8);
+            add_errors(data->bob_key, data->block_bits, data->qber, &scratch.random_state);
+        }
+        run_decoding(data, &scratch);
+        size_t frame_size = options.frame_bits / 8;
+        for (size_t frame = 0; frame < data->nr_frames; frame++) {
+            if (!scratch.decoded[frame] ||
+                memcmp(scratch.frames + frame * frame_size,
+                       (unsigned char *) data->alice_key + frame * frame_size, frame_size) != 0) {
+                nr_failed++;
+            }
+        }
+    }
+    data->frame_error_rate = (double) nr_failed / (nr_runs * data->nr_frames);
+
+    double leaked_bits = 8.0 * data->syndrome_size * data->nr_frames;
+    double final_bits =
+        (1.0 - data->frame_error_rate) *
+        (data->block_bits * (1.0 - binary_entropy(data->qber_bound)) - leaked_bits) -
+        2.0 * SECURITY_PARAMETER_LOG2 - NR_AUTHENTICATED_MESSAGES * 8.0 * QKD_AUTH_PAD_SIZE;
+    data->final_bits = final_bits > 0.0 ? (size_t) final_bits : 0;
+    data->final_key_fraction = (double) data->final_bits / (data->block_bits + data->sample_bits);
+    scratch_free(&scratch);
+}
+
+/**
+ * Generate the data of a block size and QBER.
+ *
+ * Returns true on success, false on failure.
+ */
+static bool block_data_init(block_data_t *data, size_t block_bits, double qber)
+{
+    memset(data, 0, sizeof(*data));
+    data->block_bits = block_bits;
+    data->nr_words = words(block_bits);
+    data->qber = qber;
+    uint64_t random_state = options.seed;
+
+    /* Random bases yield a sifted bit for half of the detections on average. */
+    data->nr_detections = 2 * block_bits;
+    size_t nr_detection_words = words(data->nr_detections);
+    data->alice_bases = checked_calloc(nr_detection_words, sizeof(uint64_t));
+    data->bob_bases = checked_calloc(nr_detection_words, sizeof(uint64_t));
+    data->bob_detections = checked_calloc(nr_detection_words, sizeof(uint64_t));
+    random_bits(data->alice_bases, data->nr_detections, &random_state);
+    random_bits(data->bob_bases, data->nr_detections, &random_state);
+    random_bits(data->bob_detections, data->nr_detections, &random_state);
+
+    data->alice_key = checked_calloc(data->nr_words, sizeof(uint64_t));
+    data->bob_key = checked_calloc(data->nr_words, sizeof(uint64_t));
+    random_bits(data->alice_key, block_bits, &random_state);
+    memcpy(data->bob_key, data->alice_key, data->nr_words * sizeof(uint64_t));
+    add_errors(data->bob_key, block_bits, qber, &random_state);
+    data->sample_bits = (size_t) (options.sample_fraction * block_bits);
+
+    size_t syndrome_bits = QKD_ldpc_choose_syndrome_bits(options.frame_bits, qber,
+                                                         options.efficiency);
+    data->code = QKD_ldpc_code_get(options.frame_bits, syndrome_bits);
+    if (data->code == NULL) {
+        fprintf(stderr, "No LDPC code for %zu bit frames at QBER %g\n", options.frame_bits, qber);
+        return false;
+    }
+    data->nr_frames = block_bits / options.frame_bits;
+    data->syndrome_size = (syndrome_bits + 7) / 8;
+    data->syndromes = checked_calloc(data->nr_frames * data->syndrome_size, 1);
+    for (size_t frame = 0; frame < data->nr_frames; frame++) {
+        QKD_ldpc_syndrome(data->code,
+                          (unsigned char *) data->alice_key + frame * options.frame_bits / 8,
+                          data->syndromes + frame * data->syndrome_size);
+    }
+
+    measure_efficiency(data);
+
+    /* The seed of the Toeplitz matrix has block_bits + final_bits - 1 bits. Every shifted copy
+     * has a spare word, so that a window never reads beyond it. */
+    size_t seed_bits = block_bits + data->final_bits;
+    data->seed_words = words(seed_bits) + 1;
+    uint64_t *seed = checked_calloc(data->seed_words + 1, sizeof(uint64_t));
+    random_bits(seed, seed_bits, &random_state);
+    for (int shift = 0; shift < WORD_BITS; shift++) {
+        data->toeplitz[shift] = checked_calloc(data->seed_words, sizeof(uint64_t));
+        for (size_t i = 0; i < data->seed_words; i++) {
+            data->toeplitz[shift][i] = shift ? (seed[i] >> shift) |
+                                               (seed[i + 1] << (WORD_BITS - shift)) : seed[i];
+        }
+    }
+    free(seed);
+
+    unsigned char hash_key[QKD_AUTH_KEY_SIZE];
+    for (size_t i = 0; i < sizeof(hash_key); i++) {
+        hash_key[i] = splitmix64(&random_state);
+    }
+    QKD_auth_key_init(&data->auth_key, hash_key);
+    data->messages_size = data->nr_detections / 8 + (data->sample_bits + 7) / 8 +
+                          data->nr_frames * data->syndrome_size;
+    data->messages = checked_calloc(data->messages_size, 1);
+    random_bits((uint64_t *) data->messages, WORD_BITS * (data->messages_size / 8),
+                &random_state);
+    return true;
+}
+
+static void block_data_free(block_data_t *data)
+{
+    free(data->alice_bases);
+    free(data->bob_bases);
+    free(data->bob_detections);
+    free(data->alice_key);
+    free(data->bob_key);
+    free(data->syndromes);
+    for (int shift = 0; shift < WORD_BITS; shift++) {
+        free(data->toeplitz[shift]);
+    }
+    QKD_auth_key_cleanse(&data->auth_key);
+    free(data->messages);
+}
+
+static void *worker_thread(void *arg)
+{
+    worker_t *worker = arg;
+    pthread_barrier_wait(worker->barrier);
+    uint64_t start_ns = now_ns();
+    uint64_t end_ns = start_ns + (uint64_t) (options.duration * NSEC_PER_SEC);
+    uint64_t ns;
+    do {
+        worker->kernel->run(worker->data, &worker->scratch);
+        worker->nr_runs++;
+        ns = now_ns();
+    } while (ns < end_ns);
+    worker->elapsed = (ns - start_ns) / (double) NSEC_PER_SEC;
+    return NULL;
+}
+
+/**
+ * Run a kernel on nr_threads threads at once, each on its own copy of the scratch memory.
+ *
+ * Returns the total throughput in Mbit/s of sifted key.
+ */
+static double measure_kernel(const kernel_t *kernel, const block_data_t *data, int nr_threads)
+{
+    worker_t *workers = checked_calloc(nr_threads, sizeof(worker_t));
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, nr_threads);
+    int nr_started = 0;
+    for (int i = 0; i < nr_threads; i++) {
+        workers[i].barrier = &barrier;
+        workers[i].kernel = kernel;
+        workers[i].data = data;
+        scratch_init(&workers[i].scratch, data, options.seed + i + 1);
+    }
+    for (; nr_started < nr_threads; nr_started++) {
+        if (pthread_create(&workers[nr_started].thread, NULL, worker_thread,
+                           &workers[nr_started]) != 0) {
+            break;
+        }
+    }
+    if (nr_started < nr_threads) {
+        /* The threads that did start wait at the barrier forever. */
+        fprintf(stderr, "Could not start %d threads\n", nr_threads);
+        exit(1);
+    }
+    double bits_per_second = 0.0;
+    for (int i = 0; i < nr_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        bits_per_second += workers[i].nr_runs * (double) data->block_bits / workers[i].elapsed;
+    }
+    for (int i = 0; i < nr_threads; i++) {
+        scratch_free(&workers[i].scratch);
+    }
+    pthread_barrier_destroy(&barrier);
+    free(workers);
+    return bits_per_second / 1e6;
+}
+
+/**
+ * Is a kernel selected with --kernels?
+ */
+static bool kernel_selected(const char *name)
+{
+    if (options.kernels == NULL) {
+        return true;
+    }
+    size_t len = strlen(name);
+    for (const char *start = options.kernels; *start != '\0'; ) {
+        size_t item_len = strcspn(start, ",");
+        if (item_len == len && strncmp(start, name, len) == 0) {
+            return true;
+        }
+        start += item_len + (start[item_len] == ',');
+    }
+    return false;
+}
+
+static void print_kernel_results(FILE *out, const block_data_t *data)
+{
+    bool first_kernel = true;
+    for (size_t k = 0; k < NR_KERNELS; k++) {
+        const kernel_t *kernel = &kernels[k];
+        if (!kernel_selected(kernel->name) ||
+            (kernel->run == run_amplification && data->final_bits == 0)) {
+            continue;
+        }
+        fprintf(out, "%s\n        { \"kernel\": \"%s\", \"scaling\": [", first_kernel ? "" : ",",
+                kernel->name);
+        first_kernel = false;
+        double first_mbps = 0.0;
+        for (size_t t = 0; t < options.nr_thread_counts; t++) {
+            int nr_threads = (int) options.threads[t];
+            double mbps = measure_kernel(kernel, data, nr_threads);
+            if (t == 0) {
+                first_mbps = mbps;
+            }
+            fprintf(out, "%s\n            { \"threads\": %d, \"mbps\": %.3f, "
+                    "\"mbps_per_core\": %.3f, \"speedup\": %.3f }", t ? "," : "", nr_threads,
+                    mbps, mbps / nr_threads, first_mbps > 0.0 ? mbps / first_mbps : 0.0);
+            fflush(out);
+        }
+        fprintf(out, "\n        ] }");
+    }
+}
+
+static void print_results(FILE *out)
+{
+    fprintf(out, "{\n");
+    fprintf(out, "  \"benchmark\": \"qkd_postprocessing\",\n");
+    fprintf(out, "  \"unit\": \"Mbit/s of sifted key\",\n");
+#ifdef __OPTIMIZE__
+    fprintf(out, "  \"optimized\": true,\n");
+#else
+    fprintf(out, "  \"optimized\": false,\n");
+#endif
+    fprintf(out, "  \"cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+    fprintf(out, "  \"simd\": { \"sifting_bmi2\": %s, \"ldpc_avx2\": %s, \"auth_clmul\": %s },\n",
+            compress_bmi2_enabled ? "true" : "false",
+            QKD_ldpc_simd_enabled() ? "true" : "false",
+            QKD_auth_clmul_enabled() ? "true" : "false");
+    fprintf(out, "  \"parameters\": { \"duration_s\": %g, \"frame_bits\": %zu, "
+            "\"target_efficiency\": %g, \"sample_fraction\": %g, \"max_iterations\": %d, "
+            "\"security_parameter_log2\": %d, \"seed\": %llu },\n", options.duration,
+            options.frame_bits, options.efficiency, options.sample_fraction,
+            options.max_iterations, SECURITY_PARAMETER_LOG2, (unsigned long long) options.seed);
+    fprintf(out, "  \"blocks\": [");
+    for (size_t b = 0; b < options.nr_block_sizes; b++) {
+        for (size_t q = 0; q < options.nr_qbers; q++) {
+            block_data_t data;
+            if (!block_data_init(&data, (size_t) options.block_bits[b], options.qbers[q])) {
+                exit(1);
+            }
+            fprintf(out, "%s\n    { \"block_bits\": %zu, \"qber\": %g,\n",
+                    b + q ? "," : "", data.block_bits, data.qber);
+            fprintf(out, "      \"efficiency\": { \"sifted_fraction\": %.4f, "
+                    "\"qber_estimate\": %.5f, \"qber_bound\": %.5f, \"f_ec\": %.4f, "
+                    "\"frame_error_rate\": %.5f, \"final_key_bits\": %zu, "
+                    "\"final_key_fraction\": %.4f },\n", data.sifted_fraction,
+                    data.qber_estimate, data.qber_bound, data.f_ec, data.frame_error_rate,
+                    data.final_bits, data.final_key_fraction);
+            fprintf(out, "      \"kernels\": [");
+            print_kernel_results(out, &data);
+            fprintf(out, "\n      ] }");
+            block_data_free(&data);
+        }
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -b, --block-bits LIST      Bits of sifted key per block (default 16384,65536;\n"
+            "                             multiples of --frame-bits)\n"
+            "  -q, --qber LIST            Quantum bit error rates (default 0.01,0.03,0.05)\n"
+            "  -T, --threads LIST         Numbers of threads (default 1, 2, 4, ... up to the\n"
+            "                             number of CPUs)\n"
+            "  -k, --kernels LIST         Kernels to run (default all: sifting,estimation,\n"
+            "                             syndrome,decoding,amplification,authentication)\n"
+            "  -d, --duration S           Seconds per measurement (default 0.2)\n"
+            "  -F, --frame-bits N         LDPC frame size (default 4096, a multiple of 64)\n"
+            "  -e, --efficiency F         Target reconciliation efficiency (default 1.6)\n"
+            "  -s, --sample-fraction F    Fraction of the block sampled for error estimation\n"
+            "                             (default 0.1)\n"
+            "  -i, --max-iterations N     Maximum LDPC decoder iterations (default 50)\n"
+            "  -S, --seed N               Random seed (default 1)\n"
+            "  -o, --output FILE          Write the JSON results to FILE instead of stdout\n"
+            "  -h, --help                 Print this help\n",
+            program);
+}
+
+/**
+ * Parse a comma separated list of positive numbers.
+ *
+ * Returns true on success, false on failure.
+ */
+static bool parse_list(const char *str, double *values, size_t *nr_values)
+{
+    *nr_values = 0;
+    while (*str != '\0') {
+        char *end;
+        double value = strtod(str, &end);
+        if (end == str || value <= 0.0 || *nr_values == MAX_POINTS) {
+            return false;
+        }
+        values[(*nr_values)++] = value;
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return false;
+        }
+        str = end;
+    }
+    return *nr_values > 0;
+}
+
+/**
+ * Parse the command line options into the global options.
+ *
+ * Returns true on success, false on failure.
+ */
+static bool parse_options(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"block-bits", required_argument, NULL, 'b'},
+        {"qber", required_argument, NULL, 'q'},
+        {"threads", required_argument, NULL, 'T'},
+        {"kernels", required_argument, NULL, 'k'},
+        {"duration", required_argument, NULL, 'd'},
+        {"frame-bits", required_argument, NULL, 'F'},
+        {"efficiency", required_argument, NULL, 'e'},
+        {"sample-fraction", required_argument, NULL, 's'},
+        {"max-iterations", required_argument, NULL, 'i'},
+        {"seed", required_argument, NULL, 'S'},
+        {"output", required_argument, NULL, 'o'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    const char *short_options = "b:q:T:k:d:F:e:s:i:S:o:h";
+    int opt;
+    while ((opt = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'b':
+                if (!parse_list(optarg, options.block_bits, &options.nr_block_sizes)) {
+                    fprintf(stderr, "Invalid --block-bits value %s\n", optarg);
+                    return false;
+                }
+                break;
+            case 'q':
+                if (!parse_list(optarg, options.qbers, &options.nr_qbers)) {
+                    fprintf(stderr, "Invalid --qber value %s\n", optarg);
+                    return false;
+                }
+                break;
+            case 'T':
+                if (!parse_list(optarg, options.threads, &options.nr_thread_counts)) {
+                    fprintf(stderr, "Invalid --threads value %s\n", optarg);
+                    return false;
+                }
+                break;
+            case 'k':
+                options.kernels = optarg;
+                break;
+            case 'd':
+                options.duration = atof(optarg);
+                break;
+            case 'F':
+                options.frame_bits = strtoul(optarg, NULL, 10);
+                break;
+            case 'e':
+                options.efficiency = atof(optarg);
+                break;
+            case 's':
+                options.sample_fraction = atof(optarg);
+                break;
+            case 'i':
+                options.max_iterations = atoi(optarg);
+                break;
+            case 'S':
+                options.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'o':
+                options.output = optarg;
+                break;
+            default:
+                return false;
+        }
+    }
+    if (options.duration <= 0.0 || options.frame_bits < WORD_BITS ||
+        options.frame_bits % WORD_BITS != 0 || options.efficiency < 1.0 ||
+        options.sample_fraction <= 0.0 || options.sample_fraction >= 1.0 ||
+        options.max_iterations < 1) {
+        fprintf(stderr, "Invalid option value\n");
+        return false;
+    }
+    for (size_t b = 0; b < options.nr_block_sizes; b++) {
+        size_t block_bits = (size_t) options.block_bits[b];
+        if (block_bits != options.block_bits[b] || block_bits % options.frame_bits != 0) {
+            fprintf(stderr, "Block size %g is not a multiple of the frame size %zu\n",
+                    options.block_bits[b], options.frame_bits);
+            return false;
+        }
+    }
+    for (size_t q = 0; q < options.nr_qbers; q++) {
+        if (options.qbers[q] >= 0.5) {
+            fprintf(stderr, "Invalid QBER %g\n", options.qbers[q]);
+            return false;
+        }
+    }
+    for (size_t t = 0; t < options.nr_thread_counts; t++) {
+        if (options.threads[t] != (int) options.threads[t]) {
+            fprintf(stderr, "Invalid number of threads %g\n", options.threads[t]);
+            return false;
+        }
+    }
+    for (const char *start = options.kernels; start != NULL && *start != '\0'; ) {
+        size_t len = strcspn(start, ",");
+        size_t k = 0;
+        while (k < NR_KERNELS &&
+               (strlen(kernels[k].name) != len || strncmp(start, kernels[k].name, len) != 0)) {
+            k++;
+        }
+        if (k == NR_KERNELS) {
+            fprintf(stderr, "Invalid --kernels value %s\n", options.kernels);
+            return false;
+        }
+        start += len + (start[len] == ',');
+    }
+    return true;
+}
+
+/**
+ * By default, measure 1, 2, 4, ... threads, up to and including the number of CPUs.
+ */
+static void default_thread_counts(void)
+{
+    if (options.nr_thread_counts > 0) {
+        return;
+    }
+    long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long nr_threads = 1; nr_threads < nr_cpus && options.nr_thread_counts < MAX_POINTS - 1;
+         nr_threads *= 2) {
+        options.threads[options.nr_thread_counts++] = nr_threads;
+    }
+    options.threads[options.nr_thread_counts++] = nr_cpus > 1 ? nr_cpus : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    if (!parse_options(argc, argv)) {
+        usage(argv[0]);
+        return 1;
+    }
+    QKD_debug_set_enabled(false);
+    default_thread_counts();
+    choose_compress();
+
+    FILE *out = stdout;
+    if (options.output != NULL) {
+        out = fopen(options.output, "w");
+        if (out == NULL) {
+            perror(options.output);
+            return 1;
+        }
+    }
+    print_results(out);
+    if (out != stdout) {
+        fclose(out);
+    }
+    return 0;
+}
@@ -0,0 +1,712 @@
+/**
+ * qkd_replication.c
+ *
+ * Replication of the state of a key manager from an active node to a standby node (see
+ * qkd_replication.h).
+ *
+ * On the wire, a batch is a header (the sequence number of its last record, and the size of its
+ * records), followed by the records, each of which is a type, a size, and a payload. The standby
+ * acknowledges a batch by sending back the sequence number of its last record. Records are numbered
+ * from 1, and the numbering continues across connections. An empty batch with sequence number 0
+ * dismisses the standby: the active node sends it before it closes the connection on purpose
+ * (when the standby is too slow, or when the replication is stopped), so that the standby can tell
+ * this apart from the active node dying.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#include "qkd_replication.h"
+#include "qkd_debug.h"
+#include "qkd_util.h"
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <openssl/crypto.h>
+
+#define BATCH_HEADER_SIZE 12
+#define RECORD_HEADER_SIZE 5
+#define ACK_SIZE 8
+#define MAX_BATCH_BYTES (64 * 1024 * 1024)  /* Standby: larger batches are refused */
+#define MIN_BUFFER_CAPACITY (64 * 1024)
+#define RECONNECT_INTERVAL 1.0  /* Active: seconds between attempts to connect to the standby */
+#define METRICS_INTERVAL 1.0    /* Seconds between writes of the metrics file */
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+typedef struct replication_st {
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;         /* Signalled when records are appended, or when stopping */
+    QKD_replication_role_t role;
+    QKD_replication_callbacks_t callbacks;
+    char host[256];
+    char port[16];
+    size_t max_backlog;
+    double ack_timeout;
+    const char *metrics_file;
+    double last_metrics_time;
+    bool thread_started;
+    pthread_t thread;
+    bool stopping;
+    int sock;                       /* The connection to the other node */
+    int listen_sock;                /* Standby */
+    bool streaming;
+    unsigned char *pending;         /* Active: records waiting for the next batch */
+    size_t pending_size;
+    size_t pending_capacity;
+    uint64_t nr_pending;
+    double pending_time;            /* When the oldest pending record was appended */
+    uint64_t next_seq;
+    QKD_replication_stats_t stats;
+} replication_t;
+
+static replication_t replication = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .changed = PTHREAD_COND_INITIALIZER,
+    .sock = -1,
+    .listen_sock = -1,
+    .next_seq = 1
+};
+
+/**
+ * Wait until the condition is signalled, but not longer than the given number of seconds. Must be
+ * called with the mutex held.
+ */
+static void wait_changed(double seconds)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    double wake = ts.tv_sec + ts.tv_nsec / 1e9 + seconds;
+    ts.tv_sec = (time_t) wake;
+    ts.tv_nsec = (long) ((wake - (time_t) wake) * 1e9);
+    pthread_cond_timedwait(&replication.changed, &replication.mutex, &ts);
+}
+
+/**
+ * Grow a buffer that may hold key material to at least the given capacity. The old buffer is
+ * zeroized before it is freed.
+ *
+ * Returns true on success, false on failure.
+ */
+static bool grow_buffer(unsigned char **buffer, size_t *capacity, size_t used, size_t needed)
+{
+    if (needed <= *capacity) {
+        return true;
+    }
+    size_t new_capacity = *capacity > 0 ? 2 * *capacity : MIN_BUFFER_CAPACITY;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    unsigned char *new_buffer = malloc(new_capacity);
+    if (new_buffer == NULL) {
+        return false;
+    }
+    if (*buffer != NULL) {
+        memcpy(new_buffer, *buffer, used);
+        OPENSSL_cleanse(*buffer, *capacity);
+        free(*buffer);
+    }
+    *buffer = new_buffer;
+    *capacity = new_capacity;
+    return true;
+}
+
+static void free_buffer(unsigned char **buffer, size_t *capacity)
+{
+    if (*buffer != NULL) {
+        OPENSSL_cleanse(*buffer, *capacity);
+        free(*buffer);
+    }
+    *buffer = NULL;
+    *capacity = 0;
+}
+
+/**
+ * Active: connect to the standby node.
+ *
+ * Returns the connection socket on success, or -1 on failure.
+ */
+static int connect_to_standby(void)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    struct addrinfo *res = NULL;
+    int result = getaddrinfo(replication.host, replication.port, &hints, &res);
+    if (result != 0) {
+        QKD_error("getaddrinfo %s port %s failed: %s", replication.host, replication.port,
+                  gai_strerror(result));
+        return -1;
+    }
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) {
+        QKD_error_with_errno("socket failed");
+        freeaddrinfo(res);
+        return -1;
+    }
+    if (connect(sock, res->ai_addr, res->ai_addrlen) != 0) {
+        freeaddrinfo(res);
+        close(sock);
+        return -1;
+    }
+    freeaddrinfo(res);
+    QKD_set_no_delay(sock);
+    return sock;
+}
+
+/**
+ * Standby: listen for the connection from the active node.
+ *
+ * Returns the listen socket on success, or -1 on failure.
+ */
+static int listen_for_active(void)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) {
+        QKD_error_with_errno("socket failed");
+        return -1;
+    }
+    int on = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0) {
+        QKD_error_with_errno("setsockopt SO_REUSEADDR failed");
+        close(sock);
+        return -1;
+    }
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons((uint16_t) atoi(replication.port));
+    if (bind(sock, (const struct sockaddr *) &address, sizeof(address)) != 0 ||
+        listen(sock, 1) != 0) {
+        QKD_error_with_errno("Listening on replication port %s failed", replication.port);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static void write_metrics(FILE *file, const QKD_replication_stats_t *stats)
+{
+    fprintf(file,
+            "# HELP qkd_replication_streaming Whether the active node streams to a standby.\n"
+            "# TYPE qkd_replication_streaming gauge\n"
+            "qkd_replication_streaming %d\n"
+            "# HELP qkd_replication_connects_total Connections between the active and standby.\n"
+            "# TYPE qkd_replication_connects_total counter\n"
+            "qkd_replication_connects_total %llu\n"
+            "# HELP qkd_replication_records_total Replication records sent or applied.\n"
+            "# TYPE qkd_replication_records_total counter\n"
+            "qkd_replication_records_total %llu\n"
+            "# HELP qkd_replication_bytes_total Bytes of replication records sent or applied.\n"
+            "# TYPE qkd_replication_bytes_total counter\n"
+            "qkd_replication_bytes_total %llu\n"
+            "# HELP qkd_replication_lag_seconds Time from appending a record to the "
+            "acknowledgement of its batch.\n"
+            "# TYPE qkd_replication_lag_seconds summary\n"
+            "qkd_replication_lag_seconds_sum %.6f\n"
+            "qkd_replication_lag_seconds_count %llu\n"
+            "# HELP qkd_replication_lag_seconds_max The longest lag of a batch.\n"
+            "# TYPE qkd_replication_lag_seconds_max gauge\n"
+            "qkd_replication_lag_seconds_max %.6f\n"
+            "# HELP qkd_replication_lag_seconds_last The lag of the last batch.\n"
+            "# TYPE qkd_replication_lag_seconds_last gauge\n"
+            "qkd_replication_lag_seconds_last %.6f\n",
+            stats->streaming ? 1 : 0, (unsigned long long) stats->nr_connects,
+            (unsigned long long) stats->nr_records, (unsigned long long) stats->nr_bytes,
+            stats->total_lag, (unsigned long long) stats->nr_batches, stats->max_lag,
+            stats->last_lag);
+}
+
+/**
+ * Write the metrics file, if it is configured and it was not written in the last second (unless
+ * forced). Called with the mutex held.
+ */
+static void maybe_write_metrics_file(bool force)
+{
+    if (replication.metrics_file == NULL) {
+        return;
+    }
+    double now = QKD_monotonic_seconds();
+    if (!force && now - replication.last_metrics_time < METRICS_INTERVAL) {
+        return;
+    }
+    replication.last_metrics_time = now;
+    char tmp_name[4096];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", replication.metrics_file);
+    FILE *file = fopen(tmp_name, "w");
+    if (file == NULL) {
+        QKD_error_with_errno("Could not open %s", tmp_name);
+        return;
+    }
+    replication.stats.streaming = replication.streaming;
+    write_metrics(file, &replication.stats);
+    if (fclose(file) != 0 || rename(tmp_name, replication.metrics_file) != 0) {
+        QKD_error_with_errno("Could not write %s", replication.metrics_file);
+    }
+}
+
+/**
+ * Active: wait for the acknowledgement of the batch that ends with the given record, but not
+ * longer than the acknowledgement timeout.
+ *
+ * Returns true on success, false on failure.
+ */
+static bool receive_ack(int sock, uint64_t last_seq)
+{
+    struct pollfd pfd = {.fd = sock, .events = POLLIN};
+    int result;
+    do {
+        result = poll(&pfd, 1, (int) ceil(replication.ack_timeout * 1000.0));
+    } while (result == -1 && errno == EINTR);
+    if (result == 0) {
+        QKD_error("Standby did not acknowledge within %.3f seconds", replication.ack_timeout);
+        return false;
+    }
+    unsigned char ack[ACK_SIZE];
+    if (result == -1 || !QKD_receive_all(sock, ack, sizeof(ack))) {
+        return false;
+    }
+    if (QKD_get_uint64(ack) != last_seq) {
+        QKD_error("Standby acknowledged record %llu, expected %llu",
+                  (unsigned long long) QKD_get_uint64(ack), (unsigned long long) last_seq);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Active: send the pending records to the standby in batches, one batch at a time, until the
+ * connection fails or the replication is stopped. Records that are appended while a batch is in
+ * flight make up the next batch.
+ */
+static void stream_batches(int sock)
+{
+    unsigned char *batch = NULL;
+    size_t batch_capacity = 0;
+    pthread_mutex_lock(&replication.mutex);
+    while (true) {
+        while (replication.pending_size == 0 && !replication.stopping) {
+            pthread_cond_wait(&replication.changed, &replication.mutex);
+        }
+        if (replication.stopping) {
+            break;
+        }
+
+        /* Swap the buffers, so that records can be appended while the batch is in flight. */
+        unsigned char *records = replication.pending;
+        size_t records_capacity = replication.pending_capacity;
+        size_t size = replication.pending_size;
+        uint64_t nr_records = replication.nr_pending;
+        uint64_t last_seq = replication.next_seq - 1;
+        double append_time = replication.pending_time;
+        replication.pending = batch;
+        replication.pending_capacity = batch_capacity;
+        replication.pending_size = 0;
+        replication.nr_pending = 0;
+        batch = records;
+        batch_capacity = records_capacity;
+        pthread_mutex_unlock(&replication.mutex);
+
+        unsigned char header[BATCH_HEADER_SIZE];
+        QKD_put_uint64(header, last_seq);
+        QKD_put_uint32(header + 8, (uint32_t) size);
+        struct iovec iov[2] = {{.iov_base = header, .iov_len = sizeof(header)},
+                               {.iov_base = batch, .iov_len = size}};
+        bool ok = QKD_send_all(sock, iov, 2) && receive_ack(sock, last_seq);
+        OPENSSL_cleanse(batch, size);
+        pthread_mutex_lock(&replication.mutex);
+        if (!ok) {
+            break;
+        }
+        double lag = QKD_monotonic_seconds() - append_time;
+        replication.stats.nr_records += nr_records;
+        replication.stats.nr_batches++;
+        replication.stats.nr_bytes += size;
+        replication.stats.acked_seq = last_seq;
+        replication.stats.last_lag = lag;
+        replication.stats.total_lag += lag;
+        if (lag > replication.stats.max_lag) {
+            replication.stats.max_lag = lag;
+        }
+        maybe_write_metrics_file(false);
+        pthread_mutex_unlock(&replication.mutex);
+        replication.callbacks.acked(last_seq);
+        pthread_mutex_lock(&replication.mutex);
+    }
+    pthread_mutex_unlock(&replication.mutex);
+    free_buffer(&batch, &batch_capacity);
+}
+
+/**
+ * Active: dismiss the standby, if it is still there to hear it.
+ */
+static void dismiss_standby(int sock)
+{
+    unsigned char header[BATCH_HEADER_SIZE] = {0};
+    if (send(sock, header, sizeof(header), SEND_FLAGS | MSG_DONTWAIT) != sizeof(header)) {
+        QKD_debug("Could not dismiss standby");
+    }
+}
+
+/**
+ * Active: the replication thread. It connects to the standby (and reconnects when the connection
+ * is lost), has the implementation append its full state, and then streams the log.
+ */
+static void *active_thread(void *arg)
+{
+    QKD_enter();
+    pthread_mutex_lock(&replication.mutex);
+    while (!replication.stopping) {
+        pthread_mutex_unlock(&replication.mutex);
+        int sock = connect_to_standby();
+        pthread_mutex_lock(&replication.mutex);
+        if (sock == -1) {
+            wait_changed(RECONNECT_INTERVAL);
+            continue;
+        }
+        if (replication.stopping) {
+            close(sock);
+            break;
+        }
+        replication.sock = sock;
+        replication.streaming = true;
+        replication.stats.nr_connects++;
+        maybe_write_metrics_file(true);
+        pthread_mutex_unlock(&replication.mutex);
+        QKD_debug("Connected to standby %s:%s", replication.host, replication.port);
+        replication.callbacks.sync();
+        stream_batches(sock);
+        dismiss_standby(sock);
+
+        pthread_mutex_lock(&replication.mutex);
+        replication.streaming = false;
+        replication.sock = -1;
+        OPENSSL_cleanse(replication.pending, replication.pending_size);
+        replication.pending_size = 0;
+        replication.nr_pending = 0;
+        maybe_write_metrics_file(true);
+        pthread_mutex_unlock(&replication.mutex);
+        close(sock);
+        QKD_debug("Lost standby %s:%s", replication.host, replication.port);
+        replication.callbacks.disconnected();
+        pthread_mutex_lock(&replication.mutex);
+    }
+    pthread_mutex_unlock(&replication.mutex);
+    QKD_return_success("%p", NULL);
+}
+
+/**
+ * Standby: receive a batch from the active node, apply its records, and acknowledge it.
+ *
+ * Returns true on success, false on failure, if the connection was closed, or if the active node
+ * dismissed the standby (setting dismissed).
+ */
+static bool apply_batch(int sock, unsigned char **buffer, size_t *capacity, bool *dismissed)
+{
+    unsigned char header[BATCH_HEADER_SIZE];
+    if (!QKD_receive_all(sock, header, sizeof(header))) {
+        return false;
+    }
+    uint64_t last_seq = QKD_get_uint64(header);
+    size_t size = QKD_get_uint32(header + 8);
+    if (last_seq == 0 && size == 0) {
+        *dismissed = true;
+        return false;
+    }
+    if (size > MAX_BATCH_BYTES || !grow_buffer(buffer, capacity, 0, size) ||
+        !QKD_receive_all(sock, *buffer, size)) {
+        QKD_error("Receiving batch of %zu bytes failed", size);
+        return false;
+    }
+    uint64_t nr_records = 0;
+    size_t offset = 0;
+    bool ok = true;
+    while (ok && offset < size) {
+        ok = size - offset >= RECORD_HEADER_SIZE &&
+             QKD_get_uint32(*buffer + offset + 1) <= size - offset - RECORD_HEADER_SIZE;
+        if (ok) {
+            size_t record_size = QKD_get_uint32(*buffer + offset + 1);
+            replication.callbacks.apply((*buffer)[offset], *buffer + offset + RECORD_HEADER_SIZE,
+                                        record_size);
+            offset += RECORD_HEADER_SIZE + record_size;
+            nr_records++;
+        }
+    }
+    OPENSSL_cleanse(*buffer, size);
+    if (!ok) {
+        QKD_error("Malformed batch");
+        return false;
+    }
+    pthread_mutex_lock(&replication.mutex);
+    replication.stats.nr_records += nr_records;
+    replication.stats.nr_batches++;
+    replication.stats.nr_bytes += size;
+    maybe_write_metrics_file(false);
+    pthread_mutex_unlock(&replication.mutex);
+    unsigned char ack[ACK_SIZE];
+    QKD_put_uint64(ack, last_seq);
+    struct iovec iov = {.iov_base = ack, .iov_len = sizeof(ack)};
+    return QKD_send_all(sock, &iov, 1);
+}
+
+/**
+ * Standby: the replication thread. It accepts the connection from the active node and applies the
+ * batches it receives. When the connection is lost, the implementation decides whether to take
+ * over; if not, the next connection from an active node is accepted.
+ */
+static void *standby_thread(void *arg)
+{
+    QKD_enter();
+    unsigned char *buffer = NULL;
+    size_t capacity = 0;
+    while (true) {
+        int sock = accept(replication.listen_sock, NULL, NULL);
+        pthread_mutex_lock(&replication.mutex);
+        if (replication.stopping) {
+            pthread_mutex_unlock(&replication.mutex);
+            if (sock != -1) {
+                close(sock);
+            }
+            break;
+        }
+        if (sock == -1) {
+            pthread_mutex_unlock(&replication.mutex);
+            if (errno != EINTR) {
+                QKD_error_with_errno("accept failed");
+                sleep(1);
+            }
+            continue;
+        }
+        replication.sock = sock;
+        replication.stats.nr_connects++;
+        pthread_mutex_unlock(&replication.mutex);
+        QKD_set_no_delay(sock);
+        QKD_debug("Active node connected");
+        bool dismissed = false;
+        while (apply_batch(sock, &buffer, &capacity, &dismissed)) {
+        }
+        pthread_mutex_lock(&replication.mutex);
+        replication.sock = -1;
+        bool stopping = replication.stopping;
+        maybe_write_metrics_file(true);
+        pthread_mutex_unlock(&replication.mutex);
+        close(sock);
+        if (stopping) {
+            break;
+        }
+        QKD_debug(dismissed ? "Dismissed by the active node" : "Lost the active node");
+        if (replication.callbacks.active_lost(dismissed)) {
+            break;
+        }
+    }
+    free_buffer(&buffer, &capacity);
+    pthread_mutex_lock(&replication.mutex);
+    if (replication.listen_sock != -1) {
+        close(replication.listen_sock);
+        replication.listen_sock = -1;
+    }
+    pthread_mutex_unlock(&replication.mutex);
+    QKD_return_success("%p", NULL);
+}
+
+/**
+ * Start the replication, if QKD_REPLICATION_ROLE is set: on the active node, start the thread that
+ * connects and streams to the standby; on the standby node, start listening for the active node.
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_replication_start(const QKD_replication_callbacks_t *callbacks)
+{
+    QKD_enter();
+    const char *role = getenv("QKD_REPLICATION_ROLE");
+    QKD_replication_role_t new_role;
+    if (role == NULL || *role == '\0' || strcmp(role, "none") == 0) {
+        QKD_return_success_qkd();
+    } else if (strcmp(role, "active") == 0) {
+        new_role = QKD_REPLICATION_ROLE_ACTIVE;
+    } else if (strcmp(role, "standby") == 0) {
+        new_role = QKD_REPLICATION_ROLE_STANDBY;
+    } else {
+        QKD_error("Invalid QKD_REPLICATION_ROLE %s", role);
+        QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+    }
+    const char *peer = getenv("QKD_REPLICATION_PEER");
+    const char *colon = peer ? strrchr(peer, ':') : NULL;
+    if (colon == NULL || colon == peer || (size_t) (colon - peer) >= sizeof(replication.host) ||
+        atoi(colon + 1) <= 0 || atoi(colon + 1) > 65535) {
+        QKD_error("QKD_REPLICATION_PEER must be HOST:PORT");
+        QKD_return_error_qkd(QKD_RESULT_NOT_SUPPORTED);
+    }
+
+    pthread_mutex_lock(&replication.mutex);
+    snprintf(replication.host, sizeof(replication.host), "%.*s", (int) (colon - peer), peer);
+    snprintf(replication.port, sizeof(replication.port), "%d", atoi(colon + 1));
+    replication.role = new_role;
+    replication.callbacks = *callbacks;
+    replication.max_backlog = QKD_env_size("QKD_REPLICATION_MAX_BACKLOG_BYTES",
+                                           QKD_REPLICATION_DEFAULT_MAX_BACKLOG_BYTES, 1);
+    replication.ack_timeout = QKD_env_size("QKD_REPLICATION_ACK_TIMEOUT_MS",
+                                           QKD_REPLICATION_DEFAULT_ACK_TIMEOUT_MS, 1) / 1000.0;
+    replication.metrics_file = getenv("QKD_REPLICATION_METRICS_FILE");
+    replication.last_metrics_time = -INFINITY;
+    replication.stopping = false;
+    replication.streaming = false;
+    memset(&replication.stats, 0, sizeof(replication.stats));
+    replication.stats.role = new_role;
+    if (new_role == QKD_REPLICATION_ROLE_STANDBY) {
+        replication.listen_sock = listen_for_active();
+        if (replication.listen_sock == -1) {
+            replication.role = QKD_REPLICATION_ROLE_NONE;
+            pthread_mutex_unlock(&replication.mutex);
+            QKD_return_error_qkd(QKD_RESULT_CONNECTION_FAILED);
+        }
+    }
+    maybe_write_metrics_file(true);
+    if (pthread_create(&replication.thread, NULL,
+                       new_role == QKD_REPLICATION_ROLE_ACTIVE ? active_thread : standby_thread,
+                       NULL) != 0) {
+        QKD_error("pthread_create failed");
+        if (replication.listen_sock != -1) {
+            close(replication.listen_sock);
+            replication.listen_sock = -1;
+        }
+        replication.role = QKD_REPLICATION_ROLE_NONE;
+        pthread_mutex_unlock(&replication.mutex);
+        QKD_return_error_qkd(QKD_RESULT_OUT_OF_MEMORY);
+    }
+    replication.thread_started = true;
+    pthread_mutex_unlock(&replication.mutex);
+    QKD_debug("Replication %s, peer %s:%s", role, replication.host, replication.port);
+    QKD_return_success_qkd();
+}
+
+/**
+ * Stop the replication thread, and drop the records that have not been sent.
+ */
+void QKD_replication_stop(void)
+{
+    QKD_enter();
+    pthread_mutex_lock(&replication.mutex);
+    if (!replication.thread_started) {
+        pthread_mutex_unlock(&replication.mutex);
+        QKD_return_success_void();
+    }
+    replication.stopping = true;
+    if (replication.sock != -1) {
+        /* The active node still dismisses the standby after this. */
+        shutdown(replication.sock,
+                 replication.role == QKD_REPLICATION_ROLE_ACTIVE ? SHUT_RD : SHUT_RDWR);
+    }
+    if (replication.listen_sock != -1) {
+        shutdown(replication.listen_sock, SHUT_RDWR);
+    }
+    pthread_cond_broadcast(&replication.changed);
+    pthread_mutex_unlock(&replication.mutex);
+    pthread_join(replication.thread, NULL);
+
+    pthread_mutex_lock(&replication.mutex);
+    replication.thread_started = false;
+    if (replication.listen_sock != -1) {
+        close(replication.listen_sock);
+        replication.listen_sock = -1;
+    }
+    replication.streaming = false;
+    free_buffer(&replication.pending, &replication.pending_capacity);
+    replication.pending_size = 0;
+    replication.nr_pending = 0;
+    maybe_write_metrics_file(true);
+    replication.role = QKD_REPLICATION_ROLE_NONE;
+    pthread_mutex_unlock(&replication.mutex);
+    QKD_return_success_void();
+}
+
+QKD_replication_role_t QKD_replication_role(void)
+{
+    pthread_mutex_lock(&replication.mutex);
+    QKD_replication_role_t role = replication.role;
+    pthread_mutex_unlock(&replication.mutex);
+    return role;
+}
+
+/**
+ * Active: append a record, made up of the given pieces, to the replication log. Records are only
+ * appended while streaming to a standby (the full state is sent when a standby connects).
+ *
+ * Returns the sequence number of the record, or 0 if it was not appended.
+ */
+uint64_t QKD_replication_append(unsigned char type, const struct iovec *pieces, int nr_pieces)
+{
+    size_t size = 0;
+    for (int i = 0; i < nr_pieces; i++) {
+        size += pieces[i].iov_len;
+    }
+    pthread_mutex_lock(&replication.mutex);
+    if (!replication.streaming) {
+        pthread_mutex_unlock(&replication.mutex);
+        return 0;
+    }
+    if (!grow_buffer(&replication.pending, &replication.pending_capacity,
+                     replication.pending_size,
+                     replication.pending_size + RECORD_HEADER_SIZE + size)) {
+        /* The standby would miss the record: start over with a new connection and full state. */
+        QKD_error("Growing the replication log failed");
+        if (replication.sock != -1) {
+            shutdown(replication.sock, SHUT_RDWR);
+        }
+        pthread_mutex_unlock(&replication.mutex);
+        return 0;
+    }
+    unsigned char *record = replication.pending + replication.pending_size;
+    record[0] = type;
+    QKD_put_uint32(record + 1, (uint32_t) size);
+    size_t offset = RECORD_HEADER_SIZE;
+    for (int i = 0; i < nr_pieces; i++) {
+        memcpy(record + offset, pieces[i].iov_base, pieces[i].iov_len);
+        offset += pieces[i].iov_len;
+    }
+    if (replication.pending_size == 0) {
+        replication.pending_time = QKD_monotonic_seconds();
+    }
+    replication.pending_size += offset;
+    replication.nr_pending++;
+    uint64_t seq = replication.next_seq++;
+    pthread_cond_signal(&replication.changed);
+    pthread_mutex_unlock(&replication.mutex);
+    return seq;
+}
+
+/**
+ * Active: are more than QKD_REPLICATION_MAX_BACKLOG_BYTES of records waiting to be sent?
+ */
+bool QKD_replication_backlog_full(void)
+{
+    pthread_mutex_lock(&replication.mutex);
+    bool full = replication.streaming && replication.pending_size >= replication.max_backlog;
+    pthread_mutex_unlock(&replication.mutex);
+    return full;
+}
+
+void QKD_replication_get_stats(QKD_replication_stats_t *stats)
+{
+    pthread_mutex_lock(&replication.mutex);
+    *stats = replication.stats;
+    stats->streaming = replication.streaming;
+    pthread_mutex_unlock(&replication.mutex);
+}
@@ -0,0 +1,84 @@
+/**
+ * qkd_replication.h
+ *
+ * Replication of the state of a key manager from an active node to a standby node, so that the
+ * standby can take over when the active node dies, with the key that the active node had buffered.
+ *
+ * Replication is enabled by setting environment variable QKD_REPLICATION_ROLE to "active" or
+ * "standby", and QKD_REPLICATION_PEER to the host and port of the standby node (the standby node
+ * listens on that port). The implementation of the QKD API on the active node appends records to
+ * a replication log; a thread sends the records that have queued up to the standby in a single
+ * batch, and waits until the standby has applied them and acknowledged the batch before it sends
+ * the next one. When the standby connects, the implementation first appends its full state.
+ *
+ * The replication lag is the time from appending a record to the acknowledgement of its batch. It
+ * is bounded in two ways: when more than QKD_REPLICATION_MAX_BACKLOG_BYTES (default 256 KB) of
+ * records are waiting, QKD_replication_backlog_full tells the implementation to hold back, and a
+ * standby that does not acknowledge a batch within QKD_REPLICATION_ACK_TIMEOUT_MS milliseconds
+ * (default 1000) is disconnected, after which the active node carries on without it. If
+ * environment variable QKD_REPLICATION_METRICS_FILE is set, the counters and lag are written to
+ * that file in the Prometheus text format, at most once per second.
+ *
+ * The standby node applies the records of each batch, and when the connection to the active node
+ * is lost, it decides whether to take over. An active node that disconnects the standby on purpose
+ * (because it is too slow, or because the replication is stopped) dismisses it first, so that it
+ * does not take over. Beyond that there is no fencing: if the connection between the two nodes
+ * breaks, but both nodes keep running, both serve.
+ *
+ * The log holds key material, and is sent in the clear: like the link of the mock implementation,
+ * this is for testing only.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#ifndef QKD_REPLICATION_H
+#define QKD_REPLICATION_H
+
+#include "qkd_api.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define QKD_REPLICATION_DEFAULT_MAX_BACKLOG_BYTES (256 * 1024)
+#define QKD_REPLICATION_DEFAULT_ACK_TIMEOUT_MS 1000
+
+typedef enum {
+    QKD_REPLICATION_ROLE_NONE = 0,
+    QKD_REPLICATION_ROLE_ACTIVE,
+    QKD_REPLICATION_ROLE_STANDBY
+} QKD_replication_role_t;
+
+/* Called by the replication thread, without any lock of the replication log held. */
+typedef struct QKD_replication_callbacks_st {
+    void (*sync)(void);                 /* Active: a standby connected, append the full state */
+    void (*acked)(uint64_t seq);        /* Active: the standby applied all records up to seq */
+    void (*disconnected)(void);         /* Active: the standby is gone */
+    void (*apply)(unsigned char type, const unsigned char *payload, size_t size);  /* Standby */
+    bool (*active_lost)(bool dismissed);    /* Standby: the active node is gone, or dismissed the
+                                             * standby; return true to take over (which stops
+                                             * the replication thread) */
+} QKD_replication_callbacks_t;
+
+typedef struct QKD_replication_stats_st {
+    QKD_replication_role_t role;
+    bool streaming;                     /* Active: connected to a standby */
+    uint64_t nr_connects;               /* Connections to (or from) the other node */
+    uint64_t nr_records;                /* Records sent (or applied) */
+    uint64_t nr_batches;
+    uint64_t nr_bytes;
+    uint64_t acked_seq;                 /* Active: the last record acknowledged by the standby */
+    double last_lag;                    /* Active: lag of the last batch, in seconds */
+    double max_lag;
+    double total_lag;                   /* Sum over all batches, for the mean */
+} QKD_replication_stats_t;
+
+QKD_result_t QKD_replication_start(const QKD_replication_callbacks_t *callbacks);
+void QKD_replication_stop(void);
+QKD_replication_role_t QKD_replication_role(void);
+uint64_t QKD_replication_append(unsigned char type, const struct iovec *pieces, int nr_pieces);
+bool QKD_replication_backlog_full(void);
+void QKD_replication_get_stats(QKD_replication_stats_t *stats);
+
+#endif /* QKD_REPLICATION_H */
@@ -0,0 +1,278 @@
+/**
+ * qkd_secure_arena.c
+ *
+ * A dedicated memory arena for QKD key material (see qkd_secure_arena.h).
+ *
+ * The arena is split into one region per size class. Free slabs of a size class are kept on a
+ * global free list (protected by a per-class mutex) and in per-thread caches. Allocation and
+ * release normally only touch the per-thread cache; the global free list is only used to refill an
+ * empty cache or to drain a full one, half a cache at a time.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#include "qkd_secure_arena.h"
+#include "qkd_debug.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* Number of free slabs per size class in each per-thread cache. */
+#define THREAD_CACHE_SIZE 16
+
+typedef struct free_slab_st {
+    struct free_slab_st *next;
+} free_slab_t;
+
+typedef struct size_class_st {
+    unsigned char *start;
+    size_t slab_size;
+    size_t nr_slabs;
+    pthread_mutex_t mutex;
+    free_slab_t *free_list;     /* Protected by mutex */
+    size_t nr_allocated;        /* Updated atomically */
+    size_t nr_failed;           /* Updated atomically */
+} size_class_t;
+
+typedef struct thread_cache_st {
+    void *slabs[QKD_SECURE_ARENA_NR_CLASSES][THREAD_CACHE_SIZE];
+    size_t count[QKD_SECURE_ARENA_NR_CLASSES];
+    bool registered;
+} thread_cache_t;
+
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_key_t arena_thread_key;
+static unsigned char *arena_start = NULL;
+static size_t arena_bytes = 0;
+static bool arena_locked = false;
+static size_class_t size_classes[QKD_SECURE_ARENA_NR_CLASSES];
+static __thread thread_cache_t thread_cache;
+
+/* Calling memset through a volatile function pointer prevents the compiler from optimizing away
+ * the zeroization of memory that is not read anymore. */
+static void *(*const volatile zeroize_memset)(void *, int, size_t) = memset;
+
+/**
+ * Map an allocation size to its size class, or return -1 if the size is too big.
+ */
+static int size_to_class(size_t size)
+{
+    size_t slab_size = QKD_SECURE_ARENA_MIN_SIZE;
+    for (int class = 0; class < QKD_SECURE_ARENA_NR_CLASSES; class++) {
+        if (size <= slab_size) {
+            return class;
+        }
+        slab_size *= 2;
+    }
+    return -1;
+}
+
+/**
+ * Map a pointer into the arena to the size class of the slab it points to.
+ */
+static int pointer_to_class(const void *ptr)
+{
+    assert(QKD_secure_arena_contains(ptr));
+    size_t class_bytes = arena_bytes / QKD_SECURE_ARENA_NR_CLASSES;
+    int class = ((const unsigned char *) ptr - arena_start) / class_bytes;
+    assert((((const unsigned char *) ptr - size_classes[class].start) %
+            size_classes[class].slab_size) == 0);
+    return class;
+}
+
+/**
+ * Return all slabs in the per-thread cache of the exiting thread to the global free lists.
+ */
+static void thread_cache_flush(void *arg)
+{
+    thread_cache_t *cache = arg;
+    for (int class = 0; class < QKD_SECURE_ARENA_NR_CLASSES; class++) {
+        size_class_t *size_class = &size_classes[class];
+        pthread_mutex_lock(&size_class->mutex);
+        while (cache->count[class] > 0) {
+            free_slab_t *slab = cache->slabs[class][--cache->count[class]];
+            slab->next = size_class->free_list;
+            size_class->free_list = slab;
+        }
+        pthread_mutex_unlock(&size_class->mutex);
+    }
+    cache->registered = false;
+}
+
+/**
+ * When the engine is unloaded, make sure threads that exit later don't call thread_cache_flush
+ * (which is unloaded with the engine).
+ */
+__attribute__((destructor)) static void arena_unload(void)
+{
+    if (arena_start != NULL) {
+        pthread_key_delete(arena_thread_key);
+    }
+}
+
+/**
+ * Create the arena: map it, lock it in memory, exclude it from core dumps, and carve it up into
+ * slabs.
+ */
+static void arena_init(void)
+{
+    QKD_enter();
+
+    /* Every region must be a whole number of the largest slabs, which keeps all slabs aligned. */
+    size_t bytes = QKD_SECURE_ARENA_DEFAULT_BYTES;
+    const char *bytes_str = getenv("QKD_SECURE_ARENA_BYTES");
+    if (bytes_str != NULL) {
+        bytes = strtoul(bytes_str, NULL, 10);
+    }
+    size_t class_bytes = bytes / QKD_SECURE_ARENA_NR_CLASSES;
+    class_bytes -= class_bytes % QKD_SECURE_ARENA_MAX_SIZE;
+    if (class_bytes == 0) {
+        QKD_error("QKD_SECURE_ARENA_BYTES too small (%zu)", bytes);
+        QKD_return_success_void();
+    }
+    bytes = class_bytes * QKD_SECURE_ARENA_NR_CLASSES;
+
+    void *start = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (start == MAP_FAILED) {
+        QKD_error_with_errno("mmap failed");
+        QKD_return_success_void();
+    }
+
+    /* Without mlock the arena still works, but secrets may be swapped out. That is worth an error
+     * message, but not worth failing every handshake for. */
+    if (mlock(start, bytes) == 0) {
+        arena_locked = true;
+    } else {
+        QKD_error_with_errno("mlock failed (key material may be swapped to disk)");
+    }
+#ifdef MADV_DONTDUMP
+    if (madvise(start, bytes, MADV_DONTDUMP) != 0) {
+        QKD_error_with_errno("madvise MADV_DONTDUMP failed");
+    }
+#endif
+
+    size_t slab_size = QKD_SECURE_ARENA_MIN_SIZE;
+    for (int class = 0; class < QKD_SECURE_ARENA_NR_CLASSES; class++) {
+        size_class_t *size_class = &size_classes[class];
+        size_class->start = (unsigned char *) start + class * class_bytes;
+        size_class->slab_size = slab_size;
+        size_class->nr_slabs = class_bytes / slab_size;
+        pthread_mutex_init(&size_class->mutex, NULL);
+        size_class->free_list = NULL;
+        for (size_t i = size_class->nr_slabs; i > 0; i--) {
+            free_slab_t *slab = (free_slab_t *) (size_class->start + (i - 1) * slab_size);
+            slab->next = size_class->free_list;
+            size_class->free_list = slab;
+        }
+        slab_size *= 2;
+    }
+    pthread_key_create(&arena_thread_key, thread_cache_flush);
+    arena_bytes = bytes;
+    arena_start = start;
+    QKD_debug("Secure arena of %zu bytes at %p (%s)", bytes, start,
+              arena_locked ? "locked" : "not locked");
+    QKD_return_success_void();
+}
+
+/**
+ * Allocate a zeroized slab of at least size bytes from the arena.
+ *
+ * Returns a pointer to the slab, or NULL if the size is too big or the size class is exhausted.
+ */
+void *QKD_secure_alloc(size_t size)
+{
+    pthread_once(&arena_once, arena_init);
+    int class = size_to_class(size);
+    if (arena_start == NULL || class < 0) {
+        QKD_error("Cannot allocate %zu bytes from secure arena", size);
+        return NULL;
+    }
+    size_class_t *size_class = &size_classes[class];
+    thread_cache_t *cache = &thread_cache;
+    if (!cache->registered) {
+        pthread_setspecific(arena_thread_key, cache);
+        cache->registered = true;
+    }
+
+    /* Refill an empty per-thread cache with half a cache worth of slabs from the global list. */
+    if (cache->count[class] == 0) {
+        pthread_mutex_lock(&size_class->mutex);
+        while (cache->count[class] < THREAD_CACHE_SIZE / 2 && size_class->free_list != NULL) {
+            free_slab_t *slab = size_class->free_list;
+            size_class->free_list = slab->next;
+            slab->next = NULL;
+            cache->slabs[class][cache->count[class]++] = slab;
+        }
+        pthread_mutex_unlock(&size_class->mutex);
+        if (cache->count[class] == 0) {
+            __atomic_add_fetch(&size_class->nr_failed, 1, __ATOMIC_RELAXED);
+            QKD_error("Secure arena exhausted for size class %zu", size_class->slab_size);
+            return NULL;
+        }
+    }
+
+    __atomic_add_fetch(&size_class->nr_allocated, 1, __ATOMIC_RELAXED);
+    return cache->slabs[class][--cache->count[class]];
+}
+
+/**
+ * Zeroize a slab and release it to the arena. Does nothing if ptr is NULL.
+ */
+void QKD_secure_free(void *ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+    int class = pointer_to_class(ptr);
+    size_class_t *size_class = &size_classes[class];
+    zeroize_memset(ptr, 0, size_class->slab_size);
+    __atomic_sub_fetch(&size_class->nr_allocated, 1, __ATOMIC_RELAXED);
+
+    /* Drain half of a full per-thread cache to the global list. */
+    thread_cache_t *cache = &thread_cache;
+    if (!cache->registered) {
+        pthread_setspecific(arena_thread_key, cache);
+        cache->registered = true;
+    }
+    if (cache->count[class] == THREAD_CACHE_SIZE) {
+        pthread_mutex_lock(&size_class->mutex);
+        while (cache->count[class] > THREAD_CACHE_SIZE / 2) {
+            free_slab_t *slab = cache->slabs[class][--cache->count[class]];
+            slab->next = size_class->free_list;
+            size_class->free_list = slab;
+        }
+        pthread_mutex_unlock(&size_class->mutex);
+    }
+    cache->slabs[class][cache->count[class]++] = ptr;
+}
+
+/**
+ * Does ptr point into the arena?
+ */
+bool QKD_secure_arena_contains(const void *ptr)
+{
+    const unsigned char *p = ptr;
+    return arena_start != NULL && p >= arena_start && p < arena_start + arena_bytes;
+}
+
+/**
+ * Get the size of the arena and the usage of each size class.
+ */
+void QKD_secure_arena_get_stats(QKD_secure_arena_stats_t *stats)
+{
+    assert(stats != NULL);
+    pthread_once(&arena_once, arena_init);
+    stats->arena_bytes = arena_bytes;
+    stats->locked = arena_locked;
+    for (int class = 0; class < QKD_SECURE_ARENA_NR_CLASSES; class++) {
+        size_class_t *size_class = &size_classes[class];
+        stats->slab_size[class] = size_class->slab_size;
+        stats->nr_slabs[class] = size_class->nr_slabs;
+        stats->nr_allocated[class] = __atomic_load_n(&size_class->nr_allocated, __ATOMIC_RELAXED);
+        stats->nr_failed[class] = __atomic_load_n(&size_class->nr_failed, __ATOMIC_RELAXED);
+    }
+}
@@ -0,0 +1,42 @@
+/**
+ * qkd_secure_arena.h
+ *
+ * A dedicated memory arena for QKD key material. The arena is a single region of mlock'ed pages
+ * (so that secrets are never swapped out) that is excluded from core dumps. It is divided into
+ * fixed-size slabs, one size class per key chunk size. Each thread keeps a small cache of free
+ * slabs per size class, so that the common allocate/release path does not take any lock. Slabs
+ * are zeroized as soon as they are released.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#ifndef QKD_SECURE_ARENA_H
+#define QKD_SECURE_ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Size classes are powers of two from QKD_SECURE_ARENA_MIN_SIZE up to QKD_SECURE_ARENA_MAX_SIZE. */
+#define QKD_SECURE_ARENA_MIN_SIZE 32
+#define QKD_SECURE_ARENA_MAX_SIZE 2048
+#define QKD_SECURE_ARENA_NR_CLASSES 7
+
+/* Default size of the arena. Can be overridden with environment variable QKD_SECURE_ARENA_BYTES. */
+#define QKD_SECURE_ARENA_DEFAULT_BYTES (1024 * 1024)
+
+typedef struct QKD_secure_arena_stats_st {
+    size_t arena_bytes;
+    bool locked;                                    /* Are the pages mlock'ed? */
+    size_t slab_size[QKD_SECURE_ARENA_NR_CLASSES];
+    size_t nr_slabs[QKD_SECURE_ARENA_NR_CLASSES];
+    size_t nr_allocated[QKD_SECURE_ARENA_NR_CLASSES];
+    size_t nr_failed[QKD_SECURE_ARENA_NR_CLASSES];
+} QKD_secure_arena_stats_t;
+
+void *QKD_secure_alloc(size_t size);
+void QKD_secure_free(void *ptr);
+bool QKD_secure_arena_contains(const void *ptr);
+void QKD_secure_arena_get_stats(QKD_secure_arena_stats_t *stats);
+
+#endif /* QKD_SECURE_ARENA_H */
@@ -0,0 +1,358 @@
+/**
+ * qkd_sifting.c
+ *
+ * A compact encoding for the classical messages of BB84 sifting (see qkd_sifting.h).
+ *
+ * The gamma code is written and read through a 64-bit window, so that the leading zeros of a code
+ * word are counted with one instruction. Gaps are at most QKD_SIFT_MAX_PULSES, so a code word is
+ * at most 65 bits: its zeros and its value are read separately.
+ *
+ * The AVX2 functions clear the upper halves of the vector registers before they return. The
+ * compiler only does so when it optimizes, and the engines are built without optimization; with
+ * the upper halves left dirty, every SSE instruction that follows (e.g. in log) is slowed down
+ * several times over.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#include "qkd_sifting.h"
+#include "qkd_debug.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_AVX2 1
+#endif
+
+typedef struct bit_writer_st {
+    unsigned char *out;
+    size_t size;                        /* Bytes written */
+    uint64_t bits;                      /* The low nr_bits bits have not been written yet */
+    unsigned nr_bits;
+} bit_writer_t;
+
+typedef struct bit_reader_st {
+    const unsigned char *in;
+    size_t size;
+    size_t next;                        /* The next byte to read into the window */
+    uint64_t window;                    /* The next nr_bits bits, from the most significant bit */
+    unsigned nr_bits;
+} bit_reader_t;
+
+typedef void (*pack_t)(const unsigned char *bits, size_t nr_bits, unsigned char *packed);
+typedef void (*unpack_t)(const unsigned char *packed, size_t nr_bits, unsigned char *bits);
+
+static pack_t pack = NULL;
+static unpack_t unpack = NULL;
+static pthread_once_t pack_once = PTHREAD_ONCE_INIT;
+
+/**
+ * The number of bytes needed for nr_bits packed bits.
+ */
+size_t QKD_sift_packed_size(size_t nr_bits)
+{
+    return (nr_bits + 7) / 8;
+}
+
+static void pack_portable(const unsigned char *bits, size_t nr_bits, unsigned char *packed)
+{
+    memset(packed, 0, QKD_sift_packed_size(nr_bits));
+    for (size_t i = 0; i < nr_bits; i++) {
+        packed[i / 8] |= (bits[i] & 1) << (i % 8);
+    }
+}
+
+static void unpack_portable(const unsigned char *packed, size_t nr_bits, unsigned char *bits)
+{
+    for (size_t i = 0; i < nr_bits; i++) {
+        bits[i] = (packed[i / 8] >> (i % 8)) & 1;
+    }
+}
+
+#ifdef HAVE_AVX2
+/**
+ * AVX2 version of pack_portable: moves the lowest bit of each of 32 bytes to the sign bit, and
+ * collects the sign bits with one movemask.
+ */
+__attribute__((target("avx2")))
+static void pack_avx2(const unsigned char *bits, size_t nr_bits, unsigned char *packed)
+{
+    size_t i = 0;
+    for (; i + 32 <= nr_bits; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *) (bits + i));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_slli_epi16(bytes, 7));
+        memcpy(packed + i / 8, &mask, sizeof(mask));
+    }
+    _mm256_zeroupper();
+    pack_portable(bits + i, nr_bits - i, packed + i / 8);
+}
+
+/**
+ * AVX2 version of unpack_portable: broadcasts 32 bits, moves the byte that holds the bit for each
+ * output byte into place, and compares it with the mask of that bit.
+ */
+__attribute__((target("avx2")))
+static void unpack_avx2(const unsigned char *packed, size_t nr_bits, unsigned char *bits)
+{
+    const __m256i select = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                            2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    const __m256i bit_masks = _mm256_set1_epi64x(0x8040201008040201LL);
+    const __m256i ones = _mm256_set1_epi8(1);
+    size_t i = 0;
+    for (; i + 32 <= nr_bits; i += 32) {
+        uint32_t word;
+        memcpy(&word, packed + i / 8, sizeof(word));
+        __m256i bytes = _mm256_shuffle_epi8(_mm256_set1_epi32((int) word), select);
+        __m256i set = _mm256_cmpeq_epi8(_mm256_and_si256(bytes, bit_masks), bit_masks);
+        _mm256_storeu_si256((__m256i *) (bits + i), _mm256_and_si256(set, ones));
+    }
+    _mm256_zeroupper();
+    unpack_portable(packed + i / 8, nr_bits - i, bits + i);
+}
+#endif
+
+/**
+ * Choose the implementation of packing and unpacking: AVX2 if the CPU supports it, unless
+ * environment variable QKD_SIFT_SIMD is set to 0.
+ */
+static void choose_pack(void)
+{
+    pack = pack_portable;
+    unpack = unpack_portable;
+#ifdef HAVE_AVX2
+    const char *simd = getenv("QKD_SIFT_SIMD");
+    if ((simd == NULL || strcmp(simd, "0") != 0) && __builtin_cpu_supports("avx2")) {
+        pack = pack_avx2;
+        unpack = unpack_avx2;
+    }
+#endif
+}
+
+/**
+ * Is the SIMD (AVX2) implementation of packing and unpacking used?
+ */
+bool QKD_sift_simd_enabled(void)
+{
+    pthread_once(&pack_once, choose_pack);
+    return pack != pack_portable;
+}
+
+/**
+ * Pack a string of bits, given as one byte per bit (only the lowest bit of each byte is used),
+ * into QKD_sift_packed_size(nr_bits) bytes.
+ */
+void QKD_sift_pack_bits(const unsigned char *bits, size_t nr_bits, unsigned char *packed)
+{
+    pthread_once(&pack_once, choose_pack);
+    pack(bits, nr_bits, packed);
+}
+
+/**
+ * Unpack a string of packed bits into one byte (0 or 1) per bit.
+ */
+void QKD_sift_unpack_bits(const unsigned char *packed, size_t nr_bits, unsigned char *bits)
+{
+    pthread_once(&pack_once, choose_pack);
+    unpack(packed, nr_bits, bits);
+}
+
+/**
+ * The number of bits of the gamma code of n (n >= 1).
+ */
+static size_t gamma_bits(uint64_t n)
+{
+    return 2 * (63 - __builtin_clzll(n)) + 1;
+}
+
+/**
+ * Append the nr_bits (at most 56) low bits of value to the bit stream, most significant first.
+ */
+static void put_bits(bit_writer_t *writer, uint64_t value, unsigned nr_bits)
+{
+    writer->bits = (writer->bits << nr_bits) | value;
+    writer->nr_bits += nr_bits;
+    while (writer->nr_bits >= 8) {
+        writer->nr_bits -= 8;
+        writer->out[writer->size++] = (unsigned char) (writer->bits >> writer->nr_bits);
+    }
+}
+
+static void put_gamma(bit_writer_t *writer, uint64_t n)
+{
+    unsigned nr_zeros = 63 - __builtin_clzll(n);
+    put_bits(writer, 0, nr_zeros);
+    put_bits(writer, n, nr_zeros + 1);
+}
+
+static void flush_bits(bit_writer_t *writer)
+{
+    if (writer->nr_bits > 0) {
+        put_bits(writer, 0, 8 - writer->nr_bits);
+    }
+}
+
+static void refill(bit_reader_t *reader)
+{
+    while (reader->nr_bits <= 56 && reader->next < reader->size) {
+        reader->window |= (uint64_t) reader->in[reader->next++] << (56 - reader->nr_bits);
+        reader->nr_bits += 8;
+    }
+}
+
+/**
+ * Read the next gamma code from the bit stream.
+ *
+ * Returns true on success, false if the bit stream ends or the code is too long.
+ */
+static bool get_gamma(bit_reader_t *reader, uint64_t *n)
+{
+    refill(reader);
+    if (reader->window == 0) {
+        return false;
+    }
+    unsigned nr_zeros = __builtin_clzll(reader->window);
+    if (nr_zeros > 32 || nr_zeros >= reader->nr_bits) {
+        return false;
+    }
+    reader->window <<= nr_zeros;
+    reader->nr_bits -= nr_zeros;
+    refill(reader);
+    unsigned nr_value_bits = nr_zeros + 1;
+    if (nr_value_bits > reader->nr_bits) {
+        return false;
+    }
+    *n = reader->window >> (64 - nr_value_bits);
+    reader->window = nr_value_bits < 64 ? reader->window << nr_value_bits : 0;
+    reader->nr_bits -= nr_value_bits;
+    return true;
+}
+
+/**
+ * The gaps between detections: the first one is counted from just before the first pulse, so
+ * that every gap is at least 1.
+ */
+static uint64_t gap(const uint64_t *positions, size_t i)
+{
+    return i == 0 ? positions[0] + 1 : positions[i] - positions[i - 1];
+}
+
+static size_t bitmap_size(uint64_t nr_pulses)
+{
+    return 1 + QKD_sift_packed_size(nr_pulses);
+}
+
+static size_t gamma_size(const uint64_t *positions, size_t nr_detections)
+{
+    size_t nr_bits = 0;
+    for (size_t i = 0; i < nr_detections; i++) {
+        nr_bits += gamma_bits(gap(positions, i));
+    }
+    return 1 + QKD_sift_packed_size(nr_bits);
+}
+
+/**
+ * The size of the encoded positions of nr_detections detections among nr_pulses pulses (at most
+ * QKD_SIFT_MAX_PULSES). The positions must be in increasing order.
+ */
+size_t QKD_sift_positions_size(const uint64_t *positions, size_t nr_detections,
+                               uint64_t nr_pulses)
+{
+    size_t gamma = gamma_size(positions, nr_detections);
+    size_t bitmap = bitmap_size(nr_pulses);
+    return gamma < bitmap ? gamma : bitmap;
+}
+
+/**
+ * Encode the positions of nr_detections detections among nr_pulses pulses (at most
+ * QKD_SIFT_MAX_PULSES) into QKD_sift_positions_size bytes. The positions must be in increasing
+ * order.
+ */
+void QKD_sift_encode_positions(const uint64_t *positions, size_t nr_detections,
+                               uint64_t nr_pulses, unsigned char *encoded)
+{
+    assert(nr_pulses <= QKD_SIFT_MAX_PULSES);
+    if (bitmap_size(nr_pulses) <= gamma_size(positions, nr_detections)) {
+        encoded[0] = QKD_SIFT_POSITIONS_BITMAP;
+        unsigned char *bitmap = encoded + 1;
+        memset(bitmap, 0, QKD_sift_packed_size(nr_pulses));
+        for (size_t i = 0; i < nr_detections; i++) {
+            assert(positions[i] < nr_pulses);
+            bitmap[positions[i] / 8] |= 1 << (positions[i] % 8);
+        }
+        return;
+    }
+    encoded[0] = QKD_SIFT_POSITIONS_GAMMA;
+    bit_writer_t writer = {.out = encoded + 1};
+    for (size_t i = 0; i < nr_detections; i++) {
+        assert(positions[i] < nr_pulses && (i == 0 || positions[i] > positions[i - 1]));
+        put_gamma(&writer, gap(positions, i));
+    }
+    flush_bits(&writer);
+}
+
+static bool decode_bitmap(const unsigned char *bitmap, size_t size, uint64_t nr_pulses,
+                          size_t nr_detections, uint64_t *positions)
+{
+    if (size != QKD_sift_packed_size(nr_pulses)) {
+        return false;
+    }
+    size_t nr_found = 0;
+    for (size_t byte = 0; byte < size; byte++) {
+        for (unsigned bits = bitmap[byte]; bits != 0; bits &= bits - 1) {
+            uint64_t position = byte * 8 + __builtin_ctz(bits);
+            if (position >= nr_pulses || nr_found == nr_detections) {
+                return false;
+            }
+            positions[nr_found++] = position;
+        }
+    }
+    return nr_found == nr_detections;
+}
+
+static bool decode_gamma(const unsigned char *stream, size_t size, uint64_t nr_pulses,
+                         size_t nr_detections, uint64_t *positions)
+{
+    bit_reader_t reader = {.in = stream, .size = size};
+    for (size_t i = 0; i < nr_detections; i++) {
+        uint64_t n;
+        if (!get_gamma(&reader, &n)) {
+            return false;
+        }
+        positions[i] = i == 0 ? n - 1 : positions[i - 1] + n;
+        if (positions[i] >= nr_pulses) {
+            return false;
+        }
+    }
+    /* Nothing but the padding of the last byte may be left. */
+    return reader.next == size && reader.nr_bits < 8 && reader.window == 0;
+}
+
+/**
+ * Decode the positions of nr_detections detections among nr_pulses pulses (at most
+ * QKD_SIFT_MAX_PULSES) from size bytes, as encoded by QKD_sift_encode_positions.
+ *
+ * Returns true on success, false if the encoding is not valid for that number of detections and
+ * pulses.
+ */
+bool QKD_sift_decode_positions(const unsigned char *encoded, size_t size, uint64_t nr_pulses,
+                               size_t nr_detections, uint64_t *positions)
+{
+    QKD_enter();
+    bool ok = false;
+    if (size >= 1 && nr_pulses <= QKD_SIFT_MAX_PULSES) {
+        if (encoded[0] == QKD_SIFT_POSITIONS_BITMAP) {
+            ok = decode_bitmap(encoded + 1, size - 1, nr_pulses, nr_detections, positions);
+        } else if (encoded[0] == QKD_SIFT_POSITIONS_GAMMA) {
+            ok = decode_gamma(encoded + 1, size - 1, nr_pulses, nr_detections, positions);
+        }
+    }
+    if (!ok) {
+        QKD_error("Invalid detection positions (%zu bytes for %zu detections among %llu pulses)",
+                  size, nr_detections, (unsigned long long) nr_pulses);
+        QKD_return_error("%d", false);
+    }
+    QKD_return_success("%d", true);
+}
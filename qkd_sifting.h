@@ -0,0 +1,49 @@
+/**
+ * qkd_sifting.h
+ *
+ * A compact encoding for the classical messages of BB84 sifting. In sifting, the receiving end of
+ * the quantum channel (Bob) announces in which pulses it detected a photon, and in which basis it
+ * measured each detection. The sending end (Alice) answers which of those detections were measured
+ * in the basis that it prepared the pulse in; only those become sifted key. Only a small fraction
+ * of the pulses is detected, so a message with a byte per pulse costs hundreds of bytes of
+ * classical traffic per bit of sifted key.
+ *
+ * Here the bases and the answers are bit strings with one bit per detection, packed eight to a
+ * byte (QKD_sift_pack_bits, with AVX2 where the CPU has it). The positions of the detections are
+ * encoded as a bitmap with one bit per pulse, or as the gaps between successive detections in
+ * Elias gamma code (2 floor(log2(gap)) + 1 bits per detection), whichever is smaller: the bitmap
+ * when most pulses are detected, the gaps otherwise. The first byte of the encoded positions says
+ * which encoding is used.
+ *
+ * Packed bits are in order from the least significant bit of the first byte. The gamma code is a
+ * bit stream from the most significant bit of the first byte, padded with zero bits.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#ifndef QKD_SIFTING_H
+#define QKD_SIFTING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define QKD_SIFT_MAX_PULSES (1ULL << 32)
+
+/* Encodings of the detection positions */
+#define QKD_SIFT_POSITIONS_BITMAP 1
+#define QKD_SIFT_POSITIONS_GAMMA 2
+
+size_t QKD_sift_packed_size(size_t nr_bits);
+void QKD_sift_pack_bits(const unsigned char *bits, size_t nr_bits, unsigned char *packed);
+void QKD_sift_unpack_bits(const unsigned char *packed, size_t nr_bits, unsigned char *bits);
+size_t QKD_sift_positions_size(const uint64_t *positions, size_t nr_detections,
+                               uint64_t nr_pulses);
+void QKD_sift_encode_positions(const uint64_t *positions, size_t nr_detections,
+                               uint64_t nr_pulses, unsigned char *encoded);
+bool QKD_sift_decode_positions(const unsigned char *encoded, size_t size, uint64_t nr_pulses,
+                               size_t nr_detections, uint64_t *positions);
+bool QKD_sift_simd_enabled(void);
+
+#endif /* QKD_SIFTING_H */
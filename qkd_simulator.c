@@ -0,0 +1,827 @@
+/**
+ * qkd_simulator.c
+ *
+ * A discrete-event simulator that forecasts how many TLS handshakes per second a QKD link can
+ * sustain, and with what latency, as a function of the length of the link and of the offered load.
+ *
+ * The physical layer is modelled analytically: the transmittance of the fiber and the detector, the
+ * gain and the Quantum Bit Error Rate (QBER) of a decoy-state BB84 link with a weak coherent pulse
+ * source (in the asymptotic limit of infinitely many decoy states), the sifting ratio, and the key
+ * lost to information reconciliation and privacy amplification. This gives the secret key rate of
+ * the link for each distance.
+ *
+ * Everything above the physical layer runs on a simulated clock, using the same code as the mock
+ * implementation of the ETSI QKD API: the link emulator (see qkd_link_emulator.h) delivers key
+ * blocks at the secret key rate (with the outages and key buffer of an optional link emulator
+ * configuration file), the blocks are put into the real key store (see qkd_key_store.h) and the
+ * keys for handshakes are consumed from it piece by piece, in the same way as the mock does. The
+ * mock keeps a lookahead of key blocks requested from the key manager; so does the simulator.
+ *
+ * Handshakes arrive as a Poisson process (open loop, --arrival-rate) or are issued back to back by
+ * a fixed number of clients (closed loop, --concurrency). A handshake that finds no key waits in
+ * FIFO order until key arrives, or fails when it has waited longer than the timeout. Its latency is
+ * the waiting time plus the fixed handshake time.
+ *
+ * For every combination of distance and load the simulator prints one line of a table: the link
+ * characteristics, the achieved handshake rate, the failure rate, and latency percentiles.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#include "qkd_debug.h"
+#include "qkd_histogram.h"
+#include "qkd_key_store.h"
+#include "qkd_link_emulator.h"
+#include "qkd_secure_arena.h"
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NSEC_PER_SEC 1000000000ULL
+#define USEC_PER_SEC 1000000.0
+
+#define KEY_BLOCK_SIZE QKD_SECURE_ARENA_MAX_SIZE
+#define SIMULATED_PEER "simulated-link"
+#define MAX_POINTS 64
+
+typedef struct options_st {
+    double distances_km[MAX_POINTS];
+    size_t nr_distances;
+    double loads[MAX_POINTS];           /* Arrival rates (open loop) or numbers of clients */
+    size_t nr_loads;
+    bool closed_loop;
+    double fiber_loss_db_per_km;
+    double detector_efficiency;
+    double pulse_rate_hz;
+    double mean_photon_number;
+    double dark_count_probability;
+    double misalignment_error;
+    double sifting_ratio;
+    double reconciliation_efficiency;
+    size_t key_bytes;
+    size_t buffer_bytes;
+    double link_buffer_bits;            /* 0 means: as in the link emulator configuration */
+    double handshake_ms;
+    double timeout_ms;
+    uint64_t nr_handshakes;
+    uint64_t seed;
+    const char *link_config;
+    bool print_distribution;
+} options_t;
+
+/* The characteristics of the link at one distance. */
+typedef struct link_model_st {
+    double transmittance;               /* Fiber and detector */
+    double gain;                        /* Detection probability per pulse */
+    double qber;
+    double sifted_bps;
+    double secret_bps;
+} link_model_t;
+
+typedef enum {
+    EVENT_ARRIVAL = 0,                  /* A handshake starts */
+    EVENT_BLOCK_READY,                  /* A key block from the key manager has arrived */
+    EVENT_TIMEOUT                       /* A waiting handshake gives up */
+} event_type_t;
+
+typedef struct event_st {
+    double time;
+    uint64_t sequence;                  /* Orders events that happen at the same time */
+    event_type_t type;
+    uint32_t handshake;
+    uint32_t generation;
+} event_t;
+
+typedef struct handshake_st {
+    double arrival_time;
+    uint32_t generation;                /* Incremented on reuse, to recognize stale timeouts */
+    bool waiting;
+} handshake_t;
+
+typedef struct simulation_st {
+    double now;
+    uint64_t next_sequence;
+    uint64_t random_state;
+
+    event_t *events;                    /* Binary min-heap on (time, sequence) */
+    size_t nr_events;
+    size_t max_events;
+
+    handshake_t *handshakes;
+    uint32_t *free_handshakes;
+    size_t nr_free_handshakes;
+    size_t nr_handshakes_allocated;
+    size_t max_handshakes;
+
+    uint32_t *queue;                    /* Ring buffer of waiting handshakes, in FIFO order */
+    size_t queue_head;
+    size_t queue_size;
+    size_t queue_capacity;
+
+    QKD_link_emulator_t emulator;
+    uint64_t nr_blocks_delivered;
+    uint64_t next_offset;               /* Offset in the key stream of the next key */
+    bool block_in_flight;
+
+    uint64_t nr_arrivals;
+    uint64_t nr_completed;
+    uint64_t nr_failed;
+    double end_time;                    /* Time at which the last handshake finished */
+    QKD_histogram_t latency;            /* Microseconds */
+} simulation_t;
+
+static options_t options = {
+    .distances_km = { 10.0, 25.0, 50.0, 75.0, 100.0 },
+    .nr_distances = 5,
+    .loads = { 100.0, 1000.0, 10000.0 },
+    .nr_loads = 3,
+    .closed_loop = false,
+    .fiber_loss_db_per_km = 0.2,
+    .detector_efficiency = 0.1,
+    .pulse_rate_hz = 1e9,
+    .mean_photon_number = 0.5,
+    .dark_count_probability = 1e-6,
+    .misalignment_error = 0.01,
+    .sifting_ratio = 0.5,
+    .reconciliation_efficiency = 1.16,
+    .key_bytes = 256,
+    .buffer_bytes = 8 * KEY_BLOCK_SIZE,
+    .link_buffer_bits = 0.0,
+    .handshake_ms = 2.0,
+    .timeout_ms = 5000.0,
+    .nr_handshakes = 100000,
+    .seed = 1,
+    .link_config = NULL,
+    .print_distribution = false
+};
+
+static char key[KEY_BLOCK_SIZE];
+static const char block[KEY_BLOCK_SIZE];
+
+/**
+ * Return the current time of the monotonic clock in nanoseconds.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * Binary entropy function.
+ */
+static double binary_entropy(double p)
+{
+    if (p <= 0.0 || p >= 1.0) {
+        return 0.0;
+    }
+    return -p * log2(p) - (1.0 - p) * log2(1.0 - p);
+}
+
+/**
+ * Compute the characteristics of a decoy-state BB84 link of the given length (GLLP key rate with
+ * the single-photon yield and error rate of an infinite number of decoy states).
+ */
+static void model_link(double distance_km, link_model_t *model)
+{
+    double mu = options.mean_photon_number;
+    double y0 = options.dark_count_probability;
+    double e_d = options.misalignment_error;
+    double eta = pow(10.0, -options.fiber_loss_db_per_km * distance_km / 10.0) *
+                 options.detector_efficiency;
+
+    double gain = y0 + 1.0 - exp(-mu * eta);
+    double qber = (0.5 * y0 + e_d * (1.0 - exp(-mu * eta))) / gain;
+    double single_photon_yield = y0 + eta;
+    double single_photon_gain = single_photon_yield * mu * exp(-mu);
+    double single_photon_error = (0.5 * y0 + e_d * eta) / single_photon_yield;
+
+    double secret_per_pulse =
+        single_photon_gain * (1.0 - binary_entropy(single_photon_error)) -
+        gain * options.reconciliation_efficiency * binary_entropy(qber);
+
+    model->transmittance = eta;
+    model->gain = gain;
+    model->qber = qber;
+    model->sifted_bps = options.sifting_ratio * gain * options.pulse_rate_hz;
+    model->secret_bps = fmax(0.0, options.sifting_ratio * secret_per_pulse * options.pulse_rate_hz);
+}
+
+/**
+ * Return a uniformly distributed random number in (0, 1).
+ */
+static double random_uniform(simulation_t *sim)
+{
+    uint64_t x = sim->random_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    sim->random_state = x;
+    return ((x * 0x2545F4914F6CDD1DULL >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static bool event_before(const event_t *event_1, const event_t *event_2)
+{
+    if (event_1->time != event_2->time) {
+        return event_1->time < event_2->time;
+    }
+    return event_1->sequence < event_2->sequence;
+}
+
+/**
+ * Schedule an event.
+ */
+static void schedule(simulation_t *sim, double time, event_type_t type, uint32_t handshake)
+{
+    if (sim->nr_events == sim->max_events) {
+        sim->max_events = sim->max_events ? 2 * sim->max_events : 1024;
+        sim->events = realloc(sim->events, sim->max_events * sizeof(event_t));
+        if (sim->events == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    event_t event = {
+        .time = time,
+        .sequence = sim->next_sequence++,
+        .type = type,
+        .handshake = handshake,
+        .generation = type == EVENT_TIMEOUT ? sim->handshakes[handshake].generation : 0
+    };
+    size_t i = sim->nr_events++;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!event_before(&event, &sim->events[parent])) {
+            break;
+        }
+        sim->events[i] = sim->events[parent];
+        i = parent;
+    }
+    sim->events[i] = event;
+}
+
+/**
+ * Remove the earliest event.
+ *
+ * Returns true if there was one, false if no events are left.
+ */
+static bool next_event(simulation_t *sim, event_t *event)
+{
+    if (sim->nr_events == 0) {
+        return false;
+    }
+    *event = sim->events[0];
+    event_t last = sim->events[--sim->nr_events];
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= sim->nr_events) {
+            break;
+        }
+        if (child + 1 < sim->nr_events && event_before(&sim->events[child + 1],
+                                                       &sim->events[child])) {
+            child++;
+        }
+        if (!event_before(&sim->events[child], &last)) {
+            break;
+        }
+        sim->events[i] = sim->events[child];
+        i = child;
+    }
+    if (sim->nr_events > 0) {
+        sim->events[i] = last;
+    }
+    return true;
+}
+
+static uint32_t allocate_handshake(simulation_t *sim)
+{
+    uint32_t id;
+    if (sim->nr_free_handshakes > 0) {
+        id = sim->free_handshakes[--sim->nr_free_handshakes];
+    } else {
+        if (sim->nr_handshakes_allocated == sim->max_handshakes) {
+            sim->max_handshakes = sim->max_handshakes ? 2 * sim->max_handshakes : 1024;
+            sim->handshakes = realloc(sim->handshakes, sim->max_handshakes * sizeof(handshake_t));
+            sim->free_handshakes = realloc(sim->free_handshakes,
+                                           sim->max_handshakes * sizeof(uint32_t));
+            if (sim->handshakes == NULL || sim->free_handshakes == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+        }
+        id = sim->nr_handshakes_allocated++;
+        sim->handshakes[id].generation = 0;
+    }
+    sim->handshakes[id].generation++;
+    sim->handshakes[id].arrival_time = sim->now;
+    sim->handshakes[id].waiting = false;
+    return id;
+}
+
+static void free_handshake(simulation_t *sim, uint32_t id)
+{
+    sim->free_handshakes[sim->nr_free_handshakes++] = id;
+}
+
+static void enqueue(simulation_t *sim, uint32_t id)
+{
+    if (sim->queue_size == sim->queue_capacity) {
+        size_t capacity = sim->queue_capacity ? 2 * sim->queue_capacity : 1024;
+        uint32_t *queue = malloc(capacity * sizeof(uint32_t));
+        if (queue == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < sim->queue_size; i++) {
+            queue[i] = sim->queue[(sim->queue_head + i) % sim->queue_capacity];
+        }
+        free(sim->queue);
+        sim->queue = queue;
+        sim->queue_head = 0;
+        sim->queue_capacity = capacity;
+    }
+    sim->queue[(sim->queue_head + sim->queue_size++) % sim->queue_capacity] = id;
+}
+
+static void dequeue(simulation_t *sim)
+{
+    sim->queue_head = (sim->queue_head + 1) % sim->queue_capacity;
+    sim->queue_size--;
+}
+
+static void block_handle(uint64_t block_index, QKD_key_handle_t *handle)
+{
+    QKD_key_handle_set_null(handle);
+    memcpy(handle->bytes, &block_index, sizeof(block_index));
+}
+
+/**
+ * The number of bytes of delivered key that have not been allocated to a handshake yet.
+ */
+static uint64_t available_bytes(const simulation_t *sim)
+{
+    return sim->nr_blocks_delivered * KEY_BLOCK_SIZE - sim->next_offset;
+}
+
+/**
+ * Consume the key for one handshake from the key store, in the same way as the mock: a key never
+ * straddles two blocks, and the unused tail of a block is discarded.
+ *
+ * Returns true on success, false if not enough key has been delivered yet.
+ */
+static bool take_key(simulation_t *sim)
+{
+    uint64_t offset_in_block = sim->next_offset % KEY_BLOCK_SIZE;
+    if (offset_in_block + options.key_bytes > KEY_BLOCK_SIZE) {
+        uint64_t tail = KEY_BLOCK_SIZE - offset_in_block;
+        if (available_bytes(sim) < tail + options.key_bytes) {
+            return false;
+        }
+        QKD_key_handle_t handle;
+        block_handle(sim->next_offset / KEY_BLOCK_SIZE, &handle);
+        QKD_key_store_consume(SIMULATED_PEER, &handle, offset_in_block, NULL, tail);
+        sim->next_offset += tail;
+        offset_in_block = 0;
+    }
+    if (available_bytes(sim) < options.key_bytes) {
+        return false;
+    }
+    QKD_key_handle_t handle;
+    block_handle(sim->next_offset / KEY_BLOCK_SIZE, &handle);
+    if (!QKD_key_store_consume(SIMULATED_PEER, &handle, offset_in_block, key, options.key_bytes)) {
+        fprintf(stderr, "Key missing from key store at offset %llu\n",
+                (unsigned long long) sim->next_offset);
+        exit(1);
+    }
+    sim->next_offset += options.key_bytes;
+    return true;
+}
+
+/**
+ * Request the next key block from the link if the lookahead is not full and no request is
+ * outstanding. The block is reserved from the link emulator now and arrives when the link has
+ * produced it.
+ */
+static void request_block(simulation_t *sim)
+{
+    if (sim->block_in_flight || available_bytes(sim) >= options.buffer_bytes) {
+        return;
+    }
+    double bits = 8.0 * KEY_BLOCK_SIZE;
+    double ready = QKD_link_emulator_time_available(&sim->emulator, bits, sim->now);
+    if (isinf(ready)) {
+        return;
+    }
+    QKD_link_emulator_consume(&sim->emulator, bits, sim->now);
+    schedule(sim, fmax(ready, sim->now), EVENT_BLOCK_READY, 0);
+    sim->block_in_flight = true;
+}
+
+static void complete_handshake(simulation_t *sim, uint32_t id)
+{
+    double latency = sim->now - sim->handshakes[id].arrival_time + options.handshake_ms / 1000.0;
+    QKD_histogram_record(&sim->latency, (uint64_t) (latency * USEC_PER_SEC));
+    sim->nr_completed++;
+    sim->end_time = fmax(sim->end_time, sim->now + options.handshake_ms / 1000.0);
+    if (options.closed_loop) {
+        schedule(sim, sim->now + options.handshake_ms / 1000.0, EVENT_ARRIVAL, 0);
+    }
+    free_handshake(sim, id);
+}
+
+/**
+ * Give key to waiting handshakes, in FIFO order, for as long as there is key.
+ */
+static void serve_queue(simulation_t *sim)
+{
+    while (sim->queue_size > 0) {
+        uint32_t id = sim->queue[sim->queue_head];
+        if (!sim->handshakes[id].waiting) {
+            /* Timed out */
+            dequeue(sim);
+            free_handshake(sim, id);
+            continue;
+        }
+        if (!take_key(sim)) {
+            break;
+        }
+        dequeue(sim);
+        sim->handshakes[id].waiting = false;
+        complete_handshake(sim, id);
+    }
+}
+
+static void handle_arrival(simulation_t *sim, double load)
+{
+    if (sim->nr_arrivals == options.nr_handshakes) {
+        return;
+    }
+    sim->nr_arrivals++;
+    if (!options.closed_loop && sim->nr_arrivals < options.nr_handshakes) {
+        schedule(sim, sim->now - log(random_uniform(sim)) / load, EVENT_ARRIVAL, 0);
+    }
+    uint32_t id = allocate_handshake(sim);
+    if (sim->queue_size == 0 && take_key(sim)) {
+        complete_handshake(sim, id);
+    } else {
+        sim->handshakes[id].waiting = true;
+        enqueue(sim, id);
+        schedule(sim, sim->now + options.timeout_ms / 1000.0, EVENT_TIMEOUT, id);
+    }
+    request_block(sim);
+}
+
+static void handle_block_ready(simulation_t *sim)
+{
+    QKD_key_handle_t handle;
+    block_handle(sim->nr_blocks_delivered, &handle);
+    if (QKD_key_store_put(SIMULATED_PEER, &handle, block, KEY_BLOCK_SIZE) != QKD_RESULT_SUCCESS) {
+        fprintf(stderr, "Could not put key block into key store\n");
+        exit(1);
+    }
+    sim->nr_blocks_delivered++;
+    sim->block_in_flight = false;
+    serve_queue(sim);
+    request_block(sim);
+}
+
+static void handle_timeout(simulation_t *sim, const event_t *event)
+{
+    handshake_t *handshake = &sim->handshakes[event->handshake];
+    if (handshake->generation != event->generation || !handshake->waiting) {
+        return;
+    }
+    handshake->waiting = false;
+    sim->nr_failed++;
+    sim->end_time = fmax(sim->end_time, sim->now);
+    if (options.closed_loop) {
+        schedule(sim, sim->now, EVENT_ARRIVAL, 0);
+    }
+}
+
+/**
+ * Simulate nr_handshakes handshakes over a link with the given emulator configuration and load.
+ */
+static void simulate(simulation_t *sim, const QKD_link_emulator_config_t *config, double load)
+{
+    sim->now = 0.0;
+    sim->next_sequence = 0;
+    sim->random_state = options.seed * 0x9E3779B97F4A7C15ULL + 1;
+    sim->nr_events = 0;
+    sim->nr_free_handshakes = 0;
+    sim->nr_handshakes_allocated = 0;
+    sim->queue_head = 0;
+    sim->queue_size = 0;
+    QKD_link_emulator_init(&sim->emulator, config);
+    sim->nr_blocks_delivered = 0;
+    sim->next_offset = 0;
+    sim->block_in_flight = false;
+    sim->nr_arrivals = 0;
+    sim->nr_completed = 0;
+    sim->nr_failed = 0;
+    sim->end_time = 0.0;
+    QKD_histogram_init(&sim->latency);
+    QKD_key_store_discard_peer(SIMULATED_PEER);
+
+    if (options.closed_loop) {
+        for (uint64_t i = 0; i < (uint64_t) load; i++) {
+            schedule(sim, 0.0, EVENT_ARRIVAL, 0);
+        }
+    } else {
+        schedule(sim, 0.0, EVENT_ARRIVAL, 0);
+    }
+    request_block(sim);
+
+    event_t event;
+    while (next_event(sim, &event)) {
+        sim->now = event.time;
+        switch (event.type) {
+            case EVENT_ARRIVAL:
+                handle_arrival(sim, load);
+                break;
+            case EVENT_BLOCK_READY:
+                handle_block_ready(sim);
+                break;
+            case EVENT_TIMEOUT:
+                handle_timeout(sim, &event);
+                break;
+        }
+        if (sim->nr_completed + sim->nr_failed == options.nr_handshakes) {
+            break;
+        }
+    }
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -L, --distance-km LIST     Link lengths in km (default 10,25,50,75,100)\n"
+            "  -r, --arrival-rate LIST    Poisson handshake arrival rates per second (open loop,\n"
+            "                             default 100,1000,10000)\n"
+            "  -n, --concurrency LIST     Numbers of clients doing back-to-back handshakes\n"
+            "                             (closed loop, instead of --arrival-rate)\n"
+            "  -N, --handshakes N         Handshakes simulated per table row (default 100000)\n"
+            "  -k, --key-bytes N          Key consumed per handshake (default 256, max 2048)\n"
+            "  -b, --buffer-bytes N       Key lookahead requested from the key manager\n"
+            "                             (default 16384)\n"
+            "  -B, --link-buffer-bits N   Key buffer of the link (default: as in --link-config)\n"
+            "  -s, --handshake-ms MS      Time a handshake takes once it has key (default 2)\n"
+            "  -t, --timeout-ms MS        Time after which a waiting handshake fails (default 5000)\n"
+            "  -l, --fiber-loss DB        Fiber loss in dB/km (default 0.2)\n"
+            "  -e, --detector-efficiency E  Detector efficiency (default 0.1)\n"
+            "  -p, --pulse-rate HZ        Source pulse rate (default 1e9)\n"
+            "  -m, --mean-photon-number MU  Signal state intensity (default 0.5)\n"
+            "  -y, --dark-count P         Dark count probability per pulse (default 1e-6)\n"
+            "  -a, --misalignment E       Optical misalignment error (default 0.01)\n"
+            "  -q, --sifting-ratio Q      Fraction of detections kept after sifting (default 0.5)\n"
+            "  -f, --efficiency F         Reconciliation efficiency (default 1.16)\n"
+            "  -c, --link-config FILE     Link emulator configuration for outages and buffering\n"
+            "                             (see link_emulator.cnf; the key rate and QBER are\n"
+            "                             replaced by those of the model)\n"
+            "  -S, --seed N               Random seed (default 1)\n"
+            "  -H, --histogram            Also print the full latency distributions\n"
+            "  -h, --help                 Print this help\n",
+            program);
+}
+
+/**
+ * Parse a comma separated list of positive numbers.
+ *
+ * Returns true on success, false on failure.
+ */
+static bool parse_list(const char *str, double *values, size_t *nr_values)
+{
+    *nr_values = 0;
+    while (*str != '\0') {
+        char *end;
+        double value = strtod(str, &end);
+        if (end == str || value <= 0.0 || *nr_values == MAX_POINTS) {
+            return false;
+        }
+        values[(*nr_values)++] = value;
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return false;
+        }
+        str = end;
+    }
+    return *nr_values > 0;
+}
+
+/**
+ * Parse the command line options into the global options.
+ *
+ * Returns true on success, false on failure.
+ */
+static bool parse_options(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"distance-km", required_argument, NULL, 'L'},
+        {"arrival-rate", required_argument, NULL, 'r'},
+        {"concurrency", required_argument, NULL, 'n'},
+        {"handshakes", required_argument, NULL, 'N'},
+        {"key-bytes", required_argument, NULL, 'k'},
+        {"buffer-bytes", required_argument, NULL, 'b'},
+        {"link-buffer-bits", required_argument, NULL, 'B'},
+        {"handshake-ms", required_argument, NULL, 's'},
+        {"timeout-ms", required_argument, NULL, 't'},
+        {"fiber-loss", required_argument, NULL, 'l'},
+        {"detector-efficiency", required_argument, NULL, 'e'},
+        {"pulse-rate", required_argument, NULL, 'p'},
+        {"mean-photon-number", required_argument, NULL, 'm'},
+        {"dark-count", required_argument, NULL, 'y'},
+        {"misalignment", required_argument, NULL, 'a'},
+        {"sifting-ratio", required_argument, NULL, 'q'},
+        {"efficiency", required_argument, NULL, 'f'},
+        {"link-config", required_argument, NULL, 'c'},
+        {"seed", required_argument, NULL, 'S'},
+        {"histogram", no_argument, NULL, 'H'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    const char *short_options = "L:r:n:N:k:b:B:s:t:l:e:p:m:y:a:q:f:c:S:Hh";
+    int opt;
+    while ((opt = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'L':
+                if (!parse_list(optarg, options.distances_km, &options.nr_distances)) {
+                    fprintf(stderr, "Invalid --distance-km value %s\n", optarg);
+                    return false;
+                }
+                break;
+            case 'r':
+            case 'n':
+                if (!parse_list(optarg, options.loads, &options.nr_loads)) {
+                    fprintf(stderr, "Invalid --%s value %s\n",
+                            opt == 'r' ? "arrival-rate" : "concurrency", optarg);
+                    return false;
+                }
+                options.closed_loop = (opt == 'n');
+                break;
+            case 'N':
+                options.nr_handshakes = strtoull(optarg, NULL, 10);
+                break;
+            case 'k':
+                options.key_bytes = strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                options.buffer_bytes = strtoul(optarg, NULL, 10);
+                break;
+            case 'B':
+                options.link_buffer_bits = atof(optarg);
+                break;
+            case 's':
+                options.handshake_ms = atof(optarg);
+                break;
+            case 't':
+                options.timeout_ms = atof(optarg);
+                break;
+            case 'l':
+                options.fiber_loss_db_per_km = atof(optarg);
+                break;
+            case 'e':
+                options.detector_efficiency = atof(optarg);
+                break;
+            case 'p':
+                options.pulse_rate_hz = atof(optarg);
+                break;
+            case 'm':
+                options.mean_photon_number = atof(optarg);
+                break;
+            case 'y':
+                options.dark_count_probability = atof(optarg);
+                break;
+            case 'a':
+                options.misalignment_error = atof(optarg);
+                break;
+            case 'q':
+                options.sifting_ratio = atof(optarg);
+                break;
+            case 'f':
+                options.reconciliation_efficiency = atof(optarg);
+                break;
+            case 'c':
+                options.link_config = optarg;
+                break;
+            case 'S':
+                options.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'H':
+                options.print_distribution = true;
+                break;
+            default:
+                return false;
+        }
+    }
+    if (options.nr_handshakes < 1 || options.key_bytes < 1 || options.key_bytes > KEY_BLOCK_SIZE ||
+        options.buffer_bytes < options.key_bytes || options.link_buffer_bits < 0.0 ||
+        options.handshake_ms < 0.0 || options.timeout_ms <= 0.0 ||
+        options.fiber_loss_db_per_km < 0.0 || options.detector_efficiency <= 0.0 ||
+        options.detector_efficiency > 1.0 || options.pulse_rate_hz <= 0.0 ||
+        options.mean_photon_number <= 0.0 || options.dark_count_probability < 0.0 ||
+        options.misalignment_error < 0.0 || options.misalignment_error > 0.5 ||
+        options.sifting_ratio <= 0.0 || options.sifting_ratio > 1.0 ||
+        options.reconciliation_efficiency < 1.0) {
+        fprintf(stderr, "Invalid option value\n");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Size the key store and the secure arena for the lookahead, unless the user has sized them. Must
+ * be called before the first use of either.
+ */
+static void size_key_store(void)
+{
+    char value[32];
+    size_t bytes = options.buffer_bytes + 2 * KEY_BLOCK_SIZE;
+    snprintf(value, sizeof(value), "%zu", bytes);
+    setenv("QKD_KEY_STORE_PEER_CAP_BYTES", value, 0);
+    size_t arena_bytes = QKD_SECURE_ARENA_NR_CLASSES * 2 * bytes;
+    if (arena_bytes > QKD_SECURE_ARENA_DEFAULT_BYTES) {
+        snprintf(value, sizeof(value), "%zu", arena_bytes);
+        setenv("QKD_SECURE_ARENA_BYTES", value, 0);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (!parse_options(argc, argv)) {
+        usage(argv[0]);
+        return 1;
+    }
+    QKD_debug_set_enabled(false);
+    size_key_store();
+
+    QKD_link_emulator_config_t config;
+    QKD_link_emulator_config_set_defaults(&config);
+    if (options.link_config != NULL && !QKD_link_emulator_read_config(options.link_config,
+                                                                      &config)) {
+        fprintf(stderr, "Could not read link emulator configuration %s\n", options.link_config);
+        return 1;
+    }
+    /* The model gives the secret key rate (after reconciliation and privacy amplification). */
+    config.nr_qber_points = 0;
+    config.reconciliation = QKD_RECONCILIATION_NONE;
+    config.reconciliation_efficiency = 1.0;
+    config.seed = options.seed;
+    if (options.link_buffer_bits > 0.0) {
+        config.key_buffer_bits = options.link_buffer_bits;
+    }
+
+    printf("Key per handshake %zu bytes, lookahead %zu bytes, handshake time %g ms, "
+           "timeout %g ms\n", options.key_bytes, options.buffer_bytes, options.handshake_ms,
+           options.timeout_ms);
+    printf("%8s %10s %7s %12s %12s %10s %12s %8s %10s %10s %10s\n", "km", "transmit", "QBER",
+           "sifted_bps", "secret_bps", options.closed_loop ? "clients" : "offered/s",
+           "handshakes/s", "failed%", "p50_ms", "p99_ms", "max_ms");
+
+    simulation_t sim;
+    memset(&sim, 0, sizeof(sim));
+    uint64_t nr_simulated = 0;
+    uint64_t start_ns = now_ns();
+    for (size_t d = 0; d < options.nr_distances; d++) {
+        link_model_t model;
+        model_link(options.distances_km[d], &model);
+        config.key_rate_bps = model.secret_bps;
+        for (size_t l = 0; l < options.nr_loads; l++) {
+            simulate(&sim, &config, options.loads[l]);
+            nr_simulated += sim.nr_completed + sim.nr_failed;
+            double throughput = sim.end_time > 0.0 ? sim.nr_completed / sim.end_time : 0.0;
+            double failed = sim.nr_arrivals ? 100.0 * sim.nr_failed / sim.nr_arrivals : 0.0;
+            printf("%8.1f %10.3g %7.4f %12.4g %12.4g %10g %12.1f %8.2f %10.3f %10.3f %10.3f\n",
+                   options.distances_km[d], model.transmittance, model.qber, model.sifted_bps,
+                   model.secret_bps, options.loads[l], throughput, failed,
+                   QKD_histogram_percentile(&sim.latency, 50.0) / 1000.0,
+                   QKD_histogram_percentile(&sim.latency, 99.0) / 1000.0,
+                   sim.latency.total ? sim.latency.max / 1000.0 : 0.0);
+            if (options.print_distribution) {
+                char label[64];
+                snprintf(label, sizeof(label), "Latency %g km %g", options.distances_km[d],
+                         options.loads[l]);
+                QKD_histogram_print_distribution(&sim.latency, stdout, label, "us");
+            }
+        }
+    }
+    double wall = (now_ns() - start_ns) / (double) NSEC_PER_SEC;
+    printf("Simulated %llu handshakes in %.3f s of wall time (%.0f handshakes/s)\n",
+           (unsigned long long) nr_simulated, wall, wall > 0.0 ? nr_simulated / wall : 0.0);
+
+    QKD_key_store_discard_peer(SIMULATED_PEER);
+    free(sim.events);
+    free(sim.handshakes);
+    free(sim.free_handshakes);
+    free(sim.queue);
+    return 0;
+}
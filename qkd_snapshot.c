@@ -0,0 +1,359 @@
+/**
+ * qkd_snapshot.c
+ *
+ * Encrypted on-disk snapshots of unused key material (see qkd_snapshot.h).
+ *
+ * File format:
+ *   magic "QKDSNAP1" (8 bytes) | creation time (64 bits, seconds since the epoch) | IV (12 bytes)
+ *   | ciphertext | GCM tag (16 bytes)
+ * The header and the kind of the snapshot are the additional authenticated data.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#include "qkd_snapshot.h"
+#include "qkd_debug.h"
+#include "qkd_secure_arena.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#define SNAPSHOT_MAGIC "QKDSNAP1"
+#define SNAPSHOT_MAGIC_SIZE 8
+#define SNAPSHOT_IV_SIZE 12
+#define SNAPSHOT_HEADER_SIZE (SNAPSHOT_MAGIC_SIZE + 8 + SNAPSHOT_IV_SIZE)
+#define SNAPSHOT_TAG_SIZE 16
+
+/* Data is encrypted and decrypted in chunks of this size. */
+#define CHUNK_SIZE 1024
+
+struct QKD_snapshot_st {
+    FILE *file;
+    char *tmp_file_name;            /* Writing: the snapshot is renamed into place on commit */
+    char *file_name;
+    EVP_CIPHER_CTX *ctx;
+    bool writing;
+    size_t remaining;               /* Reading: ciphertext bytes not read yet */
+};
+
+/**
+ * Read the snapshot key from the file named by QKD_SNAPSHOT_KEY_FILE into the secure arena.
+ *
+ * Returns the key (to be released with QKD_secure_free), or NULL on failure.
+ */
+static unsigned char *read_snapshot_key(void)
+{
+    QKD_enter();
+    const char *key_file_name = getenv("QKD_SNAPSHOT_KEY_FILE");
+    if (key_file_name == NULL) {
+        QKD_error("QKD_SNAPSHOT_KEY_FILE is not set");
+        QKD_return_error("%p", NULL);
+    }
+    FILE *key_file = fopen(key_file_name, "rb");
+    if (key_file == NULL) {
+        QKD_error_with_errno("Cannot open snapshot key file %s", key_file_name);
+        QKD_return_error("%p", NULL);
+    }
+    unsigned char *key = QKD_secure_alloc(QKD_SNAPSHOT_KEY_SIZE);
+    bool ok = key != NULL && fread(key, 1, QKD_SNAPSHOT_KEY_SIZE, key_file) ==
+                             QKD_SNAPSHOT_KEY_SIZE;
+    fclose(key_file);
+    if (!ok) {
+        QKD_error("Snapshot key file %s must contain %d bytes", key_file_name,
+                  QKD_SNAPSHOT_KEY_SIZE);
+        QKD_secure_free(key);
+        QKD_return_error("%p", NULL);
+    }
+    QKD_return_success("%p", key);
+}
+
+/**
+ * Set up the cipher context for the snapshot: the key, the IV, and the additional authenticated
+ * data (the header and the kind).
+ *
+ * Returns true on success, false on failure.
+ */
+static bool init_cipher(QKD_snapshot_t *snapshot, const unsigned char *header, const char *kind)
+{
+    unsigned char *key = read_snapshot_key();
+    if (key == NULL) {
+        return false;
+    }
+    snapshot->ctx = EVP_CIPHER_CTX_new();
+    int len;
+    bool ok = snapshot->ctx != NULL &&
+              EVP_CipherInit_ex(snapshot->ctx, EVP_aes_256_gcm(), NULL, key,
+                                header + SNAPSHOT_MAGIC_SIZE + 8, snapshot->writing) == 1 &&
+              EVP_CipherUpdate(snapshot->ctx, NULL, &len, header, SNAPSHOT_HEADER_SIZE) == 1 &&
+              EVP_CipherUpdate(snapshot->ctx, NULL, &len, (const unsigned char *) kind,
+                               strlen(kind)) == 1;
+    QKD_secure_free(key);
+    if (!ok) {
+        QKD_error("Initializing snapshot cipher failed");
+    }
+    return ok;
+}
+
+/**
+ * Create a new snapshot of the given kind. The snapshot only replaces the previous snapshot (if
+ * any) when it is committed.
+ *
+ * Returns the snapshot, or NULL if snapshots are not enabled or on failure.
+ */
+QKD_snapshot_t *QKD_snapshot_create(const char *kind)
+{
+    QKD_enter();
+    const char *file_name = getenv("QKD_SNAPSHOT_FILE");
+    if (file_name == NULL) {
+        QKD_debug("Snapshots not enabled");
+        QKD_return_success("%p", NULL);
+    }
+    QKD_snapshot_t *snapshot = calloc(1, sizeof(*snapshot));
+    if (snapshot == NULL) {
+        QKD_error("calloc failed");
+        QKD_return_error("%p", NULL);
+    }
+    snapshot->writing = true;
+    snapshot->file_name = strdup(file_name);
+    snapshot->tmp_file_name = malloc(strlen(file_name) + 5);
+    if (snapshot->file_name == NULL || snapshot->tmp_file_name == NULL) {
+        QKD_error("malloc failed");
+        QKD_snapshot_close(snapshot);
+        QKD_return_error("%p", NULL);
+    }
+    sprintf(snapshot->tmp_file_name, "%s.tmp", file_name);
+
+    unsigned char header[SNAPSHOT_HEADER_SIZE];
+    memcpy(header, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE);
+    uint64_t now = time(NULL);
+    for (int i = 0; i < 8; i++) {
+        header[SNAPSHOT_MAGIC_SIZE + i] = now >> (56 - 8 * i);
+    }
+    if (RAND_bytes(header + SNAPSHOT_MAGIC_SIZE + 8, SNAPSHOT_IV_SIZE) != 1 ||
+        !init_cipher(snapshot, header, kind)) {
+        QKD_snapshot_close(snapshot);
+        QKD_return_error("%p", NULL);
+    }
+
+    /* Only the owner may read the snapshot. */
+    int fd = open(snapshot->tmp_file_name, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd != -1) {
+        snapshot->file = fdopen(fd, "wb");
+    }
+    if (snapshot->file == NULL) {
+        QKD_error_with_errno("Cannot create snapshot file %s", snapshot->tmp_file_name);
+        if (fd != -1) {
+            close(fd);
+        }
+        QKD_snapshot_close(snapshot);
+        QKD_return_error("%p", NULL);
+    }
+    if (fwrite(header, 1, sizeof(header), snapshot->file) != sizeof(header)) {
+        QKD_error_with_errno("Writing snapshot file %s failed", snapshot->tmp_file_name);
+        QKD_snapshot_close(snapshot);
+        QKD_return_error("%p", NULL);
+    }
+    QKD_return_success("%p", snapshot);
+}
+
+/**
+ * Encrypt data and append it to the snapshot.
+ *
+ * Returns true on success, false on failure.
+ */
+bool QKD_snapshot_write(QKD_snapshot_t *snapshot, const void *data, size_t size)
+{
+    assert(snapshot != NULL && snapshot->writing);
+    const unsigned char *p = data;
+    unsigned char ciphertext[CHUNK_SIZE];
+    while (size > 0) {
+        int chunk = size < CHUNK_SIZE ? size : CHUNK_SIZE;
+        int len;
+        if (EVP_EncryptUpdate(snapshot->ctx, ciphertext, &len, p, chunk) != 1 ||
+            fwrite(ciphertext, 1, len, snapshot->file) != (size_t) len) {
+            QKD_error("Writing snapshot failed");
+            return false;
+        }
+        p += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+/**
+ * Finish the snapshot: write the authentication tag, make sure the snapshot is on disk, and
+ * replace the previous snapshot with it. The snapshot is closed, whether or not this succeeds.
+ *
+ * Returns QKD_result_t.
+ */
+QKD_result_t QKD_snapshot_commit(QKD_snapshot_t *snapshot)
+{
+    QKD_enter();
+    assert(snapshot != NULL && snapshot->writing);
+    unsigned char tag[SNAPSHOT_TAG_SIZE];
+    int len;
+    bool ok = EVP_EncryptFinal_ex(snapshot->ctx, tag, &len) == 1 &&
+              EVP_CIPHER_CTX_ctrl(snapshot->ctx, EVP_CTRL_GCM_GET_TAG, sizeof(tag), tag) == 1 &&
+              fwrite(tag, 1, sizeof(tag), snapshot->file) == sizeof(tag) &&
+              fflush(snapshot->file) == 0 && fsync(fileno(snapshot->file)) == 0;
+    ok = fclose(snapshot->file) == 0 && ok;
+    snapshot->file = NULL;
+    if (!ok || rename(snapshot->tmp_file_name, snapshot->file_name) != 0) {
+        QKD_error_with_errno("Committing snapshot %s failed", snapshot->file_name);
+        QKD_snapshot_close(snapshot);
+        QKD_return_error_qkd(QKD_RESULT_SEND_FAILED);
+    }
+    QKD_debug("Wrote snapshot %s", snapshot->file_name);
+    snapshot->writing = false;
+    QKD_snapshot_close(snapshot);
+    QKD_return_success_qkd();
+}
+
+/**
+ * Open the snapshot of the given kind for reading, and delete it from disk.
+ *
+ * Returns the snapshot, or NULL if snapshots are not enabled, if there is no snapshot, if the
+ * snapshot is too old, or on failure.
+ */
+QKD_snapshot_t *QKD_snapshot_open(const char *kind)
+{
+    QKD_enter();
+    const char *file_name = getenv("QKD_SNAPSHOT_FILE");
+    if (file_name == NULL) {
+        QKD_debug("Snapshots not enabled");
+        QKD_return_success("%p", NULL);
+    }
+    FILE *file = fopen(file_name, "rb");
+    if (file == NULL) {
+        QKD_debug("No snapshot %s", file_name);
+        QKD_return_success("%p", NULL);
+    }
+    if (unlink(file_name) != 0) {
+        /* A snapshot that cannot be deleted might be loaded again; don't use it. */
+        QKD_error_with_errno("Cannot delete snapshot %s", file_name);
+        fclose(file);
+        QKD_return_error("%p", NULL);
+    }
+    QKD_snapshot_t *snapshot = calloc(1, sizeof(*snapshot));
+    if (snapshot == NULL) {
+        QKD_error("calloc failed");
+        fclose(file);
+        QKD_return_error("%p", NULL);
+    }
+    snapshot->file = file;
+
+    struct stat st;
+    unsigned char header[SNAPSHOT_HEADER_SIZE];
+    unsigned char tag[SNAPSHOT_TAG_SIZE];
+    if (fstat(fileno(file), &st) != 0 || st.st_size < SNAPSHOT_HEADER_SIZE + SNAPSHOT_TAG_SIZE ||
+        fseek(file, st.st_size - SNAPSHOT_TAG_SIZE, SEEK_SET) != 0 ||
+        fread(tag, 1, sizeof(tag), file) != sizeof(tag) || fseek(file, 0, SEEK_SET) != 0 ||
+        fread(header, 1, sizeof(header), file) != sizeof(header) ||
+        memcmp(header, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) != 0) {
+        QKD_error("Invalid snapshot %s", file_name);
+        QKD_snapshot_close(snapshot);
+        QKD_return_error("%p", NULL);
+    }
+    uint64_t created = 0;
+    for (int i = 0; i < 8; i++) {
+        created = (created << 8) | header[SNAPSHOT_MAGIC_SIZE + i];
+    }
+    const char *max_age_str = getenv("QKD_SNAPSHOT_MAX_AGE_S");
+    uint64_t max_age = max_age_str ? strtoull(max_age_str, NULL, 10) :
+                                     QKD_SNAPSHOT_DEFAULT_MAX_AGE_S;
+    uint64_t now = time(NULL);
+    if (created > now || now - created > max_age) {
+        QKD_error("Snapshot %s is too old (%llu seconds)", file_name,
+                  (unsigned long long) (now - created));
+        QKD_snapshot_close(snapshot);
+        QKD_return_error("%p", NULL);
+    }
+    if (!init_cipher(snapshot, header, kind) ||
+        EVP_CIPHER_CTX_ctrl(snapshot->ctx, EVP_CTRL_GCM_SET_TAG, sizeof(tag), tag) != 1) {
+        QKD_snapshot_close(snapshot);
+        QKD_return_error("%p", NULL);
+    }
+    snapshot->remaining = st.st_size - SNAPSHOT_HEADER_SIZE - SNAPSHOT_TAG_SIZE;
+    QKD_debug("Opened snapshot %s (%llu seconds old)", file_name,
+              (unsigned long long) (now - created));
+    QKD_return_success("%p", snapshot);
+}
+
+/**
+ * Read and decrypt the next size bytes of the snapshot into data. The data is not authenticated
+ * until QKD_snapshot_verify succeeds, so it must not be used before then.
+ *
+ * Returns true on success, false on failure (including reading beyond the end of the snapshot).
+ */
+bool QKD_snapshot_read(QKD_snapshot_t *snapshot, void *data, size_t size)
+{
+    assert(snapshot != NULL && !snapshot->writing);
+    if (size > snapshot->remaining) {
+        QKD_error("Snapshot is truncated");
+        return false;
+    }
+    unsigned char *p = data;
+    unsigned char ciphertext[CHUNK_SIZE];
+    while (size > 0) {
+        int chunk = size < CHUNK_SIZE ? size : CHUNK_SIZE;
+        int len;
+        if (fread(ciphertext, 1, chunk, snapshot->file) != (size_t) chunk ||
+            EVP_DecryptUpdate(snapshot->ctx, p, &len, ciphertext, chunk) != 1 || len != chunk) {
+            QKD_error("Reading snapshot failed");
+            return false;
+        }
+        p += chunk;
+        size -= chunk;
+        snapshot->remaining -= chunk;
+    }
+    return true;
+}
+
+/**
+ * Check that all of the snapshot has been read and that it is authentic.
+ *
+ * Returns true if so, false otherwise.
+ */
+bool QKD_snapshot_verify(QKD_snapshot_t *snapshot)
+{
+    QKD_enter();
+    assert(snapshot != NULL && !snapshot->writing);
+    unsigned char final[SNAPSHOT_TAG_SIZE];
+    int len;
+    if (snapshot->remaining != 0 || EVP_DecryptFinal_ex(snapshot->ctx, final, &len) != 1) {
+        QKD_error("Snapshot is not authentic");
+        QKD_return_error("%d", false);
+    }
+    QKD_return_success("%d", true);
+}
+
+/**
+ * Close the snapshot and release its resources. A snapshot that is being written and that has not
+ * been committed is discarded.
+ */
+void QKD_snapshot_close(QKD_snapshot_t *snapshot)
+{
+    if (snapshot == NULL) {
+        return;
+    }
+    if (snapshot->file) {
+        fclose(snapshot->file);
+    }
+    if (snapshot->writing && snapshot->tmp_file_name) {
+        unlink(snapshot->tmp_file_name);
+    }
+    EVP_CIPHER_CTX_free(snapshot->ctx);
+    free(snapshot->tmp_file_name);
+    free(snapshot->file_name);
+    free(snapshot);
+}
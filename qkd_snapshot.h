@@ -0,0 +1,40 @@
+/**
+ * qkd_snapshot.h
+ *
+ * Encrypted on-disk snapshots of unused key material, so that an implementation of the QKD API
+ * can keep its buffered key across a restart (written by QKD_finish, read by QKD_init).
+ *
+ * Snapshots are enabled by setting environment variable QKD_SNAPSHOT_FILE to the name of the
+ * snapshot file and QKD_SNAPSHOT_KEY_FILE to the name of a file that contains a 32-byte key. The
+ * snapshot is encrypted and authenticated with AES-256-GCM under that key. The kind of the
+ * snapshot (e.g. which implementation of the API and which end wrote it) is authenticated too.
+ *
+ * A snapshot can be read only once: it is deleted as soon as it is opened, whether or not its
+ * contents turn out to be usable, so that key material is never used twice. Snapshots that are
+ * older than QKD_SNAPSHOT_MAX_AGE_S seconds (default 600) are rejected.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#ifndef QKD_SNAPSHOT_H
+#define QKD_SNAPSHOT_H
+
+#include "qkd_api.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#define QKD_SNAPSHOT_KEY_SIZE 32
+#define QKD_SNAPSHOT_DEFAULT_MAX_AGE_S 600
+
+typedef struct QKD_snapshot_st QKD_snapshot_t;
+
+QKD_snapshot_t *QKD_snapshot_create(const char *kind);
+bool QKD_snapshot_write(QKD_snapshot_t *snapshot, const void *data, size_t size);
+QKD_result_t QKD_snapshot_commit(QKD_snapshot_t *snapshot);
+QKD_snapshot_t *QKD_snapshot_open(const char *kind);
+bool QKD_snapshot_read(QKD_snapshot_t *snapshot, void *data, size_t size);
+bool QKD_snapshot_verify(QKD_snapshot_t *snapshot);
+void QKD_snapshot_close(QKD_snapshot_t *snapshot);
+
+#endif /* QKD_SNAPSHOT_H */
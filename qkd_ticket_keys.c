@@ -0,0 +1,419 @@
+/**
+ * qkd_ticket_keys.c
+ *
+ * Session ticket keys derived from QKD key material (see qkd_ticket_keys.h).
+ *
+ * The keys and their generation are published with a sequence lock: the sequence number is odd
+ * while a new key is being written, and a reader that sees it odd, or sees it change while it
+ * copies the keys, copies them again. Handshakes therefore never wait for each other, in this
+ * process or in others. Only one process at a time derives a new key: it holds the rotation lock,
+ * a robust process-shared mutex in the shared state. If a process dies while it holds the lock,
+ * the next process to take it is told so, and first makes the sequence number even again, since
+ * the process may have died in the middle of writing a key.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#include "qkd_ticket_keys.h"
+#include "qkd_api.h"
+#include "qkd_debug.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/rand.h>
+
+#define TICKET_KEYS_MAGIC 0x514b44544b455932ULL    /* "QKDTKEY2" */
+#define TICKET_KEYS_INITIALIZING 1                  /* Magic while the rotation lock is set up */
+#define TICKET_KEYS_INIT_WAIT_MS 1000
+#define TICKET_KEY_NAME_SIZE 16
+#define TICKET_CIPHER_KEY_SIZE 32                   /* AES-256-CBC */
+#define TICKET_MAC_KEY_SIZE 32                      /* HMAC-SHA256 */
+#define TICKET_IV_SIZE 16
+#define TICKET_QKD_KEY_SIZE 32
+#define TICKET_RANDOM_SIZE 32
+#define TICKET_QKD_TIMEOUT_MS 100                   /* How long a rotation waits for a QKD key */
+
+static const char ticket_kdf_info[] = "QKD session ticket keys";
+
+typedef struct ticket_key_st {
+    unsigned char name[TICKET_KEY_NAME_SIZE];
+    unsigned char cipher_key[TICKET_CIPHER_KEY_SIZE];
+    unsigned char mac_key[TICKET_MAC_KEY_SIZE];
+} ticket_key_t;
+
+/* The state that is shared by all processes. It starts out as all zeroes: no key yet. */
+typedef struct ticket_keys_st {
+    uint64_t magic;
+    uint64_t sequence;                  /* Odd while a new key is being written */
+    uint64_t generation;                /* Keys derived so far; keys[generation % NR_KEYS] is the
+                                         * current key */
+    ticket_key_t keys[QKD_TICKET_NR_KEYS];
+    uint64_t next_rotation_ms;          /* When the current key is due for rotation */
+    pthread_mutex_t rotation_lock;      /* Robust and process-shared */
+    QKD_ticket_stats_t stats;
+} ticket_keys_t;
+
+static ticket_keys_t *ticket_keys = NULL;
+
+static uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+/**
+ * The time between rotations: environment variable QKD_TICKET_KEY_ROTATION_SECONDS, or
+ * QKD_TICKET_DEFAULT_ROTATION_SECONDS.
+ */
+static long rotation_seconds(void)
+{
+    const char *str = getenv("QKD_TICKET_KEY_ROTATION_SECONDS");
+    if (str != NULL) {
+        long seconds = strtol(str, NULL, 10);
+        if (seconds > 0) {
+            return seconds;
+        }
+        QKD_error("Invalid QKD_TICKET_KEY_ROTATION_SECONDS %s", str);
+    }
+    return QKD_TICKET_DEFAULT_ROTATION_SECONDS;
+}
+
+/**
+ * Set up the rotation lock of the shared state if this process is the first to map it, or else
+ * wait (at most TICKET_KEYS_INIT_WAIT_MS) until the process that is the first has set it up.
+ *
+ * Returns true on success, false if the shared state is something else, or was never set up.
+ */
+static bool init_shared_state(ticket_keys_t *keys)
+{
+    uint64_t magic = 0;
+    if (__atomic_compare_exchange_n(&keys->magic, &magic, TICKET_KEYS_INITIALIZING, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        pthread_mutexattr_t attr;
+        bool ok = pthread_mutexattr_init(&attr) == 0 &&
+                  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) == 0 &&
+                  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) == 0 &&
+                  pthread_mutex_init(&keys->rotation_lock, &attr) == 0;
+        pthread_mutexattr_destroy(&attr);
+        if (!ok) {
+            QKD_error("Could not set up the rotation lock of the session ticket keys");
+            __atomic_store_n(&keys->magic, 0, __ATOMIC_RELEASE);
+            return false;
+        }
+        __atomic_store_n(&keys->magic, TICKET_KEYS_MAGIC, __ATOMIC_RELEASE);
+        return true;
+    }
+    uint64_t deadline = monotonic_ms() + TICKET_KEYS_INIT_WAIT_MS;
+    while (magic == TICKET_KEYS_INITIALIZING && monotonic_ms() < deadline) {
+        struct timespec delay = {.tv_sec = 0, .tv_nsec = 1000000};
+        nanosleep(&delay, NULL);
+        magic = __atomic_load_n(&keys->magic, __ATOMIC_ACQUIRE);
+    }
+    return magic == TICKET_KEYS_MAGIC;
+}
+
+/**
+ * Map the shared state: the POSIX shared memory object QKD_TICKET_KEYS_SHM if that environment
+ * variable is set, or else a shared anonymous mapping. Called when the server engine is
+ * initialized, before the server forks its workers.
+ *
+ * Returns true on success, false on failure.
+ */
+bool QKD_ticket_keys_init(void)
+{
+    QKD_enter();
+    if (ticket_keys != NULL) {
+        QKD_return_success("%d", true);
+    }
+    const char *shm_name = getenv("QKD_TICKET_KEYS_SHM");
+    void *area = MAP_FAILED;
+    if (shm_name == NULL) {
+        area = mmap(NULL, sizeof(ticket_keys_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                    -1, 0);
+    } else {
+        int fd = shm_open(shm_name, O_RDWR | O_CREAT, 0600);
+        if (fd == -1) {
+            QKD_error_with_errno("shm_open %s failed", shm_name);
+            QKD_return_error("%d", false);
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size < (off_t) sizeof(ticket_keys_t) &&
+            ftruncate(fd, sizeof(ticket_keys_t)) != 0) {
+            QKD_error_with_errno("ftruncate %s failed", shm_name);
+        } else {
+            area = mmap(NULL, sizeof(ticket_keys_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+    }
+    if (area == MAP_FAILED) {
+        QKD_error_with_errno("mmap failed");
+        QKD_return_error("%d", false);
+    }
+    if (mlock(area, sizeof(ticket_keys_t)) != 0) {
+        QKD_debug("Could not lock the session ticket keys in memory");
+    }
+    ticket_keys_t *keys = area;
+    if (!init_shared_state(keys)) {
+        QKD_error("%s does not hold session ticket keys", shm_name ? shm_name : "The mapping");
+        munmap(area, sizeof(ticket_keys_t));
+        QKD_return_error("%d", false);
+    }
+    ticket_keys = keys;
+    QKD_return_success("%d", true);
+}
+
+/**
+ * Get a QKD key of TICKET_QKD_KEY_SIZE bytes, waiting at most TICKET_QKD_TIMEOUT_MS for it.
+ *
+ * Returns true on success, false if there is no QKD key.
+ */
+static bool get_qkd_key(unsigned char *qkd_key)
+{
+    QKD_qos_t qos = {
+        .requested_length = TICKET_QKD_KEY_SIZE,
+        .max_bps = 0,
+        .priority = 0,
+        .timeout = TICKET_QKD_TIMEOUT_MS
+    };
+    QKD_key_handle_t key_handle = QKD_key_handle_null;
+    QKD_result_t qkd_result = QKD_open(NULL, qos, &key_handle);
+    if (QKD_RESULT_SUCCESS == qkd_result) {
+        qkd_result = QKD_connect_blocking(&key_handle, TICKET_QKD_TIMEOUT_MS);
+        if (QKD_RESULT_SUCCESS == qkd_result) {
+            qkd_result = QKD_get_key(&key_handle, (char *) qkd_key);
+        }
+        QKD_close(&key_handle);
+    }
+    if (QKD_RESULT_SUCCESS != qkd_result) {
+        QKD_error("No QKD key for the session ticket keys: %s", QKD_result_str(qkd_result));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Derive a new ticket key with HKDF-SHA256 from a QKD key followed by local randomness, or from
+ * local randomness only if there is no QKD key (stored in from_qkd). The QKD key is also known at
+ * the other end of the QKD link; mixing in local randomness keeps the ticket key a secret of this
+ * server, and the info string says whether a QKD key was used, as for the hybrid key exchange.
+ *
+ * Returns true on success, false on failure.
+ */
+static bool derive_key(ticket_key_t *key, bool *from_qkd)
+{
+    unsigned char *ikm = QKD_secure_alloc(TICKET_QKD_KEY_SIZE + TICKET_RANDOM_SIZE);
+    if (ikm == NULL) {
+        QKD_error("QKD_secure_alloc failed");
+        return false;
+    }
+    *from_qkd = get_qkd_key(ikm);
+    const unsigned char *material = *from_qkd ? ikm : ikm + TICKET_QKD_KEY_SIZE;
+    size_t material_size = (*from_qkd ? TICKET_QKD_KEY_SIZE : 0) + TICKET_RANDOM_SIZE;
+    unsigned char info[sizeof(ticket_kdf_info)];
+    memcpy(info, ticket_kdf_info, sizeof(ticket_kdf_info));
+    info[sizeof(info) - 1] = *from_qkd;
+    size_t out_size = sizeof(*key);
+    EVP_PKEY_CTX *kdf_ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    bool ok = RAND_bytes(ikm + TICKET_QKD_KEY_SIZE, TICKET_RANDOM_SIZE) == 1 &&
+              kdf_ctx != NULL && EVP_PKEY_derive_init(kdf_ctx) == 1 &&
+              EVP_PKEY_CTX_set_hkdf_md(kdf_ctx, EVP_sha256()) == 1 &&
+              EVP_PKEY_CTX_set1_hkdf_key(kdf_ctx, material, material_size) == 1 &&
+              EVP_PKEY_CTX_add1_hkdf_info(kdf_ctx, info, sizeof(info)) == 1 &&
+              EVP_PKEY_derive(kdf_ctx, (unsigned char *) key, &out_size) == 1 &&
+              out_size == sizeof(*key);
+    if (!ok) {
+        QKD_error("Deriving a session ticket key failed");
+    }
+    EVP_PKEY_CTX_free(kdf_ctx);
+    QKD_secure_free(ikm);
+    return ok;
+}
+
+/**
+ * Derive a new key and make it the current key, unless another process is doing that already. If
+ * only_if_due, only if the current key is due for rotation (checked again under the rotation
+ * lock, since another process may just have rotated it).
+ *
+ * Returns true if a new key was made current, false if not.
+ */
+static bool rotate(bool only_if_due)
+{
+    QKD_enter();
+    int lock_result = pthread_mutex_trylock(&ticket_keys->rotation_lock);
+    if (lock_result == EOWNERDEAD) {
+        /* The process died while it held the lock, perhaps half way through writing a key. Make
+         * the sequence number even, so that readers no longer wait for the write to finish. */
+        QKD_error("Took over the rotation of the session ticket keys from a process that died");
+        uint64_t sequence = __atomic_load_n(&ticket_keys->sequence, __ATOMIC_RELAXED);
+        if (sequence & 1) {
+            __atomic_store_n(&ticket_keys->sequence, sequence + 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_consistent(&ticket_keys->rotation_lock);
+    } else if (lock_result != 0) {
+        if (lock_result != EBUSY) {
+            QKD_error("Could not take the rotation lock of the session ticket keys (%d)",
+                      lock_result);
+        }
+        QKD_return_success("%d", false);
+    }
+    uint64_t now = monotonic_ms();
+    bool rotated = false;
+    ticket_key_t key;
+    bool from_qkd = false;
+    if ((!only_if_due ||
+         now >= __atomic_load_n(&ticket_keys->next_rotation_ms, __ATOMIC_RELAXED)) &&
+        derive_key(&key, &from_qkd)) {
+        /* Only the holder of the rotation lock writes the keys and the generation. */
+        uint64_t sequence = ticket_keys->sequence;
+        uint64_t generation = ticket_keys->generation + 1;
+        __atomic_store_n(&ticket_keys->sequence, sequence + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        ticket_keys->keys[generation % QKD_TICKET_NR_KEYS] = key;
+        __atomic_store_n(&ticket_keys->generation, generation, __ATOMIC_RELAXED);
+        __atomic_store_n(&ticket_keys->sequence, sequence + 2, __ATOMIC_RELEASE);
+        __atomic_store_n(&ticket_keys->next_rotation_ms, now + 1000 * rotation_seconds(),
+                         __ATOMIC_RELAXED);
+        __atomic_add_fetch(&ticket_keys->stats.nr_rotations, 1, __ATOMIC_RELAXED);
+        if (from_qkd) {
+            __atomic_add_fetch(&ticket_keys->stats.nr_qkd_rotations, 1, __ATOMIC_RELAXED);
+        }
+        QKD_debug("Session ticket key %llu derived from %s", (unsigned long long) generation,
+                  from_qkd ? "a QKD key" : "local randomness only");
+        rotated = true;
+    }
+    OPENSSL_cleanse(&key, sizeof(key));
+    pthread_mutex_unlock(&ticket_keys->rotation_lock);
+    QKD_return_success("%d", rotated);
+}
+
+/**
+ * Copy the keys (see the sequence lock above).
+ *
+ * Returns the generation of the current key (0 if there is no key yet).
+ */
+static uint64_t read_keys(ticket_key_t *keys)
+{
+    uint64_t sequence;
+    uint64_t generation;
+    do {
+        sequence = __atomic_load_n(&ticket_keys->sequence, __ATOMIC_ACQUIRE);
+        memcpy(keys, ticket_keys->keys, sizeof(ticket_keys->keys));
+        generation = __atomic_load_n(&ticket_keys->generation, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((sequence & 1) ||
+             __atomic_load_n(&ticket_keys->sequence, __ATOMIC_RELAXED) != sequence);
+    return generation;
+}
+
+/**
+ * Callback for SSL_CTX_set_tlsext_ticket_key_evp_cb. When encrypting a ticket, rotate the key if
+ * it is due, and set up the cipher and MAC with the current key; when decrypting one, find the key
+ * by its name among the current key and the keys before it.
+ *
+ * Returns 1 on success, 2 if the ticket was decrypted with an older key (so that OpenSSL issues a
+ * new one), 0 if there is no key (no ticket is issued, or the client does a full handshake), or -1
+ * on failure.
+ */
+int QKD_ticket_key_callback(SSL *ssl, unsigned char *key_name, unsigned char *iv,
+                            EVP_CIPHER_CTX *cipher_ctx, EVP_MAC_CTX *mac_ctx, int encrypt)
+{
+    QKD_enter();
+    if (ticket_keys == NULL) {
+        QKD_error("Session ticket keys are not initialized");
+        QKD_return_error("%d", 0);
+    }
+    if (encrypt && monotonic_ms() >= __atomic_load_n(&ticket_keys->next_rotation_ms,
+                                                     __ATOMIC_RELAXED)) {
+        rotate(true);
+    }
+    ticket_key_t keys[QKD_TICKET_NR_KEYS];
+    uint64_t generation = read_keys(keys);
+    ticket_key_t *key = NULL;
+    int result = 0;
+    if (generation == 0) {
+        /* Another process is deriving the first key. */
+    } else if (encrypt) {
+        key = &keys[generation % QKD_TICKET_NR_KEYS];
+        memcpy(key_name, key->name, TICKET_KEY_NAME_SIZE);
+        result = RAND_bytes(iv, TICKET_IV_SIZE) == 1 ? 1 : -1;
+        __atomic_add_fetch(&ticket_keys->stats.nr_issued, 1, __ATOMIC_RELAXED);
+    } else {
+        for (uint64_t age = 0; key == NULL && age < QKD_TICKET_NR_KEYS && age < generation; age++) {
+            ticket_key_t *candidate = &keys[(generation - age) % QKD_TICKET_NR_KEYS];
+            if (CRYPTO_memcmp(candidate->name, key_name, TICKET_KEY_NAME_SIZE) == 0) {
+                key = candidate;
+                result = age == 0 ? 1 : 2;
+            }
+        }
+        __atomic_add_fetch(result == 1 ? &ticket_keys->stats.nr_resumed :
+                           result == 2 ? &ticket_keys->stats.nr_renewed :
+                                         &ticket_keys->stats.nr_unknown, 1, __ATOMIC_RELAXED);
+    }
+    if (result > 0) {
+        OSSL_PARAM params[3] = {
+            OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key->mac_key,
+                                              sizeof(key->mac_key)),
+            OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+            OSSL_PARAM_construct_end()
+        };
+        int cipher_result = encrypt ?
+            EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, key->cipher_key, iv) :
+            EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, key->cipher_key, iv);
+        if (cipher_result != 1 || EVP_MAC_CTX_set_params(mac_ctx, params) != 1) {
+            QKD_error("Setting up the session ticket cipher failed");
+            result = -1;
+        }
+    }
+    OPENSSL_cleanse(keys, sizeof(keys));
+    QKD_return_success("%d", result);
+}
+
+/**
+ * Rotate the key now, e.g. when the operator asks for it.
+ *
+ * Returns true if a new key was made current, false if not (another process is rotating it, or no
+ * key could be derived).
+ */
+bool QKD_ticket_keys_rotate(void)
+{
+    return ticket_keys != NULL && rotate(false);
+}
+
+/**
+ * The time for which a ticket is accepted at least: it is accepted until its key has been rotated
+ * out by QKD_TICKET_NR_KEYS - 1 newer keys. Suitable for SSL_CTX_set_timeout.
+ */
+long QKD_ticket_lifetime_seconds(void)
+{
+    return rotation_seconds() * (QKD_TICKET_NR_KEYS - 1);
+}
+
+/**
+ * Get a snapshot of the counters, over all processes that share the keys.
+ */
+void QKD_ticket_get_stats(QKD_ticket_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (ticket_keys == NULL) {
+        return;
+    }
+    const QKD_ticket_stats_t *shared = &ticket_keys->stats;
+    stats->nr_rotations = __atomic_load_n(&shared->nr_rotations, __ATOMIC_RELAXED);
+    stats->nr_qkd_rotations = __atomic_load_n(&shared->nr_qkd_rotations, __ATOMIC_RELAXED);
+    stats->nr_issued = __atomic_load_n(&shared->nr_issued, __ATOMIC_RELAXED);
+    stats->nr_resumed = __atomic_load_n(&shared->nr_resumed, __ATOMIC_RELAXED);
+    stats->nr_renewed = __atomic_load_n(&shared->nr_renewed, __ATOMIC_RELAXED);
+    stats->nr_unknown = __atomic_load_n(&shared->nr_unknown, __ATOMIC_RELAXED);
+}
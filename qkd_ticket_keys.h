@@ -0,0 +1,53 @@
+/**
+ * qkd_ticket_keys.h
+ *
+ * Session ticket keys for TLS servers, derived from QKD key material and rotated on a schedule.
+ * A resumed session skips the key exchange, so it is the cheapest handshake that a server can
+ * offer, and it is only as safe as the key that encrypts the ticket.
+ *
+ * The server engine exports QKD_ticket_key_callback; an application that loads the engine installs
+ * it with SSL_CTX_set_tlsext_ticket_key_evp_cb (it finds the function with dlsym, like
+ * qkd_handshake_test does). The current key encrypts new tickets. Tickets that were encrypted with
+ * one of the QKD_TICKET_NR_KEYS - 1 keys before it are still accepted, and renewed. A new key is
+ * derived every QKD_TICKET_KEY_ROTATION_SECONDS seconds (environment variable, default 3600), by
+ * the first handshake that finds the current key due, from a QKD key mixed with local randomness.
+ * If no QKD key can be obtained, the new key is derived from local randomness only, as OpenSSL
+ * would do, rather than keeping the old key for longer.
+ *
+ * The keys are kept in shared memory, so that all worker processes of a server use the same keys:
+ * in a shared anonymous mapping that is inherited by the processes that the server forks after the
+ * engine is initialized, or, if environment variable QKD_TICKET_KEYS_SHM is set, in the POSIX
+ * shared memory object of that name (e.g. "/qkd_ticket_keys"), for processes that are started
+ * separately.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#ifndef QKD_TICKET_KEYS_H
+#define QKD_TICKET_KEYS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <openssl/ssl.h>
+
+#define QKD_TICKET_NR_KEYS 3
+#define QKD_TICKET_DEFAULT_ROTATION_SECONDS 3600
+
+typedef struct QKD_ticket_stats_st {
+    uint64_t nr_rotations;              /* Keys derived, from QKD key or not */
+    uint64_t nr_qkd_rotations;          /* Keys derived from a QKD key */
+    uint64_t nr_issued;                 /* Tickets encrypted */
+    uint64_t nr_resumed;                /* Tickets decrypted with the current key */
+    uint64_t nr_renewed;                /* Tickets decrypted with an older key, and renewed */
+    uint64_t nr_unknown;                /* Tickets with a key that is gone (full handshake) */
+} QKD_ticket_stats_t;
+
+bool QKD_ticket_keys_init(void);
+int QKD_ticket_key_callback(SSL *ssl, unsigned char *key_name, unsigned char *iv,
+                            EVP_CIPHER_CTX *cipher_ctx, EVP_MAC_CTX *mac_ctx, int encrypt);
+bool QKD_ticket_keys_rotate(void);
+long QKD_ticket_lifetime_seconds(void);
+void QKD_ticket_get_stats(QKD_ticket_stats_t *stats);
+
+#endif /* QKD_TICKET_KEYS_H */
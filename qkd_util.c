@@ -0,0 +1,185 @@
+/**
+ * qkd_util.c
+ *
+ * Small helpers that the implementations of the QKD API share (see qkd_util.h).
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#include "qkd_util.h"
+#include "qkd_debug.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+/**
+ * Store a 32-bit number in network byte order.
+ */
+void QKD_put_uint32(unsigned char *bytes, uint32_t value)
+{
+    for (int i = 3; i >= 0; i--) {
+        bytes[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+/**
+ * Load a 32-bit number in network byte order.
+ */
+uint32_t QKD_get_uint32(const unsigned char *bytes)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+/**
+ * Store a 64-bit number in network byte order.
+ */
+void QKD_put_uint64(unsigned char *bytes, uint64_t value)
+{
+    for (int i = 7; i >= 0; i--) {
+        bytes[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+/**
+ * Load a 64-bit number in network byte order.
+ */
+uint64_t QKD_get_uint64(const unsigned char *bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+/**
+ * Return the current time of the monotonic clock in seconds.
+ */
+double QKD_monotonic_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Sleep for the given number of seconds (if positive), also when interrupted by a signal.
+ */
+void QKD_sleep_seconds(double seconds)
+{
+    if (seconds <= 0.0) {
+        return;
+    }
+    struct timespec ts = {
+        .tv_sec = (time_t) seconds,
+        .tv_nsec = (long) ((seconds - (time_t) seconds) * 1e9)
+    };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+    }
+}
+
+/**
+ * Read a size from an environment variable.
+ *
+ * Returns the size, or default_value if the variable is not set or is less than min_value.
+ */
+size_t QKD_env_size(const char *name, size_t default_value, size_t min_value)
+{
+    const char *value = getenv(name);
+    if (value == NULL) {
+        return default_value;
+    }
+    unsigned long long size = strtoull(value, NULL, 10);
+    if (size < min_value) {
+        QKD_error("Invalid %s %s", name, value);
+        return default_value;
+    }
+    return size;
+}
+
+/**
+ * Send a message that consists of several pieces over a TCP connection. The pieces are sent with
+ * sendmsg, so that they are not delayed by Nagle's algorithm waiting for a delayed ack. The iovec
+ * array is modified.
+ *
+ * Returns true on success, false on failure.
+ */
+bool QKD_send_all(int sock, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+        ssize_t bytes_written = sendmsg(sock, &msg, SEND_FLAGS);
+        if (bytes_written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_written == -1) {
+            QKD_error_with_errno("sendmsg failed");
+            return false;
+        }
+        /* Skip what was sent, and finish a partial send. */
+        while (iovcnt > 0 && (size_t) bytes_written >= iov->iov_len) {
+            bytes_written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + bytes_written;
+            iov->iov_len -= bytes_written;
+        }
+    }
+    return true;
+}
+
+/**
+ * Receive exactly size bytes from a TCP connection into buffer (blocking).
+ *
+ * Returns true on success, false on failure or if the connection was closed.
+ */
+bool QKD_receive_all(int sock, void *buffer, size_t size)
+{
+    char *p = buffer;
+    while (size > 0) {
+        ssize_t bytes_read = read(sock, p, size);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            QKD_error_with_errno("read failed");
+            return false;
+        }
+        p += bytes_read;
+        size -= bytes_read;
+    }
+    return true;
+}
+
+/**
+ * Send the messages on a TCP connection as soon as they are written. Both ends of the connections
+ * of the QKD API implementations send a message right after another one (e.g. an acknowledgement
+ * right after a result), and with Nagle's algorithm the second one would wait for the delayed
+ * acknowledgement of the first.
+ */
+void QKD_set_no_delay(int sock)
+{
+    int on = 1;
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) != 0) {
+        QKD_error_with_errno("setsockopt TCP_NODELAY failed");
+    }
+}
@@ -0,0 +1,31 @@
+/**
+ * qkd_util.h
+ *
+ * Small helpers that the implementations of the QKD API share: numbers in network byte order in
+ * messages and files, the monotonic clock, size settings from environment variables, and sending
+ * and receiving whole messages on TCP connections.
+ *
+ * (c) 2019 Bruno Rijsman, All Rights Reserved.
+ * See LICENSE for licensing information.
+ */
+
+#ifndef QKD_UTIL_H
+#define QKD_UTIL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+void QKD_put_uint32(unsigned char *bytes, uint32_t value);
+uint32_t QKD_get_uint32(const unsigned char *bytes);
+void QKD_put_uint64(unsigned char *bytes, uint64_t value);
+uint64_t QKD_get_uint64(const unsigned char *bytes);
+double QKD_monotonic_seconds(void);
+void QKD_sleep_seconds(double seconds);
+size_t QKD_env_size(const char *name, size_t default_value, size_t min_value);
+bool QKD_send_all(int sock, struct iovec *iov, int iovcnt);
+bool QKD_receive_all(int sock, void *buffer, size_t size);
+void QKD_set_no_delay(int sock);
+
+#endif /* QKD_UTIL_H */
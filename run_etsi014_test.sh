@@ -0,0 +1,34 @@
+#! /bin/bash
+#
+# run_etsi014_test.sh
+#
+# Run the TLS load generator against the OpenSSL demonstration server, with both engines built
+# for the ETSI GS QKD 014 implementation of the QKD API (make QKD_API=etsi014) and getting their
+# keys from the stand-in KME (etsi014_kme.py). All command line arguments are passed on to the
+# load generator. The output of the KME is written to kme.out. With QKD_ETSI014_KEY_DELIVERY=keyring
+# the keys are delivered through the keyring of the user instead of in the responses of the KME.
+#
+# (c) 2019 Bruno Rijsman, All Rights Reserved.
+# See LICENSE for licensing information.
+#
+KME_PORT=8014
+./stop_server.sh
+echo -n "Starting KME in background... "
+rm -f kme.out
+KME_ARGS=""
+if [ "${QKD_ETSI014_KEY_DELIVERY}" = "keyring" ]; then
+    KME_ARGS="--keyring user"
+fi
+./etsi014_kme.py --port ${KME_PORT} ${KME_ARGS} >kme.out 2>&1 &
+KME_PID=$!
+echo "OK (PID ${KME_PID})"
+sleep 1
+export QKD_ETSI014_KME_URL=http://localhost:${KME_PORT}
+QKD_ETSI014_PEER_SAE_ID=sae-client ./start_server.sh
+sleep 1
+QKD_ETSI014_PEER_SAE_ID=sae-server ./run_load_test.sh --connect localhost:44330 \
+    --CAfile cert.pem "$@"
+./stop_server.sh
+kill ${KME_PID}
+wait ${KME_PID}
+tail -1 kme.out
@@ -0,0 +1,26 @@
+#! /bin/bash
+#
+# run_keyfile_test.sh
+#
+# Run the TLS load generator against the OpenSSL demonstration server, with both engines built
+# for the key file implementation of the QKD API (make QKD_API=keyfile), sharing the key file
+# keyfile.bin. This measures the throughput of the engines with the fastest possible source of key.
+# The key file is created if it does not exist yet. All command line arguments are passed on to the
+# load generator.
+#
+# (c) 2019 Bruno Rijsman, All Rights Reserved.
+# See LICENSE for licensing information.
+#
+KEY_FILE=keyfile.bin
+if [[ ! -f ${KEY_FILE} ]]; then
+    echo -n "Creating key file ${KEY_FILE}... "
+    head -c 64M /dev/urandom >${KEY_FILE}
+    echo "OK"
+fi
+export QKD_KEYFILE=${KEY_FILE}
+export QKD_KEYFILE_WRAP=1
+./stop_server.sh
+./start_server.sh
+sleep 1
+./run_load_test.sh --connect localhost:44330 --CAfile cert.pem "$@"
+./stop_server.sh
@@ -0,0 +1,23 @@
+#! /bin/bash
+#
+# run_load_test.sh
+#
+# A bash script for running the TLS load generator (qkd_load_generator) against the OpenSSL
+# demonstration server (see start_server.sh), using the ETSI QKD API for QKD key agreement. All
+# command line arguments are passed on to the load generator; run with --help for the list of
+# options. The report of the load generator is written to load.out and the debug output of the
+# client engine is written to load_debug.out.
+# 
+# (c) 2019 Bruno Rijsman, All Rights Reserved.
+# See LICENSE for licensing information.
+#
+echo "Running load generator... "
+source set_platform_dependent_variables.sh
+rm -f load.out load_debug.out
+export OPENSSL_CONF=client_openssl.cnf
+./qkd_load_generator "$@" 2>load_debug.out | tee load.out
+if [[ ${PIPESTATUS[0]} -eq 0 ]]; then
+    echo "OK"
+else
+    echo "FAILED"
+fi
@@ -0,0 +1,37 @@
+#! /bin/bash
+#
+# run_relay_test.sh
+#
+# Run the TLS load generator against the OpenSSL demonstration server, with both engines built
+# for the ETSI GS QKD 014 implementation of the QKD API (make QKD_API=etsi014), over a network of
+# trusted nodes: one stand-in KME process (etsi014_kme.py) for every node in relay_topology.cnf.
+# The server gets its keys from node alice, and the client from node carol, so every key is
+# relayed over two QKD links. All command line arguments are passed on to the load generator. The
+# output of each node is written to kme-NODE.out.
+#
+# (c) 2019 Bruno Rijsman, All Rights Reserved.
+# See LICENSE for licensing information.
+#
+TOPOLOGY=relay_topology.cnf
+NODES="alice bob carol dave"
+./stop_server.sh
+KME_PIDS=""
+for NODE in ${NODES}; do
+    echo -n "Starting trusted node ${NODE} in background... "
+    rm -f kme-${NODE}.out
+    ./etsi014_kme.py --topology ${TOPOLOGY} --node ${NODE} >kme-${NODE}.out 2>&1 &
+    KME_PIDS="${KME_PIDS} $!"
+    echo "OK (PID $!)"
+done
+# Give the links time to come up and to produce some key.
+sleep 2
+QKD_ETSI014_KME_URL=http://localhost:8101 QKD_ETSI014_PEER_SAE_ID=sae-client ./start_server.sh
+sleep 1
+QKD_ETSI014_KME_URL=http://localhost:8103 QKD_ETSI014_PEER_SAE_ID=sae-server \
+    ./run_load_test.sh --connect localhost:44330 --CAfile cert.pem "$@"
+./stop_server.sh
+kill ${KME_PIDS}
+wait ${KME_PIDS}
+for NODE in ${NODES}; do
+    echo "${NODE}: $(tail -1 kme-${NODE}.out)"
+done
@@ -0,0 +1,55 @@
+#! /bin/bash
+#
+# run_replication_test.sh
+#
+# Run the TLS load generator against two OpenSSL demonstration servers whose mock key managers are
+# replicated (see qkd_replication.h), both as local processes: an active server on port 44330 and a
+# standby server on port 44331. After the first run of the load generator, the active server is
+# killed; the standby takes over the key manager endpoint, with the key that the active server had
+# buffered, and a second run of the load generator goes to the standby server. The client keeps its
+# buffered key across the two runs in a snapshot. All command line arguments are passed on to the
+# load generator. The output of the servers is written to server-active.out and server-standby.out,
+# and the replication metrics (including the lag) to replication-active.prom and
+# replication-standby.prom.
+#
+# (c) 2019 Bruno Rijsman, All Rights Reserved.
+# See LICENSE for licensing information.
+#
+source set_platform_dependent_variables.sh
+./stop_server.sh
+REPLICATION_PEER=localhost:9301
+rm -f server-active.out server-standby.out replication-active.prom replication-standby.prom
+rm -f replication_client.snapshot
+head -c 32 /dev/urandom >replication_snapshot.key
+
+start_node () {
+    echo -n "Starting $1 server in background... "
+    QKD_REPLICATION_ROLE=$1 QKD_REPLICATION_PEER=${REPLICATION_PEER} \
+        QKD_REPLICATION_METRICS_FILE=replication-$1.prom OPENSSL_CONF=server_openssl.cnf \
+        ${OPENSSL_BIN}/openssl s_server -key key.pem -cert cert.pem -accept $2 -www \
+        >server-$1.out 2>&1 &
+    echo "OK (PID $!)"
+}
+# Start the standby first, so that the active server finds it when it comes up.
+start_node standby 44331
+STANDBY_PID=$!
+sleep 1
+start_node active 44330
+ACTIVE_PID=$!
+sleep 2
+
+export QKD_SNAPSHOT_FILE=replication_client.snapshot
+export QKD_SNAPSHOT_KEY_FILE=replication_snapshot.key
+./run_load_test.sh --connect localhost:44330 --CAfile cert.pem "$@"
+echo "Replication lag of the active server:"
+grep "^qkd_replication_lag" replication-active.prom
+echo -n "Killing active server... "
+kill -KILL ${ACTIVE_PID}
+wait ${ACTIVE_PID} 2>/dev/null
+echo "OK"
+sleep 1
+./run_load_test.sh --connect localhost:44331 --CAfile cert.pem "$@"
+kill ${STANDBY_PID}
+wait ${STANDBY_PID} 2>/dev/null
+grep "Took over\|Resumed" server-standby.out
+rm -f replication_snapshot.key replication_client.snapshot